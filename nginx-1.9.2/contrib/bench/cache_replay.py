@@ -0,0 +1,140 @@
+#!/usr/bin/env python3
+
+# 缓存命中率回放: 把访问日志按固定速率回放到一个或多个端口，按响应头
+# X-Cache($upstream_cache_status)统计每个端口的命中率，用来比较同样max_size下
+# LRU和admission=tinylfu的效果。
+#
+# 日志可以是nginx默认格式的access_log(取请求行中的URI)，也可以每行一个URI。
+# 没有现成日志时用gen生成可复现的日志: 固定随机种子，hot个热点URI按Zipf(s)分布访问，
+# 另有scan比例的请求是只访问一次的URI(模拟爬虫扫描):
+#
+#   ./cache_replay.py gen 4000 500 0.9 0.4 > replay.log
+#
+# 服务端配置两个只有admission不同的缓存，后端对所有URI返回同一个3500字节的文件，
+# 加上缓存文件头正好占一个4k块，max_size=800k约为200个对象:
+#
+#   proxy_cache_path /tmp/c1 levels=1:2 keys_zone=lru:1m max_size=800k;
+#   proxy_cache_path /tmp/c2 levels=1:2 keys_zone=lfu:1m max_size=800k
+#                    admission=tinylfu;
+#
+#   server {
+#       listen 8081;
+#       location / {
+#           proxy_pass http://127.0.0.1:8090;
+#           proxy_cache lru;
+#           proxy_cache_valid 200 1h;
+#           add_header X-Cache $upstream_cache_status;
+#       }
+#   }
+#
+#   server { listen 8082; ... proxy_cache lfu; ... }
+#   server { listen 8090; location / { root /tmp/www; try_files /obj.bin =404; } }
+#
+# 淘汰由cache manager周期性地执行，回放太快时磁盘占用会暂时超过max_size，
+# 因此需要限制速率:
+#
+#   ./cache_replay.py replay replay.log 15 8081 8082
+
+import http.client
+import random
+import re
+import sys
+import time
+
+
+def gen(count, hot, s, scan, seed=1):
+    rnd = random.Random(seed)
+
+    weights = [1.0 / (i + 1) ** s for i in range(hot)]
+    total = sum(weights)
+
+    cdf = []
+    acc = 0.0
+    for w in weights:
+        acc += w / total
+        cdf.append(acc)
+
+    scanned = 0
+
+    for _ in range(count):
+        if rnd.random() < scan:
+            scanned += 1
+            print('/scan/%d' % scanned)
+            continue
+
+        x = rnd.random()
+        lo, hi = 0, hot - 1
+        while lo < hi:
+            mid = (lo + hi) // 2
+            if cdf[mid] < x:
+                lo = mid + 1
+            else:
+                hi = mid
+        print('/hot/%d' % lo)
+
+
+def uris(path):
+    request = re.compile(r'"[A-Z]+ (\S+) HTTP/[0-9.]+"')
+
+    with open(path) as f:
+        for line in f:
+            m = request.search(line)
+            if m:
+                yield m.group(1)
+            elif line.startswith('/'):
+                yield line.split()[0]
+
+
+def replay(path, rate, ports):
+    conns = {p: http.client.HTTPConnection('127.0.0.1', p) for p in ports}
+    stats = {p: {} for p in ports}
+
+    start = time.monotonic()
+    n = 0
+
+    for uri in uris(path):
+        # 按开始时间计算每个请求的发送时刻，响应慢时不会累计误差
+        delay = start + n / rate - time.monotonic()
+        if delay > 0:
+            time.sleep(delay)
+
+        n += 1
+
+        for p in ports:
+            c = conns[p]
+            try:
+                c.request('GET', uri)
+                r = c.getresponse()
+            except (http.client.HTTPException, OSError):
+                c.close()
+                c.request('GET', uri)
+                r = c.getresponse()
+
+            r.read()
+            status = r.getheader('X-Cache', '-')
+            stats[p][status] = stats[p].get(status, 0) + 1
+
+    for p in ports:
+        st = stats[p]
+        hits = st.get('HIT', 0)
+        print('port %d: %d requests, hit ratio %.3f  %s'
+              % (p, n, hits / n if n else 0.0,
+                 ' '.join('%s=%d' % kv for kv in sorted(st.items()))))
+
+
+def usage():
+    sys.exit('usage: %s gen count hot zipf_s scan_ratio [seed]\n'
+             '       %s replay log rate port...' % (sys.argv[0], sys.argv[0]))
+
+
+if __name__ == '__main__':
+    if len(sys.argv) >= 6 and sys.argv[1] == 'gen':
+        gen(int(sys.argv[2]), int(sys.argv[3]), float(sys.argv[4]),
+            float(sys.argv[5]), int(sys.argv[6]) if len(sys.argv) > 6 else 1)
+
+    elif len(sys.argv) >= 5 and sys.argv[1] == 'replay':
+        replay(sys.argv[2], float(sys.argv[3]),
+               [int(p) for p in sys.argv[4:]])
+
+    else:
+        usage()
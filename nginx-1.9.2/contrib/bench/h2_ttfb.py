@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+
+# HTTP/2 调度基准: 在同一个连接上先下载一个大文件，delay秒后再请求n个小文件，
+# 输出小文件的首字节时间(TTFB，从发出请求算起)和大文件的完成时间。
+#
+# 只用标准库实现了最小的HTTP/2客户端(不带TLS，h2c prior knowledge)，
+# 连接和流的接收窗口都设为最大，这样大文件只受发送端调度和网络速度限制。
+#
+# 例如服务端配置:
+#
+#   listen 8099 http2 sndbuf=64k;
+#   sendfile on;
+#
+# 为了让数据排在nginx的发送队列里，而不是全部进入本机回环的socket缓冲区，
+# 需要限制回环带宽，并使用正常的MTU:
+#
+#   ip link set lo mtu 1500
+#   tc qdisc add dev lo root tbf rate 100mbit burst 256kb latency 100ms
+#
+#   ./h2_ttfb.py 8099 /big.bin /small.txt 0.3 10
+
+import socket
+import statistics
+import struct
+import sys
+import time
+
+
+def frame(type, flags, sid, payload):
+    return (struct.pack('>I', len(payload))[1:] + bytes([type, flags])
+            + struct.pack('>I', sid) + payload)
+
+
+def request(sid, path):
+    # :method GET, :scheme http, :path和:authority使用静态表中的名字
+    block = (b'\x82\x86' + bytes([0x04, len(path)]) + path
+             + b'\x01\x09127.0.0.1')
+    return frame(1, 0x5, sid, block)
+
+
+def run(port, big, small, delay, n):
+    s = socket.create_connection(('127.0.0.1', port))
+
+    s.sendall(b'PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n'
+              + frame(4, 0, 0, struct.pack('>HI', 4, 0x7fffffff))
+              + frame(8, 0, 0, struct.pack('>I', 0x7fffffff - 65535))
+              + request(1, big))
+
+    start = time.time()
+    sent = None
+    first = {}
+    done = {}
+    buf = bytearray()
+
+    while 1 not in done or len(done) < n + 1:
+
+        if sent is None and n and time.time() - start >= delay:
+            sent = time.time()
+            s.sendall(b''.join(request(3 + 2 * i, small) for i in range(n)))
+
+        s.settimeout(0.005 if sent is None and n else 30)
+
+        try:
+            data = s.recv(1 << 20)
+        except socket.timeout:
+            continue
+
+        if not data:
+            sys.exit('connection closed')
+
+        buf += data
+        pos = 0
+        now = time.time()
+
+        while len(buf) - pos >= 9:
+            length = int.from_bytes(buf[pos:pos + 3], 'big')
+            type, flags = buf[pos + 3], buf[pos + 4]
+            sid = int.from_bytes(buf[pos + 5:pos + 9], 'big') & 0x7fffffff
+
+            if len(buf) - pos < 9 + length:
+                break
+
+            pos += 9 + length
+
+            if type == 4 and not flags & 1:
+                s.sendall(frame(4, 1, 0, b''))
+
+            if type == 0 and sid > 1 and sid not in first:
+                first[sid] = now - sent
+
+            if type == 0 and flags & 1:
+                done[sid] = now - (sent if sid > 1 else start)
+
+        del buf[:pos]
+
+    s.close()
+
+    if not n:
+        return 'big done %6.0fms' % (done[1] * 1e3)
+
+    ttfb = sorted(first.values())
+
+    return ('small ttfb median %6.1fms max %6.1fms  big done %6.0fms'
+            % (statistics.median(ttfb) * 1e3, ttfb[-1] * 1e3,
+               done[1] * 1e3))
+
+
+def main():
+    if len(sys.argv) != 6:
+        sys.exit('usage: h2_ttfb.py port big small delay n')
+
+    port = int(sys.argv[1])
+    big = sys.argv[2].encode()
+    small = sys.argv[3].encode()
+
+    print(run(port, big, small, float(sys.argv[4]), int(sys.argv[5])))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,193 @@
+
+/*
+ * 内存池微基准: 模拟每个请求的池使用方式，比较worker_pool_cache关闭和开启时
+ * ngx_create_pool/ngx_palloc/ngx_destroy_pool的耗时，并输出缓存的命中/未命中次数。
+ *
+ * 每个"请求"创建一个连接池(256字节)和一个请求池(4096字节)，在请求池中分配
+ * 若干小块(超出4k后会申请新的池块)和一个大块(ngx_palloc_large)，再释放。
+ * 同时存活的请求数为并发数，释放顺序随机，这样malloc看到的不是简单的后进先出。
+ *
+ * 在已经./configure && make过的源码根目录下编译:
+ *
+ *   cc -O2 -o pool_bench -I src/core -I src/event -I src/event/modules \
+ *      -I src/os/unix -I objs contrib/bench/ngx_pool_bench.c
+ *
+ *   ./pool_bench
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+/* 直接包含实现，这样可以不依赖nginx的其他目标文件 */
+#include "../../src/os/unix/ngx_alloc.c"
+#include "../../src/core/ngx_palloc.c"
+
+
+#define NGX_BENCH_REQUESTS  2000000
+
+
+typedef struct {
+    ngx_pool_t  *conn;
+    ngx_pool_t  *req;
+} ngx_bench_slot_t;
+
+
+static ngx_log_t  ngx_bench_log;
+
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, const char *filename,
+    int lineno, ngx_err_t err, const char *fmt, ...)
+{
+}
+
+
+#if (NGX_DEBUG)
+
+void
+ngx_log_error_coreall(ngx_uint_t level, ngx_log_t *log, const char *filename,
+    int lineno, ngx_err_t err, const char *fmt, ...)
+{
+}
+
+#endif
+
+
+static double
+ngx_bench_now(void)
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+/* 大小大致对应ngx_http_request_t、headers_in的list/array、各种ctx和字符串 */
+static void
+ngx_bench_request(ngx_bench_slot_t *s)
+{
+    void        *large;
+    ngx_uint_t   i, n;
+
+    static size_t  sizes[] = { 1400, 320, 160, 96, 64, 512, 48, 200, 24, 640 };
+
+    s->conn = ngx_create_pool(256, &ngx_bench_log);
+    s->req = ngx_create_pool(4096, &ngx_bench_log);
+
+    if (s->conn == NULL || s->req == NULL) {
+        exit(1);
+    }
+
+    (void) ngx_pcalloc(s->conn, 120);
+    (void) ngx_palloc(s->conn, 1024);   /* client_header_buffer_size */
+
+    n = 6 + random() % 10;
+
+    for (i = 0; i < n; i++) {
+        (void) ngx_palloc(s->req, sizes[i % 10]);
+    }
+
+    /* 大于NGX_MAX_ALLOC_FROM_POOL的输出缓冲，走ngx_palloc_large */
+    large = ngx_palloc(s->req, 8192 + random() % 2 * 8192);
+    if (large == NULL) {
+        exit(1);
+    }
+
+    if (random() % 4 == 0) {
+        ngx_pfree(s->req, large);
+    }
+}
+
+
+static void
+ngx_bench_run(size_t max, ngx_uint_t concurrency)
+{
+    double                  t0, elapsed;
+    ngx_uint_t              i, k;
+    ngx_bench_slot_t       *slots;
+    ngx_pool_cache_stat_t   stat;
+
+    ngx_pool_cache_init(max, max / 4);
+
+    slots = calloc(concurrency, sizeof(ngx_bench_slot_t));
+    if (slots == NULL) {
+        exit(1);
+    }
+
+    srandom(concurrency);
+
+    for (i = 0; i < concurrency; i++) {
+        ngx_bench_request(&slots[i]);
+    }
+
+    t0 = ngx_bench_now();
+
+    for (i = 0; i < NGX_BENCH_REQUESTS; i++) {
+        k = random() % concurrency;
+
+        ngx_destroy_pool(slots[k].req);
+        ngx_destroy_pool(slots[k].conn);
+
+        ngx_bench_request(&slots[k]);
+    }
+
+    elapsed = ngx_bench_now() - t0;
+
+    ngx_pool_cache_stat(&stat);
+
+    printf("%-4s %6lu conns  %7.1f ns/request  hits:%lu misses:%lu "
+           "cached:%lu blocks %luk\n",
+           max ? "on" : "off", concurrency, elapsed / NGX_BENCH_REQUESTS,
+           stat.hits, stat.misses, stat.blocks, stat.size / 1024);
+
+    for (i = 0; i < concurrency; i++) {
+        ngx_destroy_pool(slots[i].req);
+        ngx_destroy_pool(slots[i].conn);
+    }
+
+    /* 两次调用之间没有申请，第二次把缓存收缩到低水位 */
+    ngx_pool_cache_expire(&ngx_bench_log);
+    ngx_pool_cache_expire(&ngx_bench_log);
+
+    ngx_pool_cache_stat(&stat);
+
+    if (stat.size > max / 4) {
+        printf("expire left %luk cached, low is %luk\n",
+               stat.size / 1024, max / 4 / 1024);
+        exit(1);
+    }
+
+    /* 释放剩下的缓存块再关闭缓存 */
+    ngx_pool_cache.low = 0;
+    ngx_pool_cache_expire(&ngx_bench_log);
+    ngx_pool_cache_init(0, 0);
+
+    free(slots);
+}
+
+
+int
+main(void)
+{
+    ngx_uint_t  i;
+
+    static ngx_uint_t  concurrency[] = { 100, 10000, 100000 };
+
+    ngx_pagesize = getpagesize();
+
+    for (ngx_pagesize_shift = 0; (1u << ngx_pagesize_shift) < ngx_pagesize;
+         ngx_pagesize_shift++)
+    {
+        /* void */
+    }
+
+    for (i = 0; i < sizeof(concurrency) / sizeof(concurrency[0]); i++) {
+        ngx_bench_run(0, concurrency[i]);
+        ngx_bench_run(64 * 1024 * 1024, concurrency[i]);
+    }
+
+    return 0;
+}
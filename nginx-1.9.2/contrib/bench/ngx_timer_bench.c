@@ -0,0 +1,217 @@
+
+/*
+ * 定时器微基准: 比较红黑树和分层时间轮(timer_wheel on)在10k/100k/1M个定时器下
+ * add、del+add(重置keepalive/send_timeout的常见用法)以及按时间推进全部超时的耗时，
+ * 同时检查每个定时器都在自己的超时时间被触发，不会提前也不会延迟。
+ *
+ * 在已经./configure && make过的源码根目录下编译:
+ *
+ *   cc -O2 -o timer_bench -I src/core -I src/event -I src/event/modules \
+ *      -I src/os/unix -I objs contrib/bench/ngx_timer_bench.c \
+ *      objs/src/core/ngx_rbtree.o
+ *
+ *   ./timer_bench
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+/* 直接包含实现，这样可以不依赖nginx的其他目标文件 */
+#include "../../src/event/ngx_event_timer.c"
+
+
+volatile ngx_msec_t  ngx_current_msec;
+
+static ngx_uint_t    ngx_bench_fired;
+static ngx_uint_t    ngx_bench_late;
+static ngx_uint_t    ngx_bench_early;
+
+
+/* 红黑树删除节点时会改写timer.key，所以超时时间另外保存在ev->data中 */
+
+static void
+ngx_bench_timer_handler(ngx_event_t *ev)
+{
+    ngx_msec_t  key;
+
+    key = (ngx_msec_t) (uintptr_t) ev->data;
+
+    if (ngx_current_msec > key) {
+        ngx_bench_late++;
+
+    } else if (ngx_current_msec < key) {
+        ngx_bench_early++;
+    }
+
+    ngx_bench_fired++;
+}
+
+
+static double
+ngx_bench_now(void)
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+/* 按ngx_event_find_timer()的结果推进时间，直到所有定时器超时 */
+static void
+ngx_bench_run_all(void)
+{
+    ngx_msec_t  timer;
+
+    while (!ngx_event_timers_empty()) {
+        timer = ngx_event_find_timer();
+
+        ngx_current_msec += timer;
+
+        ngx_event_expire_timers();
+    }
+}
+
+
+static ngx_int_t
+ngx_bench_check(void)
+{
+    static ngx_msec_t   timeouts[] = { 16400, 1700, 254 };
+    static ngx_msec_t   starts[] = { 100, 16000, 16330 };
+    ngx_uint_t          i;
+    ngx_msec_t          timer;
+    ngx_event_t         ev[3];
+
+    /* 先加16400ms，再在16000加1700ms，16330加254ms，第一个应该在16500超时 */
+
+    ngx_memzero(ev, sizeof(ev));
+
+    ngx_current_msec = 0;
+    ngx_event_timer_init(NULL);
+
+    ngx_bench_fired = 0;
+    ngx_bench_late = 0;
+    ngx_bench_early = 0;
+
+    for (i = 0; i < 3; i++) {
+        ev[i].handler = ngx_bench_timer_handler;
+
+        while (ngx_current_msec < starts[i]) {
+            timer = ngx_event_find_timer();
+
+            if (timer == NGX_TIMER_INFINITE
+                || ngx_current_msec + timer > starts[i])
+            {
+                ngx_current_msec = starts[i];
+
+            } else {
+                ngx_current_msec += timer;
+            }
+
+            ngx_event_expire_timers();
+        }
+
+        ngx_add_timer(&ev[i], timeouts[i], NGX_FUNC_LINE);
+        ev[i].data = (void *) (uintptr_t) ev[i].timer.key;
+    }
+
+    ngx_bench_run_all();
+
+    if (ngx_bench_fired != 3 || ngx_bench_late || ngx_bench_early) {
+        printf("check failed: fired:%lu late:%lu early:%lu\n",
+               ngx_bench_fired, ngx_bench_late, ngx_bench_early);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_bench_run(ngx_uint_t wheel, ngx_uint_t n)
+{
+    double        t0, add, readd, expire;
+    ngx_uint_t    i;
+    ngx_event_t  *evs;
+
+    evs = calloc(n, sizeof(ngx_event_t));
+    if (evs == NULL) {
+        exit(1);
+    }
+
+    ngx_event_timer_use_wheel = wheel;
+
+    ngx_current_msec = 1000;
+    ngx_event_timer_init(NULL);
+
+    ngx_bench_fired = 0;
+    ngx_bench_late = 0;
+    ngx_bench_early = 0;
+
+    srandom(n);
+
+    /* 超时时间分布在1ms到75s之间，覆盖root轮和前两层 */
+
+    t0 = ngx_bench_now();
+
+    for (i = 0; i < n; i++) {
+        evs[i].handler = ngx_bench_timer_handler;
+        ngx_add_timer(&evs[i], 1 + random() % 75000, NGX_FUNC_LINE);
+        evs[i].data = (void *) (uintptr_t) evs[i].timer.key;
+    }
+
+    add = ngx_bench_now() - t0;
+
+    t0 = ngx_bench_now();
+
+    for (i = 0; i < n; i++) {
+        ngx_del_timer(&evs[i], NGX_FUNC_LINE);
+        ngx_add_timer(&evs[i], 1 + random() % 75000, NGX_FUNC_LINE);
+        evs[i].data = (void *) (uintptr_t) evs[i].timer.key;
+    }
+
+    readd = ngx_bench_now() - t0;
+
+    t0 = ngx_bench_now();
+
+    ngx_bench_run_all();
+
+    expire = ngx_bench_now() - t0;
+
+    printf("%-6s %8lu  add %7.1f ns/op  del+add %7.1f ns/op  "
+           "expire %7.1f ns/op  late:%lu early:%lu\n",
+           wheel ? "wheel" : "rbtree", n, add / n, readd / n, expire / n,
+           ngx_bench_late, ngx_bench_early);
+
+    if (ngx_bench_fired != n) {
+        printf("fired %lu of %lu timers\n", ngx_bench_fired, n);
+        exit(1);
+    }
+
+    free(evs);
+}
+
+
+int
+main(void)
+{
+    ngx_uint_t  i;
+
+    static ngx_uint_t  sizes[] = { 10000, 100000, 1000000 };
+
+    ngx_event_timer_use_wheel = 1;
+
+    if (ngx_bench_check() != NGX_OK) {
+        return 1;
+    }
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        ngx_bench_run(0, sizes[i]);
+        ngx_bench_run(1, sizes[i]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,378 @@
+
+/*
+ * hash key consistent(ketama)和hash key maglev的对比: 建表时间、表占用的内存、
+ * 每秒查找次数，以及去掉一台服务器后换了服务器的key的比例(理想值为1/n)和它是理想值的几倍。
+ *
+ * 查找走的是模块里真正的ngx_http_upstream_get_chash_peer和
+ * ngx_http_upstream_get_maglev_peer，ketama查找包含init_chash_peer中的二分查找，
+ * 以及get_chash_peer里按名字在所有服务器中找到选中服务器的那次遍历。
+ *
+ * 本文件直接包含ngx_http_upstream_hash_module.c，其他函数链接已经编译好的目标文件
+ * (去掉nginx.o和hash模块自己的.o)。在已经./configure && make过的源码根目录下编译，
+ * 最后的库与objs/Makefile中链接nginx的一致:
+ *
+ *   cc -O2 -o hash_bench -I src/core -I src/event -I src/event/modules \
+ *      -I src/os/unix -I src/http -I src/http/modules -I src/http/v2 -I objs \
+ *      contrib/bench/ngx_upstream_hash_bench.c \
+ *      $(find objs -name '*.o' ! -name nginx.o \
+ *        ! -name ngx_http_upstream_hash_module.o) \
+ *      -lpthread -lcrypt -lssl -lcrypto -lz
+ *
+ *   ./hash_bench
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "../../src/http/modules/ngx_http_upstream_hash_module.c"
+
+
+#define NGX_BENCH_KEYS     65536
+#define NGX_BENCH_LOOKUPS  1000000
+#define NGX_BENCH_BUILDS   5
+
+
+typedef struct {
+    ngx_pool_t                          *pool;
+    ngx_http_upstream_srv_conf_t         us;
+    ngx_http_upstream_hash_srv_conf_t    hcf;
+    void                                *srv_conf[1];
+    ngx_http_upstream_hash_peer_data_t   hp;
+} ngx_bench_upstream_t;
+
+
+/* nginx.c中定义的全局符号，链接其他目标文件时需要 */
+
+ngx_module_t  ngx_core_module;
+ngx_uint_t    ngx_max_module;
+
+
+char **
+ngx_set_environment(ngx_cycle_t *cycle, ngx_uint_t *last)
+{
+    return NULL;
+}
+
+
+ngx_pid_t
+ngx_exec_new_binary(ngx_cycle_t *cycle, char *const *argv)
+{
+    return NGX_INVALID_PID;
+}
+
+
+uint64_t
+ngx_get_cpu_affinity(ngx_uint_t n)
+{
+    return 0;
+}
+
+
+static ngx_log_t   ngx_bench_log;
+static ngx_str_t   ngx_bench_keys[NGX_BENCH_KEYS];
+
+
+static double
+ngx_bench_now(void)
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+/* 建立n台服务器10.0.x.y:80，skip为跳过的那台(不跳过时为n) */
+static ngx_int_t
+ngx_bench_init(ngx_bench_upstream_t *b, ngx_uint_t n, ngx_uint_t skip,
+    ngx_http_upstream_init_pt init, size_t *mem)
+{
+    size_t                         used;
+    ngx_uint_t                     i;
+    ngx_conf_t                     cf;
+    ngx_pool_t                    *temp_pool;
+    ngx_addr_t                    *addr;
+    struct sockaddr_in            *sin;
+    ngx_http_upstream_server_t    *server;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers;
+    ngx_http_upstream_maglev_t    *maglev;
+
+    ngx_memzero(b, sizeof(ngx_bench_upstream_t));
+
+    b->pool = ngx_create_pool(16384, &ngx_bench_log);
+    temp_pool = ngx_create_pool(16384, &ngx_bench_log);
+
+    if (b->pool == NULL || temp_pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    b->us.servers = ngx_array_create(b->pool, n,
+                                     sizeof(ngx_http_upstream_server_t));
+    if (b->us.servers == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_str_set(&b->us.host, "bench");
+
+    for (i = 0; i < n; i++) {
+        if (i == skip) {
+            continue;
+        }
+
+        server = ngx_array_push(b->us.servers);
+        addr = ngx_pcalloc(b->pool, sizeof(ngx_addr_t));
+        sin = ngx_pcalloc(b->pool, sizeof(struct sockaddr_in));
+        server->name.data = ngx_pnalloc(b->pool, sizeof("10.0.255.255:80"));
+
+        if (server->name.data == NULL || addr == NULL || sin == NULL) {
+            return NGX_ERROR;
+        }
+
+        server->name.len = ngx_sprintf(server->name.data, "10.0.%ui.%ui:80",
+                                       i / 256, i % 256)
+                           - server->name.data;
+
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(80);
+        sin->sin_addr.s_addr = htonl(0x0a000000 + i);
+
+        addr->sockaddr = (struct sockaddr *) sin;
+        addr->socklen = sizeof(struct sockaddr_in);
+        addr->name = server->name;
+
+        server->addrs = addr;
+        server->naddrs = 1;
+        server->weight = 1;
+        server->max_fails = 1;
+        server->fail_timeout = 10;
+        server->down = 0;
+        server->backup = 0;
+    }
+
+    b->srv_conf[ngx_http_upstream_hash_module.ctx_index] = &b->hcf;
+    b->us.srv_conf = b->srv_conf;
+
+    ngx_memzero(&cf, sizeof(ngx_conf_t));
+    cf.pool = b->pool;
+    cf.temp_pool = temp_pool;
+    cf.log = &ngx_bench_log;
+
+    if (init(&cf, &b->us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_destroy_pool(temp_pool);
+
+    peers = b->us.peer.data;
+
+    if (b->hcf.points) {
+        used = sizeof(ngx_http_upstream_chash_points_t)
+               + sizeof(ngx_http_upstream_chash_point_t)
+                 * (peers->total_weight * 160 - 1);
+
+    } else {
+        maglev = b->hcf.maglev;
+
+        /* 同ngx_http_upstream_init_maglev_peer */
+
+        maglev->peer = ngx_palloc(b->pool, peers->number
+                                  * sizeof(ngx_http_upstream_rr_peer_t *));
+        if (maglev->peer == NULL) {
+            return NGX_ERROR;
+        }
+
+        for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+            maglev->peer[i] = peer;
+        }
+
+        maglev->peers = peers;
+
+        used = sizeof(ngx_http_upstream_maglev_t)
+               + maglev->size * sizeof(uint32_t)
+               + peers->number * sizeof(ngx_http_upstream_rr_peer_t *);
+    }
+
+    if (mem) {
+        *mem = used;
+    }
+
+    /* 同ngx_http_upstream_init_hash_peer */
+
+    i = (peers->number + 8 * sizeof(uintptr_t)) / (8 * sizeof(uintptr_t));
+
+    b->hp.rrp.peers = peers;
+    b->hp.rrp.tried = ngx_pcalloc(b->pool, i * sizeof(uintptr_t));
+    if (b->hp.rrp.tried == NULL) {
+        return NGX_ERROR;
+    }
+
+    b->hp.conf = &b->hcf;
+    b->hp.get_rr_peer = ngx_http_upstream_get_round_robin_peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_str_t *
+ngx_bench_get(ngx_bench_upstream_t *b, ngx_str_t *key)
+{
+    ngx_uint_t                           i;
+    ngx_peer_connection_t                pc;
+    ngx_http_upstream_hash_peer_data_t  *hp;
+
+    hp = &b->hp;
+
+    if (hp->rrp.current) {
+        i = (hp->rrp.peers->number + 8 * sizeof(uintptr_t))
+            / (8 * sizeof(uintptr_t));
+        ngx_memzero(hp->rrp.tried, i * sizeof(uintptr_t));
+    }
+
+    hp->rrp.current = NULL;
+    hp->key = *key;
+    hp->tries = 0;
+    hp->rehash = 0;
+
+    ngx_memzero(&pc, sizeof(ngx_peer_connection_t));
+    pc.log = &ngx_bench_log;
+    pc.tries = hp->rrp.peers->number;
+
+    if (b->hcf.points) {
+        /* 同ngx_http_upstream_init_chash_peer */
+        hp->hash = ngx_http_upstream_find_chash_point(b->hcf.points,
+                                       ngx_crc32_long(key->data, key->len));
+
+        if (ngx_http_upstream_get_chash_peer(&pc, hp) != NGX_OK) {
+            return NULL;
+        }
+
+    } else {
+        if (ngx_http_upstream_get_maglev_peer(&pc, hp) != NGX_OK) {
+            return NULL;
+        }
+    }
+
+    return pc.name;
+}
+
+
+/* 去掉中间的一台服务器后重新建表，返回选中的服务器发生变化的key数 */
+static ngx_uint_t
+ngx_bench_moved(ngx_bench_upstream_t *b, ngx_uint_t n,
+    ngx_http_upstream_init_pt init)
+{
+    ngx_str_t             *one, *two;
+    ngx_uint_t             i, moved;
+    ngx_bench_upstream_t   r;
+
+    if (ngx_bench_init(&r, n, n / 2, init, NULL) != NGX_OK) {
+        exit(1);
+    }
+
+    moved = 0;
+
+    for (i = 0; i < NGX_BENCH_KEYS; i++) {
+        one = ngx_bench_get(b, &ngx_bench_keys[i]);
+        two = ngx_bench_get(&r, &ngx_bench_keys[i]);
+
+        if (one == NULL || two == NULL) {
+            exit(1);
+        }
+
+        if (one->len != two->len
+            || ngx_strncmp(one->data, two->data, one->len) != 0)
+        {
+            moved++;
+        }
+    }
+
+    ngx_destroy_pool(r.pool);
+
+    return moved;
+}
+
+
+static void
+ngx_bench_run(const char *name, ngx_http_upstream_init_pt init, ngx_uint_t n)
+{
+    size_t                 mem;
+    double                 t0, build, lookup;
+    ngx_uint_t             i, moved;
+    ngx_bench_upstream_t   b;
+
+    build = 0;
+
+    for (i = 0; i < NGX_BENCH_BUILDS; i++) {
+        t0 = ngx_bench_now();
+
+        if (ngx_bench_init(&b, n, n, init, &mem) != NGX_OK) {
+            exit(1);
+        }
+
+        build += ngx_bench_now() - t0;
+
+        if (i != NGX_BENCH_BUILDS - 1) {
+            ngx_destroy_pool(b.pool);
+        }
+    }
+
+    t0 = ngx_bench_now();
+
+    for (i = 0; i < NGX_BENCH_LOOKUPS; i++) {
+        if (ngx_bench_get(&b, &ngx_bench_keys[i % NGX_BENCH_KEYS]) == NULL) {
+            exit(1);
+        }
+    }
+
+    lookup = ngx_bench_now() - t0;
+
+    moved = ngx_bench_moved(&b, n, init);
+
+    printf("%-10s %5lu servers  build %8.1f us  table %8luk  "
+           "%6.2f M lookups/s  moved %5.2f%% (ideal %.2f%%, %.1fx)\n",
+           name, n, build / NGX_BENCH_BUILDS / 1e3, mem / 1024,
+           NGX_BENCH_LOOKUPS / lookup * 1e3,
+           moved * 100.0 / NGX_BENCH_KEYS, 100.0 / n,
+           (double) moved * n / NGX_BENCH_KEYS);
+
+    ngx_destroy_pool(b.pool);
+}
+
+
+int
+main(void)
+{
+    ngx_uint_t  i;
+
+    static ngx_uint_t  servers[] = { 100, 1000, 2000 };
+
+    ngx_pagesize = getpagesize();
+
+    ngx_time_init();
+
+    for (i = 0; i < NGX_BENCH_KEYS; i++) {
+        ngx_bench_keys[i].data = malloc(NGX_INT_T_LEN + sizeof("/static/.jpg"));
+        if (ngx_bench_keys[i].data == NULL) {
+            return 1;
+        }
+
+        ngx_bench_keys[i].len = ngx_sprintf(ngx_bench_keys[i].data,
+                                            "/static/%ui.jpg", i * 7919)
+                                - ngx_bench_keys[i].data;
+    }
+
+    for (i = 0; i < sizeof(servers) / sizeof(servers[0]); i++) {
+        ngx_bench_run("consistent", ngx_http_upstream_init_chash, servers[i]);
+        ngx_bench_run("maglev", ngx_http_upstream_init_maglev, servers[i]);
+    }
+
+    for (i = 0; i < NGX_BENCH_KEYS; i++) {
+        free(ngx_bench_keys[i].data);
+    }
+
+    return 0;
+}
@@ -23,6 +23,8 @@ static char *ngx_set_cpu_affinity(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static char *ngx_set_worker_processes(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_set_pool_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 
 
 static ngx_conf_enum_t  ngx_debug_points[] = {
@@ -134,6 +136,41 @@ static ngx_command_t  ngx_core_commands[] = {
       0,
       offsetof(ngx_core_conf_t, rlimit_core),
       NULL },
+
+    /*
+    worker_pool_cache off | max [low];  worker进程中缓存内存池释放的内存块，max为高水位，缓存超过max后释放的内存块直接free，
+    空闲时缓存收缩到low(默认max/4)，见ngx_pool_cache_init
+    */
+    { ngx_string("worker_pool_cache"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE12,
+      ngx_set_pool_cache,
+      0,
+      0,
+      NULL },
+
+    /*
+    worker_slab_magazine number; 每个worker进程为每个共享内存池的每种chunk大小缓存最多number个chunk，ngx_slab_alloc/ngx_slab_free
+    及其_locked版本先从缓存中取、放，批量与slab交换，减少共享内存锁的竞争。worker异常退出时缓存的chunk由master
+    收回。默认0，不启用，见ngx_slab_magazine_alloc
+    */
+    { ngx_string("worker_slab_magazine"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      0,
+      offsetof(ngx_core_conf_t, slab_magazine),
+      NULL },
+
+    /*
+    worker_reuseport_steering on | off; 给listen reuseport的每组socket挂一个BPF程序，按处理该连接软中断的CPU选择socket，
+    也就是选择绑定在这个CPU上的worker(worker_cpu_affinity)，让连接的accept、处理和应答都在同一个CPU上。默认off，
+    见ngx_attach_reuseport_bpf
+    */
+    { ngx_string("worker_reuseport_steering"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      0,
+      offsetof(ngx_core_conf_t, reuseport_steering),
+      NULL },
     //设置coredump path文件的产生路径
     { ngx_string("working_directory"),
       NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE1,
@@ -1063,6 +1100,11 @@ ngx_core_module_create_conf(ngx_cycle_t *cycle)
     ccf->rlimit_nofile = NGX_CONF_UNSET;
     ccf->rlimit_core = NGX_CONF_UNSET;
 
+    ccf->pool_cache = NGX_CONF_UNSET_SIZE;
+    ccf->pool_cache_low = NGX_CONF_UNSET_SIZE;
+    ccf->slab_magazine = NGX_CONF_UNSET;
+    ccf->reuseport_steering = NGX_CONF_UNSET;
+
     ccf->user = (ngx_uid_t) NGX_CONF_UNSET_UINT;
     ccf->group = (ngx_gid_t) NGX_CONF_UNSET_UINT;
 
@@ -1088,6 +1130,22 @@ ngx_core_module_init_conf(ngx_cycle_t *cycle, void *conf)
     ngx_conf_init_value(ccf->worker_processes, 1);
     ngx_conf_init_value(ccf->debug_points, 0);
 
+    ngx_conf_init_size_value(ccf->pool_cache, 0);
+    ngx_conf_init_size_value(ccf->pool_cache_low, ccf->pool_cache / 4);
+    ngx_conf_init_value(ccf->slab_magazine, 0);
+    ngx_conf_init_value(ccf->reuseport_steering, 0);
+
+#if !(NGX_HAVE_REUSEPORT_CBPF)
+
+    if (ccf->reuseport_steering) {
+        ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                      "\"worker_reuseport_steering\" is not supported "
+                      "on this platform, ignored");
+        ccf->reuseport_steering = 0;
+    }
+
+#endif
+
 #if (NGX_HAVE_CPU_AFFINITY)
 
     if (ccf->cpu_affinity_n
@@ -1463,3 +1521,46 @@ ngx_set_worker_processes(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     return NGX_CONF_OK;
 }
+
+
+static char *
+ngx_set_pool_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_core_conf_t  *ccf = conf;
+
+    ngx_str_t  *value;
+
+    if (ccf->pool_cache != NGX_CONF_UNSET_SIZE) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+
+        if (cf->args->nelts != 2) {
+            return "invalid number of arguments";
+        }
+
+        ccf->pool_cache = 0;
+        return NGX_CONF_OK;
+    }
+
+    ccf->pool_cache = ngx_parse_size(&value[1]);
+
+    if (ccf->pool_cache == (size_t) NGX_ERROR) {
+        return "invalid value";
+    }
+
+    if (cf->args->nelts == 3) {
+        ccf->pool_cache_low = ngx_parse_size(&value[2]);
+
+        if (ccf->pool_cache_low == (size_t) NGX_ERROR
+            || ccf->pool_cache_low > ccf->pool_cache)
+        {
+            return "invalid low watermark";
+        }
+    }
+
+    return NGX_CONF_OK;
+}
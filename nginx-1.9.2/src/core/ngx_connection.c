@@ -14,6 +14,9 @@ ngx_os_io_t  ngx_io; //epoll为ngx_os_io
 
 
 static void ngx_drain_connections(void);
+#if (NGX_HAVE_REUSEPORT_CBPF)
+static void ngx_attach_reuseport_bpf(ngx_cycle_t *cycle, ngx_listening_t *ls);
+#endif
 
 //ngx_event_process_init
 //master进程执行ngx_clone_listening中如果配置了多worker，监听80端口会有worker个listen赋值，master进程在ngx_open_listening_sockets
@@ -758,6 +761,13 @@ ngx_configure_listening_sockets(ngx_cycle_t *cycle)
         }
 #endif
 
+#if (NGX_HAVE_REUSEPORT_CBPF)
+        /* BPF程序作用于整个reuseport组，挂在worker 0的socket上即可 */
+        if (ls[i].reuseport && ls[i].worker == 0) {
+            ngx_attach_reuseport_bpf(cycle, &ls[i]);
+        }
+#endif
+
 #if 0
         if (1) {
             int tcp_nodelay = 1;
@@ -896,6 +906,90 @@ ngx_configure_listening_sockets(ngx_cycle_t *cycle)
 }
 
 
+#if (NGX_HAVE_REUSEPORT_CBPF)
+
+/*
+reuseport组中socket的下标就是listen()的顺序，ngx_clone_listening为worker n复制的socket紧跟在原socket之后，
+所以下标n对应worker n。BPF程序取出处理该包的CPU，按worker_cpu_affinity找到绑定在该CPU上的worker，
+返回其socket下标；CPU不属于任何worker时返回cpu % worker_processes。返回的下标超出组中socket个数时
+内核退回到按哈希选择，例如减少worker_processes后重新加载配置的情况
+*/
+static void
+ngx_attach_reuseport_bpf(ngx_cycle_t *cycle, ngx_listening_t *ls)
+{
+    uint64_t             mask;
+    ngx_uint_t           cpu, w, workers;
+    ngx_core_conf_t     *ccf;
+    struct sock_fprog    prog;
+    struct sock_filter   code[1 + 64 * 2 + 2], *f;
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    if (!ccf->reuseport_steering) {
+
+#ifdef SO_DETACH_REUSEPORT_BPF
+        /* 重新加载配置关闭了steering，没有挂过程序时返回ENOENT */
+        (void) setsockopt(ls->fd, SOL_SOCKET, SO_DETACH_REUSEPORT_BPF,
+                          NULL, 0);
+#endif
+
+        return;
+    }
+
+    workers = ccf->worker_processes;
+    f = code;
+
+    *f++ = (struct sock_filter)
+               BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+
+    /* 只有一个掩码时所有worker绑定相同的CPU，无法按CPU区分 */
+
+    if (ccf->cpu_affinity_n > 1) {
+
+        for (cpu = 0; cpu < 64; cpu++) {
+
+            for (w = 0; w < workers; w++) {
+                mask = ccf->cpu_affinity[ngx_min(w, ccf->cpu_affinity_n - 1)];
+
+                if (mask & ((uint64_t) 1 << cpu)) {
+                    break;
+                }
+            }
+
+            if (w == workers) {
+                continue;
+            }
+
+            *f++ = (struct sock_filter)
+                       BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, cpu, 0, 1);
+            *f++ = (struct sock_filter) BPF_STMT(BPF_RET|BPF_K, w);
+        }
+    }
+
+    *f++ = (struct sock_filter) BPF_STMT(BPF_ALU|BPF_MOD|BPF_K, workers);
+    *f++ = (struct sock_filter) BPF_STMT(BPF_RET|BPF_A, 0);
+
+    prog.len = f - code;
+    prog.filter = code;
+
+    if (setsockopt(ls->fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                   (const void *) &prog, sizeof(struct sock_fprog))
+        == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                      "setsockopt(SO_ATTACH_REUSEPORT_CBPF) %V failed, "
+                      "ignored", &ls->addr_text);
+        return;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, cycle->log, 0,
+                   "reuseport bpf for %V: %ui insns",
+                   &ls->addr_text, (ngx_uint_t) prog.len);
+}
+
+#endif
+
+
 void
 ngx_close_listening_sockets(ngx_cycle_t *cycle)
 {
@@ -9,6 +9,9 @@
 #include <ngx_core.h>
 
 
+ngx_uint_t  ngx_cpu_features;
+
+
 #if (( __i386__ || __amd64__ ) && ( __GNUC__ || __INTEL_COMPILER ))
 
 
@@ -31,6 +34,7 @@ ngx_cpuid(uint32_t i, uint32_t *buf)
 
     "    mov    %%ebx, %%esi;  "
 
+    "    xor    %%ecx, %%ecx;  "
     "    cpuid;                "
     "    mov    %%eax, (%1);   "
     "    mov    %%ebx, 4(%1);  "
@@ -55,7 +59,7 @@ ngx_cpuid(uint32_t i, uint32_t *buf)
 
         "cpuid"
 
-    : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (i) );
+    : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (i), "c" (0) );
 
     buf[0] = eax;
     buf[1] = ebx;
@@ -67,13 +71,30 @@ ngx_cpuid(uint32_t i, uint32_t *buf)
 #endif
 
 
+/* XCR0, the OS has to save the YMM registers for AVX2 to be usable */
+
+static ngx_inline uint32_t
+ngx_xgetbv(void)
+{
+    uint32_t  eax, edx;
+
+    __asm__ (
+
+        ".byte 0x0f, 0x01, 0xd0"    /* xgetbv */
+
+    : "=a" (eax), "=d" (edx) : "c" (0) );
+
+    return eax;
+}
+
+
 /* auto detect the L2 cache line size of modern and widespread CPUs */
 //这个函数便是在获取CPU的信息，根据CPU的型号对ngx_cacheline_size进行设置
 void
 ngx_cpuinfo(void)
 {
     u_char    *vendor;
-    uint32_t   vbuf[5], cpu[4], model;
+    uint32_t   vbuf[5], cpu[4], ext[4], model;
 
     vbuf[0] = 0;
     vbuf[1] = 0;
@@ -91,6 +112,24 @@ ngx_cpuinfo(void)
 
     ngx_cpuid(1, cpu);
 
+    //cpu[3]为ecx: bit 20 SSE4.2, bit 27 OSXSAVE, bit 28 AVX
+    if (cpu[3] & 0x00100000) {
+        ngx_cpu_features |= NGX_CPU_SSE42;
+    }
+
+    if (vbuf[0] >= 7
+        && (cpu[3] & 0x18000000) == 0x18000000
+        && (ngx_xgetbv() & 0x6) == 0x6)
+    {
+        ngx_cpuid(7, ext);
+
+        /* ebx: bit 5 AVX2 */
+
+        if (ext[1] & 0x20) {
+            ngx_cpu_features |= NGX_CPU_AVX2;
+        }
+    }
+
     if (ngx_strcmp(vendor, "GenuineIntel") == 0) {
 
         switch ((cpu[0] & 0xf00) >> 8) {
@@ -273,6 +273,11 @@ typedef struct { //从ngx_cycle_s->conf_ctx[ngx_core_module.index]指向这里
      //修改工作进程的core文件尺寸的最大值限制(RLIMIT_CORE)，用于在不重启主进程的情况下增大该限制。
      off_t                    rlimit_core;//worker_rlimit_core 1024k;  coredump文件大小
 
+     size_t                   pool_cache; //worker_pool_cache max [low]; 为0表示不缓存内存池的内存块
+     size_t                   pool_cache_low;
+     ngx_int_t                slab_magazine; //worker_slab_magazine number;
+     ngx_flag_t               reuseport_steering; //worker_reuseport_steering on | off;
+
      int                      priority;
 
      /*
@@ -11,6 +11,51 @@
 
 static void *ngx_palloc_block(ngx_pool_t *pool, size_t size);
 static void *ngx_palloc_large(ngx_pool_t *pool, size_t size);
+static ngx_int_t ngx_pool_cache_slot(size_t size);
+static void *ngx_get_cached_block(size_t *size);
+static void ngx_put_cached_block(void *p, size_t size);
+
+
+#define NGX_POOL_CACHE_MIN_SHIFT  7
+#define NGX_POOL_CACHE_PAGES      16
+#define NGX_POOL_CACHE_SLOTS      32
+
+
+typedef struct ngx_cached_block_s  ngx_cached_block_t;
+
+struct ngx_cached_block_s {
+    ngx_cached_block_t       *next;
+};
+
+
+typedef struct {
+    ngx_cached_block_t       *block; //空闲块链表
+    ngx_uint_t                number; //链表中块的个数
+    ngx_uint_t                hits;
+    ngx_uint_t                misses;
+} ngx_cached_block_slot_t;
+
+
+/*
+每个worker进程内的内存块缓存，ngx_create_pool、ngx_palloc_block、ngx_palloc_large申请的内存先按大小取整到size class，
+释放时放回对应slot的空闲链表，下次申请同样大小的块时直接复用，减少malloc/free的调用。
+
+size class: 128 256 ... ngx_pagesize/2 为2的幂，之后为1到NGX_POOL_CACHE_PAGES个页面大小，更大的内存不缓存。
+缓存的总字节数超过max(高水位)时释放的块直接free，空闲时由ngx_pool_cache_expire把缓存收缩到low(低水位)以下。
+只在worker进程(事件循环所在线程)中启用，见ngx_pool_cache_init
+*/
+typedef struct {
+    size_t                    max;   /* 为0表示不启用缓存 */
+    size_t                    low;
+    size_t                    size;  /* 当前缓存的字节数 */
+    ngx_uint_t                nsmall; /* 小于一个页面的size class个数 */
+    ngx_uint_t                nslots;
+    ngx_uint_t                tries; /* 上一次ngx_pool_cache_expire时的hits + misses */
+    ngx_cached_block_slot_t   slots[NGX_POOL_CACHE_SLOTS];
+} ngx_pool_cache_t;
+
+
+static ngx_pool_cache_t  ngx_pool_cache;
 
 /*
 ngx_create_pool：创建pool
@@ -24,9 +69,13 @@ ngx_create_pool(size_t size, ngx_log_t *log)
 {
     ngx_pool_t  *p;
 
-    p = ngx_memalign(NGX_POOL_ALIGNMENT, size, log); //// 分配一块 size 大小的内存  内存空间16字节对齐
+    p = ngx_get_cached_block(&size);
+
     if (p == NULL) {
-        return NULL;
+        p = ngx_memalign(NGX_POOL_ALIGNMENT, size, log); //// 分配一块 size 大小的内存  内存空间16字节对齐
+        if (p == NULL) {
+            return NULL;
+        }
     }
 
     // 对pool中的数据项赋初始值
@@ -74,7 +123,7 @@ ngx_destroy_pool(ngx_pool_t *pool)
         ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, pool->log, 0, "free: %p", l->alloc);
 
         if (l->alloc) {
-            ngx_free(l->alloc);
+            ngx_put_cached_block(l->alloc, l->size);
         }
     }
 
@@ -97,7 +146,7 @@ ngx_destroy_pool(ngx_pool_t *pool)
 #endif
 
     for (p = pool, n = pool->d.next; /* void */; p = n, n = n->d.next) {
-        ngx_free(p);
+        ngx_put_cached_block(p, (size_t) (p->d.end - (u_char *) p));
 
         if (n == NULL) {
             break;
@@ -120,7 +169,7 @@ ngx_reset_pool(ngx_pool_t *pool)
 
     for (l = pool->large; l; l = l->next) {
         if (l->alloc) {
-            ngx_free(l->alloc);
+            ngx_put_cached_block(l->alloc, l->size);
         }
     }
 
@@ -215,10 +264,14 @@ ngx_palloc_block(ngx_pool_t *pool, size_t size)
     // 先前的整个 pool 的大小
     psize = (size_t) (pool->d.end - (u_char *) pool);
 
-    //// 在内存对齐了的前提下，新分配一块内存
-    m = ngx_memalign(NGX_POOL_ALIGNMENT, psize, pool->log);
+    m = ngx_get_cached_block(&psize);
+
     if (m == NULL) {
-        return NULL;
+        //// 在内存对齐了的前提下，新分配一块内存
+        m = ngx_memalign(NGX_POOL_ALIGNMENT, psize, pool->log);
+        if (m == NULL) {
+            return NULL;
+        }
     }
 
     new = (ngx_pool_t *) m;
@@ -262,9 +315,13 @@ ngx_palloc_large(ngx_pool_t *pool, size_t size)
     // 注意：此处不使用 ngx_memalign 的原因是，新分配的内存较大，对其也没太大必要
     //  而且后面提供了 ngx_pmemalign 函数，专门用户分配对齐了的内存
     */
-    p = ngx_alloc(size, pool->log);
+    p = ngx_get_cached_block(&size);
+
     if (p == NULL) {
-        return NULL;
+        p = ngx_alloc(size, pool->log);
+        if (p == NULL) {
+            return NULL;
+        }
     }
 
     n = 0;
@@ -273,6 +330,7 @@ ngx_palloc_large(ngx_pool_t *pool, size_t size)
     for (large = pool->large; large; large = large->next) {
         if (large->alloc == NULL) { //就用这个没用的large
             large->alloc = p;
+            large->size = size;
             return p;
         }
 
@@ -287,12 +345,13 @@ ngx_palloc_large(ngx_pool_t *pool, size_t size)
 
     large = ngx_palloc(pool, sizeof(ngx_pool_large_t));
     if (large == NULL) {
-        ngx_free(p);
+        ngx_put_cached_block(p, size);
         return NULL;
     }
 
     // 将新分配的 large 串到链表后面
     large->alloc = p;
+    large->size = size;
     large->next = pool->large;
     pool->large = large;
 
@@ -318,6 +377,7 @@ ngx_pmemalign(ngx_pool_t *pool, size_t size, size_t alignment)
     }
 
     large->alloc = p;
+    large->size = 0; /* 对齐方式不确定，不放入缓存 */
     large->next = pool->large;
     pool->large = large;
 
@@ -334,7 +394,7 @@ ngx_pfree(ngx_pool_t *pool, void *p)
         if (p == l->alloc) {
             ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, pool->log, 0,
                            "free: %p", l->alloc);
-            ngx_free(l->alloc);
+            ngx_put_cached_block(l->alloc, l->size);
             l->alloc = NULL;
 
             return NGX_OK;
@@ -502,31 +562,205 @@ ngx_pool_delete_file(void *data)
 }
 
 
-#if 0
+void
+ngx_pool_cache_init(size_t max, size_t low)
+{
+    ngx_memzero(&ngx_pool_cache, sizeof(ngx_pool_cache_t));
+
+    if (ngx_pagesize_shift > NGX_POOL_CACHE_MIN_SHIFT) {
+        ngx_pool_cache.nsmall = ngx_pagesize_shift - NGX_POOL_CACHE_MIN_SHIFT;
+    }
+
+    ngx_pool_cache.nslots = ngx_pool_cache.nsmall + NGX_POOL_CACHE_PAGES;
+
+    if (ngx_pool_cache.nslots > NGX_POOL_CACHE_SLOTS) {
+        return;
+    }
+
+    ngx_pool_cache.max = max;
+    ngx_pool_cache.low = ngx_min(low, max);
+}
+
+
+static size_t
+ngx_pool_cache_slot_size(ngx_uint_t n)
+{
+    if (n < ngx_pool_cache.nsmall) {
+        return (size_t) 1 << (n + NGX_POOL_CACHE_MIN_SHIFT);
+    }
+
+    return (n - ngx_pool_cache.nsmall + 1) << ngx_pagesize_shift;
+}
+
 
+//返回size所属的size class，超过NGX_POOL_CACHE_PAGES个页面的返回NGX_ERROR
+static ngx_int_t
+ngx_pool_cache_slot(size_t size)
+{
+    ngx_uint_t  n, shift;
+
+    if (size > ngx_pagesize / 2) {
+        n = (size + ngx_pagesize - 1) >> ngx_pagesize_shift;
+
+        if (n > NGX_POOL_CACHE_PAGES) {
+            return NGX_ERROR;
+        }
+
+        return ngx_pool_cache.nsmall + n - 1;
+    }
+
+    for (shift = NGX_POOL_CACHE_MIN_SHIFT; ((size_t) 1 << shift) < size;
+         shift++)
+    {
+        /* void */
+    }
+
+    return shift - NGX_POOL_CACHE_MIN_SHIFT;
+}
+
+
+/*
+启用缓存时把*size取整到size class大小，slot中有空闲块则返回它，否则返回NULL，由调用者按取整后的*size申请内存
+*/
 static void *
-ngx_get_cached_block(size_t size)
+ngx_get_cached_block(size_t *size)
 {
     void                     *p;
+    ngx_int_t                 n;
     ngx_cached_block_slot_t  *slot;
 
-    if (ngx_cycle->cache == NULL) {
+    if (ngx_pool_cache.max == 0) {
         return NULL;
     }
 
-    slot = &ngx_cycle->cache[(size + ngx_pagesize - 1) / ngx_pagesize];
+    n = ngx_pool_cache_slot(*size);
 
-    slot->tries++;
+    if (n == NGX_ERROR) {
+        return NULL;
+    }
+
+    *size = ngx_pool_cache_slot_size(n);
+
+    slot = &ngx_pool_cache.slots[n];
 
     if (slot->number) {
         p = slot->block;
         slot->block = slot->block->next;
         slot->number--;
+        slot->hits++;
+
+        ngx_pool_cache.size -= *size;
+
         return p;
     }
 
+    slot->misses++;
+
     return NULL;
 }
 
-#endif
 
+/*
+size必须正好是某个size class的大小才能放回缓存，启用缓存之前(例如master进程中)按实际大小申请的内存直接释放
+*/
+static void
+ngx_put_cached_block(void *p, size_t size)
+{
+    ngx_int_t                 n;
+    ngx_cached_block_t       *block;
+    ngx_cached_block_slot_t  *slot;
+
+    if (ngx_pool_cache.max == 0
+        || ngx_pool_cache.size + size > ngx_pool_cache.max
+        || ((uintptr_t) p & (NGX_POOL_ALIGNMENT - 1)))
+    {
+        ngx_free(p);
+        return;
+    }
+
+    n = ngx_pool_cache_slot(size);
+
+    if (n == NGX_ERROR || ngx_pool_cache_slot_size(n) != size) {
+        ngx_free(p);
+        return;
+    }
+
+    slot = &ngx_pool_cache.slots[n];
+
+    block = p;
+    block->next = slot->block;
+    slot->block = block;
+    slot->number++;
+
+    ngx_pool_cache.size += size;
+}
+
+
+/*
+由worker进程的定时器周期调用，两次调用之间没有任何申请时认为进程空闲，从最大的size class开始把缓存释放到低水位以下
+*/
+void
+ngx_pool_cache_expire(ngx_log_t *log)
+{
+    size_t                    size;
+    ngx_uint_t                n, tries;
+    ngx_cached_block_t       *block;
+    ngx_cached_block_slot_t  *slot;
+
+    if (ngx_pool_cache.max == 0) {
+        return;
+    }
+
+    tries = 0;
+
+    for (n = 0; n < ngx_pool_cache.nslots; n++) {
+        tries += ngx_pool_cache.slots[n].hits + ngx_pool_cache.slots[n].misses;
+    }
+
+    if (tries != ngx_pool_cache.tries) {
+        ngx_pool_cache.tries = tries;
+        return;
+    }
+
+    n = ngx_pool_cache.nslots;
+
+    while (n-- && ngx_pool_cache.size > ngx_pool_cache.low) {
+
+        slot = &ngx_pool_cache.slots[n];
+        size = ngx_pool_cache_slot_size(n);
+
+        while (slot->number && ngx_pool_cache.size > ngx_pool_cache.low) {
+            block = slot->block;
+            slot->block = block->next;
+            slot->number--;
+
+            ngx_pool_cache.size -= size;
+
+            ngx_free(block);
+        }
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, log, 0,
+                   "pool cache expire, cached: %uz", ngx_pool_cache.size);
+}
+
+
+void
+ngx_pool_cache_stat(ngx_pool_cache_stat_t *stat)
+{
+    ngx_uint_t  n;
+
+    ngx_memzero(stat, sizeof(ngx_pool_cache_stat_t));
+
+    if (ngx_pool_cache.max == 0) {
+        return;
+    }
+
+    for (n = 0; n < ngx_pool_cache.nslots; n++) {
+        stat->hits += ngx_pool_cache.slots[n].hits;
+        stat->misses += ngx_pool_cache.slots[n].misses;
+        stat->blocks += ngx_pool_cache.slots[n].number;
+    }
+
+    stat->size = ngx_pool_cache.size;
+}
@@ -61,6 +61,7 @@ typedef struct ngx_pool_large_s  ngx_pool_large_t;
 struct ngx_pool_large_s { //ngx_pool_s中的大块内存成员
     ngx_pool_large_t     *next;
     void                 *alloc;//申请的内存块地址   
+    size_t                size; //alloc的大小，释放时用于放回ngx_pool_cache，为0表示不能缓存
 };
 
 /*
@@ -127,4 +128,17 @@ void ngx_pool_cleanup_file(void *data);
 void ngx_pool_delete_file(void *data);
 
 
+typedef struct {
+    ngx_uint_t            hits;
+    ngx_uint_t            misses;
+    ngx_uint_t            blocks; //当前缓存的块数
+    size_t                size; //当前缓存的字节数
+} ngx_pool_cache_stat_t;
+
+
+void ngx_pool_cache_init(size_t max, size_t low);
+void ngx_pool_cache_expire(ngx_log_t *log);
+void ngx_pool_cache_stat(ngx_pool_cache_stat_t *stat);
+
+
 #endif /* _NGX_PALLOC_H_INCLUDED_ */
@@ -154,6 +154,7 @@ struct ngx_resolver_ctx_s {
     ngx_addr_t               *addrs;
     ngx_addr_t                addr;
     struct sockaddr_in        sin;
+    time_t                    valid; //解析结果的有效期，由TTL或resolver的valid参数决定，只对域名解析有效
 
     ngx_resolver_handler_pt   handler;
     void                     *data;
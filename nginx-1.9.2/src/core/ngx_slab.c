@@ -64,12 +64,59 @@
 
 #endif
 
+static void *ngx_slab_pool_alloc(ngx_slab_pool_t *pool, size_t size);
+static void ngx_slab_pool_free(ngx_slab_pool_t *pool, void *p);
 static ngx_slab_page_t *ngx_slab_alloc_pages(ngx_slab_pool_t *pool,
     ngx_uint_t pages);
 static void ngx_slab_free_pages(ngx_slab_pool_t *pool, ngx_slab_page_t *page,
     ngx_uint_t pages);
+static ngx_uint_t ngx_slab_page_chunks(ngx_uint_t shift);
 static void ngx_slab_error(ngx_slab_pool_t *pool, ngx_uint_t level,
     char *text);
+static ngx_slab_magazine_t *ngx_slab_magazine_get(ngx_slab_pool_t *pool,
+    ngx_uint_t locked);
+static void *ngx_slab_magazine_alloc(ngx_slab_pool_t *pool, size_t size,
+    ngx_uint_t locked);
+static ngx_int_t ngx_slab_magazine_free(ngx_slab_pool_t *pool, void *p,
+    ngx_uint_t locked);
+static void ngx_slab_magazine_flush_slot(ngx_slab_pool_t *pool,
+    ngx_slab_magazine_t *mag, ngx_uint_t slot, ngx_uint_t n,
+    ngx_uint_t locked);
+
+
+#define NGX_SLAB_MAGAZINE_SLOTS  16
+#define NGX_SLAB_MAGAZINE_POOLS  32
+
+
+typedef struct ngx_slab_chunk_s  ngx_slab_chunk_t;
+
+struct ngx_slab_chunk_s {
+    ngx_slab_chunk_t  *next;
+};
+
+
+/*
+worker进程的magazine，每个共享内存池一个，slots[i]缓存大小为2^(min_shift + i)的已分配chunk。
+ngx_slab_alloc/ngx_slab_free以及它们的_locked版本先在magazine中取、放，不碰slab的页和bitmap；magazine空了
+从slab中批量分配ngx_slab_magazine_size/2个，满了批量释放一半，不带_locked的版本只在这时加锁。
+缓存在magazine中的chunk在slab看来仍是已分配状态，worker退出时由ngx_slab_magazine_flush_all全部还给slab。
+
+magazine结构本身从所属的共享内存池中分配，挂在pool->magazines链表上并记下所属进程的pid，worker异常退出时
+master在ngx_reap_children中调用ngx_slab_magazine_reclaim把它缓存的chunk还给slab
+*/
+struct ngx_slab_magazine_s {
+    ngx_slab_pool_t      *pool;
+    ngx_pid_t             pid;
+    ngx_slab_magazine_t  *next;
+    ngx_slab_chunk_t     *chunks[NGX_SLAB_MAGAZINE_SLOTS];
+    ngx_uint_t            number[NGX_SLAB_MAGAZINE_SLOTS];
+};
+
+
+static ngx_uint_t            ngx_slab_magazine_size; //每个slot最多缓存的chunk数，为0表示不启用
+static ngx_slab_magazine_t  *ngx_slab_magazines[NGX_SLAB_MAGAZINE_POOLS];
+static ngx_uint_t            ngx_slab_magazines_n;
+static ngx_slab_magazine_t  *ngx_slab_magazine_last;
 
 //slabÒ³ÃæµÄ´óĞ¡,32Î»LinuxÖĞÎª4k,  
 static ngx_uint_t  ngx_slab_max_size;//ÉèÖÃngx_slab_max_size = 2048B¡£Èç¹ûÒ»¸öÒ³Òª´æ·Å¶à¸öobj£¬Ôòobj sizeÒªĞ¡ÓÚÕâ¸öÊıÖµ 
@@ -147,6 +194,15 @@ ngx_slab_init(ngx_slab_pool_t *pool)//poolÖ¸ÏòµÄÊÇÕû¸ö¹²ÏíÄÚ´
 
     p += n * sizeof(ngx_slab_page_t); //Ìø¹ıÉÏÃæÄÇĞ©slab page  
 
+    //slots[]之后是每个slot的分配统计，供ngx_slab_info使用
+    //最后多出的一项stats[n]统计大于ngx_slab_max_size、直接按页分配的请求
+    pool->stats = (ngx_slab_stat_t *) p;
+    ngx_memzero(pool->stats, (n + 1) * sizeof(ngx_slab_stat_t));
+
+    p += (n + 1) * sizeof(ngx_slab_stat_t);
+
+    size -= n * sizeof(ngx_slab_page_t) + (n + 1) * sizeof(ngx_slab_stat_t);
+
     //**¼ÆËãÕâ¸ö¿Õ¼ä×Ü¹²¿ÉÒÔ·ÖÅäµÄ»º´æÒ³(4KB)µÄÊıÁ¿£¬Ã¿¸öÒ³µÄoverheadÊÇÒ»¸öslab pageµÄ´óĞ¡  
     //**Õâ¶ùµÄoverhead»¹²»°üÀ¨Ö®ºó¸ø<128BÎïÌå·ÖÅäµÄbitmapµÄËğºÄ  
 
@@ -189,6 +245,8 @@ ngx_slab_init(ngx_slab_pool_t *pool)//poolÖ¸ÏòµÄÊÇÕû¸ö¹²ÏíÄÚ´
     pool->log_nomem = 1;
     pool->log_ctx = &pool->zero;
     pool->zero = '\0';
+
+    pool->magazines = NULL;
 }
 
 //ÓÉÓÚÊÇ¹²ÏíÄÚ´æ£¬ËùÒÔÔÚ½ø³Ì¼äĞèÒªÓÃËøÀ´±£³ÖÍ¬²½
@@ -197,15 +255,42 @@ ngx_slab_alloc(ngx_slab_pool_t *pool, size_t size)
 {
     void  *p;
 
+    if (ngx_slab_magazine_size && size <= ngx_slab_max_size) {
+        p = ngx_slab_magazine_alloc(pool, size, 0);
+        if (p) {
+            return p;
+        }
+    }
+
     ngx_shmtx_lock(&pool->mutex);
 
-    p = ngx_slab_alloc_locked(pool, size);
+    p = ngx_slab_pool_alloc(pool, size);
 
     ngx_shmtx_unlock(&pool->mutex);
 
     return p;
 }
 
+
+/*
+limit_req、ssl_session_cache、proxy_cache的keys_zone等在持有pool->mutex时分配和释放，
+同样先经过magazine，这时magazine的批量补充和回收不再加锁
+*/
+void *
+ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
+{
+    void  *p;
+
+    if (ngx_slab_magazine_size && size <= ngx_slab_max_size) {
+        p = ngx_slab_magazine_alloc(pool, size, 1);
+        if (p) {
+            return p;
+        }
+    }
+
+    return ngx_slab_pool_alloc(pool, size);
+}
+
 /*
 ¶ÔÓÚ¸ø¶¨size,´Óslab_poolÖĞ·ÖÅäÄÚ´æ.
 1.Èç¹ûsize´óÓÚµÈÓÚÒ»Ò³,ÄÇÃ´´Óm_pageÖĞ²éÕÒ,Èç¹ûÓĞÔòÖ±½Ó·µ»Ø,·ñÔòÊ§°Ü.
@@ -247,8 +332,9 @@ page[]¶¼»áºÍ¶ÔÓ¦µÄslots[]¹ØÁª£¬Èç¹ûÊÇ·ÖÅä´óÓÚ204
 µ±¸ÃpageÒ³ÓÃÍêºó£¬Ôò»áÖØĞÂ°Ñpage[]µÄnextºÍprevÖÃÎªNULL£¬Í¬Ê±°Ñ¶ÔÓ¦µÄslot[]µÄnextºÍprevÖ¸Ïòslot[]±¾Éí
 µ±pageÓÃÍêºóÊÍ·ÅÆäÖĞÒ»¸öobjºó£¬ÓĞ»Ö¸´Îªpage->next = &slots[slot]; page->prev = &slots[slot]£¬slots[slot].next = page;
 */
-void * 
-ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
+//调用者持有pool->mutex，直接从slab中分配，不经过magazine
+static void *
+ngx_slab_pool_alloc(ngx_slab_pool_t *pool, size_t size)
 { //Õâ¶ù¼ÙÉèpage_sizeÊÇ4KB  
     size_t            s;
     uintptr_t         p, n, m, mask, *bitmap;
@@ -260,20 +346,25 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
         ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0,
                        "slab alloc: %uz", size);
 
+        slot = ngx_pagesize_shift - pool->min_shift;
+
+        pool->stats[slot].reqs++;
+
         //·ÖÅä1¸ö»ò¶à¸öÄÚ´æÒ³  
-        page = ngx_slab_alloc_pages(pool, (size >> ngx_pagesize_shift)
-                                          + ((size % ngx_pagesize) ? 1 : 0)); //ÀıÈçsize¸ÕºÃÊÇ4K,Ôòpage=1,Èç¹ûÊÇ4K+1£¬Ôòpage=2
+        n = (size >> ngx_pagesize_shift) + ((size % ngx_pagesize) ? 1 : 0); //ÀıÈçsize¸ÕºÃÊÇ4K,Ôòpage=1,Èç¹ûÊÇ4K+1£¬Ôòpage=2
+        page = ngx_slab_alloc_pages(pool, n);
         if (page) {
+            pool->stats[slot].pages += n;
+
             //»ñµÃpageÏò¶ÔÓÚpage[0]µÄÆ«ÒÆÁ¿ÓÉÓÚm_pageºÍpageÊı×éÊÇÏà»¥¶ÔÓ¦µÄ,¼´m_page[0]¹ÜÀípage[0]Ò³Ãæ,m_page[1]¹ÜÀípage[1]Ò³Ãæ.  
             //ËùÒÔ»ñµÃpageÏà¶ÔÓÚm_page[0]µÄÆ«ÒÆÁ¿¾Í¿ÉÒÔ¸ù¾İstartµÃµ½ÏàÓ¦Ò³ÃæµÄÆ«ÒÆÁ¿.  
             p = (page - pool->pages) << ngx_pagesize_shift;
             p += (uintptr_t) pool->start; //µÃµ½Êµ¼Ê·ÖÅäµÄÒ³µÄÆğÊ¼µØÖ·
 
-        } else {
-            p = 0;
+            goto done;
         }
 
-        goto done;
+        goto failed;
     }
 
     //½ÏĞ¡µÄobj, size < 2048B¸ù¾İĞèÒª·ÖÅäµÄsizeÀ´È·¶¨ÔÚslotsµÄÎ»ÖÃ£¬Ã¿¸öslot´æ·ÅÒ»ÖÖ´óĞ¡µÄobjµÄ¼¯ºÏ£¬Èçslots[0]±íÊ¾8byteµÄ¿Õ¼ä£¬
@@ -292,6 +383,8 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
     //ngx_slab_pool_t + 9 * sizeof(ngx_slab_page_t) + pages * sizeof(ngx_slab_page_t) +pages*ngx_pagesize(ÕâÊÇÊµ¼ÊµÄÊı¾İ²¿·Ö)
     ngx_log_debug2(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0,
                    "slab alloc: %uz slot: %ui", size, slot);
+
+    pool->stats[slot].reqs++;
                    
     //Ö¸Ïò9 * sizeof(ngx_slab_page_t) £¬Ò²¾ÍÊÇslots[0-8]Êı×é = 8 - 2048
     slots = (ngx_slab_page_t *) ((u_char *) pool + sizeof(ngx_slab_pool_t));
@@ -452,6 +545,9 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
        ×Ö½ÚobjÀ´´æ´¢¸ÃbitmapĞÅÏ¢£¬µÚÒ»¸ö64×Ö½ÚobjÊµ¼ÊÉÏÖ»ÓÃÁË8×Ö½Ú£¬ÆäËû56×Ö½ÚÎ´ÓÃ
      */
     if (page) {
+        pool->stats[slot].pages++;
+        pool->stats[slot].total += ngx_slab_page_chunks(shift);
+
         //size<128
         if (shift < ngx_slab_exact_shift) {
             p = (page - pool->pages) << ngx_pagesize_shift;//slot¿éµÄmap´æ´¢ÔÚpageµÄslotÖĞ¶¨Î»µ½¶ÔÓ¦µÄpage  
@@ -527,10 +623,18 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
         }
     }
 
+failed:
+
     p = 0;
 
+    pool->stats[slot].fails++;
+
 done:
 
+    if (p) {
+        pool->stats[slot].used++;
+    }
+
     ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0, "slab alloc: %p", p);
 
     return (void *) p;
@@ -542,9 +646,20 @@ ngx_slab_calloc(ngx_slab_pool_t *pool, size_t size)
 {
     void  *p;
 
+    if (ngx_slab_magazine_size && size <= ngx_slab_max_size) {
+        p = ngx_slab_magazine_alloc(pool, size, 0);
+        if (p) {
+            ngx_memzero(p, size);
+            return p;
+        }
+    }
+
     ngx_shmtx_lock(&pool->mutex);
 
-    p = ngx_slab_calloc_locked(pool, size);
+    p = ngx_slab_pool_alloc(pool, size);
+    if (p) {
+        ngx_memzero(p, size);
+    }
 
     ngx_shmtx_unlock(&pool->mutex);
 
@@ -569,13 +684,32 @@ ngx_slab_calloc_locked(ngx_slab_pool_t *pool, size_t size)
 void
 ngx_slab_free(ngx_slab_pool_t *pool, void *p)
 {
+    if (ngx_slab_magazine_size
+        && ngx_slab_magazine_free(pool, p, 0) == NGX_OK)
+    {
+        return;
+    }
+
     ngx_shmtx_lock(&pool->mutex);
 
-    ngx_slab_free_locked(pool, p);
+    ngx_slab_pool_free(pool, p);
 
     ngx_shmtx_unlock(&pool->mutex);
 }
 
+
+void
+ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
+{
+    if (ngx_slab_magazine_size
+        && ngx_slab_magazine_free(pool, p, 1) == NGX_OK)
+    {
+        return;
+    }
+
+    ngx_slab_pool_free(pool, p);
+}
+
 /*
 ¸ù¾İ¸ø¶¨µÄÖ¸Õëp,ÊÍ·ÅÏàÓ¦ÄÚ´æ¿é.
 1.ÕÒµ½p¶ÔÓ¦µÄÄÚ´æ¿éºÍ¶ÔÓ¦µÄm_pageÊı×éÔªËØ,
@@ -593,8 +727,9 @@ b.ÉèÈç¹ûÕû¸öÒ³Ãæ¶¼¿ÉÓÃ,Ôò½«Ò³Ãæ¹éÈëfreeÖĞ
 a.ÉèÖÃÏàÓ¦Ò³Ãæ¿éÎª¿ÉÓÃ
 b.½«Ò³Ãæ¹éÈëfreeÖĞ
 */
-void
-ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
+//调用者持有pool->mutex，直接还给slab
+static void
+ngx_slab_pool_free(ngx_slab_pool_t *pool, void *p)
 {
     size_t            size;
     uintptr_t         slab, m, *bitmap;
@@ -677,6 +812,10 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
                 }
             }
 
+            slot = shift - pool->min_shift;
+            pool->stats[slot].pages--;
+            pool->stats[slot].total -= ngx_slab_page_chunks(shift);
+
             ngx_slab_free_pages(pool, page, 1); //Õû¸öÒ³Ãæ¶¼Ã»ÓĞÊ¹ÓÃ£¬¹é»¹¸øfree 
 
             goto done;
@@ -689,6 +828,7 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
         m = (uintptr_t) 1 <<
                 (((uintptr_t) p & (ngx_pagesize - 1)) >> ngx_slab_exact_shift);
         size = ngx_slab_exact_size;
+        shift = ngx_slab_exact_shift;
 
         if ((uintptr_t) p & (size - 1)) {//Èç¹ûpÎªpageÖĞµÄobj¿é,ÄÇÃ´Ò»¶¨ÊÇsizeÕûÊı±¶  
             goto wrong_chunk;
@@ -715,6 +855,10 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
                 goto done;
             }
 
+            slot = shift - pool->min_shift;
+            pool->stats[slot].pages--;
+            pool->stats[slot].total -= ngx_slab_page_chunks(shift);
+
             ngx_slab_free_pages(pool, page, 1);//pageÒ³ÃæÖĞËùÓĞslab¿é¶¼Ã»ÓĞÊ¹ÓÃ  
 
             goto done;
@@ -759,6 +903,10 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
             }
 
             //Èç¹ûpageÒ³ÖĞËùÓĞslab¿é¶¼²»ÔÚÊ¹ÓÃ¾Í½«¸ÃÒ³ÃæÁ´ÈëfreeÖĞ  
+            slot = shift - pool->min_shift;
+            pool->stats[slot].pages--;
+            pool->stats[slot].total -= ngx_slab_page_chunks(shift);
+
             ngx_slab_free_pages(pool, page, 1);
 
             goto done;
@@ -790,6 +938,10 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
         n = ((u_char *) p - pool->start) >> ngx_pagesize_shift;
         size = slab & ~NGX_SLAB_PAGE_START;//¼ÆËã¹é»¹pageµÄ¸öÊı  
 
+        slot = ngx_pagesize_shift - pool->min_shift;
+        pool->stats[slot].used--;
+        pool->stats[slot].pages -= size;
+
         ngx_slab_free_pages(pool, &pool->pages[n], size); //¹é»¹Ò³Ãæ  
 
         ngx_slab_junk(p, size << ngx_pagesize_shift);
@@ -803,6 +955,8 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
 
 done:
 
+    pool->stats[shift - pool->min_shift].used--;
+
     ngx_slab_junk(p, size);
 
     return;
@@ -1047,3 +1201,437 @@ ngx_slab_error(ngx_slab_pool_t *pool, ngx_uint_t level, char *text)
 {
     ngx_log_error(level, ngx_cycle->log, 0, "%s%s", text, pool->log_ctx);
 }
+
+
+void
+ngx_slab_info(ngx_slab_pool_t *pool, ngx_slab_info_t *info)
+{
+    ngx_shmtx_lock(&pool->mutex);
+
+    ngx_slab_info_locked(pool, info);
+
+    ngx_shmtx_unlock(&pool->mutex);
+}
+
+
+/*
+每种chunk大小占用的页数、chunk总数和已分配数由ngx_slab_pool_alloc/ngx_slab_pool_free在pool->stats[]中
+随分配和释放更新，这里只复制计数并遍历pool->free链表得到空闲页和最大连续空闲页数，持锁时间与池的大小无关。
+放在worker magazine中的chunk在slab看来仍是已分配的
+*/
+void
+ngx_slab_info_locked(ngx_slab_pool_t *pool, ngx_slab_info_t *info)
+{
+    ngx_uint_t        i, n;
+    ngx_slab_page_t  *page;
+
+    ngx_memzero(info, sizeof(ngx_slab_info_t));
+
+    n = ngx_pagesize_shift - pool->min_shift;
+
+    if (n > NGX_SLAB_INFO_SLOTS) {
+        n = NGX_SLAB_INFO_SLOTS;
+    }
+
+    info->nslots = n;
+
+    for (i = 0; i < n; i++) {
+        info->slots[i].size = (size_t) 1 << (i + pool->min_shift);
+        info->slots[i].pages = pool->stats[i].pages;
+        info->slots[i].total = pool->stats[i].total;
+        info->slots[i].used = pool->stats[i].used;
+        info->slots[i].reqs = pool->stats[i].reqs;
+        info->slots[i].fails = pool->stats[i].fails;
+    }
+
+    n = ngx_pagesize_shift - pool->min_shift;
+
+    info->large_pages = pool->stats[n].pages;
+    info->large_reqs = pool->stats[n].reqs;
+    info->large_fails = pool->stats[n].fails;
+
+    info->pages = pool->last - pool->pages;
+
+    for (page = pool->free.next; page != &pool->free; page = page->next) {
+        info->free_runs++;
+        info->free_pages += page->slab;
+
+        if (page->slab > info->max_free_run) {
+            info->max_free_run = page->slab;
+        }
+    }
+}
+
+
+/* 一页划分为2^shift大小的chunk时可分配的chunk数，小于ngx_slab_exact_size时页开头有几个chunk存放bitmap */
+
+static ngx_uint_t
+ngx_slab_page_chunks(ngx_uint_t shift)
+{
+    ngx_uint_t  n, map;
+
+    n = (ngx_uint_t) 1 << (ngx_pagesize_shift - shift);
+
+    if (shift < ngx_slab_exact_shift) {
+        map = n / 8 / ((ngx_uint_t) 1 << shift);
+
+        if (map == 0) {
+            map = 1;
+        }
+
+        n -= map;
+    }
+
+    return n;
+}
+
+
+/*
+只在worker进程中调用，见ngx_worker_process_init。magazine中的chunk只在本进程的事件循环中使用，不能在线程池的线程中
+调用ngx_slab_alloc/ngx_slab_free
+*/
+void
+ngx_slab_magazine_init(ngx_uint_t size)
+{
+    ngx_slab_magazine_size = size;
+}
+
+
+static ngx_slab_magazine_t *
+ngx_slab_magazine_get(ngx_slab_pool_t *pool, ngx_uint_t locked)
+{
+    ngx_uint_t            i;
+    ngx_slab_magazine_t  *mag;
+
+    if (ngx_slab_magazine_last && ngx_slab_magazine_last->pool == pool) {
+        return ngx_slab_magazine_last;
+    }
+
+    if (pool->min_shift + NGX_SLAB_MAGAZINE_SLOTS < ngx_pagesize_shift) {
+        return NULL;
+    }
+
+    for (i = 0; i < ngx_slab_magazines_n; i++) {
+        if (ngx_slab_magazines[i]->pool == pool) {
+            ngx_slab_magazine_last = ngx_slab_magazines[i];
+            return ngx_slab_magazine_last;
+        }
+    }
+
+    if (ngx_slab_magazines_n == NGX_SLAB_MAGAZINE_POOLS) {
+        /* too many zones, the rest use the locked path */
+        return NULL;
+    }
+
+    if (!locked) {
+        ngx_shmtx_lock(&pool->mutex);
+    }
+
+    mag = ngx_slab_pool_alloc(pool, sizeof(ngx_slab_magazine_t));
+
+    if (mag) {
+        ngx_memzero(mag, sizeof(ngx_slab_magazine_t));
+
+        mag->pool = pool;
+        mag->pid = ngx_pid;
+
+        mag->next = pool->magazines;
+        pool->magazines = mag;
+    }
+
+    if (!locked) {
+        ngx_shmtx_unlock(&pool->mutex);
+    }
+
+    if (mag == NULL) {
+        return NULL;
+    }
+
+    ngx_slab_magazines[ngx_slab_magazines_n++] = mag;
+    ngx_slab_magazine_last = mag;
+
+    return mag;
+}
+
+
+static void *
+ngx_slab_magazine_alloc(ngx_slab_pool_t *pool, size_t size, ngx_uint_t locked)
+{
+    size_t                s;
+    ngx_uint_t            n, slot, shift, log_nomem;
+    ngx_slab_chunk_t     *chunk;
+    ngx_slab_magazine_t  *mag;
+
+    mag = ngx_slab_magazine_get(pool, locked);
+    if (mag == NULL) {
+        return NULL;
+    }
+
+    if (size > pool->min_size) {
+        shift = 1;
+        for (s = size - 1; s >>= 1; shift++) { /* void */ }
+
+    } else {
+        shift = pool->min_shift;
+    }
+
+    slot = shift - pool->min_shift;
+
+    if (mag->chunks[slot] == NULL) {
+
+        /* 批量补充，分配失败时不记录no memory日志，由后面直接从slab分配的路径记录 */
+
+        if (!locked) {
+            ngx_shmtx_lock(&pool->mutex);
+        }
+
+        log_nomem = pool->log_nomem;
+        pool->log_nomem = 0;
+
+        for (n = 0; n < ngx_slab_magazine_size / 2 + 1; n++) {
+
+            chunk = ngx_slab_pool_alloc(pool, (size_t) 1 << shift);
+            if (chunk == NULL) {
+                break;
+            }
+
+            chunk->next = mag->chunks[slot];
+            mag->chunks[slot] = chunk;
+            mag->number[slot]++;
+        }
+
+        pool->log_nomem = log_nomem;
+
+        if (n == 0) {
+            /* 共享内存不足，把本进程缓存的chunk全部还给slab后直接从slab分配重试 */
+
+            for (slot = 0; slot < NGX_SLAB_MAGAZINE_SLOTS; slot++) {
+                if (mag->number[slot]) {
+                    ngx_slab_magazine_flush_slot(pool, mag, slot,
+                                                 mag->number[slot], 1);
+                }
+            }
+        }
+
+        if (!locked) {
+            ngx_shmtx_unlock(&pool->mutex);
+        }
+
+        if (n == 0) {
+            return NULL;
+        }
+    }
+
+    chunk = mag->chunks[slot];
+    mag->chunks[slot] = chunk->next;
+    mag->number[slot]--;
+
+    return chunk;
+}
+
+
+static ngx_int_t
+ngx_slab_magazine_free(ngx_slab_pool_t *pool, void *p, ngx_uint_t locked)
+{
+    ngx_uint_t            n, slot, shift;
+    ngx_slab_page_t      *page;
+    ngx_slab_chunk_t     *chunk;
+    ngx_slab_magazine_t  *mag;
+
+    if ((u_char *) p < pool->start || (u_char *) p >= pool->end) {
+        return NGX_DECLINED;
+    }
+
+    /*
+     * p is allocated, so the type of its page and the chunk size
+     * cannot change until it is freed, and can be read without the lock
+     */
+
+    n = ((u_char *) p - pool->start) >> ngx_pagesize_shift;
+    page = &pool->pages[n];
+
+    switch (page->prev & NGX_SLAB_PAGE_MASK) {
+
+    case NGX_SLAB_SMALL:
+    case NGX_SLAB_BIG:
+        shift = page->slab & NGX_SLAB_SHIFT_MASK;
+        break;
+
+    case NGX_SLAB_EXACT:
+        shift = ngx_slab_exact_shift;
+        break;
+
+    default: /* NGX_SLAB_PAGE */
+        return NGX_DECLINED;
+    }
+
+    if ((uintptr_t) p & (((uintptr_t) 1 << shift) - 1)) {
+        return NGX_DECLINED;
+    }
+
+    mag = ngx_slab_magazine_get(pool, locked);
+    if (mag == NULL) {
+        return NGX_DECLINED;
+    }
+
+    slot = shift - pool->min_shift;
+
+    if (mag->number[slot] >= ngx_slab_magazine_size) {
+        ngx_slab_magazine_flush_slot(pool, mag, slot,
+                                     ngx_slab_magazine_size / 2 + 1, locked);
+    }
+
+    ngx_slab_junk(p, (size_t) 1 << shift);
+
+    /* 先链上再改链表头，进程在两步之间崩溃时reclaim最多漏掉这一个chunk */
+
+    chunk = p;
+    chunk->next = mag->chunks[slot];
+    mag->chunks[slot] = chunk;
+    mag->number[slot]++;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_slab_magazine_flush_slot(ngx_slab_pool_t *pool, ngx_slab_magazine_t *mag,
+    ngx_uint_t slot, ngx_uint_t n, ngx_uint_t locked)
+{
+    ngx_slab_chunk_t  *chunk;
+
+    if (!locked) {
+        ngx_shmtx_lock(&pool->mutex);
+    }
+
+    while (n-- && mag->chunks[slot]) {
+        chunk = mag->chunks[slot];
+        mag->chunks[slot] = chunk->next;
+        mag->number[slot]--;
+
+        ngx_slab_pool_free(pool, chunk);
+    }
+
+    if (!locked) {
+        ngx_shmtx_unlock(&pool->mutex);
+    }
+}
+
+
+void
+ngx_slab_magazine_flush(ngx_slab_pool_t *pool)
+{
+    ngx_uint_t            i, slot;
+    ngx_slab_magazine_t  *mag;
+
+    for (i = 0; i < ngx_slab_magazines_n; i++) {
+        mag = ngx_slab_magazines[i];
+
+        if (pool && mag->pool != pool) {
+            continue;
+        }
+
+        for (slot = 0; slot < NGX_SLAB_MAGAZINE_SLOTS; slot++) {
+            if (mag->number[slot]) {
+                ngx_slab_magazine_flush_slot(mag->pool, mag, slot,
+                                             mag->number[slot], 0);
+            }
+        }
+    }
+}
+
+
+/* worker退出时调用，把缓存的chunk和magazine结构本身都还给共享内存 */
+
+void
+ngx_slab_magazine_flush_all(void)
+{
+    ngx_uint_t             i;
+    ngx_slab_pool_t       *pool;
+    ngx_slab_magazine_t   *mag, **prev;
+
+    ngx_slab_magazine_flush(NULL);
+
+    for (i = 0; i < ngx_slab_magazines_n; i++) {
+        mag = ngx_slab_magazines[i];
+        pool = mag->pool;
+
+        ngx_shmtx_lock(&pool->mutex);
+
+        for (prev = &pool->magazines; *prev; prev = &(*prev)->next) {
+            if (*prev == mag) {
+                *prev = mag->next;
+                break;
+            }
+        }
+
+        ngx_slab_pool_free(pool, mag);
+
+        ngx_shmtx_unlock(&pool->mutex);
+    }
+
+    ngx_slab_magazines_n = 0;
+    ngx_slab_magazine_last = NULL;
+    ngx_slab_magazine_size = 0;
+}
+
+
+/*
+master在worker退出后调用(见ngx_reap_children)。正常退出的worker已经在ngx_slab_magazine_flush_all中
+摘掉了自己的magazine，这里只会找到异常退出的worker留下的，把其中缓存的chunk和magazine结构还给slab。
+chunk链表由已经死掉的进程维护，遍历时检查每个指针都在共享内存内，并且不超过记录的个数加一
+(见ngx_slab_magazine_free中入链的顺序)
+*/
+ngx_uint_t
+ngx_slab_magazine_reclaim(ngx_slab_pool_t *pool, ngx_pid_t pid)
+{
+    ngx_uint_t            slot, n, reclaimed;
+    ngx_slab_chunk_t     *chunk, *next;
+    ngx_slab_magazine_t  *mag, **prev;
+
+    reclaimed = 0;
+
+    ngx_shmtx_lock(&pool->mutex);
+
+    prev = &pool->magazines;
+
+    while (*prev) {
+        mag = *prev;
+
+        if (mag->pid != pid) {
+            prev = &mag->next;
+            continue;
+        }
+
+        *prev = mag->next;
+
+        for (slot = 0; slot < NGX_SLAB_MAGAZINE_SLOTS; slot++) {
+
+            chunk = mag->chunks[slot];
+
+            for (n = 0; chunk && n <= mag->number[slot]; n++) {
+
+                if ((u_char *) chunk < pool->start
+                    || (u_char *) chunk >= pool->end)
+                {
+                    ngx_slab_error(pool, NGX_LOG_ALERT,
+                                   "ngx_slab_magazine_reclaim(): "
+                                   "chunk outside of pool");
+                    break;
+                }
+
+                next = chunk->next;
+                ngx_slab_pool_free(pool, chunk);
+                chunk = next;
+
+                reclaimed++;
+            }
+        }
+
+        ngx_slab_pool_free(pool, mag);
+    }
+
+    ngx_shmtx_unlock(&pool->mutex);
+
+    return reclaimed;
+}
@@ -14,6 +14,7 @@
 
 
 typedef struct ngx_slab_page_s  ngx_slab_page_t;
+typedef struct ngx_slab_magazine_s  ngx_slab_magazine_t;
 //Í¼ĞÎ»¯Àí½â²Î¿¼:http://blog.csdn.net/u013009575/article/details/17743261
 struct ngx_slab_page_s { //³õÊ¼»¯¸³ÖµÔÚngx_slab_init
     //¶àÖÖÇé¿ö£¬¶à¸öÓÃÍ¾  
@@ -52,6 +53,15 @@ m_page[k]¶ÔÓ¦page[k]Ò³Ãæ
 
 */
 //Í¼ĞÎ»¯Àí½â²Î¿¼:http://blog.csdn.net/u013009575/article/details/17743261
+typedef struct {
+    ngx_uint_t        pages;  /* 划分为这种chunk的页数 */
+    ngx_uint_t        total;  /* 这些页中可分配的chunk数 */
+    ngx_uint_t        used;
+    ngx_uint_t        reqs;
+    ngx_uint_t        fails;
+} ngx_slab_stat_t;
+
+
 typedef struct { //³õÊ¼»¯¸³ÖµÔÚngx_slab_init  slab½á¹¹ÊÇÅäºÏ¹²ÏíÄÚ´æÊ¹ÓÃµÄ  ¿ÉÒÔÒÔlimit reqÄ£¿éÎªÀı£¬²Î¿¼ngx_http_limit_req_module
     ngx_shmtx_sh_t    lock; //mutexµÄËø  
 
@@ -79,6 +89,10 @@ typedef struct { //³õÊ¼»¯¸³ÖµÔÚngx_slab_init  slab½á¹¹ÊÇÅäº
     unsigned          log_nomem:1; //ngx_slab_initÖĞÄ¬ÈÏÎª1
 
     //ngx_http_file_cache_initÖĞcache->shpool->data = cache->sh;
+    ngx_slab_stat_t  *stats; //每种chunk大小的页数、chunk数、已分配数以及请求和失败次数，紧跟在slots[]之后，见ngx_slab_init
+
+    ngx_slab_magazine_t  *magazines; //各worker进程在这个池上的magazine，见ngx_slab_magazine_reclaim
+
     void             *data; //Ö¸Ïòngx_http_file_cache_t->sh
     void             *addr; //Ö¸Ïòngx_slab_pool_tµÄ¿ªÍ·    //Ö¸Ïò¹²ÏíÄÚ´ængx_shm_zone_tÖĞµÄaddr+sizeÎ²²¿µØÖ·
 } ngx_slab_pool_t;
@@ -93,4 +107,40 @@ void ngx_slab_free(ngx_slab_pool_t *pool, void *p);
 void ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p);
 
 
+#define NGX_SLAB_INFO_SLOTS  16
+
+typedef struct {
+    size_t            size;   /* chunk大小 */
+    ngx_uint_t        pages;  /* 划分为这种chunk的页数 */
+    ngx_uint_t        total;  /* 这些页中可分配的chunk数 */
+    ngx_uint_t        used;
+    ngx_uint_t        reqs;
+    ngx_uint_t        fails;
+} ngx_slab_slot_info_t;
+
+
+//ngx_slab_info遍历共享内存池得到的使用情况，用于区分碎片和真正的空间不足
+typedef struct {
+    ngx_uint_t            pages;        /* 总页数 */
+    ngx_uint_t            free_pages;
+    ngx_uint_t            free_runs;    /* 空闲页链表中连续空闲页块的个数 */
+    ngx_uint_t            max_free_run; /* 最大的连续空闲页数 */
+    ngx_uint_t            large_pages;  /* 大于ngx_slab_max_size的分配占用的页数 */
+    ngx_uint_t            large_reqs;
+    ngx_uint_t            large_fails;
+    ngx_uint_t            nslots;
+    ngx_slab_slot_info_t  slots[NGX_SLAB_INFO_SLOTS];
+} ngx_slab_info_t;
+
+
+void ngx_slab_info(ngx_slab_pool_t *pool, ngx_slab_info_t *info);
+void ngx_slab_info_locked(ngx_slab_pool_t *pool, ngx_slab_info_t *info);
+
+
+void ngx_slab_magazine_init(ngx_uint_t size);
+void ngx_slab_magazine_flush(ngx_slab_pool_t *pool);
+void ngx_slab_magazine_flush_all(void);
+ngx_uint_t ngx_slab_magazine_reclaim(ngx_slab_pool_t *pool, ngx_pid_t pid);
+
+
 #endif /* _NGX_SLAB_H_INCLUDED_ */
@@ -25,7 +25,7 @@ struct ngx_thread_task_s {
 };
 
 
-typedef struct ngx_thread_pool_s  ngx_thread_pool_t;//一个该结构对应一个threads_pool线程池配置
+//ngx_thread_pool_t在ngx_core.h中声明，一个该结构对应一个threads_pool线程池配置
 
 ngx_thread_pool_t *ngx_thread_pool_add(ngx_conf_t *cf, ngx_str_t *name);
 ngx_thread_pool_t *ngx_thread_pool_get(ngx_cycle_t *cycle, ngx_str_t *name);
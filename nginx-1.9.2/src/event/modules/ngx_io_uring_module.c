@@ -0,0 +1,1808 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+/*
+ngx_io_uring_module用io_uring的IORING_OP_POLL_ADD实现事件驱动，通过"use io_uring;"选择。
+
+和epoll每次ngx_add_event/ngx_del_event都要调用一次epoll_ctl不同，这里添加、删除事件只是往提交队列(SQ)中
+填一个sqe，所有sqe在ngx_io_uring_process_events中和等待完成事件(CQE)一起通过一次io_uring_enter提交给内核，
+一次事件循环只有一次系统调用。
+
+读写事件的语义和epoll保持一致:
+1.带NGX_CLEAR_EVENT添加的事件(连接上的读写事件)使用multishot poll(IORING_POLL_ADD_MULTI)，每次fd从不可读(写)
+  变为可读(写)时返回一个CQE，相当于EPOLLET；
+2.不带NGX_CLEAR_EVENT的事件(监听套接字、channel)使用一次性poll，触发后自动重新提交，相当于水平触发。
+
+需要Linux 5.13以上的内核(multishot poll以及io_uring_enter的IORING_ENTER_EXT_ARG超时参数)。
+
+文件异步I/O(aio on)通过IORING_OP_READ提交，完成后和Linux AIO一样投递aio->event，见ngx_io_uring_aio_read。
+SQ满了时退回到ngx_linux_aio_read.c中的Linux AIO，它的ngx_eventfd同样放到io_uring中监听，见ngx_io_uring_aio_init。
+
+io_uring_io on时ngx_io换成ngx_io_uring_io，套接字的recv/send也变成IORING_OP_RECV/IORING_OP_SEND，和其他sqe一起
+在下一次io_uring_enter中提交:
+1.recv时先从连接自己的缓冲区中取上次完成的数据，没有数据时提交一个RECV并返回NGX_AGAIN，完成后置rev->ready并投递
+  读事件；
+2.send时把数据拷贝到连接的发送缓冲区并提交SEND，在完成之前不认为有数据发出去(返回NGX_AGAIN或者原样返回chain)，
+  完成后投递写事件，调用者下一次send时才把完成的字节数从chain中去掉。这样调用者看到发送完毕时数据确实已经交给了
+  内核，关闭连接时可以直接取消未完成的请求；
+3.chain开头是文件中的数据时仍然调用ngx_os_io.send_chain用sendfile()发送。
+缓冲区在连接第一次读写时分配，连接关闭时还有未完成的请求则先取消，等完成事件返回后再释放。
+直接在fd上读写的代码(splice、明文连接上再开始的SSL握手，例如mail的STARTTLS)不能和io_uring_io一起使用:
+splice在这种连接上不启用，mail中配置了starttls时在配置解析后报错，见ngx_io_uring_socket_io。
+*/
+
+typedef struct {
+    ngx_uint_t  entries; //"io_uring_entries"参数设置，SQ的大小，CQ是它的4倍  默认512 见ngx_io_uring_init_conf
+    ngx_uint_t  aio_requests; // "io_uring_aio_requests"参数设置  默认32 见ngx_io_uring_init_conf
+    ngx_flag_t  io; //"io_uring_io"参数设置  默认off
+    size_t      buffer_size; //"io_uring_buffer_size"参数设置，每个连接的接收和发送缓冲区各这么大  默认16k
+} ngx_io_uring_conf_t;
+
+
+typedef struct {
+    unsigned               *head;
+    unsigned               *tail;
+    unsigned               *ring_mask;
+    unsigned               *ring_entries;
+    unsigned               *array;
+    struct io_uring_sqe    *sqes;
+
+    unsigned                local_tail;   /* 已经填好但还没有发布给内核的sqe的尾部 */
+    unsigned                submitted;    /* 已经发布给内核的尾部 */
+} ngx_io_uring_sq_t;
+
+
+typedef struct {
+    unsigned               *head;
+    unsigned               *tail;
+    unsigned               *ring_mask;
+    struct io_uring_cqe    *cqes;
+} ngx_io_uring_cq_t;
+
+
+/* io_uring_io on时每个连接的读写状态，按连接在cycle->connections中的下标保存在conns中 */
+typedef struct {
+    ngx_connection_t  *connection;    /* 连接关闭后为NULL，等未完成的请求返回后释放 */
+
+    u_char            *recv_buf;
+    u_char            *recv_pos;      /* recv_pos到recv_last是已经收到还没有取走的数据 */
+    u_char            *recv_last;
+    u_char            *send_buf;
+    size_t             size;
+
+    size_t             sent;          /* 已经完成但还没有告诉调用者的发送字节数 */
+
+    ngx_err_t          recv_err;
+    ngx_err_t          send_err;
+
+    unsigned           recv_active:1;
+    unsigned           recv_eof:1;
+    unsigned           send_active:1;
+    unsigned           send_complete:1;
+} ngx_io_uring_conn_t;
+
+
+/*
+user_data的低3位: poll请求的第0位是instance，第1、2位区分完成类的请求，ngx_event_t和ngx_io_uring_conn_t都至少
+8字节对齐。POLL_REMOVE等不关心完成结果的sqe用NGX_IO_URING_IGNORE
+*/
+#define NGX_IO_URING_IGNORE   0
+#define NGX_IO_URING_RECV     2
+#define NGX_IO_URING_SEND     4
+#define NGX_IO_URING_READ     6
+#define NGX_IO_URING_OP_MASK  6
+
+
+static ngx_int_t ngx_io_uring_init(ngx_cycle_t *cycle, ngx_msec_t timer);
+static ngx_int_t ngx_io_uring_setup(ngx_cycle_t *cycle,
+    ngx_io_uring_conf_t *iucf);
+#if (NGX_HAVE_EVENTFD)
+static ngx_int_t ngx_io_uring_notify_init(ngx_log_t *log);
+static void ngx_io_uring_notify_handler(ngx_event_t *ev);
+#endif
+static void ngx_io_uring_done(ngx_cycle_t *cycle);
+static ngx_int_t ngx_io_uring_add_event(ngx_event_t *ev, ngx_int_t event,
+    ngx_uint_t flags);
+static ngx_int_t ngx_io_uring_del_event(ngx_event_t *ev, ngx_int_t event,
+    ngx_uint_t flags);
+static ngx_int_t ngx_io_uring_del_connection(ngx_connection_t *c,
+    ngx_uint_t flags);
+#if (NGX_HAVE_EVENTFD)
+static ngx_int_t ngx_io_uring_notify(ngx_event_handler_pt handler);
+#endif
+static ngx_int_t ngx_io_uring_process_events(ngx_cycle_t *cycle,
+    ngx_msec_t timer, ngx_uint_t flags);
+
+static ngx_int_t ngx_io_uring_poll_add(ngx_event_t *ev, int fd,
+    ngx_uint_t multishot, ngx_log_t *log);
+static ngx_int_t ngx_io_uring_poll_remove(ngx_event_t *ev, ngx_log_t *log);
+static ngx_int_t ngx_io_uring_cancel(uint64_t data, ngx_log_t *log);
+static struct io_uring_sqe *ngx_io_uring_get_sqe(ngx_log_t *log);
+static ngx_int_t ngx_io_uring_submit(ngx_uint_t wait,
+    struct __kernel_timespec *ts);
+static void ngx_io_uring_complete(uint64_t data, int res, ngx_uint_t flags);
+
+static ngx_io_uring_conn_t *ngx_io_uring_get_conn(ngx_connection_t *c);
+static void ngx_io_uring_free_conn(ngx_connection_t *c);
+static ngx_int_t ngx_io_uring_submit_io(ngx_io_uring_conn_t *uc,
+    ngx_uint_t op, u_char *buf, size_t size, ngx_log_t *log);
+static ssize_t ngx_io_uring_recv(ngx_connection_t *c, u_char *buf,
+    size_t size);
+static ssize_t ngx_io_uring_recv_chain(ngx_connection_t *c, ngx_chain_t *in,
+    off_t limit);
+static size_t ngx_io_uring_recv_buffered(ngx_io_uring_conn_t *uc, u_char *buf,
+    size_t size);
+static ssize_t ngx_io_uring_recv_wait(ngx_connection_t *c,
+    ngx_io_uring_conn_t *uc);
+static ssize_t ngx_io_uring_send(ngx_connection_t *c, u_char *buf,
+    size_t size);
+static ngx_chain_t *ngx_io_uring_send_chain(ngx_connection_t *c,
+    ngx_chain_t *in, off_t limit);
+
+#if (NGX_HAVE_FILE_AIO)
+static void ngx_io_uring_eventfd_handler(ngx_event_t *ev);
+#endif
+
+static void *ngx_io_uring_create_conf(ngx_cycle_t *cycle);
+static char *ngx_io_uring_init_conf(ngx_cycle_t *cycle, void *conf);
+
+static int                  ring = -1; //io_uring_setup的返回值
+static ngx_io_uring_sq_t    sq;
+static ngx_io_uring_cq_t    cq;
+static void                *sq_ring_ptr = MAP_FAILED;
+static size_t               sq_ring_size;
+static void                *sqes_ptr = MAP_FAILED;
+static size_t               sqes_size;
+
+#if (NGX_HAVE_EVENTFD)
+static int                  notify_fd = -1;
+static ngx_event_t          notify_event;
+static ngx_connection_t     notify_conn;
+#endif
+
+#if (NGX_HAVE_FILE_AIO)
+//这两个变量定义在ngx_epoll_module.c中，ngx_file_aio_read通过它们提交异步I/O
+extern int                  ngx_eventfd;
+extern aio_context_t        ngx_aio_ctx;
+
+static ngx_event_t          ngx_eventfd_event;
+static ngx_connection_t     ngx_eventfd_conn;
+
+//置1后ngx_file_aio_read通过ngx_io_uring_aio_read提交读文件请求
+ngx_uint_t                  ngx_io_uring_file_aio;
+#endif
+
+static ngx_io_uring_conn_t **conns;
+static ngx_uint_t            nconns;
+static size_t                io_buffer_size;
+
+//udp_recv和flags在ngx_io_uring_init中从ngx_os_io复制
+static ngx_os_io_t  ngx_io_uring_io = {
+    ngx_io_uring_recv,
+    ngx_io_uring_recv_chain,
+    NULL,
+    ngx_io_uring_send,
+    ngx_io_uring_send_chain,
+    0
+};
+
+static ngx_str_t      io_uring_name = ngx_string("io_uring");
+
+static ngx_command_t  ngx_io_uring_commands[] = {
+
+    /*
+    io_uring提交队列的大小，一次事件循环中添加、删除的事件超过这个数时会提前调用一次io_uring_enter把sqe提交给内核
+     */
+    { ngx_string("io_uring_entries"),
+      NGX_EVENT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      0,
+      offsetof(ngx_io_uring_conf_t, entries),
+      NULL },
+
+    /* 同epoll的worker_aio_requests，同名指令会被ngx_epoll_module先匹配，所以这里单独命名 */
+    { ngx_string("io_uring_aio_requests"),
+      NGX_EVENT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      0,
+      offsetof(ngx_io_uring_conf_t, aio_requests),
+      NULL },
+
+    /* 套接字的recv/send也通过io_uring提交，见文件开头的说明 */
+    { ngx_string("io_uring_io"),
+      NGX_EVENT_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      0,
+      offsetof(ngx_io_uring_conf_t, io),
+      NULL },
+
+    { ngx_string("io_uring_buffer_size"),
+      NGX_EVENT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      0,
+      offsetof(ngx_io_uring_conf_t, buffer_size),
+      NULL },
+
+      ngx_null_command
+};
+
+
+ngx_event_module_t  ngx_io_uring_module_ctx = {
+    &io_uring_name,
+    ngx_io_uring_create_conf,            /* create configuration */
+    ngx_io_uring_init_conf,              /* init configuration */
+
+    {
+        ngx_io_uring_add_event,          /* add an event */
+        ngx_io_uring_del_event,          /* delete an event */
+        ngx_io_uring_add_event,          /* enable an event */
+        ngx_io_uring_del_event,          /* disable an event */
+        NULL,                            /* add an connection */
+        ngx_io_uring_del_connection,     /* delete an connection */
+#if (NGX_HAVE_EVENTFD)
+        ngx_io_uring_notify,             /* trigger a notify */
+#else
+        NULL,                            /* trigger a notify */
+#endif
+        ngx_io_uring_process_events,     /* process the events */
+        ngx_io_uring_init,               /* init the events */
+        ngx_io_uring_done,               /* done the events */
+    }
+};
+
+ngx_module_t  ngx_io_uring_module = {
+    NGX_MODULE_V1,
+    &ngx_io_uring_module_ctx,            /* module context */
+    ngx_io_uring_commands,               /* module directives */
+    NGX_EVENT_MODULE,                    /* module type */
+    NULL,                                /* init master */
+    NULL,                                /* init module */
+    NULL,                                /* init process */
+    NULL,                                /* init thread */
+    NULL,                                /* exit thread */
+    NULL,                                /* exit process */
+    NULL,                                /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static int
+io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(SYS_io_uring_setup, entries, p);
+}
+
+
+static int
+io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+    unsigned flags, void *arg, size_t argsz)
+{
+    return syscall(SYS_io_uring_enter, fd, to_submit, min_complete, flags,
+                   arg, argsz);
+}
+
+
+#if (NGX_HAVE_FILE_AIO)
+
+static int
+io_setup(u_int nr_reqs, aio_context_t *ctx)
+{
+    return syscall(SYS_io_setup, nr_reqs, ctx);
+}
+
+
+static int
+io_destroy(aio_context_t ctx)
+{
+    return syscall(SYS_io_destroy, ctx);
+}
+
+
+static int
+io_getevents(aio_context_t ctx, long min_nr, long nr, struct io_event *events,
+    struct timespec *tmo)
+{
+    return syscall(SYS_io_getevents, ctx, min_nr, nr, events, tmo);
+}
+
+
+/*
+和ngx_epoll_aio_init一样创建ngx_eventfd和异步I/O上下文，只是ngx_eventfd的可读事件通过io_uring的poll得到。
+读文件平时通过IORING_OP_READ提交，Linux AIO只在SQ满了的时候使用，所以这里失败时不清除ngx_file_aio
+*/
+static void
+ngx_io_uring_aio_init(ngx_cycle_t *cycle, ngx_io_uring_conf_t *iucf)
+{
+    int  n;
+
+#if (NGX_HAVE_SYS_EVENTFD_H)
+    ngx_eventfd = eventfd(0, 0);
+#else
+    ngx_eventfd = syscall(SYS_eventfd, 0);
+#endif
+
+    if (ngx_eventfd == -1) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "eventfd() failed");
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "aio eventfd: %d", ngx_eventfd);
+
+    n = 1;
+
+    if (ioctl(ngx_eventfd, FIONBIO, &n) == -1) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "ioctl(eventfd, FIONBIO) failed");
+        goto failed;
+    }
+
+    if (io_setup(iucf->aio_requests, &ngx_aio_ctx) == -1) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "io_setup() failed");
+        goto failed;
+    }
+
+    ngx_eventfd_event.data = &ngx_eventfd_conn;
+    ngx_eventfd_event.handler = ngx_io_uring_eventfd_handler;
+    ngx_eventfd_event.log = cycle->log;
+    ngx_eventfd_event.active = 1;
+    ngx_eventfd_conn.fd = ngx_eventfd;
+    ngx_eventfd_conn.read = &ngx_eventfd_event;
+    ngx_eventfd_conn.log = cycle->log;
+
+    if (ngx_io_uring_poll_add(&ngx_eventfd_event, ngx_eventfd, 1, cycle->log)
+        == NGX_OK)
+    {
+        return;
+    }
+
+    if (io_destroy(ngx_aio_ctx) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "io_destroy() failed");
+    }
+
+failed:
+
+    if (close(ngx_eventfd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "eventfd close() failed");
+    }
+
+    ngx_eventfd = -1;
+    ngx_aio_ctx = 0;
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_io_uring_init(ngx_cycle_t *cycle, ngx_msec_t timer)
+{
+    ngx_io_uring_conf_t  *iucf;
+
+    iucf = ngx_event_get_conf(cycle->conf_ctx, ngx_io_uring_module);
+
+    if (ring == -1) {
+
+        if (ngx_io_uring_setup(cycle, iucf) != NGX_OK) {
+            ngx_io_uring_done(cycle);
+            return NGX_ERROR;
+        }
+
+#if (NGX_HAVE_EVENTFD)
+        if (ngx_io_uring_notify_init(cycle->log) != NGX_OK) {
+            ngx_io_uring_module_ctx.actions.notify = NULL;
+        }
+#endif
+
+#if (NGX_HAVE_FILE_AIO)
+
+        ngx_io_uring_aio_init(cycle, iucf);
+
+        ngx_io_uring_file_aio = 1;
+
+#endif
+    }
+
+    if (iucf->io) {
+
+        if (conns == NULL) {
+            conns = ngx_calloc(cycle->connection_n
+                               * sizeof(ngx_io_uring_conn_t *), cycle->log);
+            if (conns == NULL) {
+                return NGX_ERROR;
+            }
+
+            nconns = cycle->connection_n;
+        }
+
+        io_buffer_size = iucf->buffer_size;
+
+        ngx_io_uring_io.udp_recv = ngx_os_io.udp_recv;
+        ngx_io_uring_io.flags = ngx_os_io.flags;
+
+        ngx_io = ngx_io_uring_io;
+
+    } else {
+        ngx_io = ngx_os_io;
+    }
+
+    ngx_event_actions = ngx_io_uring_module_ctx.actions;
+
+    ngx_event_flags = NGX_USE_CLEAR_EVENT|NGX_USE_GREEDY_EVENT;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_setup(ngx_cycle_t *cycle, ngx_io_uring_conf_t *iucf)
+{
+    struct io_uring_params  p;
+
+    ngx_memzero(&p, sizeof(struct io_uring_params));
+
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = iucf->entries * 4;
+
+    ring = io_uring_setup(iucf->entries, &p);
+
+    if (ring == -1) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "io_uring_setup() failed");
+        return NGX_ERROR;
+    }
+
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)
+        || !(p.features & IORING_FEAT_NODROP)
+        || !(p.features & IORING_FEAT_EXT_ARG))
+    {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "io_uring features 0x%xD are not supported, "
+                      "Linux 5.13 or newer is required", p.features);
+        return NGX_ERROR;
+    }
+
+    /* IORING_FEAT_SINGLE_MMAP: SQ和CQ共用一次mmap */
+
+    sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+
+    if (sq_ring_size < p.cq_off.cqes
+                       + p.cq_entries * sizeof(struct io_uring_cqe))
+    {
+        sq_ring_size = p.cq_off.cqes
+                       + p.cq_entries * sizeof(struct io_uring_cqe);
+    }
+
+    sq_ring_ptr = mmap(NULL, sq_ring_size, PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+
+    if (sq_ring_ptr == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "mmap(IORING_OFF_SQ_RING) failed");
+        return NGX_ERROR;
+    }
+
+    sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    sqes_ptr = mmap(NULL, sqes_size, PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_POPULATE, ring, IORING_OFF_SQES);
+
+    if (sqes_ptr == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "mmap(IORING_OFF_SQES) failed");
+        return NGX_ERROR;
+    }
+
+    sq.head = (unsigned *) ((u_char *) sq_ring_ptr + p.sq_off.head);
+    sq.tail = (unsigned *) ((u_char *) sq_ring_ptr + p.sq_off.tail);
+    sq.ring_mask = (unsigned *) ((u_char *) sq_ring_ptr + p.sq_off.ring_mask);
+    sq.ring_entries = (unsigned *) ((u_char *) sq_ring_ptr
+                                    + p.sq_off.ring_entries);
+    sq.array = (unsigned *) ((u_char *) sq_ring_ptr + p.sq_off.array);
+    sq.sqes = sqes_ptr;
+    sq.local_tail = *sq.tail;
+    sq.submitted = sq.local_tail;
+
+    cq.head = (unsigned *) ((u_char *) sq_ring_ptr + p.cq_off.head);
+    cq.tail = (unsigned *) ((u_char *) sq_ring_ptr + p.cq_off.tail);
+    cq.ring_mask = (unsigned *) ((u_char *) sq_ring_ptr + p.cq_off.ring_mask);
+    cq.cqes = (struct io_uring_cqe *) ((u_char *) sq_ring_ptr
+                                       + p.cq_off.cqes);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring: fd:%d sq:%uD cq:%uD",
+                   ring, p.sq_entries, p.cq_entries);
+
+    return NGX_OK;
+}
+
+
+#if (NGX_HAVE_EVENTFD)
+
+static ngx_int_t
+ngx_io_uring_notify_init(ngx_log_t *log)
+{
+#if (NGX_HAVE_SYS_EVENTFD_H)
+    notify_fd = eventfd(0, 0);
+#else
+    notify_fd = syscall(SYS_eventfd, 0);
+#endif
+
+    if (notify_fd == -1) {
+        ngx_log_error(NGX_LOG_EMERG, log, ngx_errno, "eventfd() failed");
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "notify eventfd: %d", notify_fd);
+
+    notify_event.handler = ngx_io_uring_notify_handler;
+    notify_event.log = log;
+    notify_event.active = 1;
+
+    notify_conn.fd = notify_fd;
+    notify_conn.read = &notify_event;
+    notify_conn.log = log;
+
+    if (ngx_io_uring_poll_add(&notify_event, notify_fd, 1, log) != NGX_OK) {
+
+        if (close(notify_fd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          "eventfd close() failed");
+        }
+
+        notify_fd = -1;
+
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+//和ngx_epoll_notify_handler一样，multishot poll相当于EPOLLET，不需要每次都读eventfd
+static void
+ngx_io_uring_notify_handler(ngx_event_t *ev)
+{
+    ssize_t               n;
+    uint64_t              count;
+    ngx_err_t             err;
+    ngx_event_handler_pt  handler;
+
+    if (++ev->index == NGX_MAX_UINT32_VALUE) {
+        ev->index = 0;
+
+        n = read(notify_fd, &count, sizeof(uint64_t));
+
+        err = ngx_errno;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                       "read() eventfd %d: %z count:%uL", notify_fd, n, count);
+
+        if ((size_t) n != sizeof(uint64_t)) {
+            ngx_log_error(NGX_LOG_ALERT, ev->log, err,
+                          "read() eventfd %d failed", notify_fd);
+        }
+    }
+
+    handler = ev->data;
+    handler(ev);
+}
+
+
+static ngx_int_t
+ngx_io_uring_notify(ngx_event_handler_pt handler)
+{
+    static uint64_t inc = 1;
+
+    notify_event.data = handler;
+
+    if ((size_t) write(notify_fd, &inc, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        ngx_log_error(NGX_LOG_ALERT, notify_event.log, ngx_errno,
+                      "write() to eventfd %d failed", notify_fd);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static void
+ngx_io_uring_done(ngx_cycle_t *cycle)
+{
+#if (NGX_HAVE_EVENTFD)
+
+    if (notify_fd != -1) {
+        if (close(notify_fd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "eventfd close() failed");
+        }
+
+        notify_fd = -1;
+    }
+
+#endif
+
+#if (NGX_HAVE_FILE_AIO)
+
+    if (ngx_eventfd != -1) {
+
+        if (io_destroy(ngx_aio_ctx) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "io_destroy() failed");
+        }
+
+        if (close(ngx_eventfd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "eventfd close() failed");
+        }
+
+        ngx_eventfd = -1;
+    }
+
+    ngx_aio_ctx = 0;
+
+#endif
+
+    if (sqes_ptr != MAP_FAILED) {
+        if (munmap(sqes_ptr, sqes_size) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "munmap(IORING_OFF_SQES) failed");
+        }
+
+        sqes_ptr = MAP_FAILED;
+    }
+
+    if (sq_ring_ptr != MAP_FAILED) {
+        if (munmap(sq_ring_ptr, sq_ring_size) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "munmap(IORING_OFF_SQ_RING) failed");
+        }
+
+        sq_ring_ptr = MAP_FAILED;
+    }
+
+    if (ring != -1) {
+        if (close(ring) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "io_uring close() failed");
+        }
+
+        ring = -1;
+    }
+
+    if (conns) {
+        ngx_free(conns);
+        conns = NULL;
+    }
+}
+
+
+/*
+读写事件分别提交各自的poll请求，user_data是ngx_event_t的地址，最后1位是instance，用于识别过期事件，和epoll中
+data.ptr存放ngx_connection_t | instance的用法一样
+*/
+static ngx_int_t
+ngx_io_uring_add_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
+{
+    ngx_connection_t  *c;
+
+    if (ev->active) {
+        return NGX_OK;
+    }
+
+    c = ev->data;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "io_uring add %s event: fd:%d flags:%ui",
+                   ev->write ? "write" : "read", c->fd, flags);
+
+    if (ngx_io_uring_poll_add(ev, c->fd, flags & NGX_CLEAR_EVENT, ev->log)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ev->active = 1;
+    ev->oneshot = (flags & NGX_CLEAR_EVENT) ? 0 : 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_del_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
+{
+    ngx_connection_t  *c;
+
+    if (!ev->active) {
+        return NGX_OK;
+    }
+
+    /*
+     * unlike epoll, a pending poll request holds a reference to the file,
+     * so it has to be removed even if the descriptor is about to be closed
+     */
+
+    c = ev->data;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "io_uring del %s event: fd:%d",
+                   ev->write ? "write" : "read", c->fd);
+
+    ev->active = 0;
+    ev->oneshot = 0;
+
+    return ngx_io_uring_poll_remove(ev, ev->log);
+}
+
+
+//ngx_close_connection中调用，除了删除读写事件，还要取消该连接未完成的recv/send
+static ngx_int_t
+ngx_io_uring_del_connection(ngx_connection_t *c, ngx_uint_t flags)
+{
+    ngx_int_t  rc;
+
+    rc = NGX_OK;
+
+    if (c->read->active
+        && ngx_io_uring_del_event(c->read, NGX_READ_EVENT, flags) != NGX_OK)
+    {
+        rc = NGX_ERROR;
+    }
+
+    if (c->write->active
+        && ngx_io_uring_del_event(c->write, NGX_WRITE_EVENT, flags) != NGX_OK)
+    {
+        rc = NGX_ERROR;
+    }
+
+    if (conns) {
+        ngx_io_uring_free_conn(c);
+    }
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_io_uring_poll_add(ngx_event_t *ev, int fd, ngx_uint_t multishot,
+    ngx_log_t *log)
+{
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_io_uring_get_sqe(log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = ev->write ? POLLOUT : (POLLIN|POLLRDHUP);
+    sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = (uintptr_t) ev | ev->instance;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_poll_remove(ngx_event_t *ev, ngx_log_t *log)
+{
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_io_uring_get_sqe(log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t) ev | ev->instance;
+    sqe->user_data = NGX_IO_URING_IGNORE;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_cancel(uint64_t data, ngx_log_t *log)
+{
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_io_uring_get_sqe(log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = data;
+    sqe->user_data = NGX_IO_URING_IGNORE;
+
+    return NGX_OK;
+}
+
+
+//从SQ中取一个空闲的sqe，SQ满了则先把已有的sqe提交给内核
+static struct io_uring_sqe *
+ngx_io_uring_get_sqe(ngx_log_t *log)
+{
+    unsigned              head, idx;
+    struct io_uring_sqe  *sqe;
+
+    head = *sq.head;
+    ngx_memory_barrier();
+
+    if (sq.local_tail - head >= *sq.ring_entries) {
+
+        ngx_log_debug0(NGX_LOG_DEBUG_EVENT, log, 0,
+                       "io_uring sq is full, submitting");
+
+        if (ngx_io_uring_submit(0, NULL) == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          "io_uring_enter() failed");
+            return NULL;
+        }
+
+        head = *sq.head;
+        ngx_memory_barrier();
+
+        if (sq.local_tail - head >= *sq.ring_entries) {
+            ngx_log_error(NGX_LOG_ALERT, log, 0, "io_uring sq overflow");
+            return NULL;
+        }
+    }
+
+    idx = sq.local_tail & *sq.ring_mask;
+
+    sqe = &sq.sqes[idx];
+    ngx_memzero(sqe, sizeof(struct io_uring_sqe));
+
+    sq.array[idx] = idx;
+    sq.local_tail++;
+
+    return sqe;
+}
+
+
+/*
+发布所有填好的sqe并调用一次io_uring_enter，wait为1时同时等待至少一个CQE，ts为NULL表示无限等待
+*/
+static ngx_int_t
+ngx_io_uring_submit(ngx_uint_t wait, struct __kernel_timespec *ts)
+{
+    int                             n;
+    unsigned                        to_submit, flags;
+    struct io_uring_getevents_arg   arg;
+
+    to_submit = sq.local_tail - sq.submitted;
+
+    if (to_submit) {
+        ngx_memory_barrier();
+        *sq.tail = sq.local_tail;
+        ngx_memory_barrier();
+    }
+
+    if (!wait && to_submit == 0) {
+        return NGX_OK;
+    }
+
+    flags = 0;
+
+    if (wait) {
+        ngx_memzero(&arg, sizeof(struct io_uring_getevents_arg));
+        arg.ts = (uintptr_t) ts;
+
+        flags = IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG;
+    }
+
+    n = io_uring_enter(ring, to_submit, wait ? 1 : 0, flags,
+                       wait ? &arg : NULL,
+                       wait ? sizeof(struct io_uring_getevents_arg) : 0);
+
+    if (n > 0) {
+        sq.submitted += n;
+    }
+
+    if (n == -1) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_process_events(ngx_cycle_t *cycle, ngx_msec_t timer,
+    ngx_uint_t flags)
+{
+    int                        res;
+    unsigned                   head, tail, cflags;
+    uint64_t                   data;
+    ngx_int_t                  instance;
+    ngx_uint_t                 level, events;
+    ngx_err_t                  err;
+    ngx_event_t               *ev;
+    ngx_queue_t               *queue;
+    ngx_connection_t          *c;
+    struct __kernel_timespec   ts, *tp;
+
+    if (timer == NGX_TIMER_INFINITE) {
+        tp = NULL;
+
+    } else {
+        ts.tv_sec = timer / 1000;
+        ts.tv_nsec = (timer % 1000) * 1000000;
+        tp = &ts;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring timer: %M, submit: %uD",
+                   timer, sq.local_tail - sq.submitted);
+
+    /* 本次循环中所有的事件添加、删除和等待都在这一次io_uring_enter中完成 */
+
+    err = 0;
+
+    head = *cq.head;
+    tail = *cq.tail;
+    ngx_memory_barrier();
+
+    if (ngx_io_uring_submit(head == tail, tp) == NGX_ERROR) {
+        err = ngx_errno;
+    }
+
+    if (flags & NGX_UPDATE_TIME || ngx_event_timer_alarm) {
+        ngx_time_update();
+    }
+
+    if (err) {
+        if (err == NGX_EINTR) {
+
+            if (ngx_event_timer_alarm) {
+                ngx_event_timer_alarm = 0;
+                return NGX_OK;
+            }
+
+            level = NGX_LOG_INFO;
+
+        } else if (err == ETIME || err == NGX_EBUSY) {
+            /* ETIME: 超时，EBUSY: CQ中还有没有取走的完成事件 */
+            level = 0;
+
+        } else {
+            level = NGX_LOG_ALERT;
+        }
+
+        if (level) {
+            ngx_log_error(level, cycle->log, err, "io_uring_enter() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    head = *cq.head;
+    tail = *cq.tail;
+    ngx_memory_barrier();
+
+    if (head == tail) {
+        if (timer != NGX_TIMER_INFINITE) {
+            return NGX_OK;
+        }
+
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, 0,
+                      "io_uring_enter() returned no events without timeout");
+        return NGX_ERROR;
+    }
+
+    for ( /* void */ ; head != tail; head++) {
+
+        data = cq.cqes[head & *cq.ring_mask].user_data;
+        res = cq.cqes[head & *cq.ring_mask].res;
+        cflags = cq.cqes[head & *cq.ring_mask].flags;
+
+        /* 先把CQE还给内核，handler中可能会提交新的sqe */
+
+        ngx_memory_barrier();
+        *cq.head = head + 1;
+
+        if (data == NGX_IO_URING_IGNORE) {
+            continue;
+        }
+
+        if (data & NGX_IO_URING_OP_MASK) {
+            ngx_io_uring_complete(data, res, flags);
+            continue;
+        }
+
+        if (res == -ECANCELED) {
+            continue;
+        }
+
+        instance = data & 1;
+        ev = (ngx_event_t *) (uintptr_t) (data & (uint64_t) ~1);
+
+#if (NGX_HAVE_EVENTFD)
+        if (ev == &notify_event) {
+            ev->handler(ev);
+            continue;
+        }
+#endif
+
+#if (NGX_HAVE_FILE_AIO)
+        if (ev == &ngx_eventfd_event) {
+            ev->handler(ev);
+            continue;
+        }
+#endif
+
+        c = ev->data;
+
+        if (c->fd == -1 || !ev->active || ev->instance != instance) {
+
+            /*
+             * the stale event from a file descriptor
+             * that was just closed or deleted in this iteration
+             */
+
+            ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                           "io_uring: stale event %p", ev);
+            continue;
+        }
+
+        if (res < 0) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, -res,
+                          "io_uring poll on fd:%d failed", c->fd);
+
+            events = POLLERR;
+
+        } else {
+            events = (ngx_uint_t) res;
+        }
+
+        ngx_log_debug4(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                       "io_uring: fd:%d %s ev:%04Xi f:%uD",
+                       c->fd, ev->write ? "w" : "r", events, cflags);
+
+        if (ev->oneshot) {
+            /* 水平触发方式的事件，重新提交poll，在下一次io_uring_enter时生效 */
+
+            if (ngx_io_uring_poll_add(ev, c->fd, 0, cycle->log) != NGX_OK) {
+                ev->active = 0;
+            }
+
+        } else if (!(cflags & IORING_CQE_F_MORE)) {
+            /* multishot poll已经结束，需要时由ngx_handle_read_event重新添加 */
+            ev->active = 0;
+        }
+
+        if (!ev->write && (events & POLLRDHUP)) {
+            ev->pending_eof = 1;
+        }
+
+        ev->ready = 1;
+
+        if (flags & NGX_POST_EVENTS) {
+            queue = ev->accept ? &ngx_posted_accept_events
+                               : &ngx_posted_events;
+
+            ngx_post_event(ev, queue);
+
+        } else {
+            ev->handler(ev);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+RECV/SEND/READ请求的完成事件。连接已经关闭的(uc->connection为NULL)只是等所有请求返回后释放ngx_io_uring_conn_t
+*/
+static void
+ngx_io_uring_complete(uint64_t data, int res, ngx_uint_t flags)
+{
+    ngx_uint_t            op;
+    ngx_event_t          *ev;
+    ngx_connection_t     *c;
+    ngx_io_uring_conn_t  *uc;
+#if (NGX_HAVE_FILE_AIO)
+    ngx_event_aio_t      *aio;
+#endif
+
+    op = data & NGX_IO_URING_OP_MASK;
+
+#if (NGX_HAVE_FILE_AIO)
+
+    if (op == NGX_IO_URING_READ) {
+        ev = (ngx_event_t *) (uintptr_t) (data & ~(uint64_t) op);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                       "io_uring read: %p res:%d", ev, res);
+
+        ev->complete = 1;
+        ev->active = 0;
+        ev->ready = 1;
+
+        aio = ev->data;
+        aio->res = res;
+
+        ngx_post_event(ev, &ngx_posted_events);
+        return;
+    }
+
+#endif
+
+    uc = (ngx_io_uring_conn_t *) (uintptr_t) (data & ~(uint64_t) op);
+    c = uc->connection;
+
+    if (op == NGX_IO_URING_RECV) {
+        uc->recv_active = 0;
+
+    } else {
+        uc->send_active = 0;
+    }
+
+    if (c == NULL) {
+        if (!uc->recv_active && !uc->send_active) {
+            ngx_free(uc);
+        }
+
+        return;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "io_uring %s: fd:%d res:%d",
+                   op == NGX_IO_URING_RECV ? "recv" : "send", c->fd, res);
+
+    /*
+     * a non-blocking socket may return EAGAIN instead of waiting,
+     * the request is resubmitted when poll reports the socket ready
+     */
+
+    if (res == -NGX_EAGAIN) {
+        return;
+    }
+
+    if (op == NGX_IO_URING_RECV) {
+        ev = c->read;
+
+        if (res > 0) {
+            uc->recv_pos = uc->recv_buf;
+            uc->recv_last = uc->recv_buf + res;
+
+        } else if (res == 0) {
+            uc->recv_eof = 1;
+
+        } else {
+            uc->recv_err = -res;
+        }
+
+    } else {
+        ev = c->write;
+
+        if (res >= 0) {
+            uc->sent = res;
+            uc->send_complete = 1;
+
+        } else {
+            uc->send_err = -res;
+        }
+    }
+
+    ev->ready = 1;
+
+    if (flags & NGX_POST_EVENTS) {
+        ngx_post_event(ev, &ngx_posted_events);
+
+    } else {
+        ev->handler(ev);
+    }
+}
+
+
+#if (NGX_HAVE_FILE_AIO)
+
+/*
+ngx_file_aio_read中调用，SQ满了返回NGX_DECLINED，由调用者退回到Linux AIO
+*/
+ngx_int_t
+ngx_io_uring_aio_read(ngx_file_t *file, u_char *buf, size_t size,
+    off_t offset)
+{
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_io_uring_get_sqe(file->log);
+    if (sqe == NULL) {
+        return NGX_DECLINED;
+    }
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = file->fd;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = size;
+    sqe->off = offset;
+    sqe->user_data = (uintptr_t) &file->aio->event | NGX_IO_URING_READ;
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static ngx_io_uring_conn_t *
+ngx_io_uring_get_conn(ngx_connection_t *c)
+{
+    ngx_uint_t            i;
+    ngx_io_uring_conn_t  *uc;
+
+    i = c - ngx_cycle->connections;
+
+    if (i >= nconns) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                      "io_uring: connection %p is not in the pool", c);
+        return NULL;
+    }
+
+    uc = conns[i];
+
+    if (uc) {
+        return uc;
+    }
+
+    uc = ngx_alloc(sizeof(ngx_io_uring_conn_t) + 2 * io_buffer_size, c->log);
+    if (uc == NULL) {
+        return NULL;
+    }
+
+    ngx_memzero(uc, sizeof(ngx_io_uring_conn_t));
+
+    uc->connection = c;
+    uc->size = io_buffer_size;
+    uc->recv_buf = (u_char *) (uc + 1);
+    uc->recv_pos = uc->recv_buf;
+    uc->recv_last = uc->recv_buf;
+    uc->send_buf = uc->recv_buf + io_buffer_size;
+
+    conns[i] = uc;
+
+    return uc;
+}
+
+
+/*
+连接关闭时调用，有未完成的请求则取消它们，ngx_io_uring_complete中收到所有完成事件后再释放。
+sqe中的fd在io_uring_enter时才解析，RECV/SEND可能还没有提交，而close()之后同一个fd马上会被新的连接使用，
+所以这里要立即提交，让它们和取消请求在fd关闭之前进入内核
+*/
+static void
+ngx_io_uring_free_conn(ngx_connection_t *c)
+{
+    ngx_uint_t            i;
+    ngx_io_uring_conn_t  *uc;
+
+    i = c - ngx_cycle->connections;
+
+    if (i >= nconns || conns[i] == NULL) {
+        return;
+    }
+
+    uc = conns[i];
+    conns[i] = NULL;
+
+    uc->connection = NULL;
+
+    if (uc->recv_active) {
+        if (ngx_io_uring_cancel((uintptr_t) uc | NGX_IO_URING_RECV, c->log)
+            != NGX_OK)
+        {
+            ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                          "io_uring: could not cancel recv on fd:%d", c->fd);
+        }
+    }
+
+    if (uc->send_active) {
+        if (ngx_io_uring_cancel((uintptr_t) uc | NGX_IO_URING_SEND, c->log)
+            != NGX_OK)
+        {
+            ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                          "io_uring: could not cancel send on fd:%d", c->fd);
+        }
+    }
+
+    if (!uc->recv_active && !uc->send_active) {
+        ngx_free(uc);
+        return;
+    }
+
+    if (ngx_io_uring_submit(0, NULL) == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, ngx_errno,
+                      "io_uring_enter() failed");
+    }
+}
+
+
+static ngx_int_t
+ngx_io_uring_submit_io(ngx_io_uring_conn_t *uc, ngx_uint_t op, u_char *buf,
+    size_t size, ngx_log_t *log)
+{
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_io_uring_get_sqe(log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (op == NGX_IO_URING_RECV) {
+        sqe->opcode = IORING_OP_RECV;
+
+    } else {
+        sqe->opcode = IORING_OP_SEND;
+        sqe->msg_flags = MSG_NOSIGNAL;
+    }
+
+    sqe->fd = uc->connection->fd;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = size;
+    sqe->user_data = (uintptr_t) uc | op;
+
+    return NGX_OK;
+}
+
+
+static ssize_t
+ngx_io_uring_recv(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    size_t                n;
+    ngx_io_uring_conn_t  *uc;
+
+    uc = ngx_io_uring_get_conn(c);
+    if (uc == NULL) {
+        c->read->error = 1;
+        return NGX_ERROR;
+    }
+
+    n = ngx_io_uring_recv_buffered(uc, buf, size);
+
+    if (n) {
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "io_uring recv: fd:%d %uz of %uz", c->fd, n, size);
+        return n;
+    }
+
+    return ngx_io_uring_recv_wait(c, uc);
+}
+
+
+//和ngx_readv_chain一样只把数据拷贝到buf->last开始的空间，不修改buf
+static ssize_t
+ngx_io_uring_recv_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
+{
+    size_t                n, size, total;
+    ngx_io_uring_conn_t  *uc;
+
+    uc = ngx_io_uring_get_conn(c);
+    if (uc == NULL) {
+        c->read->error = 1;
+        return NGX_ERROR;
+    }
+
+    total = 0;
+
+    for ( /* void */ ; in; in = in->next) {
+
+        size = in->buf->end - in->buf->last;
+
+        if (limit) {
+            if (total >= (size_t) limit) {
+                break;
+            }
+
+            if (size > (size_t) limit - total) {
+                size = (size_t) limit - total;
+            }
+        }
+
+        n = ngx_io_uring_recv_buffered(uc, in->buf->last, size);
+
+        total += n;
+
+        if (n < size) {
+            break;
+        }
+    }
+
+    if (total) {
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "io_uring recv chain: fd:%d %uz", c->fd, total);
+        return total;
+    }
+
+    return ngx_io_uring_recv_wait(c, uc);
+}
+
+
+static size_t
+ngx_io_uring_recv_buffered(ngx_io_uring_conn_t *uc, u_char *buf, size_t size)
+{
+    size_t  n;
+
+    n = uc->recv_last - uc->recv_pos;
+
+    if (n > size) {
+        n = size;
+    }
+
+    ngx_memcpy(buf, uc->recv_pos, n);
+
+    uc->recv_pos += n;
+
+    if (uc->recv_pos == uc->recv_last) {
+        uc->recv_pos = uc->recv_buf;
+        uc->recv_last = uc->recv_buf;
+    }
+
+    return n;
+}
+
+
+/*
+缓冲区中没有数据时返回上次RECV的结果(连接关闭或者出错)，否则提交一个新的RECV并返回NGX_AGAIN
+*/
+static ssize_t
+ngx_io_uring_recv_wait(ngx_connection_t *c, ngx_io_uring_conn_t *uc)
+{
+    ngx_event_t  *rev;
+
+    rev = c->read;
+
+    if (uc->recv_eof) {
+        rev->ready = 0;
+        rev->eof = 1;
+        return 0;
+    }
+
+    if (uc->recv_err) {
+        rev->ready = 0;
+        rev->error = 1;
+        return ngx_connection_error(c, uc->recv_err, "recv() failed");
+    }
+
+    if (!uc->recv_active) {
+
+        if (ngx_io_uring_submit_io(uc, NGX_IO_URING_RECV, uc->recv_buf,
+                                   uc->size, c->log)
+            != NGX_OK)
+        {
+            rev->error = 1;
+            return NGX_ERROR;
+        }
+
+        uc->recv_active = 1;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "io_uring recv: fd:%d not ready", c->fd);
+
+    rev->ready = 0;
+
+    return NGX_AGAIN;
+}
+
+
+/*
+调用者在返回NGX_AGAIN后会用同样的数据再次调用，上次提交的SEND完成后这里才返回发出去的字节数
+*/
+static ssize_t
+ngx_io_uring_send(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    size_t                n;
+    ngx_event_t          *wev;
+    ngx_io_uring_conn_t  *uc;
+
+    wev = c->write;
+
+    uc = ngx_io_uring_get_conn(c);
+    if (uc == NULL) {
+        wev->error = 1;
+        return NGX_ERROR;
+    }
+
+    if (uc->send_err) {
+        wev->error = 1;
+        (void) ngx_connection_error(c, uc->send_err, "send() failed");
+        return NGX_ERROR;
+    }
+
+    if (uc->send_complete) {
+        n = uc->sent;
+
+        uc->sent = 0;
+        uc->send_complete = 0;
+
+        if (n) {
+            ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "io_uring send: fd:%d %uz of %uz", c->fd, n, size);
+
+            c->sent += n;
+            return n;
+        }
+    }
+
+    if (!uc->send_active) {
+
+        n = ngx_min(size, uc->size);
+
+        ngx_memcpy(uc->send_buf, buf, n);
+
+        if (ngx_io_uring_submit_io(uc, NGX_IO_URING_SEND, uc->send_buf, n,
+                                   c->log)
+            != NGX_OK)
+        {
+            wev->error = 1;
+            return NGX_ERROR;
+        }
+
+        uc->send_active = 1;
+    }
+
+    wev->ready = 0;
+
+    return NGX_AGAIN;
+}
+
+
+/*
+先把上次完成的字节数从chain中去掉，再把chain开头内存中的数据(最多limit和缓冲区大小)拷贝到发送缓冲区提交SEND，
+返回的chain中不包括这次提交的数据，直到它完成
+*/
+static ngx_chain_t *
+ngx_io_uring_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
+{
+    size_t                n, size, max;
+    ngx_buf_t            *b;
+    ngx_chain_t          *cl;
+    ngx_event_t          *wev;
+    ngx_io_uring_conn_t  *uc;
+
+    wev = c->write;
+
+    uc = ngx_io_uring_get_conn(c);
+    if (uc == NULL) {
+        wev->error = 1;
+        return NGX_CHAIN_ERROR;
+    }
+
+    if (uc->send_err) {
+        wev->error = 1;
+        (void) ngx_connection_error(c, uc->send_err, "send() failed");
+        return NGX_CHAIN_ERROR;
+    }
+
+    if (uc->send_complete) {
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "io_uring send chain: fd:%d sent %uz", c->fd, uc->sent);
+
+        c->sent += uc->sent;
+        in = ngx_chain_update_sent(in, uc->sent);
+
+        uc->sent = 0;
+        uc->send_complete = 0;
+    }
+
+    if (uc->send_active) {
+        wev->ready = 0;
+        return in;
+    }
+
+    in = ngx_chain_update_sent(in, 0);
+
+    if (in == NULL) {
+        return NULL;
+    }
+
+    max = uc->size;
+
+    if (limit && (off_t) max > limit) {
+        max = (size_t) limit;
+    }
+
+    size = 0;
+
+    for (cl = in; cl && size < max; cl = cl->next) {
+        b = cl->buf;
+
+        if (ngx_buf_special(b)) {
+            continue;
+        }
+
+        if (!ngx_buf_in_memory(b)) {
+            break;
+        }
+
+        n = ngx_min((size_t) (b->last - b->pos), max - size);
+
+        ngx_memcpy(uc->send_buf + size, b->pos, n);
+
+        size += n;
+    }
+
+    if (size == 0) {
+        /* 文件中的数据仍然用sendfile()发送 */
+        return ngx_os_io.send_chain(c, in, limit);
+    }
+
+    if (ngx_io_uring_submit_io(uc, NGX_IO_URING_SEND, uc->send_buf, size,
+                               c->log)
+        != NGX_OK)
+    {
+        wev->error = 1;
+        return NGX_CHAIN_ERROR;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "io_uring send chain: fd:%d submit %uz", c->fd, size);
+
+    uc->send_active = 1;
+    wev->ready = 0;
+
+    return in;
+}
+
+
+#if (NGX_HAVE_FILE_AIO)
+
+/*
+和ngx_epoll_eventfd_handler完全一样，ngx_eventfd可读时通过io_getevents取出完成的异步I/O事件
+*/
+static void
+ngx_io_uring_eventfd_handler(ngx_event_t *ev)
+{
+    int               n, events;
+    long              i;
+    uint64_t          ready;
+    ngx_err_t         err;
+    ngx_event_t      *e;
+    ngx_event_aio_t  *aio;
+    struct io_event   event[64];
+    struct timespec   ts;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, 0, "eventfd handler");
+
+    n = read(ngx_eventfd, &ready, 8);
+
+    err = ngx_errno;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ev->log, 0, "eventfd: %d", n);
+
+    if (n != 8) {
+        if (n == -1) {
+            if (err == NGX_EAGAIN) {
+                return;
+            }
+
+            ngx_log_error(NGX_LOG_ALERT, ev->log, err, "read(eventfd) failed");
+            return;
+        }
+
+        ngx_log_error(NGX_LOG_ALERT, ev->log, 0,
+                      "read(eventfd) returned only %d bytes", n);
+        return;
+    }
+
+    ts.tv_sec = 0;
+    ts.tv_nsec = 0;
+
+    while (ready) {
+
+        events = io_getevents(ngx_aio_ctx, 1, 64, event, &ts);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                       "io_getevents: %l", events);
+
+        if (events > 0) {
+            ready -= events;
+
+            for (i = 0; i < events; i++) {
+
+                ngx_log_debug4(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                               "io_event: %uXL %uXL %L %L",
+                                event[i].data, event[i].obj,
+                                event[i].res, event[i].res2);
+
+                e = (ngx_event_t *) (uintptr_t) event[i].data;
+
+                e->complete = 1;
+                e->active = 0;
+                e->ready = 1;
+
+                aio = e->data;
+                aio->res = event[i].res;
+
+                ngx_post_event(e, &ngx_posted_events);
+            }
+
+            continue;
+        }
+
+        if (events == 0) {
+            return;
+        }
+
+        /* events == -1 */
+        ngx_log_error(NGX_LOG_ALERT, ev->log, ngx_errno,
+                      "io_getevents() failed");
+        return;
+    }
+}
+
+#endif
+
+
+/*
+use io_uring并且io_uring_io on时返回1。在所有配置解析完之后由需要直接在fd上读写的模块调用，
+见ngx_mail_init_conf
+*/
+ngx_uint_t
+ngx_io_uring_socket_io(ngx_cycle_t *cycle)
+{
+    ngx_event_conf_t     *ecf;
+    ngx_io_uring_conf_t  *iucf;
+
+    if (ngx_get_conf(cycle->conf_ctx, ngx_events_module) == NULL) {
+        return 0;
+    }
+
+    ecf = ngx_event_get_conf(cycle->conf_ctx, ngx_event_core_module);
+    iucf = ngx_event_get_conf(cycle->conf_ctx, ngx_io_uring_module);
+
+    return ecf->use == ngx_io_uring_module.ctx_index && iucf->io;
+}
+
+
+static void *
+ngx_io_uring_create_conf(ngx_cycle_t *cycle)
+{
+    ngx_io_uring_conf_t  *iucf;
+
+    iucf = ngx_palloc(cycle->pool, sizeof(ngx_io_uring_conf_t));
+    if (iucf == NULL) {
+        return NULL;
+    }
+
+    iucf->entries = NGX_CONF_UNSET;
+    iucf->aio_requests = NGX_CONF_UNSET;
+    iucf->io = NGX_CONF_UNSET;
+    iucf->buffer_size = NGX_CONF_UNSET_SIZE;
+
+    return iucf;
+}
+
+
+static char *
+ngx_io_uring_init_conf(ngx_cycle_t *cycle, void *conf)
+{
+    ngx_io_uring_conf_t *iucf = conf;
+
+    ngx_conf_init_uint_value(iucf->entries, 512);
+    ngx_conf_init_uint_value(iucf->aio_requests, 32);
+    ngx_conf_init_value(iucf->io, 0);
+    ngx_conf_init_size_value(iucf->buffer_size, 16384);
+
+    return NGX_CONF_OK;
+}
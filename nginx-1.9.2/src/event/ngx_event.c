@@ -23,6 +23,7 @@ extern ngx_module_t ngx_select_module;
 static char *ngx_event_init_conf(ngx_cycle_t *cycle, void *conf);
 static ngx_int_t ngx_event_module_init(ngx_cycle_t *cycle);
 static ngx_int_t ngx_event_process_init(ngx_cycle_t *cycle);
+static void ngx_pool_cache_handler(ngx_event_t *ev);
 static char *ngx_events_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 
 static char *ngx_event_connections(ngx_conf_t *cf, ngx_command_t *cmd,
@@ -48,6 +49,12 @@ timer_resolution指令的使用将会设置epoll_wait超时时间为-1，这表
 static ngx_uint_t     ngx_timer_resolution; //不配置timer_resolution参数，该值为0   参考ngx_process_events_and_timers  单位是ms
 sig_atomic_t          ngx_event_timer_alarm; //ngx_event_timer_alarm只是个全局变量，当它设为l时，表示需要更新时间。
 
+//worker_pool_cache启用时，每NGX_POOL_CACHE_EXPIRE毫秒检查一次进程是否空闲，空闲则把内存块缓存收缩到低水位
+#define NGX_POOL_CACHE_EXPIRE  1000
+
+static ngx_event_t       ngx_pool_cache_event;
+static ngx_connection_t  ngx_pool_cache_dumb;
+
 static ngx_uint_t     ngx_event_max_module;//gx_event_max_module是编译进Nginx的所有事件模块的总个数。
 
 ngx_uint_t            ngx_event_flags; //位图表示，见NGX_USE_FD_EVENT等  初始化见ngx_epoll_init
@@ -225,6 +232,14 @@ static ngx_command_t  ngx_event_core_commands[] = {
       0,
       offsetof(ngx_event_conf_t, accept_mutex_delay),
       NULL },
+
+    //timer_wheel on|off，定时器使用分层时间轮代替红黑树，添加删除定时器由O(log n)变为O(1)，适合大量keepalive长连接的场景
+    { ngx_string("timer_wheel"),
+      NGX_EVENT_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      0,
+      offsetof(ngx_event_conf_t, timer_wheel),
+      NULL },
     //debug_connection 1.2.2.2则在收到该IP地址请求的时候，使用debug级别打印。其他的还是沿用error_log中的设置
     //需要对来自指定IP的TCP连接打印debug级别的调斌日志
     { ngx_string("debug_connection"),
@@ -856,6 +871,26 @@ ngx_timer_signal_handler(int signo)
 }
 
 #endif
+
+
+static void
+ngx_pool_cache_handler(ngx_event_t *ev)
+{
+    ngx_pool_cache_stat_t  stat;
+
+    ngx_pool_cache_expire(ev->log);
+
+    ngx_pool_cache_stat(&stat);
+
+    ngx_log_debug4(NGX_LOG_DEBUG_ALLOC, ev->log, 0,
+                   "pool cache hits:%ui misses:%ui blocks:%ui size:%uz",
+                   stat.hits, stat.misses, stat.blocks, stat.size);
+
+    if (!ngx_exiting) {
+        ngx_add_timer(ev, NGX_POOL_CACHE_EXPIRE, NGX_FUNC_LINE);
+    }
+}
+
 //在创建子进程的里面执行  ngx_worker_process_init，
 static ngx_int_t
 ngx_event_process_init(ngx_cycle_t *cycle)
@@ -900,11 +935,25 @@ ngx_event_process_init(ngx_cycle_t *cycle)
     ngx_queue_init(&ngx_posted_accept_events);
     ngx_queue_init(&ngx_posted_events);
 
+    ngx_event_timer_use_wheel = ecf->timer_wheel;
+
     //初始化红黑树实现的定时器。
     if (ngx_event_timer_init(cycle->log) == NGX_ERROR) {
         return NGX_ERROR;
     }
 
+    if (ngx_process == NGX_PROCESS_WORKER && ccf->pool_cache) {
+        ngx_pool_cache_dumb.fd = (ngx_socket_t) -1;
+
+        ngx_pool_cache_event.handler = ngx_pool_cache_handler;
+        ngx_pool_cache_event.data = &ngx_pool_cache_dumb;
+        ngx_pool_cache_event.log = cycle->log;
+        ngx_pool_cache_event.cancelable = 1;
+
+        ngx_add_timer(&ngx_pool_cache_event, NGX_POOL_CACHE_EXPIRE,
+                      NGX_FUNC_LINE);
+    }
+
     //在调用use配置项指定的事件模块中，在ngx_event_module_t接口下，ngx_event_actions_t中的init方法进行这个事件模块的初始化工作。
     for (m = 0; ngx_modules[m]; m++) {
         if (ngx_modules[m]->type != NGX_EVENT_MODULE) {
@@ -1504,6 +1553,7 @@ ngx_event_core_create_conf(ngx_cycle_t *cycle)
     ecf->multi_accept = NGX_CONF_UNSET;
     ecf->accept_mutex = NGX_CONF_UNSET;
     ecf->accept_mutex_delay = NGX_CONF_UNSET_MSEC;
+    ecf->timer_wheel = NGX_CONF_UNSET;
     ecf->name = (void *) NGX_CONF_UNSET;
 
 #if (NGX_DEBUG)
@@ -1604,6 +1654,7 @@ ngx_event_core_init_conf(ngx_cycle_t *cycle, void *conf)
     ngx_conf_init_value(ecf->multi_accept, 0);
     ngx_conf_init_value(ecf->accept_mutex, 1);
     ngx_conf_init_msec_value(ecf->accept_mutex_delay, 500);
+    ngx_conf_init_value(ecf->timer_wheel, 0);
 
     return NGX_CONF_OK;
 }
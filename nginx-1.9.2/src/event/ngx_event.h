@@ -602,6 +602,8 @@ typedef struct {
      */ //默认500ms，也就是0.5s
     ngx_msec_t    accept_mutex_delay; //单位ms  如果没获取到mutex锁，则延迟这么多毫秒重新获取
 
+    ngx_flag_t    timer_wheel; //timer_wheel on，定时器使用分层时间轮实现，默认0使用红黑树
+
     u_char       *name;//所选用事件模块的名字，它与use成员是匹配的  epoll select
 
 /*
@@ -8,6 +8,9 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_event.h>
+#if (NGX_SSL_ASYNC)
+#include <ngx_thread_pool.h>
+#endif
 
 
 #define NGX_SSL_PASSWORD_BUFFER_SIZE  4096
@@ -18,6 +21,27 @@ typedef struct {
 } ngx_openssl_conf_t;
 
 
+#if (NGX_SSL_ASYNC)
+
+/* 交给线程池执行的一次RSA私钥运算，task和本结构用ngx_alloc分配，连接关闭后仍可能被线程使用 */
+typedef struct {
+    RSA               *rsa;
+    int                flen;
+    int                padding;
+    int                ret;
+    u_char            *from;
+    u_char            *to;
+
+    ngx_connection_t  *connection; /* 运算完成前连接已关闭时为NULL */
+    ngx_ssl_conn_t    *ssl_conn;   /* 连接关闭后由任务保留的SSL对象，恢复job结束后再释放 */
+
+    unsigned           decrypt:1;
+    unsigned           done:1;
+} ngx_ssl_key_offload_ctx_t;
+
+#endif
+
+
 static int ngx_ssl_password_callback(char *buf, int size, int rwflag,
     void *userdata);
 static int ngx_ssl_verify_callback(int ok, X509_STORE_CTX *x509_store);
@@ -28,6 +52,21 @@ static void ngx_ssl_handshake_handler(ngx_event_t *ev);
 static ngx_int_t ngx_ssl_handle_recv(ngx_connection_t *c, int n);
 static void ngx_ssl_write_handler(ngx_event_t *wev);
 static void ngx_ssl_read_handler(ngx_event_t *rev);
+#if (NGX_SSL_ASYNC)
+static int ngx_ssl_key_offload_priv_enc(int flen, const u_char *from,
+    u_char *to, RSA *rsa, int padding);
+static int ngx_ssl_key_offload_priv_dec(int flen, const u_char *from,
+    u_char *to, RSA *rsa, int padding);
+static int ngx_ssl_key_offload_run(int flen, const u_char *from, u_char *to,
+    RSA *rsa, int padding, ngx_uint_t decrypt);
+static int ngx_ssl_key_offload_async_callback(ngx_ssl_conn_t *ssl_conn,
+    void *arg);
+static ngx_connection_t *ngx_ssl_key_offload_get_connection(void);
+static void ngx_ssl_key_offload_thread_handler(void *data, ngx_log_t *log);
+static void ngx_ssl_key_offload_event_handler(ngx_event_t *ev);
+static void ngx_ssl_key_offload_info_callback(const ngx_ssl_conn_t *ssl_conn,
+    int where, int ret);
+#endif
 static void ngx_ssl_shutdown_handler(ngx_event_t *ev);
 static void ngx_ssl_connection_error(ngx_connection_t *c, int sslerr,
     ngx_err_t err, char *text);
@@ -39,6 +78,9 @@ ngx_int_t ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data);
 static int ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn,
     ngx_ssl_session_t *sess);
 static ngx_ssl_session_t *ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn,
+#if OPENSSL_VERSION_NUMBER >= 0x10100003L
+    const
+#endif
     u_char *id, int len, int *copy);
 static void ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess);
 static void ngx_ssl_expire_sessions(ngx_ssl_session_cache_t *cache,
@@ -104,6 +146,11 @@ int  ngx_ssl_session_ticket_keys_index;
 int  ngx_ssl_certificate_index;
 int  ngx_ssl_stapling_index;
 
+#if (NGX_SSL_ASYNC)
+static int                ngx_ssl_key_offload_index;
+static RSA_METHOD        *ngx_ssl_key_offload_method;
+#endif
+
 
 ngx_int_t
 ngx_ssl_init(ngx_log_t *log)
@@ -184,6 +231,35 @@ ngx_ssl_init(ngx_log_t *log)
         return NGX_ERROR;
     }
 
+#if (NGX_SSL_ASYNC)
+
+    ngx_ssl_key_offload_index = RSA_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+
+    if (ngx_ssl_key_offload_index == -1) {
+        ngx_ssl_error(NGX_LOG_ALERT, log, 0, "RSA_get_ex_new_index() failed");
+        return NGX_ERROR;
+    }
+
+    /* 在OpenSSL默认RSA实现的基础上替换私钥加密(签名)和解密 */
+
+    ngx_ssl_key_offload_method = RSA_meth_dup(RSA_PKCS1_OpenSSL());
+
+    if (ngx_ssl_key_offload_method == NULL
+        || RSA_meth_set1_name(ngx_ssl_key_offload_method, "nginx key offload")
+           == 0
+        || RSA_meth_set_priv_enc(ngx_ssl_key_offload_method,
+                                 ngx_ssl_key_offload_priv_enc)
+           == 0
+        || RSA_meth_set_priv_dec(ngx_ssl_key_offload_method,
+                                 ngx_ssl_key_offload_priv_dec)
+           == 0)
+    {
+        ngx_ssl_error(NGX_LOG_ALERT, log, 0, "RSA_meth_dup() failed");
+        return NGX_ERROR;
+    }
+
+#endif
+
     return NGX_OK;
 }
 
@@ -281,6 +357,11 @@ ngx_ssl_create(ngx_ssl_t *ssl, ngx_uint_t protocols, void *data)
     SSL_CTX_set_options(ssl->ctx, SSL_OP_NO_COMPRESSION);
 #endif
 
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    /* OpenSSL 3把没有close_notify的EOF当作错误，这里按以前的版本当作正常关闭 */
+    SSL_CTX_set_options(ssl->ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
 #ifdef SSL_MODE_RELEASE_BUFFERS
     SSL_CTX_set_mode(ssl->ctx, SSL_MODE_RELEASE_BUFFERS);
 #endif
@@ -904,8 +985,9 @@ ngx_ssl_passwords_cleanup(void *data)
 ngx_int_t
 ngx_ssl_dhparam(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *file)
 {
-    DH   *dh;
-    BIO  *bio;
+    DH      *dh;
+    BIO     *bio;
+    BIGNUM  *p, *g;
 
     /*
      * -----BEGIN DH PARAMETERS-----
@@ -934,21 +1016,36 @@ ngx_ssl_dhparam(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *file)
 
     if (file->len == 0) {
 
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        /* 内置的1024位参数低于OpenSSL 3默认的安全级别，改用按证书强度选择的参数 */
+        SSL_CTX_set_dh_auto(ssl->ctx, 1);
+        return NGX_OK;
+#endif
+
         dh = DH_new();
         if (dh == NULL) {
             ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0, "DH_new() failed");
             return NGX_ERROR;
         }
 
-        dh->p = BN_bin2bn(dh1024_p, sizeof(dh1024_p), NULL);
-        dh->g = BN_bin2bn(dh1024_g, sizeof(dh1024_g), NULL);
+        p = BN_bin2bn(dh1024_p, sizeof(dh1024_p), NULL);
+        g = BN_bin2bn(dh1024_g, sizeof(dh1024_g), NULL);
 
-        if (dh->p == NULL || dh->g == NULL) {
+        if (p == NULL || g == NULL) {
             ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0, "BN_bin2bn() failed");
             DH_free(dh);
+            BN_free(p);
+            BN_free(g);
             return NGX_ERROR;
         }
 
+#if OPENSSL_VERSION_NUMBER >= 0x10100005L
+        DH_set0_pqg(dh, p, NULL, g);
+#else
+        dh->p = p;
+        dh->g = g;
+#endif
+
         SSL_CTX_set_tmp_dh(ssl->ctx, dh);
 
         DH_free(dh);
@@ -1025,6 +1122,331 @@ ngx_ssl_ecdh_curve(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *name)
 }
 
 
+#if (NGX_SSL_ASYNC)
+
+/*
+ssl_key_offload threads[=pool]:
+RSA私钥运算(完整握手中的签名或RSA密钥交换的解密)一次约1ms，会阻塞整个worker。这里把证书私钥换成使用
+ngx_ssl_key_offload_method的等价RSA key，并让SSL_CTX工作在SSL_MODE_ASYNC模式，握手在OpenSSL的async job中进行。
+私钥运算时把任务投递到线程池并暂停job，SSL_do_handshake返回SSL_ERROR_WANT_ASYNC，线程完成后
+ngx_thread_pool_handler执行ngx_ssl_key_offload_event_handler继续握手。握手完成后清除SSL_MODE_ASYNC，
+之后的读写不再经过async job
+*/
+ngx_int_t
+ngx_ssl_key_offload(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_thread_pool_t *tp)
+{
+    RSA       *rsa;
+    EVP_PKEY  *pkey, *key;
+
+    if (tp == NULL) {
+        return NGX_OK;
+    }
+
+    pkey = SSL_CTX_get0_privatekey(ssl->ctx);
+
+    if (pkey == NULL || EVP_PKEY_base_id(pkey) != EVP_PKEY_RSA) {
+        ngx_log_error(NGX_LOG_WARN, ssl->log, 0,
+                      "\"ssl_key_offload\" supports only RSA keys, ignored");
+        return NGX_OK;
+    }
+
+    rsa = EVP_PKEY_get1_RSA(pkey);
+    if (rsa == NULL) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0, "EVP_PKEY_get1_RSA() failed");
+        return NGX_ERROR;
+    }
+
+    if (RSA_set_method(rsa, ngx_ssl_key_offload_method) == 0
+        || RSA_set_ex_data(rsa, ngx_ssl_key_offload_index, tp) == 0)
+    {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0, "RSA_set_method() failed");
+        RSA_free(rsa);
+        return NGX_ERROR;
+    }
+
+    key = EVP_PKEY_new();
+    if (key == NULL) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0, "EVP_PKEY_new() failed");
+        RSA_free(rsa);
+        return NGX_ERROR;
+    }
+
+    if (EVP_PKEY_assign_RSA(key, rsa) == 0) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0, "EVP_PKEY_assign() failed");
+        RSA_free(rsa);
+        EVP_PKEY_free(key);
+        return NGX_ERROR;
+    }
+
+    if (SSL_CTX_use_PrivateKey(ssl->ctx, key) == 0) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "SSL_CTX_use_PrivateKey() failed");
+        EVP_PKEY_free(key);
+        return NGX_ERROR;
+    }
+
+    EVP_PKEY_free(key);
+
+    if (SSL_CTX_set_async_callback(ssl->ctx,
+                                   ngx_ssl_key_offload_async_callback)
+        == 0)
+    {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "SSL_CTX_set_async_callback() failed");
+        return NGX_ERROR;
+    }
+
+    SSL_CTX_set_mode(ssl->ctx, SSL_MODE_ASYNC);
+
+    return NGX_OK;
+}
+
+
+static int
+ngx_ssl_key_offload_priv_enc(int flen, const u_char *from, u_char *to,
+    RSA *rsa, int padding)
+{
+    return ngx_ssl_key_offload_run(flen, from, to, rsa, padding, 0);
+}
+
+
+static int
+ngx_ssl_key_offload_priv_dec(int flen, const u_char *from, u_char *to,
+    RSA *rsa, int padding)
+{
+    return ngx_ssl_key_offload_run(flen, from, to, rsa, padding, 1);
+}
+
+
+/* 在握手的async job中执行，job暂停期间worker继续处理其他事件 */
+
+static int
+ngx_ssl_key_offload_run(int flen, const u_char *from, u_char *to, RSA *rsa,
+    int padding, ngx_uint_t decrypt)
+{
+    int                         ret, size;
+    ngx_connection_t           *c;
+    ngx_thread_pool_t          *tp;
+    ngx_thread_task_t          *task;
+    const RSA_METHOD           *method;
+    ngx_ssl_key_offload_ctx_t  *ctx;
+
+    c = ngx_ssl_key_offload_get_connection();
+    tp = RSA_get_ex_data(rsa, ngx_ssl_key_offload_index);
+    size = RSA_size(rsa);
+
+    if (c == NULL || tp == NULL || flen > size)
+    {
+        goto sync;
+    }
+
+    task = ngx_alloc(sizeof(ngx_thread_task_t)
+                     + sizeof(ngx_ssl_key_offload_ctx_t) + 2 * size, c->log);
+    if (task == NULL) {
+        goto sync;
+    }
+
+    ngx_memzero(task, sizeof(ngx_thread_task_t)
+                      + sizeof(ngx_ssl_key_offload_ctx_t));
+
+    ctx = (ngx_ssl_key_offload_ctx_t *) (task + 1);
+
+    ctx->rsa = rsa;
+    ctx->flen = flen;
+    ctx->padding = padding;
+    ctx->from = (u_char *) (ctx + 1);
+    ctx->to = ctx->from + size;
+    ctx->connection = c;
+    ctx->decrypt = decrypt;
+
+    ngx_memcpy(ctx->from, from, flen);
+
+    task->ctx = ctx;
+    task->handler = ngx_ssl_key_offload_thread_handler;
+    task->event.data = task;
+    task->event.handler = ngx_ssl_key_offload_event_handler;
+
+    /* 线程执行期间nginx reload也不能释放该key */
+    RSA_up_ref(rsa);
+
+    if (ngx_thread_task_post(tp, task) != NGX_OK) {
+        RSA_free(rsa);
+        ngx_free(task);
+        goto sync;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "SSL key offload posted, task #%ui", task->id);
+
+    c->ssl->key_task = task;
+
+    /* 连接上的读写事件也会恢复job，运算没有完成时继续暂停 */
+
+    do {
+        if (ASYNC_pause_job() == 0) {
+            ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                          "ASYNC_pause_job() failed");
+        }
+    } while (!ctx->done);
+
+    if (ctx->ssl_conn) {
+        /* 连接已关闭，让握手失败退出，job随之结束并释放，见ngx_ssl_shutdown */
+        ret = -1;
+
+    } else {
+        c->ssl->key_task = NULL;
+        ret = ctx->ret;
+    }
+
+    if (ret > 0) {
+        ngx_memcpy(to, ctx->to, ret);
+    }
+
+    RSA_free(rsa);
+    ngx_free(task);
+
+    return ret;
+
+sync:
+
+    method = RSA_PKCS1_OpenSSL();
+
+    if (decrypt) {
+        return RSA_meth_get_priv_dec(method)(flen, from, to, rsa, padding);
+    }
+
+    return RSA_meth_get_priv_enc(method)(flen, from, to, rsa, padding);
+}
+
+
+/*
+ * 设置了async回调时，OpenSSL启动握手job时会为SSL对象的wait ctx设置回调，回调参数就是SSL对象，
+ * 私钥运算回调由此找到SSL对象，再通过ngx_ssl_connection_index找到连接。
+ * 回调本身只有engine通知job可以恢复时才会被调用，这里运算完成由线程池事件通知，不需要它做什么
+ */
+
+static int
+ngx_ssl_key_offload_async_callback(ngx_ssl_conn_t *ssl_conn, void *arg)
+{
+    return 1;
+}
+
+
+static ngx_connection_t *
+ngx_ssl_key_offload_get_connection(void)
+{
+    void               *arg;
+    ASYNC_JOB          *job;
+    ASYNC_WAIT_CTX     *waitctx;
+    ASYNC_callback_fn   callback;
+
+    job = ASYNC_get_current_job();
+    if (job == NULL) {
+        return NULL;
+    }
+
+    waitctx = ASYNC_get_wait_ctx(job);
+
+    if (waitctx == NULL
+        || ASYNC_WAIT_CTX_get_callback(waitctx, &callback, &arg) == 0
+        || arg == NULL)
+    {
+        return NULL;
+    }
+
+    /* 连接关闭后由任务保留的SSL对象上的ex_data已清除，见ngx_ssl_shutdown */
+
+    return SSL_get_ex_data(arg, ngx_ssl_connection_index);
+}
+
+
+static void
+ngx_ssl_key_offload_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_ssl_key_offload_ctx_t *ctx = data;
+
+    const RSA_METHOD  *method;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_CORE, log, 0, "SSL key offload thread handler");
+
+    method = RSA_PKCS1_OpenSSL();
+
+    if (ctx->decrypt) {
+        ctx->ret = RSA_meth_get_priv_dec(method)(ctx->flen, ctx->from, ctx->to,
+                                                 ctx->rsa, ctx->padding);
+
+    } else {
+        ctx->ret = RSA_meth_get_priv_enc(method)(ctx->flen, ctx->from, ctx->to,
+                                                 ctx->rsa, ctx->padding);
+    }
+
+    if (ctx->ret <= 0) {
+        /* OpenSSL的错误队列是线程私有的，只能在这里记录 */
+        ngx_ssl_error(NGX_LOG_ERR, log, 0, "RSA private key operation failed");
+    }
+}
+
+
+static void
+ngx_ssl_key_offload_event_handler(ngx_event_t *ev)
+{
+    ngx_ssl_conn_t             *ssl_conn;
+    ngx_connection_t           *c;
+    ngx_thread_task_t          *task;
+    ngx_ssl_key_offload_ctx_t  *ctx;
+
+    task = ev->data;
+    ctx = task->ctx;
+    c = ctx->connection;
+
+    ctx->done = 1;
+
+    if (c == NULL) {
+
+        /*
+         * 握手暂停期间连接已被关闭，见ngx_ssl_shutdown。恢复job让它在ngx_ssl_key_offload_run中
+         * 返回失败，握手随之结束，job和它的栈才会被释放，任务也在那里释放，之后不能再访问task
+         */
+
+        ssl_conn = ctx->ssl_conn;
+
+        if (ssl_conn == NULL) {
+            RSA_free(ctx->rsa);
+            ngx_free(task);
+            return;
+        }
+
+        ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
+                       "SSL key offload done, connection closed");
+
+        ngx_ssl_clear_error(ngx_cycle->log);
+
+        (void) SSL_do_handshake(ssl_conn);
+
+        ERR_clear_error();
+
+        SSL_free(ssl_conn);
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "SSL key offload done, task #%ui", task->id);
+
+    ngx_ssl_handshake_handler(c->read);
+}
+
+
+/* 连接关闭后恢复的握手不能再通过ngx_ssl_info_callback访问已释放的连接 */
+
+static void
+ngx_ssl_key_offload_info_callback(const ngx_ssl_conn_t *ssl_conn, int where,
+    int ret)
+{
+}
+
+#endif
+
+
 ngx_int_t
 ngx_ssl_create_connection(ngx_ssl_t *ssl, ngx_connection_t *c, ngx_uint_t flags)
 {
@@ -1157,12 +1579,18 @@ ngx_ssl_handshake(ngx_connection_t *c)
 
         c->ssl->handshaked = 1;
 
+#if (NGX_SSL_ASYNC)
+        /* 之后的SSL_read/SSL_write不需要在async job中执行 */
+        SSL_clear_mode(c->ssl->connection, SSL_MODE_ASYNC);
+#endif
+
         c->recv = ngx_ssl_recv;
         c->send = ngx_ssl_write;
         c->recv_chain = ngx_ssl_recv_chain;
         c->send_chain = ngx_ssl_send_chain;
 
-#ifdef SSL3_FLAGS_NO_RENEGOTIATE_CIPHERS
+#if (defined SSL3_FLAGS_NO_RENEGOTIATE_CIPHERS                                  \
+     && OPENSSL_VERSION_NUMBER < 0x10100000L)
 
         /* initial handshake done, disable renegotiation (CVE-2009-3555) */
         if (c->ssl->connection->s3) {
@@ -1211,6 +1639,18 @@ ngx_ssl_handshake(ngx_connection_t *c)
         return NGX_AGAIN; //需要继续握手
     }
 
+#if (NGX_SSL_ASYNC)
+
+    if (sslerr == SSL_ERROR_WANT_ASYNC) {
+        /* 私钥运算在线程池中执行，完成后由ngx_ssl_key_offload_event_handler继续握手 */
+        c->read->handler = ngx_ssl_handshake_handler;
+        c->write->handler = ngx_ssl_handshake_handler;
+
+        return NGX_AGAIN;
+    }
+
+#endif
+
     err = (sslerr == SSL_ERROR_SYSCALL) ? ngx_errno : 0;
 
     c->ssl->no_wait_shutdown = 1;
@@ -1769,6 +2209,68 @@ ngx_ssl_shutdown(ngx_connection_t *c)
     int        n, sslerr, mode;
     ngx_err_t  err;
 
+#if (NGX_SSL_ASYNC)
+    BIO                        *bio;
+    ngx_ssl_key_offload_ctx_t  *ctx;
+
+    if (c->ssl->key_task) {
+
+        /*
+         * 握手的async job暂停在线程中的私钥运算上，现在释放SSL对象会泄漏job和它的栈。
+         * SSL对象交给任务保留，运算完成后ngx_ssl_key_offload_event_handler恢复job让握手失败结束，
+         * 然后再SSL_free。恢复的握手不能再读写已关闭(可能已被复用)的fd，也不能访问连接
+         */
+
+        bio = BIO_new(BIO_s_null());
+
+        if (bio == NULL) {
+            ngx_ssl_error(NGX_LOG_ALERT, c->log, 0, "BIO_new() failed");
+
+        } else {
+            ctx = c->ssl->key_task->ctx;
+
+            SSL_set_bio(c->ssl->connection, bio, bio);
+            SSL_set_ex_data(c->ssl->connection, ngx_ssl_connection_index,
+                            NULL);
+            SSL_set_info_callback(c->ssl->connection,
+                                  ngx_ssl_key_offload_info_callback);
+
+            ctx->connection = NULL;
+            ctx->ssl_conn = c->ssl->connection;
+
+            c->ssl->key_task = NULL;
+            c->ssl = NULL;
+
+            return NGX_OK;
+        }
+
+        /* 无法安全地恢复job，只能放弃它，任务由ngx_ssl_key_offload_event_handler释放 */
+
+        ((ngx_ssl_key_offload_ctx_t *) c->ssl->key_task->ctx)->connection =
+                                                                         NULL;
+        c->ssl->key_task = NULL;
+    }
+
+    SSL_clear_mode(c->ssl->connection, SSL_MODE_ASYNC);
+
+#endif
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+
+    if (SSL_in_init(c->ssl->connection)) {
+        /*
+         * 握手没有完成时OpenSSL 1.1起SSL_shutdown()会报
+         * "shutdown while in init"，这时也没有需要发送的close_notify
+         */
+
+        SSL_free(c->ssl->connection);
+        c->ssl = NULL;
+
+        return NGX_OK;
+    }
+
+#endif
+
     if (c->timedout) {
         mode = SSL_RECEIVED_SHUTDOWN|SSL_SENT_SHUTDOWN;
         SSL_set_quiet_shutdown(c->ssl->connection, 1);
@@ -1916,7 +2418,9 @@ ngx_ssl_connection_error(ngx_connection_t *c, int sslerr, ngx_err_t err,
             || n == SSL_R_ERROR_IN_RECEIVED_CIPHER_LIST              /*  151 */
             || n == SSL_R_EXCESSIVE_MESSAGE_SIZE                     /*  152 */
             || n == SSL_R_LENGTH_MISMATCH                            /*  159 */
+#ifdef SSL_R_NO_CIPHERS_PASSED
             || n == SSL_R_NO_CIPHERS_PASSED                          /*  182 */
+#endif
             || n == SSL_R_NO_CIPHERS_SPECIFIED                       /*  183 */
             || n == SSL_R_NO_COMPRESSION_SPECIFIED                   /*  187 */
             || n == SSL_R_NO_SHARED_CIPHER                           /*  193 */
@@ -2132,7 +2636,7 @@ ngx_ssl_session_id_context(ngx_ssl_t *ssl, ngx_str_t *sess_ctx)
     int                   n, i;
     X509                 *cert;
     X509_NAME            *name;
-    EVP_MD_CTX            md;
+    EVP_MD_CTX           *md;
     unsigned int          len;
     STACK_OF(X509_NAME)  *list;
     u_char                buf[EVP_MAX_MD_SIZE];
@@ -2142,15 +2646,18 @@ ngx_ssl_session_id_context(ngx_ssl_t *ssl, ngx_str_t *sess_ctx)
      * the server certificate, and the client CA list.
      */
 
-    EVP_MD_CTX_init(&md);
+    md = EVP_MD_CTX_create();
+    if (md == NULL) {
+        return NGX_ERROR;
+    }
 
-    if (EVP_DigestInit_ex(&md, EVP_sha1(), NULL) == 0) {
+    if (EVP_DigestInit_ex(md, EVP_sha1(), NULL) == 0) {
         ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
                       "EVP_DigestInit_ex() failed");
         goto failed;
     }
 
-    if (EVP_DigestUpdate(&md, sess_ctx->data, sess_ctx->len) == 0) {
+    if (EVP_DigestUpdate(md, sess_ctx->data, sess_ctx->len) == 0) {
         ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
                       "EVP_DigestUpdate() failed");
         goto failed;
@@ -2164,7 +2671,7 @@ ngx_ssl_session_id_context(ngx_ssl_t *ssl, ngx_str_t *sess_ctx)
         goto failed;
     }
 
-    if (EVP_DigestUpdate(&md, buf, len) == 0) {
+    if (EVP_DigestUpdate(md, buf, len) == 0) {
         ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
                       "EVP_DigestUpdate() failed");
         goto failed;
@@ -2184,7 +2691,7 @@ ngx_ssl_session_id_context(ngx_ssl_t *ssl, ngx_str_t *sess_ctx)
                 goto failed;
             }
 
-            if (EVP_DigestUpdate(&md, buf, len) == 0) {
+            if (EVP_DigestUpdate(md, buf, len) == 0) {
                 ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
                               "EVP_DigestUpdate() failed");
                 goto failed;
@@ -2192,13 +2699,13 @@ ngx_ssl_session_id_context(ngx_ssl_t *ssl, ngx_str_t *sess_ctx)
         }
     }
 
-    if (EVP_DigestFinal_ex(&md, buf, &len) == 0) {
+    if (EVP_DigestFinal_ex(md, buf, &len) == 0) {
         ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
                       "EVP_DigestUpdate() failed");
         goto failed;
     }
 
-    EVP_MD_CTX_cleanup(&md);
+    EVP_MD_CTX_destroy(md);
 
     if (SSL_CTX_set_session_id_context(ssl->ctx, buf, len) == 0) {
         ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
@@ -2210,7 +2717,7 @@ ngx_ssl_session_id_context(ngx_ssl_t *ssl, ngx_str_t *sess_ctx)
 
 failed:
 
-    EVP_MD_CTX_cleanup(&md);
+    EVP_MD_CTX_destroy(md);
 
     return NGX_ERROR;
 }
@@ -2431,8 +2938,11 @@ failed:
 
 
 static ngx_ssl_session_t *
-ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn, u_char *id, int len,
-    int *copy)
+ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn,
+#if OPENSSL_VERSION_NUMBER >= 0x10100003L
+    const
+#endif
+    u_char *id, int len, int *copy)
 {
 #if OPENSSL_VERSION_NUMBER >= 0x0090707fL
     const
@@ -2451,7 +2961,7 @@ ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn, u_char *id, int len,
     ngx_connection_t         *c;
 #endif
 
-    hash = ngx_crc32_short(id, (size_t) len);
+    hash = ngx_crc32_short((u_char *) id, (size_t) len);
     *copy = 0;
 
 #if (NGX_DEBUG)
@@ -2491,7 +3001,8 @@ ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn, u_char *id, int len,
 
         sess_id = (ngx_ssl_sess_id_t *) node;
 
-        rc = ngx_memn2cmp(id, sess_id->id, (size_t) len, (size_t) node->data);
+        rc = ngx_memn2cmp((u_char *) id, sess_id->id, (size_t) len,
+                          (size_t) node->data);
 
         if (rc == 0) {
 
@@ -30,6 +30,16 @@
 #include <openssl/x509.h>
 #include <openssl/x509v3.h>
 
+/*
+ * 私钥运算回调通过job的wait ctx回调参数找到SSL对象，这需要OpenSSL 3.0的
+ * SSL_CTX_set_async_callback，见ngx_ssl_key_offload_get_connection
+ */
+#if (NGX_THREADS && defined SSL_MODE_ASYNC && !defined OPENSSL_NO_ASYNC       \
+     && OPENSSL_VERSION_NUMBER >= 0x30000000L)
+#include <openssl/async.h>
+#define NGX_SSL_ASYNC    1  /* 可以把握手中的RSA私钥运算交给线程池，见ngx_ssl_key_offload */
+#endif
+
 #define NGX_SSL_NAME     "OpenSSL"
 
 
@@ -66,6 +76,9 @@ typedef struct {
     unsigned                    no_wait_shutdown:1;
     unsigned                    no_send_shutdown:1;
     unsigned                    handshake_buffer_set:1;
+#if (NGX_SSL_ASYNC)
+    ngx_thread_task_t          *key_task; /* 正在线程池中执行的私钥运算，握手暂停等待其完成 */
+#endif
 } ngx_ssl_connection_t;
 
 
@@ -142,6 +155,10 @@ RSA *ngx_ssl_rsa512_key_callback(ngx_ssl_conn_t *ssl_conn, int is_export,
 ngx_array_t *ngx_ssl_read_password_file(ngx_conf_t *cf, ngx_str_t *file);
 ngx_int_t ngx_ssl_dhparam(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *file);
 ngx_int_t ngx_ssl_ecdh_curve(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *name);
+#if (NGX_SSL_ASYNC)
+ngx_int_t ngx_ssl_key_offload(ngx_conf_t *cf, ngx_ssl_t *ssl,
+    ngx_thread_pool_t *tp);
+#endif
 ngx_int_t ngx_ssl_session_cache(ngx_ssl_t *ssl, ngx_str_t *sess_ctx,
     ssize_t builtin_session_cache, ngx_shm_zone_t *shm_zone, time_t timeout);
 ngx_int_t ngx_ssl_session_ticket_keys(ngx_conf_t *cf, ngx_ssl_t *ssl,
@@ -57,6 +57,58 @@ ngx_rbtree_t              ngx_event_timer_rbtree;
 static ngx_rbtree_node_t  ngx_event_timer_sentinel;
 //哨兵节点是所有最下层的叶子节点都指向一个NULL空节点，图形化参考:http://blog.csdn.net/xzongyuan/article/details/22389185
 
+
+/*
+分层时间轮(hierarchical timing wheel)，events{}中配置timer_wheel on后代替上面的红黑树。
+一个tick为1ms，root轮有256个槽，每个槽对应1个tick；其上还有4层，每层64个槽，每个槽分别对应
+256ms、16.4s、17.5min、18.6h，总共覆盖2^32ms。每个槽是一个以哨兵节点为头的双向循环链表，
+复用ev->timer(ngx_rbtree_node_t)的left/right作为prev/next指针，所以添加和删除定时器都是O(1)。
+
+当root轮转完一圈(root下标回到0)时，把上一层对应槽中的定时器整体重新挂到下层(cascade)，
+这样远期的keepalive、send_timeout等大量定时器以粗粒度的槽为单位批量移动，只有快到期时才落到root轮。
+*/
+#define NGX_TIMER_WHEEL_ROOT_BITS    8
+#define NGX_TIMER_WHEEL_ROOT_SIZE    (1 << NGX_TIMER_WHEEL_ROOT_BITS)
+#define NGX_TIMER_WHEEL_ROOT_MASK    (NGX_TIMER_WHEEL_ROOT_SIZE - 1)
+#define NGX_TIMER_WHEEL_LEVEL_BITS   6
+#define NGX_TIMER_WHEEL_LEVEL_SIZE   (1 << NGX_TIMER_WHEEL_LEVEL_BITS)
+#define NGX_TIMER_WHEEL_LEVEL_MASK   (NGX_TIMER_WHEEL_LEVEL_SIZE - 1)
+#define NGX_TIMER_WHEEL_LEVELS       4
+
+#define NGX_TIMER_WHEEL_MAX                                                   \
+    ((ngx_msec_t) 0xffffffff)
+
+/* 第level层(从1开始)槽下标在tick中的起始bit */
+#define ngx_event_timer_wheel_shift(level)                                    \
+    (NGX_TIMER_WHEEL_ROOT_BITS + ((level) - 1) * NGX_TIMER_WHEEL_LEVEL_BITS)
+
+#define ngx_event_timer_wheel_slot_empty(slot)  ((slot)->right == (slot))
+
+
+typedef struct {
+    /* 下一个需要处理的tick，小于current的tick都已经处理过了 */
+    ngx_msec_t          current;
+    ngx_uint_t          count;     /* 时间轮中的定时器总数 */
+    ngx_uint_t          expiring;  /* 正在ngx_event_timer_wheel_expire中 */
+
+    ngx_rbtree_node_t   root[NGX_TIMER_WHEEL_ROOT_SIZE];
+    ngx_rbtree_node_t   levels[NGX_TIMER_WHEEL_LEVELS]
+                              [NGX_TIMER_WHEEL_LEVEL_SIZE];
+} ngx_event_timer_wheel_t;
+
+
+static void ngx_event_timer_wheel_init(void);
+static ngx_msec_t ngx_event_timer_wheel_next(ngx_event_timer_wheel_t *w);
+static ngx_msec_t ngx_event_timer_wheel_find(void);
+static void ngx_event_timer_wheel_expire(void);
+static void ngx_event_timer_wheel_cascade(ngx_rbtree_node_t *slot);
+static void ngx_event_timer_wheel_cancel(void);
+static void ngx_event_timer_wheel_cancel_slot(ngx_rbtree_node_t *slot);
+
+
+ngx_uint_t                       ngx_event_timer_use_wheel;
+static ngx_event_timer_wheel_t   ngx_event_timer_wheel;
+
 /*
  * the event timer rbtree may contain the duplicate keys, however,
  * it should not be a problem, because we use the rbtree to find
@@ -69,6 +121,13 @@ ngx_event_timer_init(ngx_log_t *log)
     ngx_rbtree_init(&ngx_event_timer_rbtree, &ngx_event_timer_sentinel,
                     ngx_rbtree_insert_timer_value);
 
+    if (ngx_event_timer_use_wheel) {
+        ngx_event_timer_wheel_init();
+
+        ngx_log_debug0(NGX_LOG_DEBUG_EVENT, log, 0,
+                       "event timer: hierarchical timing wheel");
+    }
+
     return NGX_OK;
 }
 
@@ -79,6 +138,10 @@ ngx_event_find_timer(void)
     ngx_msec_int_t      timer;
     ngx_rbtree_node_t  *node, *root, *sentinel;
 
+    if (ngx_event_timer_use_wheel) {
+        return ngx_event_timer_wheel_find();
+    }
+
     if (ngx_event_timer_rbtree.root == &ngx_event_timer_sentinel) {
         return NGX_TIMER_INFINITE;
     }
@@ -109,6 +172,11 @@ ngx_event_expire_timers(void)
     ngx_event_t        *ev;
     ngx_rbtree_node_t  *node, *root, *sentinel;
 
+    if (ngx_event_timer_use_wheel) {
+        ngx_event_timer_wheel_expire();
+        return;
+    }
+
     sentinel = ngx_event_timer_rbtree.sentinel;
 
     for ( ;; ) {
@@ -155,6 +223,11 @@ ngx_event_cancel_timers(void)
     ngx_event_t        *ev;
     ngx_rbtree_node_t  *node, *root, *sentinel;
 
+    if (ngx_event_timer_use_wheel) {
+        ngx_event_timer_wheel_cancel();
+        return;
+    }
+
     sentinel = ngx_event_timer_rbtree.sentinel;
 
     for ( ;; ) {
@@ -189,3 +262,341 @@ ngx_event_cancel_timers(void)
         ev->handler(ev);
     }
 }
+
+
+//定时器是否已经全部清空，worker退出时用来判断是否可以退出进程
+ngx_uint_t
+ngx_event_timers_empty(void)
+{
+    if (ngx_event_timer_use_wheel) {
+        return ngx_event_timer_wheel.count == 0;
+    }
+
+    return ngx_event_timer_rbtree.root == ngx_event_timer_rbtree.sentinel;
+}
+
+
+static void
+ngx_event_timer_wheel_init(void)
+{
+    ngx_uint_t                i, l;
+    ngx_event_timer_wheel_t  *w;
+
+    w = &ngx_event_timer_wheel;
+
+    for (i = 0; i < NGX_TIMER_WHEEL_ROOT_SIZE; i++) {
+        w->root[i].left = &w->root[i];
+        w->root[i].right = &w->root[i];
+    }
+
+    for (l = 0; l < NGX_TIMER_WHEEL_LEVELS; l++) {
+        for (i = 0; i < NGX_TIMER_WHEEL_LEVEL_SIZE; i++) {
+            w->levels[l][i].left = &w->levels[l][i];
+            w->levels[l][i].right = &w->levels[l][i];
+        }
+    }
+
+    w->current = ngx_current_msec;
+    w->count = 0;
+    w->expiring = 0;
+}
+
+
+//根据node->key距离current的远近把定时器挂到对应层的槽中，O(1)
+void
+ngx_event_timer_wheel_add(ngx_rbtree_node_t *node)
+{
+    ngx_uint_t                l;
+    ngx_msec_t                expires, diff;
+    ngx_rbtree_node_t        *slot;
+    ngx_event_timer_wheel_t  *w;
+
+    w = &ngx_event_timer_wheel;
+
+    if (w->count == 0 && !w->expiring) {
+        /* 时间轮为空时current可能已经落后很多，直接对齐到当前时间 */
+        w->current = ngx_current_msec;
+    }
+
+    expires = node->key;
+
+    if ((ngx_msec_int_t) (expires - w->current) < 0) {
+        /* 已经超时的定时器放到下一个要处理的槽中 */
+        expires = w->current;
+    }
+
+    diff = expires - w->current;
+
+    if (diff < NGX_TIMER_WHEEL_ROOT_SIZE) {
+        slot = &w->root[expires & NGX_TIMER_WHEEL_ROOT_MASK];
+
+    } else {
+        if (diff > NGX_TIMER_WHEEL_MAX) {
+            expires = w->current + NGX_TIMER_WHEEL_MAX;
+            diff = NGX_TIMER_WHEEL_MAX;
+        }
+
+        for (l = 1; l < NGX_TIMER_WHEEL_LEVELS; l++) {
+            if (diff < ((ngx_msec_t) 1 << ngx_event_timer_wheel_shift(l + 1))) {
+                break;
+            }
+        }
+
+        slot = &w->levels[l - 1][(expires >> ngx_event_timer_wheel_shift(l))
+                                 & NGX_TIMER_WHEEL_LEVEL_MASK];
+    }
+
+    node->left = slot->left;
+    node->right = slot;
+    slot->left->right = node;
+    slot->left = node;
+
+    w->count++;
+}
+
+
+void
+ngx_event_timer_wheel_del(ngx_rbtree_node_t *node)
+{
+    node->left->right = node->right;
+    node->right->left = node->left;
+
+    ngx_event_timer_wheel.count--;
+}
+
+
+/*
+返回下一个需要处理的tick。root轮中找到的是准确的超时时间，上层槽返回的是它cascade到下层的时间，
+这个时间不会晚于槽中任何定时器的超时时间，所以epoll_wait只会提前返回，不会延迟定时器。
+结果取root轮和每一层第一个非空槽的cascade时间中最早的一个，任何一层非空槽的cascade点都不会被跳过。
+调用前需要保证时间轮不为空
+*/
+static ngx_msec_t
+ngx_event_timer_wheel_next(ngx_event_timer_wheel_t *w)
+{
+    ngx_uint_t   i, j, l, shift, found;
+    ngx_msec_t   tick, next, span;
+
+    found = 0;
+    next = 0;
+
+    /* root轮中的槽按current开始的一圈顺序检查，得到的就是准确的超时时间 */
+
+    i = w->current & NGX_TIMER_WHEEL_ROOT_MASK;
+
+    for (j = 0; j < NGX_TIMER_WHEEL_ROOT_SIZE; j++) {
+        if (!ngx_event_timer_wheel_slot_empty(
+                 &w->root[(i + j) & NGX_TIMER_WHEEL_ROOT_MASK]))
+        {
+            next = w->current + j;
+            found = 1;
+            break;
+        }
+    }
+
+    for (l = 1; l <= NGX_TIMER_WHEEL_LEVELS; l++) {
+        shift = ngx_event_timer_wheel_shift(l);
+        span = (ngx_msec_t) 1 << shift;
+
+        /* tick是第l层不早于current的第一个cascade点，更高层的cascade点都不会早于它 */
+
+        tick = (w->current + span - 1) & ~(span - 1);
+
+        if (found && (ngx_msec_int_t) (next - tick) < 0) {
+            break;
+        }
+
+        i = (tick >> shift) & NGX_TIMER_WHEEL_LEVEL_MASK;
+
+        for (j = 0; j < NGX_TIMER_WHEEL_LEVEL_SIZE; j++) {
+            if (!ngx_event_timer_wheel_slot_empty(
+                     &w->levels[l - 1][(i + j) & NGX_TIMER_WHEEL_LEVEL_MASK]))
+            {
+                tick += (ngx_msec_t) j << shift;
+
+                if (!found || (ngx_msec_int_t) (tick - next) < 0) {
+                    next = tick;
+                    found = 1;
+                }
+
+                break;
+            }
+        }
+    }
+
+    return found ? next : w->current;
+}
+
+
+static ngx_msec_t
+ngx_event_timer_wheel_find(void)
+{
+    ngx_msec_int_t            timer;
+    ngx_event_timer_wheel_t  *w;
+
+    w = &ngx_event_timer_wheel;
+
+    if (w->count == 0) {
+        return NGX_TIMER_INFINITE;
+    }
+
+    timer = (ngx_msec_int_t) (ngx_event_timer_wheel_next(w)
+                              - ngx_current_msec);
+
+    return (ngx_msec_t) (timer > 0 ? timer : 0);
+}
+
+
+static void
+ngx_event_timer_wheel_expire(void)
+{
+    ngx_uint_t                l, idx;
+    ngx_msec_t                next;
+    ngx_event_t              *ev;
+    ngx_rbtree_node_t        *slot, *node;
+    ngx_event_timer_wheel_t  *w;
+
+    w = &ngx_event_timer_wheel;
+
+    w->expiring = 1;
+
+    while (w->count) {
+
+        next = ngx_event_timer_wheel_next(w);
+
+        if ((ngx_msec_int_t) (next - ngx_current_msec) > 0) {
+            break;
+        }
+
+        /* 中间的tick对应的槽都是空的，直接跳过 */
+        w->current = next;
+
+        idx = w->current & NGX_TIMER_WHEEL_ROOT_MASK;
+
+        if (idx == 0) {
+            /* root轮转完一圈，把上层对应槽中的定时器重新分配到下层 */
+
+            for (l = 1; l <= NGX_TIMER_WHEEL_LEVELS; l++) {
+                idx = (w->current >> ngx_event_timer_wheel_shift(l))
+                      & NGX_TIMER_WHEEL_LEVEL_MASK;
+
+                ngx_event_timer_wheel_cascade(&w->levels[l - 1][idx]);
+
+                if (idx != 0) {
+                    break;
+                }
+            }
+
+            idx = 0;
+        }
+
+        slot = &w->root[idx];
+
+        while (!ngx_event_timer_wheel_slot_empty(slot)) {
+            node = slot->right;
+
+            ev = (ngx_event_t *) ((char *) node
+                                  - offsetof(ngx_event_t, timer));
+
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                           "event timer del: %d: %M",
+                           ngx_event_ident(ev->data), ev->timer.key);
+
+            ngx_event_timer_wheel_del(node);
+
+#if (NGX_DEBUG)
+            ev->timer.left = NULL;
+            ev->timer.right = NULL;
+            ev->timer.parent = NULL;
+#endif
+
+            ev->timer_set = 0;
+
+            ev->timedout = 1;
+
+            ev->handler(ev);
+        }
+
+        w->current++;
+    }
+
+    if ((ngx_msec_int_t) (ngx_current_msec - w->current) >= 0) {
+        /* 到ngx_current_msec为止的tick都没有定时器了 */
+        w->current = ngx_current_msec + 1;
+    }
+
+    w->expiring = 0;
+}
+
+
+static void
+ngx_event_timer_wheel_cascade(ngx_rbtree_node_t *slot)
+{
+    ngx_rbtree_node_t  *node;
+
+    while (!ngx_event_timer_wheel_slot_empty(slot)) {
+        node = slot->right;
+
+        ngx_event_timer_wheel_del(node);
+        ngx_event_timer_wheel_add(node);
+    }
+}
+
+
+static void
+ngx_event_timer_wheel_cancel(void)
+{
+    ngx_uint_t                i, l;
+    ngx_event_timer_wheel_t  *w;
+
+    w = &ngx_event_timer_wheel;
+
+    for (i = 0; i < NGX_TIMER_WHEEL_ROOT_SIZE; i++) {
+        ngx_event_timer_wheel_cancel_slot(&w->root[i]);
+    }
+
+    for (l = 0; l < NGX_TIMER_WHEEL_LEVELS; l++) {
+        for (i = 0; i < NGX_TIMER_WHEEL_LEVEL_SIZE; i++) {
+            ngx_event_timer_wheel_cancel_slot(&w->levels[l][i]);
+        }
+    }
+}
+
+
+static void
+ngx_event_timer_wheel_cancel_slot(ngx_rbtree_node_t *slot)
+{
+    ngx_event_t        *ev;
+    ngx_rbtree_node_t  *node;
+
+again:
+
+    /* handler中可能删除同一个槽中的其他定时器，所以每次都从头开始找 */
+
+    for (node = slot->right; node != slot; node = node->right) {
+
+        ev = (ngx_event_t *) ((char *) node - offsetof(ngx_event_t, timer));
+
+        if (!ev->cancelable) {
+            continue;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                       "event timer cancel: %d: %M",
+                       ngx_event_ident(ev->data), ev->timer.key);
+
+        ngx_event_timer_wheel_del(node);
+
+#if (NGX_DEBUG)
+        ev->timer.left = NULL;
+        ev->timer.right = NULL;
+        ev->timer.parent = NULL;
+#endif
+
+        ev->timer_set = 0;
+
+        ev->handler(ev);
+
+        goto again;
+    }
+}
@@ -23,9 +23,15 @@ ngx_int_t ngx_event_timer_init(ngx_log_t *log);
 ngx_msec_t ngx_event_find_timer(void);
 void ngx_event_expire_timers(void);
 void ngx_event_cancel_timers(void);
+ngx_uint_t ngx_event_timers_empty(void);
+
+void ngx_event_timer_wheel_add(ngx_rbtree_node_t *node);
+void ngx_event_timer_wheel_del(ngx_rbtree_node_t *node);
 
 
 extern ngx_rbtree_t  ngx_event_timer_rbtree;
+/* 为1表示定时器使用分层时间轮，而不是红黑树，见events{}中的timer_wheel配置 */
+extern ngx_uint_t    ngx_event_timer_use_wheel;
 
 
 static ngx_inline void
@@ -37,8 +43,13 @@ ngx_event_del_timer(ngx_event_t *ev, const char *func, unsigned int line)
     ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
                    "%s event timer del: %d: %M", tmpbuf,
                     ngx_event_ident(ev->data), ev->timer.key);
-                    
-    ngx_rbtree_delete(&ngx_event_timer_rbtree, &ev->timer);
+
+    if (ngx_event_timer_use_wheel) {
+        ngx_event_timer_wheel_del(&ev->timer);
+
+    } else {
+        ngx_rbtree_delete(&ngx_event_timer_rbtree, &ev->timer);
+    }
 
 #if (NGX_DEBUG)
     ev->timer.left = NULL;
@@ -99,7 +110,12 @@ ngx_event_add_timer(ngx_event_t *ev, ngx_msec_t timer, const char *func, unsigne
                    "%s event timer add fd:%d, expire-time:%M s, timer.key:%M", tmpbuf,
                     ngx_event_ident(ev->data), timer / 1000, ev->timer.key);
 
-    ngx_rbtree_insert(&ngx_event_timer_rbtree, &ev->timer);
+    if (ngx_event_timer_use_wheel) {
+        ngx_event_timer_wheel_add(&ev->timer);
+
+    } else {
+        ngx_rbtree_insert(&ngx_event_timer_rbtree, &ev->timer);
+    }
 
     ev->timer_set = 1;
 }
@@ -34,10 +34,17 @@ typedef struct {
 
 #endif
 
+/*
+rules和rules6在merge时编译成基数树，节点的value为deny。按规则顺序插入，前面已有规则覆盖整个网段的规则永远
+匹配不到，不插入；这样树中一个地址能匹配到的最长前缀就是原来按顺序第一条匹配的规则，查找只与前缀长度有关，
+见ngx_http_access_compile
+*/
 typedef struct {
     ngx_array_t      *rules;     /* array of ngx_http_access_rule_t */
+    ngx_radix_tree_t *tree;
 #if (NGX_HAVE_INET6)
     ngx_array_t      *rules6;    /* array of ngx_http_access_rule6_t */
+    ngx_radix_tree_t *tree6;
 #endif
 #if (NGX_HAVE_UNIX_DOMAIN)
     ngx_array_t      *rules_un;  /* array of ngx_http_access_rule_un_t */
@@ -57,6 +64,10 @@ static ngx_int_t ngx_http_access_unix(ngx_http_request_t *r,
     ngx_http_access_loc_conf_t *alcf);
 #endif
 static ngx_int_t ngx_http_access_found(ngx_http_request_t *r, ngx_uint_t deny);
+static char *ngx_http_access_compile(ngx_conf_t *cf,
+    ngx_http_access_loc_conf_t *alcf);
+static ngx_uint_t ngx_http_access_covered(ngx_radix_tree_t *tree, u_char *key,
+    u_char *mask, ngx_uint_t len);
 static char *ngx_http_access_rule(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static void *ngx_http_access_create_loc_conf(ngx_conf_t *cf);
@@ -218,9 +229,23 @@ static ngx_int_t
 ngx_http_access_inet(ngx_http_request_t *r, ngx_http_access_loc_conf_t *alcf,
     in_addr_t addr)
 {
+    uintptr_t                deny;
     ngx_uint_t               i;
     ngx_http_access_rule_t  *rule;
 
+    if (alcf->tree) {
+        deny = ngx_radix32tree_find(alcf->tree, ntohl(addr));
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "access: %08XD %i", addr, (ngx_int_t) deny);
+
+        if (deny == NGX_RADIX_NO_VALUE) {
+            return NGX_DECLINED;
+        }
+
+        return ngx_http_access_found(r, deny);
+    }
+
     rule = alcf->rules->elts;
     for (i = 0; i < alcf->rules->nelts; i++) {
 
@@ -243,10 +268,24 @@ static ngx_int_t
 ngx_http_access_inet6(ngx_http_request_t *r, ngx_http_access_loc_conf_t *alcf,
     u_char *p)
 {
+    uintptr_t                 deny;
     ngx_uint_t                n;
     ngx_uint_t                i;
     ngx_http_access_rule6_t  *rule6;
 
+    if (alcf->tree6) {
+        deny = ngx_radix128tree_find(alcf->tree6, p);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "access6: %i", (ngx_int_t) deny);
+
+        if (deny == NGX_RADIX_NO_VALUE) {
+            return NGX_DECLINED;
+        }
+
+        return ngx_http_access_found(r, deny);
+    }
+
     rule6 = alcf->rules6->elts;
     for (i = 0; i < alcf->rules6->nelts; i++) {
 
@@ -472,19 +511,140 @@ ngx_http_access_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
         && conf->rules_un == NULL
 #endif
     ) {
+        /* 先编译上一级的规则，继承的location共用同一棵树 */
+
+        if (ngx_http_access_compile(cf, prev) != NGX_CONF_OK) {
+            return NGX_CONF_ERROR;
+        }
+
         conf->rules = prev->rules;
+        conf->tree = prev->tree;
 #if (NGX_HAVE_INET6)
         conf->rules6 = prev->rules6;
+        conf->tree6 = prev->tree6;
 #endif
 #if (NGX_HAVE_UNIX_DOMAIN)
         conf->rules_un = prev->rules_un;
 #endif
     }
 
+    return ngx_http_access_compile(cf, conf);
+}
+
+
+static char *
+ngx_http_access_compile(ngx_conf_t *cf, ngx_http_access_loc_conf_t *alcf)
+{
+    uint32_t                  key, mask;
+    ngx_uint_t                i;
+    ngx_http_access_rule_t   *rule;
+#if (NGX_HAVE_INET6)
+    ngx_http_access_rule6_t  *rule6;
+#endif
+
+    if (alcf->rules && alcf->tree == NULL) {
+
+        alcf->tree = ngx_radix_tree_create(cf->pool, 0);
+        if (alcf->tree == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        rule = alcf->rules->elts;
+        for (i = 0; i < alcf->rules->nelts; i++) {
+
+            /* ngx_radix32tree_insert的key和mask为主机字节序 */
+
+            key = ntohl(rule[i].addr);
+            mask = ntohl(rule[i].mask);
+
+            if (ngx_http_access_covered(alcf->tree, (u_char *) &rule[i].addr,
+                                        (u_char *) &rule[i].mask, 4))
+            {
+                continue;
+            }
+
+            if (ngx_radix32tree_insert(alcf->tree, key, mask, rule[i].deny)
+                == NGX_ERROR)
+            {
+                return NGX_CONF_ERROR;
+            }
+        }
+    }
+
+#if (NGX_HAVE_INET6)
+
+    if (alcf->rules6 && alcf->tree6 == NULL) {
+
+        alcf->tree6 = ngx_radix_tree_create(cf->pool, 0);
+        if (alcf->tree6 == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        rule6 = alcf->rules6->elts;
+        for (i = 0; i < alcf->rules6->nelts; i++) {
+
+            if (ngx_http_access_covered(alcf->tree6, rule6[i].addr.s6_addr,
+                                        rule6[i].mask.s6_addr, 16))
+            {
+                continue;
+            }
+
+            if (ngx_radix128tree_insert(alcf->tree6, rule6[i].addr.s6_addr,
+                                        rule6[i].mask.s6_addr, rule6[i].deny)
+                == NGX_ERROR)
+            {
+                return NGX_CONF_ERROR;
+            }
+        }
+    }
+
+#endif
+
     return NGX_CONF_OK;
 }
 
 
+/*
+树中是否已有前缀不长于mask并且包含key/mask的节点，有则说明该网段已经被前面的规则全部匹配。key和mask为
+网络字节序，len为字节数
+*/
+static ngx_uint_t
+ngx_http_access_covered(ngx_radix_tree_t *tree, u_char *key, u_char *mask,
+    ngx_uint_t len)
+{
+    u_char             bit;
+    ngx_uint_t         i;
+    ngx_radix_node_t  *node;
+
+    i = 0;
+    bit = 0x80;
+    node = tree->root;
+
+    for ( ;; ) {
+        if (node->value != NGX_RADIX_NO_VALUE) {
+            return 1;
+        }
+
+        if (i == len || !(mask[i] & bit)) {
+            return 0;
+        }
+
+        node = (key[i] & bit) ? node->right : node->left;
+
+        if (node == NULL) {
+            return 0;
+        }
+
+        bit >>= 1;
+
+        if (bit == 0) {
+            i++;
+            bit = 0x80;
+        }
+    }
+}
+
+
 static ngx_int_t
 ngx_http_access_init(ngx_conf_t *cf)
 {
@@ -578,6 +578,18 @@ nginx忽略被代理服务器的应答数目和所有应答的大小，接受pro
       offsetof(ngx_http_proxy_loc_conf_t, upstream.request_buffering),
       NULL },
 
+    /*
+     proxy_splice on | off; 默认off。proxy_buffering off时，对有Content-Length的明文应答用splice()经过管道把包体
+     从上游直接转给客户端，不拷贝到用户态。gzip、sub_filter等修改包体的过滤模块生效或任一端是SSL时自动按原方式转发，
+     见ngx_http_upstream_splice_init
+     */
+    { ngx_string("proxy_splice"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.splice),
+      NULL },
+
     { ngx_string("proxy_ignore_client_abort"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
       ngx_conf_set_flag_slot,
@@ -1078,6 +1090,14 @@ more request may be passed to the proxied server.
       offsetof(ngx_http_proxy_loc_conf_t, upstream.cache_revalidate),
       NULL },
 
+    //过期缓存先发送给客户端，同时由一个后台子请求去后端更新缓存。需要proxy_cache_use_stale包含updating，否则不生效
+    { ngx_string("proxy_cache_background_update"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.cache_background_update),
+      NULL },
+
 #endif
 
     /*
@@ -2690,6 +2710,10 @@ ngx_http_proxy_input_filter_init(void *data)
 
         u->pipe->length = u->headers_in.content_length_n;
         u->length = u->headers_in.content_length_n;
+
+#if (NGX_HAVE_SPLICE)
+        u->splice = u->conf->splice && u->headers_in.content_length_n > 0;
+#endif
     }
 
     return NGX_OK;
@@ -3583,6 +3607,7 @@ ngx_http_proxy_create_loc_conf(ngx_conf_t *cf)
     conf->upstream.store_access = NGX_CONF_UNSET_UINT;
     conf->upstream.next_upstream_tries = NGX_CONF_UNSET_UINT;
     conf->upstream.buffering = NGX_CONF_UNSET;
+    conf->upstream.splice = NGX_CONF_UNSET;
     conf->upstream.request_buffering = NGX_CONF_UNSET;
     conf->upstream.ignore_client_abort = NGX_CONF_UNSET;
     conf->upstream.force_ranges = NGX_CONF_UNSET;
@@ -3615,6 +3640,7 @@ ngx_http_proxy_create_loc_conf(ngx_conf_t *cf)
     conf->upstream.cache_lock_timeout = NGX_CONF_UNSET_MSEC;
     conf->upstream.cache_lock_age = NGX_CONF_UNSET_MSEC;
     conf->upstream.cache_revalidate = NGX_CONF_UNSET;
+    conf->upstream.cache_background_update = NGX_CONF_UNSET;
 #endif
 
     conf->upstream.hide_headers = NGX_CONF_UNSET_PTR;
@@ -3693,6 +3719,9 @@ ngx_http_proxy_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->upstream.buffering,
                               prev->upstream.buffering, 1);
 
+    ngx_conf_merge_value(conf->upstream.splice,
+                              prev->upstream.splice, 0);
+
     ngx_conf_merge_value(conf->upstream.request_buffering,
                               prev->upstream.request_buffering, 1);
 
@@ -3914,6 +3943,9 @@ ngx_http_proxy_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->upstream.cache_revalidate,
                               prev->upstream.cache_revalidate, 0);
 
+    ngx_conf_merge_value(conf->upstream.cache_background_update,
+                              prev->upstream.cache_background_update, 0);
+
 #endif
 
     ngx_conf_merge_str_value(conf->method, prev->method, "");
@@ -47,6 +47,8 @@ static char *ngx_http_ssl_password_file(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static char *ngx_http_ssl_session_cache(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_ssl_key_offload(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 
 static ngx_int_t ngx_http_ssl_init(ngx_conf_t *cf);
 
@@ -170,6 +172,18 @@ static ngx_command_t  ngx_http_ssl_commands[] = {
       offsetof(ngx_http_ssl_srv_conf_t, prefer_server_ciphers),
       NULL },
 
+    /*
+    ssl_key_offload off | threads[=pool];  默认off
+    完整握手中的RSA私钥运算交给thread_pool指令配置的线程池执行，运算期间worker继续处理其他连接，见ngx_ssl_key_offload。
+    不指定pool时使用名为default的线程池。只对RSA证书私钥生效
+    */
+    { ngx_string("ssl_key_offload"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_http_ssl_key_offload,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("ssl_session_cache"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE12,
       ngx_http_ssl_session_cache,
@@ -529,6 +543,9 @@ ngx_http_ssl_create_srv_conf(ngx_conf_t *cf)
 
     sscf->enable = NGX_CONF_UNSET;
     sscf->prefer_server_ciphers = NGX_CONF_UNSET;
+#if (NGX_SSL_ASYNC)
+    sscf->key_offload = NGX_CONF_UNSET_PTR;
+#endif
     sscf->buffer_size = NGX_CONF_UNSET_SIZE;
     sscf->verify = NGX_CONF_UNSET_UINT;
     sscf->verify_depth = NGX_CONF_UNSET_UINT;
@@ -569,6 +586,10 @@ ngx_http_ssl_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->prefer_server_ciphers,
                          prev->prefer_server_ciphers, 0);
 
+#if (NGX_SSL_ASYNC)
+    ngx_conf_merge_ptr_value(conf->key_offload, prev->key_offload, NULL);
+#endif
+
     ngx_conf_merge_bitmask_value(conf->protocols, prev->protocols,
                          (NGX_CONF_BITMASK_SET|NGX_SSL_TLSv1
                           |NGX_SSL_TLSv1_1|NGX_SSL_TLSv1_2));
@@ -724,6 +745,12 @@ ngx_http_ssl_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
         SSL_CTX_set_options(conf->ssl.ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
     }
 
+#if (NGX_SSL_ASYNC)
+    if (ngx_ssl_key_offload(cf, &conf->ssl, conf->key_offload) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+#endif
+
 #ifndef LIBRESSL_VERSION_NUMBER
     /* a temporary 512-bit RSA key is required for export versions of MSIE */
     SSL_CTX_set_tmp_rsa_callback(conf->ssl.ctx, ngx_ssl_rsa512_key_callback);
@@ -939,6 +966,69 @@ invalid:
 }
 
 
+//ssl_key_offload off | threads[=pool];
+static char *
+ngx_http_ssl_key_offload(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+#if (NGX_SSL_ASYNC)
+    ngx_http_ssl_srv_conf_t *sscf = conf;
+
+    ngx_str_t           name;
+    ngx_thread_pool_t  *tp;
+#endif
+
+    ngx_str_t  *value;
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+#if (NGX_SSL_ASYNC)
+        if (sscf->key_offload != NGX_CONF_UNSET_PTR) {
+            return "is duplicate";
+        }
+
+        sscf->key_offload = NULL;
+#endif
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strncmp(value[1].data, "threads", 7) == 0
+        && (value[1].len == 7 || value[1].data[7] == '='))
+    {
+#if (NGX_SSL_ASYNC)
+        if (sscf->key_offload != NGX_CONF_UNSET_PTR) {
+            return "is duplicate";
+        }
+
+        if (value[1].len >= 8) {
+            name.len = value[1].len - 8;
+            name.data = value[1].data + 8;
+
+            tp = ngx_thread_pool_add(cf, &name);
+
+        } else {
+            tp = ngx_thread_pool_add(cf, NULL);
+        }
+
+        if (tp == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        sscf->key_offload = tp;
+
+        return NGX_CONF_OK;
+#else
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"ssl_key_offload threads\" "
+                           "is unsupported on this platform");
+        return NGX_CONF_ERROR;
+#endif
+    }
+
+    return "invalid value";
+}
+
+
 static ngx_int_t
 ngx_http_ssl_init(ngx_conf_t *cf)
 {
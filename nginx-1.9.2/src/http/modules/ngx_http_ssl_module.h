@@ -21,6 +21,10 @@ typedef struct {
 
     ngx_flag_t                      prefer_server_ciphers;
 
+#if (NGX_SSL_ASYNC)
+    ngx_thread_pool_t              *key_offload; /* ssl_key_offload threads[=pool] */
+#endif
+
     ngx_uint_t                      protocols;
 
     ngx_uint_t                      verify;
@@ -16,6 +16,9 @@ static ngx_int_t ngx_http_stub_status_variable(ngx_http_request_t *r,
 static ngx_int_t ngx_http_stub_status_add_variables(ngx_conf_t *cf);
 static char *ngx_http_set_stub_status(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static ngx_int_t ngx_http_slab_status_handler(ngx_http_request_t *r);
+static char *ngx_http_set_slab_status(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 
 
 static ngx_command_t  ngx_http_status_commands[] = {
@@ -27,6 +30,14 @@ static ngx_command_t  ngx_http_status_commands[] = {
       0,
       NULL },
 
+    /* 输出每个共享内存zone的slab使用情况，见ngx_slab_info */
+    { ngx_string("slab_status"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_set_slab_status,
+      0,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
@@ -164,6 +175,146 @@ ngx_http_stub_status_handler(ngx_http_request_t *r)
 }
 
 
+/*
+slab_status的输出格式，每个共享内存zone一段:
+zone: one size: 10485760 pages: 2553 free: 2541 free runs: 1 max free run: 2541 large pages: 0 large reqs: 0 large fails: 0
+ size pages total used reqs fails
+ 8 0 0 0 0 0
+ ...
+*/
+static ngx_int_t
+ngx_http_slab_status_handler(ngx_http_request_t *r)
+{
+    size_t                 size;
+    ngx_int_t              rc;
+    ngx_buf_t             *b;
+    ngx_uint_t             i, j, n;
+    ngx_chain_t            out;
+    ngx_list_part_t       *part;
+    ngx_shm_zone_t        *shm_zone;
+    ngx_slab_info_t        info;
+    ngx_slab_pool_t       *shpool;
+    ngx_slab_slot_info_t  *slot;
+
+    if (r->method != NGX_HTTP_GET && r->method != NGX_HTTP_HEAD) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    r->headers_out.content_type_len = sizeof("text/plain") - 1;
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    r->headers_out.content_type_lowcase = NULL;
+
+    if (r->method == NGX_HTTP_HEAD) {
+        r->headers_out.status = NGX_HTTP_OK;
+
+        rc = ngx_http_send_header(r);
+
+        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+            return rc;
+        }
+    }
+
+    size = 0;
+
+    part = &((ngx_cycle_t *) ngx_cycle)->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        size += sizeof("zone:  size:  pages:  free:  free runs:  "
+                       "max free run:  large pages:  large reqs:  "
+                       "large fails: \n") - 1
+                + shm_zone[i].shm.name.len + 8 * NGX_INT_T_LEN
+                + sizeof(" size pages total used reqs fails\n") - 1
+                + NGX_SLAB_INFO_SLOTS * (sizeof("      \n") - 1
+                                         + 6 * NGX_INT_T_LEN);
+    }
+
+    if (size == 0) {
+        size = 1;
+    }
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    part = &((ngx_cycle_t *) ngx_cycle)->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        shpool = (ngx_slab_pool_t *) shm_zone[i].shm.addr;
+
+        ngx_slab_info(shpool, &info);
+
+        b->last = ngx_sprintf(b->last, "zone: %V size: %uz pages: %ui "
+                              "free: %ui free runs: %ui max free run: %ui "
+                              "large pages: %ui large reqs: %ui "
+                              "large fails: %ui\n",
+                              &shm_zone[i].shm.name, shm_zone[i].shm.size,
+                              info.pages, info.free_pages, info.free_runs,
+                              info.max_free_run, info.large_pages,
+                              info.large_reqs, info.large_fails);
+
+        b->last = ngx_cpymem(b->last, " size pages total used reqs fails\n",
+                             sizeof(" size pages total used reqs fails\n")
+                             - 1);
+
+        n = info.nslots;
+
+        for (j = 0; j < n; j++) {
+            slot = &info.slots[j];
+
+            b->last = ngx_sprintf(b->last, " %uz %ui %ui %ui %ui %ui\n",
+                                  slot->size, slot->pages, slot->total,
+                                  slot->used, slot->reqs, slot->fails);
+        }
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
 static ngx_int_t
 ngx_http_stub_status_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data)
@@ -238,3 +389,15 @@ ngx_http_set_stub_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     return NGX_CONF_OK;
 }
+
+
+static char *
+ngx_http_set_slab_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_slab_status_handler;
+
+    return NGX_CONF_OK;
+}
@@ -0,0 +1,523 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+/* 没有配置decay参数时响应时间样本的衰减时间常数 */
+#define NGX_HTTP_UPSTREAM_EWMA_DECAY  10000
+
+
+/* 同一类(非backup或者backup)服务器按链表顺序排成的数组，用于O(1)随机选取，下标与rrp->tried中的位一致 */
+typedef struct {
+    ngx_http_upstream_rr_peers_t      *peers;
+    ngx_http_upstream_rr_peer_t      **peer;
+} ngx_http_upstream_ewma_index_t;
+
+
+typedef struct {
+    ngx_msec_t                         decay;
+    /* 0为非backup服务器，1为backup服务器，由ngx_http_upstream_ewma_build_index在worker中建立 */
+    ngx_http_upstream_ewma_index_t     index[2];
+} ngx_http_upstream_ewma_srv_conf_t;
+
+
+typedef struct {
+    /* the round robin data must be first */
+    ngx_http_upstream_rr_peer_data_t   rrp;
+
+    ngx_http_upstream_ewma_srv_conf_t *conf;
+    ngx_msec_t                         start; //本次选取后端的时间，用于计算响应时间样本
+} ngx_http_upstream_ewma_peer_data_t;
+
+
+static ngx_int_t ngx_http_upstream_init_ewma_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_get_ewma_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_http_upstream_free_ewma_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+static ngx_int_t ngx_http_upstream_ewma_build_index(
+    ngx_http_upstream_ewma_index_t *index, ngx_http_upstream_rr_peers_t *peers);
+static void *ngx_http_upstream_ewma_create_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_ewma(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_http_upstream_ewma_commands[] = {
+/*
+语法:  ewma [decay=time];
+默认值:  ―
+上下文:  upstream
+
+每次随机取两台可用的服务器，选择 响应时间的峰值指数加权平均 × 正在处理的请求数 / 权重 较小的那台(power of two
+choices)。响应时间变长时平均值立即跟上，变短时按decay(默认10s)衰减，这样某台服务器变慢后很快就会少分到请求。
+选取一次的开销与服务器数量无关。配合zone指令时响应时间记录在共享内存中，所有worker共用
+*/
+    { ngx_string("ewma"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+      ngx_http_upstream_ewma,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_ewma_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_upstream_ewma_create_conf,    /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_ewma_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_ewma_module_ctx,    /* module context */
+    ngx_http_upstream_ewma_commands,       /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_http_upstream_init_ewma(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->log, 0, "init ewma");
+
+    if (ngx_http_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_http_upstream_init_ewma_peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_init_ewma_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_rr_peers_t        *peers;
+    ngx_http_upstream_ewma_srv_conf_t   *ecf;
+    ngx_http_upstream_ewma_peer_data_t  *ewp;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "init ewma peer");
+
+    ecf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_ewma_module);
+
+    /*
+     配置了zone时us->peer.data在ngx_http_upstream_zone_copy_peers中被换成了共享内存中的拷贝，所以数组在worker
+     第一次使用时才建立
+     */
+
+    peers = us->peer.data;
+
+    if (ecf->index[0].peers != peers) {
+        if (ngx_http_upstream_ewma_build_index(&ecf->index[0], peers)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        if (peers->next
+            && ngx_http_upstream_ewma_build_index(&ecf->index[1], peers->next)
+               != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    ewp = ngx_palloc(r->pool, sizeof(ngx_http_upstream_ewma_peer_data_t));
+    if (ewp == NULL) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.data = &ewp->rrp;
+
+    if (ngx_http_upstream_init_round_robin_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ewp->conf = ecf;
+    ewp->start = ngx_current_msec;
+
+    r->upstream->peer.get = ngx_http_upstream_get_ewma_peer;
+    r->upstream->peer.free = ngx_http_upstream_free_ewma_peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_ewma_build_index(ngx_http_upstream_ewma_index_t *index,
+    ngx_http_upstream_rr_peers_t *peers)
+{
+    size_t                        size;
+    ngx_uint_t                    i;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    size = peers->number * sizeof(ngx_http_upstream_rr_peer_t *);
+
+    index->peer = ngx_palloc(ngx_cycle->pool, size);
+    if (index->peer == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+        index->peer[i] = peer;
+    }
+
+    index->peers = peers;
+
+    return NGX_OK;
+}
+
+
+/* 返回1表示peer可以被选取 */
+static ngx_inline ngx_uint_t
+ngx_http_upstream_ewma_usable(ngx_http_upstream_rr_peer_data_t *rrp,
+    ngx_http_upstream_rr_peer_t *peer, ngx_uint_t i, time_t now)
+{
+    uintptr_t   m;
+    ngx_uint_t  n;
+
+    n = i / (8 * sizeof(uintptr_t));
+    m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+    if (rrp->tried[n] & m) {
+        return 0;
+    }
+
+    if (peer->down) {
+        return 0;
+    }
+
+    if (peer->max_fails
+        && peer->fails >= peer->max_fails
+        && now - peer->checked <= peer->fail_timeout)
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+
+/*
+比较 (ewma + 1) * (conns + 1) / weight，peer的代价比best小返回1。ewma以微秒为单位，用64位整数计算避免溢出，
+也不需要除法
+*/
+static ngx_inline ngx_uint_t
+ngx_http_upstream_ewma_better(ngx_http_upstream_rr_peer_t *peer,
+    ngx_http_upstream_rr_peer_t *best)
+{
+    uint64_t  a, b;
+
+    a = (uint64_t) (peer->ewma + 1) * (peer->conns + 1) * best->weight;
+    b = (uint64_t) (best->ewma + 1) * (best->conns + 1) * peer->weight;
+
+    return a < b;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_get_ewma_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_ewma_peer_data_t  *ewp = data;
+
+    time_t                             now;
+    uintptr_t                          m;
+    ngx_int_t                          rc;
+    ngx_uint_t                         i, j, n, p;
+    ngx_http_upstream_rr_peer_t       *peer, *best;
+    ngx_http_upstream_rr_peers_t      *peers;
+    ngx_http_upstream_ewma_index_t    *index;
+    ngx_http_upstream_rr_peer_data_t  *rrp;
+
+    rrp = &ewp->rrp;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get ewma peer, try: %ui", pc->tries);
+
+    ewp->start = ngx_current_msec;
+
+    if (rrp->peers->single) {
+        return ngx_http_upstream_get_round_robin_peer(pc, rrp);
+    }
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    now = ngx_time();
+
+    peers = rrp->peers;
+
+    index = (peers == ewp->conf->index[0].peers) ? &ewp->conf->index[0]
+                                                 : &ewp->conf->index[1];
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+    best = NULL;
+    p = 0;
+    n = peers->number;
+
+    /*
+     * 随机取两个不同的下标，各自可用时选代价小的那个。peers->single为0时这一组也可能只有一台
+     * (一台主服务器加backup，或者backup组只有一台)，这时没有第二个选择
+     */
+
+    i = ngx_random() % n;
+
+    peer = index->peer[i];
+
+    if (ngx_http_upstream_ewma_usable(rrp, peer, i, now)) {
+        best = peer;
+        p = i;
+    }
+
+    if (n > 1) {
+        j = (i + 1 + ngx_random() % (n - 1)) % n;
+
+        peer = index->peer[j];
+
+        if (ngx_http_upstream_ewma_usable(rrp, peer, j, now)
+            && (best == NULL || ngx_http_upstream_ewma_better(peer, best)))
+        {
+            best = peer;
+            p = j;
+        }
+    }
+
+    if (best == NULL) {
+
+        /* 两台都不可用(已试过、down或者失败过多)，才遍历所有服务器选代价最小的 */
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "get ewma peer, scan");
+
+        for (i = 0; i < n; i++) {
+            peer = index->peer[i];
+
+            if (!ngx_http_upstream_ewma_usable(rrp, peer, i, now)) {
+                continue;
+            }
+
+            if (best == NULL || ngx_http_upstream_ewma_better(peer, best)) {
+                best = peer;
+                p = i;
+            }
+        }
+    }
+
+    if (best == NULL) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "get ewma peer, no peer found");
+
+        goto failed;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get ewma peer: %ui ewma:%ui conns:%ui",
+                   p, best->ewma, best->conns);
+
+    if (now - best->checked > best->fail_timeout) {
+        best->checked = now;
+    }
+
+    pc->sockaddr = best->sockaddr;
+    pc->socklen = best->socklen;
+    pc->name = &best->name;
+
+    best->conns++;
+
+    rrp->current = best;
+
+    n = p / (8 * sizeof(uintptr_t));
+    m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
+
+    rrp->tried[n] |= m;
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    return NGX_OK;
+
+failed:
+
+    if (peers->next) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "get ewma peer, backup servers");
+
+        rrp->peers = peers->next;
+
+        n = (rrp->peers->number + (8 * sizeof(uintptr_t) - 1))
+                / (8 * sizeof(uintptr_t));
+
+        for (i = 0; i < n; i++) {
+             rrp->tried[i] = 0;
+        }
+
+        ngx_http_upstream_rr_peers_unlock(peers);
+
+        rc = ngx_http_upstream_get_ewma_peer(pc, ewp);
+
+        if (rc != NGX_BUSY) {
+            return rc;
+        }
+
+        ngx_http_upstream_rr_peers_wlock(peers);
+    }
+
+    /* all peers failed, mark them as live for quick recovery */
+
+    for (peer = peers->peer; peer; peer = peer->next) {
+        peer->fails = 0;
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    pc->name = peers->name;
+
+    return NGX_BUSY;
+}
+
+
+/*
+用本次的响应时间更新peer->ewma。样本比平均值大时直接取样本(峰值)，否则按距上次更新的时间dt衰减:
+ewma = (ewma * decay + sample * dt) / (decay + dt)，即用decay / (decay + dt)近似exp(-dt / decay)
+*/
+static void
+ngx_http_upstream_free_ewma_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_http_upstream_ewma_peer_data_t  *ewp = data;
+
+    ngx_msec_t                         dt;
+    ngx_uint_t                         sample;
+    ngx_http_upstream_rr_peer_t       *peer;
+    ngx_http_upstream_rr_peer_data_t  *rrp;
+
+    rrp = &ewp->rrp;
+    peer = rrp->current;
+
+    if (peer && !(state & NGX_PEER_FAILED)) {
+
+        sample = (ngx_current_msec - ewp->start) * 1000;
+
+        ngx_http_upstream_rr_peers_rlock(rrp->peers);
+        ngx_http_upstream_rr_peer_lock(rrp->peers, peer);
+
+        if (sample >= peer->ewma) {
+            peer->ewma = sample;
+
+        } else {
+            dt = ngx_current_msec - peer->ewma_stamp;
+
+            peer->ewma = (ngx_uint_t)
+                (((uint64_t) peer->ewma * ewp->conf->decay
+                  + (uint64_t) sample * dt)
+                 / (ewp->conf->decay + dt));
+        }
+
+        peer->ewma_stamp = ngx_current_msec;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "free ewma peer, sample:%ui ewma:%ui",
+                       sample, peer->ewma);
+
+        ngx_http_upstream_rr_peer_unlock(rrp->peers, peer);
+        ngx_http_upstream_rr_peers_unlock(rrp->peers);
+    }
+
+    ngx_http_upstream_free_round_robin_peer(pc, &ewp->rrp, state);
+}
+
+
+static void *
+ngx_http_upstream_ewma_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_ewma_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_ewma_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->decay = NGX_CONF_UNSET_MSEC;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_ewma(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_ewma_srv_conf_t  *ecf = conf;
+
+    ngx_str_t                     *value, s;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    if (uscf->peer.init_upstream) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "load balancing method redefined");
+    }
+
+    ecf->decay = NGX_HTTP_UPSTREAM_EWMA_DECAY;
+
+    if (cf->args->nelts == 2) {
+        value = cf->args->elts;
+
+        if (ngx_strncmp(value[1].data, "decay=", 6) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        s.len = value[1].len - 6;
+        s.data = &value[1].data[6];
+
+        ecf->decay = ngx_parse_time(&s, 0);
+
+        if (ecf->decay == (ngx_msec_t) NGX_ERROR || ecf->decay == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid decay \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    uscf->peer.init_upstream = ngx_http_upstream_init_ewma;
+
+    uscf->flags = NGX_HTTP_UPSTREAM_CREATE
+                  |NGX_HTTP_UPSTREAM_WEIGHT
+                  |NGX_HTTP_UPSTREAM_MAX_FAILS
+                  |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_HTTP_UPSTREAM_DOWN
+                  |NGX_HTTP_UPSTREAM_BACKUP;
+
+    return NGX_CONF_OK;
+}
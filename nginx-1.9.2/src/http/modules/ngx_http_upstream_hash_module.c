@@ -22,9 +22,23 @@ typedef struct {
 } ngx_http_upstream_chash_points_t;
 
 
+/*
+hash key maglev的查找表。每台服务器按自己的name得到一个0到size-1的排列，各服务器按权重轮流占用自己排列中下一个
+还空着的位置，直到填满。查找只需取entry[hash % size]，增删一台服务器时其他服务器的位置大多保持不变
+*/
+typedef struct {
+    ngx_uint_t                          size;  //查找表大小，为素数
+    uint32_t                           *entry; //值为服务器在peers->peer链表中的序号
+    /* 序号到服务器的数组，在worker中第一次使用时建立，见ngx_http_upstream_init_maglev_peer */
+    ngx_http_upstream_rr_peers_t       *peers;
+    ngx_http_upstream_rr_peer_t       **peer;
+} ngx_http_upstream_maglev_t;
+
+
 typedef struct {
     ngx_http_complex_value_t            key;
     ngx_http_upstream_chash_points_t   *points;
+    ngx_http_upstream_maglev_t         *maglev;
 } ngx_http_upstream_hash_srv_conf_t;
 
 
@@ -58,13 +72,26 @@ static ngx_int_t ngx_http_upstream_init_chash_peer(ngx_http_request_t *r,
 static ngx_int_t ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc,
     void *data);
 
+static ngx_int_t ngx_http_upstream_init_maglev(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_init_maglev_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_get_maglev_peer(ngx_peer_connection_t *pc,
+    void *data);
+
 static void *ngx_http_upstream_hash_create_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 
 
 static ngx_command_t  ngx_http_upstream_hash_commands[] = {
+/*
+语法:  hash key [consistent | maglev];
+上下文:  upstream
 
+consistent为ketama一致性hash，每单位权重160个点，查找时二分。maglev用一张大小为素数的查找表，查找O(1)，
+表的大小约为服务器数的100倍(最小4093)，见ngx_http_upstream_init_maglev
+*/
     { ngx_string("hash"),
       NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12,
       ngx_http_upstream_hash,
@@ -614,6 +641,276 @@ found:
 }
 
 
+/*
+查找表大小从下面一组略小于2的幂的素数中取第一个不小于服务器数100倍的，实际为服务器数的100到200倍，
+各服务器分到的位置数与按权重应得的相差不超过约1%。大小改变时所有key都会重新分布，最小取4093，
+服务器数在40台以内增减时大小不变。大小不变时去掉一台服务器，换了服务器的key约为理想值1/n的2到7倍
+(见contrib/bench/ngx_upstream_hash_bench.c)
+*/
+static ngx_uint_t  ngx_http_upstream_maglev_sizes[] = {
+    4093, 8191, 16381, 32749, 65521, 131071, 262139, 524287, 1048573
+};
+
+
+static ngx_int_t
+ngx_http_upstream_init_maglev(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
+{
+    uint32_t                           *entry;
+    ngx_int_t                           max_weight, *credit;
+    ngx_uint_t                          i, n, size, filled, c;
+    ngx_uint_t                         *pos, *skip;
+    ngx_http_upstream_rr_peer_t        *peer;
+    ngx_http_upstream_rr_peers_t       *peers;
+    ngx_http_upstream_maglev_t         *maglev;
+    ngx_http_upstream_hash_srv_conf_t  *hcf;
+
+    if (ngx_http_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_http_upstream_init_maglev_peer;
+
+    peers = us->peer.data;
+    n = peers->number;
+
+    for (i = 0;
+         i < sizeof(ngx_http_upstream_maglev_sizes) / sizeof(ngx_uint_t) - 1;
+         i++)
+    {
+        if (ngx_http_upstream_maglev_sizes[i] >= n * 100) {
+            break;
+        }
+    }
+
+    size = ngx_http_upstream_maglev_sizes[i];
+
+    if (n > size) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "too many servers for maglev hash in upstream \"%V\"",
+                      &us->host);
+        return NGX_ERROR;
+    }
+
+    maglev = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_maglev_t));
+    if (maglev == NULL) {
+        return NGX_ERROR;
+    }
+
+    entry = ngx_palloc(cf->pool, size * sizeof(uint32_t));
+    if (entry == NULL) {
+        return NGX_ERROR;
+    }
+
+    pos = ngx_palloc(cf->temp_pool, 2 * n * sizeof(ngx_uint_t));
+    credit = ngx_pcalloc(cf->temp_pool, n * sizeof(ngx_int_t));
+    if (pos == NULL || credit == NULL) {
+        return NGX_ERROR;
+    }
+
+    skip = pos + n;
+
+    /* 每台服务器的排列为 offset, offset + skip, offset + 2 * skip, ... (mod size)，size为素数所以不会重复 */
+
+    max_weight = 0;
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+        pos[i] = ngx_crc32_long(peer->name.data, peer->name.len) % size;
+        skip[i] = ngx_murmur_hash2(peer->name.data, peer->name.len)
+                  % (size - 1) + 1;
+
+        if (peer->weight > max_weight) {
+            max_weight = peer->weight;
+        }
+    }
+
+    ngx_memset(entry, 0xff, size * sizeof(uint32_t));
+
+    filled = 0;
+
+    for ( ;; ) {
+        for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+
+            /* 权重为最大权重一半的服务器每两轮才占用一个位置 */
+
+            credit[i] += peer->weight;
+
+            while (credit[i] >= max_weight) {
+                credit[i] -= max_weight;
+
+                do {
+                    c = pos[i];
+                    pos[i] = (pos[i] + skip[i]) % size;
+                } while (entry[c] != (uint32_t) -1);
+
+                entry[c] = (uint32_t) i;
+
+                if (++filled == size) {
+                    goto done;
+                }
+            }
+        }
+    }
+
+done:
+
+    maglev->size = size;
+    maglev->entry = entry;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, cf->log, 0,
+                   "init maglev hash, servers:%ui size:%ui", n, size);
+
+    hcf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_hash_module);
+    hcf->maglev = maglev;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_init_maglev_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_uint_t                          i;
+    ngx_http_upstream_rr_peer_t        *peer;
+    ngx_http_upstream_rr_peers_t       *peers;
+    ngx_http_upstream_maglev_t         *maglev;
+    ngx_http_upstream_hash_srv_conf_t  *hcf;
+
+    if (ngx_http_upstream_init_hash_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.get = ngx_http_upstream_get_maglev_peer;
+
+    hcf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_hash_module);
+    maglev = hcf->maglev;
+
+    /*
+     配置了zone时us->peer.data在ngx_http_upstream_zone_copy_peers中被换成了共享内存中的拷贝，链表顺序不变，
+     所以序号到服务器的数组在worker第一次使用时才建立
+     */
+
+    peers = us->peer.data;
+
+    if (maglev->peers != peers) {
+        maglev->peer = ngx_palloc(ngx_cycle->pool, peers->number
+                                  * sizeof(ngx_http_upstream_rr_peer_t *));
+        if (maglev->peer == NULL) {
+            return NGX_ERROR;
+        }
+
+        for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+            maglev->peer[i] = peer;
+        }
+
+        maglev->peers = peers;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_get_maglev_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_hash_peer_data_t  *hp = data;
+
+    time_t                        now;
+    u_char                        buf[NGX_INT_T_LEN];
+    size_t                        size;
+    uint32_t                      hash;
+    uintptr_t                     m;
+    ngx_uint_t                    n, p;
+    ngx_http_upstream_rr_peer_t  *peer;
+    ngx_http_upstream_maglev_t   *maglev;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get maglev hash peer, try: %ui", pc->tries);
+
+    ngx_http_upstream_rr_peers_wlock(hp->rrp.peers);
+
+    if (hp->tries > 20 || hp->rrp.peers->single) {
+        ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+        return hp->get_rr_peer(pc, &hp->rrp);
+    }
+
+    now = ngx_time();
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    maglev = hp->conf->maglev;
+
+    for ( ;; ) {
+
+        /* 选中的服务器不可用时，在key前加上重试次数重新计算hash */
+
+        ngx_crc32_init(hash);
+
+        if (hp->rehash > 0) {
+            size = ngx_sprintf(buf, "%ui", hp->rehash) - buf;
+            ngx_crc32_update(&hash, buf, size);
+        }
+
+        ngx_crc32_update(&hash, hp->key.data, hp->key.len);
+        ngx_crc32_final(hash);
+
+        hp->rehash++;
+
+        p = maglev->entry[hash % maglev->size];
+        peer = maglev->peer[p];
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "get maglev hash peer, value:%uD, peer:%ui", hash, p);
+
+        n = p / (8 * sizeof(uintptr_t));
+        m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
+
+        if (hp->rrp.tried[n] & m) {
+            goto next;
+        }
+
+        if (peer->down) {
+            goto next;
+        }
+
+        if (peer->max_fails
+            && peer->fails >= peer->max_fails
+            && now - peer->checked <= peer->fail_timeout)
+        {
+            goto next;
+        }
+
+        break;
+
+    next:
+
+        if (++hp->tries > 20) {
+            ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+            return hp->get_rr_peer(pc, &hp->rrp);
+        }
+    }
+
+    hp->rrp.current = peer;
+
+    pc->sockaddr = peer->sockaddr;
+    pc->socklen = peer->socklen;
+    pc->name = &peer->name;
+
+    peer->conns++;
+
+    if (now - peer->checked > peer->fail_timeout) {
+        peer->checked = now;
+    }
+
+    ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+
+    hp->rrp.tried[n] |= m;
+
+    return NGX_OK;
+}
+
+
 static void *
 ngx_http_upstream_hash_create_conf(ngx_conf_t *cf)
 {
@@ -625,6 +922,7 @@ ngx_http_upstream_hash_create_conf(ngx_conf_t *cf)
     }
 
     conf->points = NULL;
+    conf->maglev = NULL;
 
     return conf;
 }
@@ -670,6 +968,9 @@ ngx_http_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     } else if (ngx_strcmp(value[2].data, "consistent") == 0) {
         uscf->peer.init_upstream = ngx_http_upstream_init_chash;
 
+    } else if (ngx_strcmp(value[2].data, "maglev") == 0) {
+        uscf->peer.init_upstream = ngx_http_upstream_init_maglev;
+
     } else {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[2]);
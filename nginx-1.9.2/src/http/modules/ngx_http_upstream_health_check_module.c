@@ -0,0 +1,793 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+/* 每个worker检查一遍各服务器是否到了检查时间的最大间隔 */
+#define NGX_HTTP_UPSTREAM_HC_TICK         1000
+/* 读取检查应答的缓冲区大小，body参数只在这个范围内匹配 */
+#define NGX_HTTP_UPSTREAM_HC_BUFFER_SIZE  4096
+
+
+typedef struct {
+    ngx_msec_t                         interval;
+    ngx_msec_t                         timeout;
+    ngx_uint_t                         fails;
+    ngx_uint_t                         passes;
+    ngx_uint_t                         status_min;
+    ngx_uint_t                         status_max;
+    ngx_str_t                          request; //配置时生成的完整检查请求，len为0表示没有配置health_check
+    ngx_str_t                          body;    //应答中需要包含的字符串
+} ngx_http_upstream_hc_srv_conf_t;
+
+
+/* 每个worker为每个配置了health_check的upstream建立一个，定时检查哪些服务器需要探测 */
+typedef struct {
+    ngx_event_t                        event;
+    ngx_connection_t                   dumb;
+    ngx_http_upstream_srv_conf_t      *upstream;
+    ngx_http_upstream_hc_srv_conf_t   *conf;
+} ngx_http_upstream_hc_timer_t;
+
+
+/* 一次探测，从独立的内存池中分配，探测结束时销毁 */
+typedef struct {
+    ngx_peer_connection_t              pc;
+    ngx_pool_t                        *pool;
+    ngx_buf_t                         *buffer;
+    u_char                            *request;  //请求中还没有发送的位置
+    ngx_http_upstream_rr_peers_t      *peers;
+    ngx_http_upstream_rr_peer_t       *peer;
+    /* 探测开始时peer->sockaddr的值，结束时不同说明这个位置已被upstream_conf换成了其他服务器 */
+    struct sockaddr                   *sockaddr;
+    ngx_http_upstream_hc_srv_conf_t   *conf;
+} ngx_http_upstream_hc_probe_t;
+
+
+static void ngx_http_upstream_hc_timer_handler(ngx_event_t *ev);
+static void ngx_http_upstream_hc_probe(ngx_http_upstream_hc_timer_t *hct,
+    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peer_t *peer,
+    struct sockaddr *sockaddr, socklen_t socklen, ngx_str_t *name);
+static void ngx_http_upstream_hc_send_handler(ngx_event_t *wev);
+static void ngx_http_upstream_hc_recv_handler(ngx_event_t *rev);
+static ngx_uint_t ngx_http_upstream_hc_parse(ngx_http_upstream_hc_probe_t *hp);
+static void ngx_http_upstream_hc_finish(ngx_http_upstream_hc_probe_t *hp,
+    ngx_uint_t ok);
+static void *ngx_http_upstream_hc_create_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_health_check(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_upstream_hc_postconfiguration(ngx_conf_t *cf);
+static ngx_int_t ngx_http_upstream_hc_init_process(ngx_cycle_t *cycle);
+
+
+static ngx_command_t  ngx_http_upstream_health_check_commands[] = {
+/*
+语法:  health_check [interval=time] [timeout=time] [fails=number] [passes=number]
+                    [uri=uri] [status=code[-code]] [body=string];
+默认值:  interval=5s timeout=1s fails=1 passes=1 uri=/ status=200-399
+上下文:  upstream
+
+主动探测upstream中的每台服务器，向它发送GET uri的HTTP/1.0请求，应答状态码在status范围内并且(配置了body时)
+应答的前4k字节中包含body(不区分大小写)，就算一次成功。连续失败fails次的服务器被标记为不健康，不再分配请求；连续成功passes次
+后恢复。需要同时配置zone，探测时间和结果都记录在共享内存中的peer里，每台服务器每个interval只由一个worker探测
+*/
+    { ngx_string("health_check"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_ANY,
+      ngx_http_upstream_health_check,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_health_check_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_upstream_hc_postconfiguration, /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_upstream_hc_create_conf,      /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_health_check_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_health_check_module_ctx, /* module context */
+    ngx_http_upstream_health_check_commands, /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    ngx_http_upstream_hc_init_process,     /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_http_upstream_hc_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                        i;
+    ngx_msec_t                        tick;
+    ngx_http_upstream_hc_timer_t     *hct;
+    ngx_http_upstream_srv_conf_t    **uscfp;
+    ngx_http_upstream_main_conf_t    *umcf;
+    ngx_http_upstream_hc_srv_conf_t  *hcf;
+
+    /* cache manager和cache loader进程也会调用init process，它们不做探测 */
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                               ngx_http_upstream_module);
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL || uscfp[i]->shm_zone == NULL) {
+            continue;
+        }
+
+        hcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                          ngx_http_upstream_health_check_module);
+
+        if (hcf->request.len == 0) {
+            continue;
+        }
+
+        hct = ngx_pcalloc(cycle->pool, sizeof(ngx_http_upstream_hc_timer_t));
+        if (hct == NULL) {
+            return NGX_ERROR;
+        }
+
+        hct->upstream = uscfp[i];
+        hct->conf = hcf;
+
+        hct->dumb.fd = (ngx_socket_t) -1;
+        hct->dumb.data = hct;
+
+        hct->event.handler = ngx_http_upstream_hc_timer_handler;
+        hct->event.data = &hct->dumb;
+        hct->event.log = cycle->log;
+        hct->event.cancelable = 1;
+
+        /* 各worker错开第一次检查的时间 */
+
+        tick = ngx_min(hcf->interval, NGX_HTTP_UPSTREAM_HC_TICK);
+
+        ngx_add_timer(&hct->event, ngx_random() % tick + 1, NGX_FUNC_LINE);
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+遍历upstream的所有服务器(包括backup)，对到了检查时间的服务器，在peer锁内把peer->hc_next推后一个interval，
+谁先推后谁探测，所以同一台服务器同一时间只有一个worker在探测
+*/
+static void
+ngx_http_upstream_hc_timer_handler(ngx_event_t *ev)
+{
+    ngx_str_t                         name;
+    socklen_t                         socklen;
+    ngx_uint_t                        claim;
+    ngx_connection_t                 *dumb;
+    ngx_http_upstream_hc_timer_t     *hct;
+    ngx_http_upstream_rr_peer_t      *peer;
+    ngx_http_upstream_rr_peers_t     *peers;
+    ngx_http_upstream_hc_srv_conf_t  *hcf;
+    u_char                            sockaddr[NGX_SOCKADDRLEN];
+    u_char                            text[NGX_SOCKADDR_STRLEN];
+
+    dumb = ev->data;
+    hct = dumb->data;
+    hcf = hct->conf;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    for (peers = hct->upstream->peer.data; peers; peers = peers->next) {
+
+        for (peer = peers->peer; peer; peer = peer->next) {
+
+            /* 还没有使用的空位或者已经被upstream_conf删除 */
+
+            if (peer->weight == 0) {
+                continue;
+            }
+
+            claim = 0;
+
+            ngx_http_upstream_rr_peers_rlock(peers);
+            ngx_http_upstream_rr_peer_lock(peers, peer);
+
+            if (peer->weight
+                && (ngx_msec_int_t) (ngx_current_msec - peer->hc_next) >= 0)
+            {
+                peer->hc_next = ngx_current_msec
+                                + ngx_max(hcf->interval, hcf->timeout);
+                claim = 1;
+
+                socklen = peer->socklen;
+                ngx_memcpy(sockaddr, peer->sockaddr, socklen);
+
+                name.len = ngx_min(peer->name.len, NGX_SOCKADDR_STRLEN);
+                name.data = text;
+                ngx_memcpy(text, peer->name.data, name.len);
+            }
+
+            ngx_http_upstream_rr_peer_unlock(peers, peer);
+            ngx_http_upstream_rr_peers_unlock(peers);
+
+            if (claim) {
+                ngx_http_upstream_hc_probe(hct, peers, peer,
+                                           (struct sockaddr *) sockaddr,
+                                           socklen, &name);
+            }
+        }
+    }
+
+    ngx_add_timer(ev, ngx_min(hcf->interval, NGX_HTTP_UPSTREAM_HC_TICK),
+                  NGX_FUNC_LINE);
+}
+
+
+static void
+ngx_http_upstream_hc_probe(ngx_http_upstream_hc_timer_t *hct,
+    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peer_t *peer,
+    struct sockaddr *sockaddr, socklen_t socklen, ngx_str_t *name)
+{
+    ngx_int_t                      rc;
+    ngx_pool_t                    *pool;
+    ngx_connection_t              *c;
+    ngx_http_upstream_hc_probe_t  *hp;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, hct->event.log, 0,
+                   "health check probe: %V", name);
+
+    pool = ngx_create_pool(NGX_HTTP_UPSTREAM_HC_BUFFER_SIZE + 1024,
+                           hct->event.log);
+    if (pool == NULL) {
+        return;
+    }
+
+    hp = ngx_pcalloc(pool, sizeof(ngx_http_upstream_hc_probe_t));
+    if (hp == NULL) {
+        goto failed;
+    }
+
+    hp->pool = pool;
+    hp->peers = peers;
+    hp->peer = peer;
+    hp->sockaddr = peer->sockaddr;
+    hp->conf = hct->conf;
+    hp->request = hct->conf->request.data;
+
+    hp->buffer = ngx_create_temp_buf(pool, NGX_HTTP_UPSTREAM_HC_BUFFER_SIZE);
+    if (hp->buffer == NULL) {
+        goto failed;
+    }
+
+    hp->pc.sockaddr = ngx_pnalloc(pool, socklen);
+    hp->pc.name = ngx_palloc(pool, sizeof(ngx_str_t));
+    if (hp->pc.sockaddr == NULL || hp->pc.name == NULL) {
+        goto failed;
+    }
+
+    ngx_memcpy(hp->pc.sockaddr, sockaddr, socklen);
+    hp->pc.socklen = socklen;
+
+    hp->pc.name->data = ngx_pstrdup(pool, name);
+    if (hp->pc.name->data == NULL) {
+        goto failed;
+    }
+
+    hp->pc.name->len = name->len;
+
+    hp->pc.get = ngx_event_get_peer;
+    hp->pc.log = hct->event.log;
+    hp->pc.log_error = NGX_ERROR_ERR;
+
+    rc = ngx_event_connect_peer(&hp->pc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_http_upstream_hc_finish(hp, 0);
+        return;
+    }
+
+    c = hp->pc.connection;
+
+    c->data = hp;
+    c->pool = pool;
+
+    c->write->handler = ngx_http_upstream_hc_send_handler;
+    c->read->handler = ngx_http_upstream_hc_recv_handler;
+
+    ngx_add_timer(c->write, hp->conf->timeout, NGX_FUNC_LINE);
+    ngx_add_timer(c->read, hp->conf->timeout, NGX_FUNC_LINE);
+
+    if (rc == NGX_OK) {
+        ngx_http_upstream_hc_send_handler(c->write);
+    }
+
+    return;
+
+failed:
+
+    ngx_destroy_pool(pool);
+}
+
+
+static void
+ngx_http_upstream_hc_send_handler(ngx_event_t *wev)
+{
+    ssize_t                        n;
+    u_char                        *last;
+    ngx_connection_t              *c;
+    ngx_http_upstream_hc_probe_t  *hp;
+
+    c = wev->data;
+    hp = c->data;
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "health check of %V timed out", hp->pc.name);
+        ngx_http_upstream_hc_finish(hp, 0);
+        return;
+    }
+
+    last = hp->conf->request.data + hp->conf->request.len;
+
+    while (hp->request < last) {
+        n = c->send(c, hp->request, last - hp->request);
+
+        if (n == NGX_ERROR) {
+            ngx_http_upstream_hc_finish(hp, 0);
+            return;
+        }
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_write_event(wev, 0, NGX_FUNC_LINE) != NGX_OK) {
+                ngx_http_upstream_hc_finish(hp, 0);
+            }
+
+            return;
+        }
+
+        hp->request += n;
+    }
+
+    if (wev->timer_set) {
+        ngx_del_timer(wev, NGX_FUNC_LINE);
+    }
+
+    /* 请求已发完，等待应答 */
+
+    if (c->read->ready) {
+        ngx_http_upstream_hc_recv_handler(c->read);
+    }
+}
+
+
+static void
+ngx_http_upstream_hc_recv_handler(ngx_event_t *rev)
+{
+    ssize_t                        n;
+    ngx_buf_t                     *b;
+    ngx_connection_t              *c;
+    ngx_http_upstream_hc_probe_t  *hp;
+
+    c = rev->data;
+    hp = c->data;
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "health check of %V timed out", hp->pc.name);
+        ngx_http_upstream_hc_finish(hp, 0);
+        return;
+    }
+
+    b = hp->buffer;
+
+    for ( ;; ) {
+
+        if (b->last == b->end) {
+            /* 缓冲区满了，只按已经读到的部分判断 */
+            break;
+        }
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_read_event(rev, 0, NGX_FUNC_LINE) != NGX_OK) {
+                ngx_http_upstream_hc_finish(hp, 0);
+            }
+
+            return;
+        }
+
+        if (n == NGX_ERROR) {
+            ngx_http_upstream_hc_finish(hp, 0);
+            return;
+        }
+
+        if (n == 0) {
+            break;
+        }
+
+        b->last += n;
+    }
+
+    ngx_http_upstream_hc_finish(hp, ngx_http_upstream_hc_parse(hp));
+}
+
+
+/* 检查状态行"HTTP/1.x NNN"和body，返回1表示检查通过 */
+static ngx_uint_t
+ngx_http_upstream_hc_parse(ngx_http_upstream_hc_probe_t *hp)
+{
+    u_char      *p, *body;
+    size_t       len;
+    ngx_int_t    status;
+    ngx_buf_t   *b;
+
+    b = hp->buffer;
+    p = b->pos;
+    len = b->last - b->pos;
+
+    if (len < sizeof("HTTP/1.x NNN") - 1
+        || ngx_strncmp(p, "HTTP/1.", sizeof("HTTP/1.") - 1) != 0
+        || p[8] != ' ')
+    {
+        ngx_log_error(NGX_LOG_ERR, hp->pc.log, 0,
+                      "health check of %V: invalid response", hp->pc.name);
+        return 0;
+    }
+
+    status = ngx_atoi(p + 9, 3);
+
+    if (status == NGX_ERROR
+        || (ngx_uint_t) status < hp->conf->status_min
+        || (ngx_uint_t) status > hp->conf->status_max)
+    {
+        ngx_log_error(NGX_LOG_ERR, hp->pc.log, 0,
+                      "health check of %V: status %*s",
+                      hp->pc.name, (size_t) 3, p + 9);
+        return 0;
+    }
+
+    if (hp->conf->body.len == 0) {
+        return 1;
+    }
+
+    body = ngx_strlcasestrn(p, b->last, (u_char *) CRLF CRLF, 4 - 1);
+
+    if (body == NULL
+        || ngx_strlcasestrn(body + 4, b->last, hp->conf->body.data,
+                            hp->conf->body.len - 1)
+           == NULL)
+    {
+        ngx_log_error(NGX_LOG_ERR, hp->pc.log, 0,
+                      "health check of %V: body does not match",
+                      hp->pc.name);
+        return 0;
+    }
+
+    return 1;
+}
+
+
+/*
+把一次探测的结果记到共享内存中的peer里。连续失败fails次置NGX_HTTP_UPSTREAM_PEER_UNHEALTHY，各负载均衡模块
+看到peer->down不为0就不再选它；连续成功passes次清除
+*/
+static void
+ngx_http_upstream_hc_finish(ngx_http_upstream_hc_probe_t *hp, ngx_uint_t ok)
+{
+    ngx_uint_t                     changed;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    peers = hp->peers;
+    peer = hp->peer;
+    changed = 0;
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+    ngx_http_upstream_rr_peer_lock(peers, peer);
+
+    if (peer->sockaddr == hp->sockaddr && peer->weight) {
+
+        if (ok) {
+            peer->hc_fails = 0;
+            peer->hc_passes++;
+
+            if ((peer->down & NGX_HTTP_UPSTREAM_PEER_UNHEALTHY)
+                && peer->hc_passes >= hp->conf->passes)
+            {
+                peer->down &= ~NGX_HTTP_UPSTREAM_PEER_UNHEALTHY;
+                peer->fails = 0;
+                changed = 1;
+            }
+
+        } else {
+            peer->hc_passes = 0;
+            peer->hc_fails++;
+
+            if (!(peer->down & NGX_HTTP_UPSTREAM_PEER_UNHEALTHY)
+                && peer->hc_fails >= hp->conf->fails)
+            {
+                peer->down |= NGX_HTTP_UPSTREAM_PEER_UNHEALTHY;
+                changed = 1;
+            }
+        }
+    }
+
+    ngx_http_upstream_rr_peer_unlock(peers, peer);
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    if (changed && ok) {
+        ngx_log_error(NGX_LOG_NOTICE, hp->pc.log, 0,
+                      "upstream server %V in upstream \"%V\" is healthy",
+                      hp->pc.name, peers->name);
+
+    } else if (changed) {
+        ngx_log_error(NGX_LOG_WARN, hp->pc.log, 0,
+                      "upstream server %V in upstream \"%V\" is unhealthy",
+                      hp->pc.name, peers->name);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, hp->pc.log, 0,
+                   "health check done: %V %ui", hp->pc.name, ok);
+
+    if (hp->pc.connection) {
+        ngx_close_connection(hp->pc.connection);
+    }
+
+    ngx_destroy_pool(hp->pool);
+}
+
+
+static void *
+ngx_http_upstream_hc_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_hc_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_hc_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->request = { 0, NULL };
+     *     conf->body = { 0, NULL };
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_health_check(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_hc_srv_conf_t  *hcf = conf;
+
+    u_char                        *p, *dash;
+    size_t                         len;
+    ngx_int_t                      n, min, max;
+    ngx_str_t                     *value, s, uri;
+    ngx_uint_t                     i;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    if (hcf->request.len) {
+        return "is duplicate";
+    }
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    hcf->interval = 5000;
+    hcf->timeout = 1000;
+    hcf->fails = 1;
+    hcf->passes = 1;
+    hcf->status_min = 200;
+    hcf->status_max = 399;
+
+    ngx_str_set(&uri, "/");
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            hcf->interval = ngx_parse_time(&s, 0);
+
+            if (hcf->interval == (ngx_msec_t) NGX_ERROR
+                || hcf->interval == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+            s.len = value[i].len - 8;
+            s.data = value[i].data + 8;
+
+            hcf->timeout = ngx_parse_time(&s, 0);
+
+            if (hcf->timeout == (ngx_msec_t) NGX_ERROR || hcf->timeout == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "fails=", 6) == 0) {
+            n = ngx_atoi(value[i].data + 6, value[i].len - 6);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hcf->fails = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "passes=", 7) == 0) {
+            n = ngx_atoi(value[i].data + 7, value[i].len - 7);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hcf->passes = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "uri=", 4) == 0) {
+            uri.len = value[i].len - 4;
+            uri.data = value[i].data + 4;
+
+            if (uri.len == 0 || uri.data[0] != '/') {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "status=", 7) == 0) {
+            p = value[i].data + 7;
+            len = value[i].len - 7;
+
+            dash = ngx_strlchr(p, p + len, '-');
+
+            if (dash) {
+                min = ngx_atoi(p, dash - p);
+                max = ngx_atoi(dash + 1, p + len - dash - 1);
+
+            } else {
+                min = ngx_atoi(p, len);
+                max = min;
+            }
+
+            if (min == NGX_ERROR || max == NGX_ERROR
+                || min < 100 || max > 599 || min > max)
+            {
+                goto invalid;
+            }
+
+            hcf->status_min = min;
+            hcf->status_max = max;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "body=", 5) == 0) {
+            hcf->body.len = value[i].len - 5;
+            hcf->body.data = value[i].data + 5;
+
+            if (hcf->body.len == 0) {
+                goto invalid;
+            }
+
+            /* 匹配时不区分大小写，见ngx_http_upstream_hc_parse */
+            ngx_strlow(hcf->body.data, hcf->body.data, hcf->body.len);
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    len = sizeof("GET  HTTP/1.0" CRLF "Host: " CRLF
+                 "User-Agent: nginx health check" CRLF
+                 "Connection: close" CRLF CRLF) - 1
+          + uri.len + uscf->host.len;
+
+    p = ngx_pnalloc(cf->pool, len);
+    if (p == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    hcf->request.data = p;
+    hcf->request.len = ngx_sprintf(p, "GET %V HTTP/1.0" CRLF "Host: %V" CRLF
+                                   "User-Agent: nginx health check" CRLF
+                                   "Connection: close" CRLF CRLF,
+                                   &uri, &uscf->host)
+                       - p;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+/* 健康检查的状态记录在共享内存中，没有配置zone的upstream不能使用 */
+static ngx_int_t
+ngx_http_upstream_hc_postconfiguration(ngx_conf_t *cf)
+{
+    ngx_uint_t                        i;
+    ngx_http_upstream_srv_conf_t    **uscfp;
+    ngx_http_upstream_main_conf_t    *umcf;
+    ngx_http_upstream_hc_srv_conf_t  *hcf;
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        hcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                          ngx_http_upstream_health_check_module);
+
+        if (hcf->request.len && uscfp[i]->shm_zone == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "health_check requires zone in upstream \"%V\" "
+                          "in %s:%ui", &uscfp[i]->host,
+                          uscfp[i]->file_name, uscfp[i]->line);
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
@@ -13,6 +13,10 @@
 typedef struct {
     //最大缓存连接个数，由keepalive参数指定（keepalive connection）  默认0，不开启keepalive con-num设置
     ngx_uint_t                         max_cached; //keepalive的第一个参数  开辟max_cached个ngx_http_upstream_keepalive_cache_t
+    /* keepalive的per_server参数，每台服务器最多缓存的空闲连接数，配置了zone时是所有worker合计，0表示不限制 */
+    ngx_uint_t                         per_server;
+    ngx_uint_t                         requests; //keepalive_requests 一个连接最多处理的请求数
+    ngx_msec_t                         timeout;  //keepalive_timeout 连接在缓存中空闲的最长时间
 
     /*
     //长连接队列，其中cache为缓存连接池，free为空闲连接池。初始化时根据keepalive指令的参数初始化free队列，后续有连接过来从free队列
@@ -37,6 +41,7 @@ typedef struct {//ngx_http_upstream_init_keepalive中开辟max_cached(keepalive
 
     ngx_queue_t                        queue;
     ngx_connection_t                  *connection;
+    ngx_http_upstream_rr_peer_t       *peer; //连接所属的服务器，用于维护peer->ka_idle
 
      //缓存连接池中保存的后端服务器的地址，后续就是根据相同的socket地址来找出对应的连接，并使用该连接
     socklen_t                          socklen;
@@ -94,13 +99,34 @@ static char *ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd,
 //指定可用于长连接的连接数
 static ngx_command_t  ngx_http_upstream_keepalive_commands[] = {
     // 默认0，不开启keepalive con-num设置
+    /*
+    keepalive connections [per_server=number];
+    per_server限制到每台服务器的空闲连接数，超过时不再缓存，直接关闭。upstream配置了zone时空闲连接数在共享内存中
+    累计，限制的是所有worker的合计，否则是每个worker各自的数量
+    */
     { ngx_string("keepalive"), //缓存多少个长连接，一般和后端有多少个服务器这里就配置为多少，这个nginx可以与每一个后端只建立一个TCP连接
-      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12,
       ngx_http_upstream_keepalive,   //keepalive connections
       NGX_HTTP_SRV_CONF_OFFSET,
       0,
       NULL },
 
+    /* 一个缓存连接处理了这么多请求后关闭，默认100 */
+    { ngx_string("keepalive_requests"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_upstream_keepalive_srv_conf_t, requests),
+      NULL },
+
+    /* 连接在缓存中空闲超过这个时间后关闭，应小于后端的keepalive超时，避免复用已被后端关闭的连接，默认60s */
+    { ngx_string("keepalive_timeout"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_upstream_keepalive_srv_conf_t, timeout),
+      NULL },
+
       ngx_null_command
 };
 
@@ -174,6 +200,9 @@ ngx_http_upstream_init_keepalive(ngx_conf_t *cf,
 
     // 先执行原始初始化upstream函数（即ngx_http_upstream_init_round_robin），该函数会根据配置的后端地址解析成socket地址，用
     //于连接后端。并设置us->peer.init钩子为ngx_http_upstream_init_round_robin_peer
+    ngx_conf_init_uint_value(kcf->requests, 100);
+    ngx_conf_init_msec_value(kcf->timeout, 60000);
+
     if (kcf->original_init_upstream(cf, us) != NGX_OK) { //默认ngx_http_upstream_init_round_robin
         return NGX_ERROR;
     }
@@ -276,9 +305,10 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
     ngx_http_upstream_keepalive_peer_data_t  *kp = data;
     ngx_http_upstream_keepalive_cache_t      *item;
 
-    ngx_int_t          rc;
-    ngx_queue_t       *q, *cache;
-    ngx_connection_t  *c;
+    ngx_int_t                          rc;
+    ngx_queue_t                       *q, *cache;
+    ngx_connection_t                  *c;
+    ngx_http_upstream_rr_peer_data_t  *rrp;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "get keepalive peer");
@@ -291,6 +321,14 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
         return rc;
     }
 
+    /* 各负载均衡模块的peer data都以ngx_http_upstream_rr_peer_data_t开头，rrp->current是选中的服务器 */
+
+    rrp = kp->data;
+
+    if (rrp->current) {
+        (void) ngx_atomic_fetch_add(&rrp->current->ka_requests, 1);
+    }
+
     /* 已经选定应该把请求发往后端某个节点，然后下面就选择和这个节点的某个已有的长连接来发送数据 */
     
     /* search cache for suitable connection */
@@ -322,6 +360,18 @@ found:
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "get keepalive peer: using connection %p", c);
 
+    (void) ngx_atomic_fetch_add(&item->peer->ka_idle, -1);
+
+    if (rrp->current) {
+        (void) ngx_atomic_fetch_add(&rrp->current->ka_reused, 1);
+    }
+
+    /* 删除缓存时设置的keepalive_timeout定时器，之后的超时由upstream设置 */
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read, NGX_FUNC_LINE);
+    }
+
     c->idle = 0;
     c->sent = 0;
     c->log = pc->log;
@@ -354,9 +404,12 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     ngx_http_upstream_keepalive_peer_data_t  *kp = data;
     ngx_http_upstream_keepalive_cache_t      *item;
 
-    ngx_queue_t          *q;
-    ngx_connection_t     *c;
-    ngx_http_upstream_t  *u;
+    ngx_queue_t                       *q;
+    ngx_connection_t                  *c;
+    ngx_http_upstream_t               *u;
+    ngx_atomic_int_t                   idle;
+    ngx_http_upstream_rr_peer_t       *peer;
+    ngx_http_upstream_rr_peer_data_t  *rrp;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "free keepalive peer");
@@ -382,9 +435,31 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
         goto invalid;
     }
 
+    if (++c->requests >= kp->conf->requests) {
+        goto invalid;
+    }
+
+    rrp = kp->data;
+    peer = rrp->current;
+
+    if (peer == NULL) {
+        goto invalid;
+    }
+
+    /* 先占一个名额，超过per_server时退回，这样多个worker同时缓存也不会超过限制 */
+
+    idle = ngx_atomic_fetch_add(&peer->ka_idle, 1);
+
+    if (kp->conf->per_server && (ngx_uint_t) idle >= kp->conf->per_server) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "free keepalive peer: %V has enough idle connections",
+                       &peer->name);
+        goto release;
+    }
+
     //通常设置keepalive后连接都是由后端web服务发起的，因此需要添加读事件
     if (ngx_handle_read_event(c->read, 0, NGX_FUNC_LINE) != NGX_OK) {
-        goto invalid;
+        goto release;
     }
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
@@ -399,6 +474,8 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
 
         item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
 
+        (void) ngx_atomic_fetch_add(&item->peer->ka_idle, -1);
+
         ngx_http_upstream_keepalive_close(item->connection);
 
     } else {
@@ -414,6 +491,7 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     //缓存当前连接，将item插入cache队列，然后将pc->connection置空，防止上层调用
     //ngx_http_upstream_finalize_request关闭该连接（详见该函数）
     item->connection = c;
+    item->peer = peer;
 
     pc->connection = NULL;
 
@@ -425,6 +503,9 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
         ngx_del_timer(c->write, NGX_FUNC_LINE);
     }
 
+    /* 空闲超过keepalive_timeout由ngx_http_upstream_keepalive_close_handler关闭 */
+    ngx_add_timer(c->read, kp->conf->timeout, NGX_FUNC_LINE);
+
     
     //设置连接读写钩子。写钩子是一个假钩子（keepalive连接不会由客户端主动关闭）
     //读钩子处理关闭keepalive连接的操作（接收到来自后端web服务器的FIN分节）
@@ -446,6 +527,12 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
         ngx_http_upstream_keepalive_close_handler(c->read);
     }
 
+    goto invalid;
+
+release:
+
+    (void) ngx_atomic_fetch_add(&peer->ka_idle, -1);
+
 invalid:
 
     kp->original_free_peer(pc, kp->data, state); //指向原负载均衡算法对应的free
@@ -475,7 +562,7 @@ ngx_http_upstream_keepalive_close_handler(ngx_event_t *ev)
 
     c = ev->data;
 
-    if (c->close) {
+    if (c->close || c->read->timedout) {
         goto close;
     }
 
@@ -496,6 +583,8 @@ close:
     item = c->data;
     conf = item->conf;
 
+    (void) ngx_atomic_fetch_add(&item->peer->ka_idle, -1);
+
     ngx_http_upstream_keepalive_close(c);
 
     ngx_queue_remove(&item->queue);
@@ -566,8 +655,12 @@ ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf)
      *     conf->original_init_upstream = NULL;
      *     conf->original_init_peer = NULL;
      *     conf->max_cached = 0;
+     *     conf->per_server = 0;
      */
 
+    conf->requests = NGX_CONF_UNSET_UINT;
+    conf->timeout = NGX_CONF_UNSET_MSEC;
+
     return conf;
 }
 
@@ -580,6 +673,7 @@ ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     ngx_int_t    n;
     ngx_str_t   *value;
+    ngx_uint_t   i;
 
     if (kcf->max_cached) {
         return "is duplicate";
@@ -600,6 +694,24 @@ ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     kcf->max_cached = n;
 
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "per_server=", 11) == 0) {
+
+            n = ngx_atoi(value[i].data + 11, value[i].len - 11);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            kcf->per_server = n;
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
     uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
 
     /*
@@ -621,4 +733,11 @@ ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     uscf->peer.init_upstream = ngx_http_upstream_init_keepalive; //原始的负债均衡钩子保存在kcf->original_init_upstream
 
     return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
 }
@@ -10,30 +10,104 @@
 #include <ngx_http.h>
 
 
+/* 每个worker检查一遍各域名是否到了重新解析时间的间隔 */
+#define NGX_HTTP_UPSTREAM_RESOLVE_TICK   1000
+/* 解析失败后过多久再试，期间保留原来的地址 */
+#define NGX_HTTP_UPSTREAM_RESOLVE_RETRY  10000
+
+
+/* 每个worker为每个带resolve参数的server建立一个，记录正在进行的解析 */
+typedef struct {
+    ngx_http_upstream_srv_conf_t      *upstream;
+    ngx_uint_t                         index;  //在peers->resolve数组中的序号
+    ngx_resolver_ctx_t                *ctx;
+} ngx_http_upstream_zone_resolve_t;
+
+
+/* 每个worker为每个有resolve服务器的upstream建立一个，定时检查哪些域名需要重新解析 */
+typedef struct {
+    ngx_event_t                        event;
+    ngx_connection_t                   dumb;
+    ngx_http_upstream_srv_conf_t      *upstream;
+    ngx_http_upstream_zone_resolve_t  *resolve;
+} ngx_http_upstream_zone_timer_t;
+
+
 static char *ngx_http_upstream_zone(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static ngx_int_t ngx_http_upstream_init_zone(ngx_shm_zone_t *shm_zone,
     void *data);
 static ngx_int_t ngx_http_upstream_zone_copy_peers(ngx_slab_pool_t *shpool,
     ngx_http_upstream_srv_conf_t *uscf);
+static ngx_int_t ngx_http_upstream_zone_add_peer(
+    ngx_http_upstream_rr_peers_t *peers, ngx_addr_t *addr,
+    ngx_http_upstream_rr_peer_t *tmp, ngx_uint_t *id);
 
+static ngx_int_t ngx_http_upstream_zone_postconfiguration(ngx_conf_t *cf);
+static ngx_int_t ngx_http_upstream_zone_init_process(ngx_cycle_t *cycle);
+static void ngx_http_upstream_zone_resolve_timer_handler(ngx_event_t *ev);
+static void ngx_http_upstream_zone_resolve(ngx_http_upstream_zone_resolve_t *rs,
+    ngx_http_upstream_rr_resolve_t *e, ngx_log_t *log);
+static void ngx_http_upstream_zone_resolve_handler(ngx_resolver_ctx_t *ctx);
+
+static ngx_int_t ngx_http_upstream_conf_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_upstream_conf_add(ngx_http_request_t *r,
+    ngx_http_upstream_rr_peers_t *peers, ngx_uint_t *id);
+static ngx_int_t ngx_http_upstream_conf_modify(ngx_http_request_t *r,
+    ngx_http_upstream_rr_peers_t *peers, ngx_uint_t id);
+static ngx_int_t ngx_http_upstream_conf_params(ngx_http_request_t *r,
+    ngx_http_upstream_rr_peer_t *peer);
+static ngx_int_t ngx_http_upstream_conf_send(ngx_http_request_t *r,
+    ngx_http_upstream_rr_peers_t *peers, ngx_int_t id, ngx_uint_t status);
+static char *ngx_http_upstream_conf(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 
-static ngx_command_t  ngx_http_upstream_zone_commands[] = {
 
+static ngx_command_t  ngx_http_upstream_zone_commands[] = {
+/*
+zone name [size] [spare=number];
+spare为共享内存中预留的空位数，upstream_conf添加服务器时使用这些空位。空位以down、weight=0的服务器形式挂在
+peers->peer链表最后，所以链表长度和peers->number在运行中不会变化，各请求的tried位图和各负载均衡模块按序号
+建立的数组都不受影响
+*/
     { ngx_string("zone"),
-      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12,
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE123,
       ngx_http_upstream_zone,
       0,
       0,
       NULL },
 
+/*
+upstream_conf;
+上下文: location
+
+运行时修改配置了zone的upstream，修改对所有worker立即生效，不需要reload。参数都在URI中，列出服务器可以用GET，
+添加、删除和修改只接受POST，避免被预取、爬虫或跨站的GET请求触发:
+    ?upstream=name                            列出服务器，每行末尾注释中是id和当前连接数
+    ?upstream=name&add=&server=addr[&weight=n][&max_fails=n][&fail_timeout=time][&down=]
+                                              添加服务器，addr只能是IP地址加端口或者unix:路径，需要zone有空位
+    ?upstream=name&id=n&remove=               删除服务器，它的位置在连接数降为0后可以被复用
+    ?upstream=name&id=n[&weight=n][&max_fails=n][&fail_timeout=time][&down=][&up=][&drain=]
+                                              修改服务器，drain与down相同，都是不再分配新请求，已有连接照常完成，
+                                              可以观察conns降为0后再remove
+只修改非backup服务器。hash和ip_hash用total_weight对整个链表取模，运行时添加的服务器立即按权重分到请求，
+同时大部分key会换到别的服务器；hash consistent和maglev的表在配置时建立，不包含运行时添加的服务器，只有表中
+选中的服务器不可用、重试20次后退回轮询时才会用到它们
+*/
+    { ngx_string("upstream_conf"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_upstream_conf,
+      0,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
 
 static ngx_http_module_t  ngx_http_upstream_zone_module_ctx = {
     NULL,                                  /* preconfiguration */
-    NULL,                                  /* postconfiguration */
+    ngx_http_upstream_zone_postconfiguration, /* postconfiguration */
 
     NULL,                                  /* create main configuration */
     NULL,                                  /* init main configuration */
@@ -53,7 +127,7 @@ ngx_module_t  ngx_http_upstream_zone_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_upstream_zone_init_process,   /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -66,7 +140,9 @@ static char *
 ngx_http_upstream_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ssize_t                         size;
-    ngx_str_t                      *value;
+    ngx_int_t                       n;
+    ngx_str_t                      *value, s;
+    ngx_uint_t                      i;
     ngx_http_upstream_srv_conf_t   *uscf;
     ngx_http_upstream_main_conf_t  *umcf;
 
@@ -81,12 +157,38 @@ ngx_http_upstream_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
-    if (cf->args->nelts == 3) {
-        size = ngx_parse_size(&value[2]);
+    size = 0;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "spare=", 6) == 0) {
+            s.len = value[i].len - 6;
+            s.data = value[i].data + 6;
+
+            n = ngx_atoi(s.data, s.len);
+
+            if (n == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid parameter \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            uscf->spare = n;
+
+            continue;
+        }
+
+        if (i != 2) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        size = ngx_parse_size(&value[i]);
 
         if (size == NGX_ERROR) {
             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                               "invalid zone size \"%V\"", &value[2]);
+                               "invalid zone size \"%V\"", &value[i]);
             return NGX_CONF_ERROR;
         }
 
@@ -95,9 +197,6 @@ ngx_http_upstream_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
                                "zone \"%V\" is too small", &value[1]);
             return NGX_CONF_ERROR;
         }
-
-    } else {
-        size = 0;
     }
 
     uscf->shm_zone = ngx_shared_memory_add(cf, &value[1], size,
@@ -166,8 +265,11 @@ static ngx_int_t
 ngx_http_upstream_zone_copy_peers(ngx_slab_pool_t *shpool,
     ngx_http_upstream_srv_conf_t *uscf)
 {
-    ngx_http_upstream_rr_peer_t   *peer, **peerp;
-    ngx_http_upstream_rr_peers_t  *peers, *backup;
+    ngx_uint_t                       i, n;
+    ngx_http_upstream_server_t      *server;
+    ngx_http_upstream_rr_peer_t     *peer, **peerp;
+    ngx_http_upstream_rr_peers_t    *peers, *backup;
+    ngx_http_upstream_rr_resolve_t  *e;
 
     peers = ngx_slab_alloc(shpool, sizeof(ngx_http_upstream_rr_peers_t));
     if (peers == NULL) {
@@ -191,6 +293,63 @@ ngx_http_upstream_zone_copy_peers(ngx_slab_pool_t *shpool,
         *peerp = peer;
     }
 
+    /* 空位接在链表最后，weight为0表示没有使用 */
+
+    for (i = 0; i < uscf->spare; i++) {
+        peer = ngx_slab_calloc_locked(shpool,
+                                      sizeof(ngx_http_upstream_rr_peer_t));
+        if (peer == NULL) {
+            return NGX_ERROR;
+        }
+
+        peer->down = 1;
+
+        *peerp = peer;
+        peerp = &peer->next;
+    }
+
+    if (uscf->spare) {
+        peers->number += uscf->spare;
+        peers->single = 0;
+    }
+
+    /* 带resolve参数的server，运行中重新解析，见ngx_http_upstream_zone_resolve_handler */
+
+    server = uscf->servers->elts;
+
+    for (n = 0, i = 0; i < uscf->servers->nelts; i++) {
+        if (server[i].resolve) {
+            n++;
+        }
+    }
+
+    if (n) {
+        e = ngx_slab_calloc_locked(shpool,
+                                   n * sizeof(ngx_http_upstream_rr_resolve_t));
+        if (e == NULL) {
+            return NGX_ERROR;
+        }
+
+        peers->resolve = e;
+        peers->nresolve = n;
+
+        for (i = 0; i < uscf->servers->nelts; i++) {
+            if (!server[i].resolve) {
+                continue;
+            }
+
+            e->host = server[i].host;
+            e->port = server[i].port;
+            e->server = server[i].name;
+            e->weight = server[i].weight;
+            e->max_fails = server[i].max_fails;
+            e->fail_timeout = server[i].fail_timeout;
+            e->down = server[i].down ? NGX_HTTP_UPSTREAM_PEER_DOWN : 0;
+
+            e++;
+        }
+    }
+
     if (peers->next == NULL) {
         goto done;
     }
@@ -226,3 +385,898 @@ done:
     return NGX_OK;
 }
 
+
+
+static ngx_int_t
+ngx_http_upstream_conf_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                        rc, n;
+    ngx_str_t                        name, value;
+    ngx_uint_t                       i, id;
+    ngx_http_upstream_rr_peers_t    *peers;
+    ngx_http_upstream_srv_conf_t   **uscfp;
+    ngx_http_upstream_main_conf_t   *umcf;
+
+    if (r->method != NGX_HTTP_GET && r->method != NGX_HTTP_HEAD
+        && r->method != NGX_HTTP_POST)
+    {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    if (ngx_http_arg(r, (u_char *) "upstream", 8, &name) != NGX_OK) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+    uscfp = umcf->upstreams.elts;
+
+    peers = NULL;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        if (uscfp[i]->shm_zone
+            && uscfp[i]->host.len == name.len
+            && ngx_strncmp(uscfp[i]->host.data, name.data, name.len) == 0)
+        {
+            peers = uscfp[i]->peer.data;
+            break;
+        }
+    }
+
+    if (peers == NULL || peers->shpool == NULL) {
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    if (ngx_http_arg(r, (u_char *) "add", 3, &value) == NGX_OK) {
+
+        if (r->method != NGX_HTTP_POST) {
+            return NGX_HTTP_NOT_ALLOWED;
+        }
+
+        rc = ngx_http_upstream_conf_add(r, peers, &id);
+
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        return ngx_http_upstream_conf_send(r, peers, id, NGX_HTTP_OK);
+    }
+
+    if (ngx_http_arg(r, (u_char *) "id", 2, &value) == NGX_OK) {
+
+        if (r->method != NGX_HTTP_POST) {
+            return NGX_HTTP_NOT_ALLOWED;
+        }
+
+        n = ngx_atoi(value.data, value.len);
+
+        if (n == NGX_ERROR) {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+        rc = ngx_http_upstream_conf_modify(r, peers, n);
+
+        if (rc == NGX_DONE) {
+            /* 删除成功，没有内容需要输出 */
+            return ngx_http_upstream_conf_send(r, peers, -2,
+                                               NGX_HTTP_NO_CONTENT);
+        }
+
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        return ngx_http_upstream_conf_send(r, peers, n, NGX_HTTP_OK);
+    }
+
+    return ngx_http_upstream_conf_send(r, peers, -1, NGX_HTTP_OK);
+}
+
+
+/* 解析server参数，放到共享内存的空位中，返回它的序号 */
+static ngx_int_t
+ngx_http_upstream_conf_add(ngx_http_request_t *r,
+    ngx_http_upstream_rr_peers_t *peers, ngx_uint_t *id)
+{
+    ngx_int_t                     rc;
+    ngx_url_t                     u;
+    ngx_http_upstream_rr_peer_t   tmp;
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    if (ngx_http_arg(r, (u_char *) "server", 6, &u.url) != NGX_OK) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    u.default_port = 80;
+
+    /* 不在worker中同步解析域名 */
+    u.no_resolve = 1;
+
+    if (ngx_parse_url(r->pool, &u) != NGX_OK || u.naddrs != 1) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "upstream_conf: invalid server \"%V\"", &u.url);
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    ngx_memzero(&tmp, sizeof(ngx_http_upstream_rr_peer_t));
+
+    tmp.weight = 1;
+    tmp.max_fails = 1;
+    tmp.fail_timeout = 10;
+
+    if (ngx_http_upstream_conf_params(r, &tmp) != NGX_OK) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+    rc = ngx_http_upstream_zone_add_peer(peers, &u.addrs[0], &tmp, id);
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    if (rc == NGX_DECLINED) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "upstream_conf: no spare slot in upstream \"%V\"",
+                      peers->name);
+        return NGX_HTTP_CONFLICT;
+    }
+
+    if (rc != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                  "upstream_conf: added server %V to upstream \"%V\"",
+                  &u.addrs[0].name, peers->name);
+
+    return NGX_OK;
+}
+
+
+/*
+在peers->peer链表中找一个weight为0且没有连接的位置放入新服务器，参数取自tmp，返回它的序号。地址和名字分配在
+共享内存中，复用位置时释放原来动态分配的地址。调用者持有peers写锁，没有空位时返回NGX_DECLINED
+*/
+static ngx_int_t
+ngx_http_upstream_zone_add_peer(ngx_http_upstream_rr_peers_t *peers,
+    ngx_addr_t *addr, ngx_http_upstream_rr_peer_t *tmp, ngx_uint_t *id)
+{
+    u_char                       *p;
+    ngx_uint_t                    i;
+    ngx_slab_pool_t              *shpool;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+        if (peer->weight == 0 && peer->conns == 0) {
+            break;
+        }
+    }
+
+    if (peer == NULL) {
+        return NGX_DECLINED;
+    }
+
+    shpool = peers->shpool;
+
+    p = ngx_slab_alloc(shpool, addr->socklen + addr->name.len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    if ((u_char *) peer->sockaddr >= shpool->start
+        && (u_char *) peer->sockaddr < shpool->end)
+    {
+        ngx_slab_free(shpool, peer->sockaddr);
+    }
+
+#if (NGX_HTTP_SSL)
+    if (peer->ssl_session) {
+        ngx_slab_free(shpool, peer->ssl_session);
+        peer->ssl_session = NULL;
+        peer->ssl_session_len = 0;
+    }
+#endif
+
+    ngx_memcpy(p, addr->sockaddr, addr->socklen);
+
+    peer->sockaddr = (struct sockaddr *) p;
+    peer->socklen = addr->socklen;
+
+    p += addr->socklen;
+
+    ngx_memcpy(p, addr->name.data, addr->name.len);
+
+    peer->name.len = addr->name.len;
+    peer->name.data = p;
+    peer->server = tmp->server.len ? tmp->server : peer->name;
+
+    peer->weight = tmp->weight;
+    peer->effective_weight = tmp->weight;
+    peer->current_weight = 0;
+    peer->max_fails = tmp->max_fails;
+    peer->fail_timeout = tmp->fail_timeout;
+    peer->down = tmp->down;
+    peer->fails = 0;
+    peer->accessed = 0;
+    peer->checked = ngx_time();
+    peer->ewma = 0;
+    peer->ewma_stamp = 0;
+    peer->hc_next = 0;
+    peer->hc_fails = 0;
+    peer->hc_passes = 0;
+    peer->ka_requests = 0;
+    peer->ka_reused = 0;
+
+    peers->total_weight += peer->weight;
+
+    *id = i;
+
+    return NGX_OK;
+}
+
+
+/* 返回NGX_DONE表示服务器已删除 */
+static ngx_int_t
+ngx_http_upstream_conf_modify(ngx_http_request_t *r,
+    ngx_http_upstream_rr_peers_t *peers, ngx_uint_t id)
+{
+    ngx_str_t                     value;
+    ngx_uint_t                    i;
+    ngx_http_upstream_rr_peer_t  *peer, tmp;
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+    for (peer = peers->peer, i = 0; peer && i < id; peer = peer->next, i++) {
+        /* void */
+    }
+
+    if (peer == NULL || peer->weight == 0) {
+        ngx_http_upstream_rr_peers_unlock(peers);
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    if (ngx_http_arg(r, (u_char *) "remove", 6, &value) == NGX_OK) {
+
+        /* hash、ip_hash要用total_weight取模，不允许删除最后一台服务器 */
+
+        if (peers->total_weight == (ngx_uint_t) peer->weight) {
+            ngx_http_upstream_rr_peers_unlock(peers);
+            return NGX_HTTP_CONFLICT;
+        }
+
+        peers->total_weight -= peer->weight;
+
+        peer->weight = 0;
+        peer->effective_weight = 0;
+        peer->current_weight = 0;
+        peer->down = 1;
+
+        ngx_http_upstream_rr_peers_unlock(peers);
+
+        ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                      "upstream_conf: removed server %V from upstream \"%V\"",
+                      &peer->name, peers->name);
+
+        return NGX_DONE;
+    }
+
+    tmp = *peer;
+
+    if (ngx_http_upstream_conf_params(r, &tmp) != NGX_OK) {
+        ngx_http_upstream_rr_peers_unlock(peers);
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    if (tmp.weight != peer->weight) {
+        peers->total_weight += tmp.weight - peer->weight;
+
+        peer->weight = tmp.weight;
+        peer->effective_weight = tmp.weight;
+        peer->current_weight = 0;
+    }
+
+    peer->max_fails = tmp.max_fails;
+    peer->fail_timeout = tmp.fail_timeout;
+
+    if ((peer->down & NGX_HTTP_UPSTREAM_PEER_DOWN)
+        && !(tmp.down & NGX_HTTP_UPSTREAM_PEER_DOWN))
+    {
+        peer->fails = 0;
+        peer->checked = ngx_time();
+    }
+
+    peer->down = tmp.down;
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    return NGX_OK;
+}
+
+
+/* 从请求参数中取weight、max_fails、fail_timeout、down、up、drain，存到peer中 */
+static ngx_int_t
+ngx_http_upstream_conf_params(ngx_http_request_t *r,
+    ngx_http_upstream_rr_peer_t *peer)
+{
+    time_t     fail_timeout;
+    ngx_int_t  n;
+    ngx_str_t  value;
+
+    if (ngx_http_arg(r, (u_char *) "weight", 6, &value) == NGX_OK) {
+        n = ngx_atoi(value.data, value.len);
+
+        if (n == NGX_ERROR || n == 0) {
+            return NGX_ERROR;
+        }
+
+        peer->weight = n;
+    }
+
+    if (ngx_http_arg(r, (u_char *) "max_fails", 9, &value) == NGX_OK) {
+        n = ngx_atoi(value.data, value.len);
+
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        peer->max_fails = n;
+    }
+
+    if (ngx_http_arg(r, (u_char *) "fail_timeout", 12, &value) == NGX_OK) {
+        fail_timeout = ngx_parse_time(&value, 1);
+
+        if (fail_timeout == (time_t) NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        peer->fail_timeout = fail_timeout;
+    }
+
+    if (ngx_http_arg(r, (u_char *) "down", 4, &value) == NGX_OK
+        || ngx_http_arg(r, (u_char *) "drain", 5, &value) == NGX_OK)
+    {
+        peer->down |= NGX_HTTP_UPSTREAM_PEER_DOWN;
+    }
+
+    /* 只清除管理员设置的down，健康检查的结果由探测决定 */
+
+    if (ngx_http_arg(r, (u_char *) "up", 2, &value) == NGX_OK) {
+        peer->down &= ~NGX_HTTP_UPSTREAM_PEER_DOWN;
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+输出服务器列表，id为-1时输出全部，-2时不输出内容。格式与server指令相同:
+server 127.0.0.1:8080 weight=1 max_fails=1 fail_timeout=10s; # id=0 conns=0 idle=0 requests=0 reused=0
+idle、requests、reused是keepalive模块的统计，分别是所有worker缓存的空闲连接数、请求数和其中复用缓存连接的请求数
+*/
+static ngx_int_t
+ngx_http_upstream_conf_send(ngx_http_request_t *r,
+    ngx_http_upstream_rr_peers_t *peers, ngx_int_t id, ngx_uint_t status)
+{
+    size_t                        size;
+    ngx_int_t                     rc;
+    ngx_buf_t                    *b;
+    ngx_uint_t                    i;
+    ngx_chain_t                   out;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    r->headers_out.status = status;
+
+    if (id == -2) {
+        r->header_only = 1;
+        r->headers_out.content_length_n = 0;
+
+        return ngx_http_send_header(r);
+    }
+
+    r->headers_out.content_type_len = sizeof("text/plain") - 1;
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    r->headers_out.content_type_lowcase = NULL;
+
+    /* 链表长度在运行中不变，可以先算出最大长度 */
+
+    size = peers->number
+           * (sizeof("server  weight= max_fails= fail_timeout=s down;"
+                     " # id= conns= idle= requests= reused= unhealthy" CRLF)
+              - 1 + NGX_SOCKADDR_STRLEN + 5 * NGX_INT_T_LEN
+              + 3 * NGX_ATOMIC_T_LEN);
+
+    b = ngx_create_temp_buf(r->pool, size + 1);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+
+        if (peer->weight == 0 || (id >= 0 && (ngx_uint_t) id != i)) {
+            continue;
+        }
+
+        b->last = ngx_sprintf(b->last, "server %V weight=%i max_fails=%ui "
+                              "fail_timeout=%Ts%s; # id=%ui conns=%ui "
+                              "idle=%uA requests=%uA reused=%uA%s" CRLF,
+                              &peer->name, peer->weight, peer->max_fails,
+                              peer->fail_timeout,
+                              (peer->down & NGX_HTTP_UPSTREAM_PEER_DOWN)
+                                  ? " down" : "",
+                              i, peer->conns, peer->ka_idle,
+                              peer->ka_requests, peer->ka_reused,
+                              (peer->down & NGX_HTTP_UPSTREAM_PEER_UNHEALTHY)
+                                  ? " unhealthy" : "");
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    if (b->last == b->pos) {
+        r->header_only = 1;
+    }
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static char *
+ngx_http_upstream_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_upstream_conf_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+upstream backend {
+    zone backend 64k spare=8;
+    server backend.example.com:8080 resolve;
+}
+
+带resolve参数的server除了启动时解析外，运行中还会用http级的resolver按DNS应答的TTL(或resolver的valid参数)
+重新解析。新出现的地址放到zone的空位中，消失的地址像upstream_conf的remove一样删除，地址没变的服务器不受影响，
+已有的keepalive连接照常使用。需要配置zone和http级的resolver
+*/
+static ngx_int_t
+ngx_http_upstream_zone_postconfiguration(ngx_conf_t *cf)
+{
+    ngx_uint_t                       i, j;
+    ngx_http_core_loc_conf_t        *clcf;
+    ngx_http_upstream_server_t      *server;
+    ngx_http_upstream_srv_conf_t   **uscfp;
+    ngx_http_upstream_main_conf_t   *umcf;
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->servers == NULL) {
+            continue;
+        }
+
+        server = uscfp[i]->servers->elts;
+
+        for (j = 0; j < uscfp[i]->servers->nelts; j++) {
+            if (server[j].resolve) {
+                break;
+            }
+        }
+
+        if (j == uscfp[i]->servers->nelts) {
+            continue;
+        }
+
+        if (uscfp[i]->shm_zone == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "\"resolve\" requires \"zone\" in upstream \"%V\" "
+                          "in %s:%ui",
+                          &uscfp[i]->host, uscfp[i]->file_name,
+                          uscfp[i]->line);
+            return NGX_ERROR;
+        }
+
+        /* 没有配置http级resolver时这里是merge时创建的空resolver */
+
+        if (clcf->resolver == NULL
+            || clcf->resolver->udp_connections.nelts == 0)
+        {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "no resolver defined to resolve servers "
+                          "in upstream \"%V\" in %s:%ui",
+                          &uscfp[i]->host, uscfp[i]->file_name,
+                          uscfp[i]->line);
+            return NGX_ERROR;
+        }
+
+        uscfp[i]->resolver = clcf->resolver;
+        uscfp[i]->resolver_timeout =
+                             (clcf->resolver_timeout == NGX_CONF_UNSET_MSEC)
+                             ? 30000 : clcf->resolver_timeout;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_zone_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                       i, n;
+    ngx_http_upstream_rr_peers_t    *peers;
+    ngx_http_upstream_zone_timer_t  *zt;
+    ngx_http_upstream_srv_conf_t   **uscfp;
+    ngx_http_upstream_main_conf_t   *umcf;
+
+    /* cache manager和cache loader进程也会调用init process，它们不解析 */
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                               ngx_http_upstream_module);
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->shm_zone == NULL) {
+            continue;
+        }
+
+        peers = uscfp[i]->peer.data;
+
+        if (peers->nresolve == 0) {
+            continue;
+        }
+
+        zt = ngx_pcalloc(cycle->pool, sizeof(ngx_http_upstream_zone_timer_t));
+        if (zt == NULL) {
+            return NGX_ERROR;
+        }
+
+        zt->resolve = ngx_pcalloc(cycle->pool, peers->nresolve
+                                  * sizeof(ngx_http_upstream_zone_resolve_t));
+        if (zt->resolve == NULL) {
+            return NGX_ERROR;
+        }
+
+        for (n = 0; n < peers->nresolve; n++) {
+            zt->resolve[n].upstream = uscfp[i];
+            zt->resolve[n].index = n;
+        }
+
+        zt->upstream = uscfp[i];
+
+        zt->dumb.fd = (ngx_socket_t) -1;
+        zt->dumb.data = zt;
+
+        zt->event.handler = ngx_http_upstream_zone_resolve_timer_handler;
+        zt->event.data = &zt->dumb;
+        zt->event.log = cycle->log;
+        zt->event.cancelable = 1;
+
+        ngx_add_timer(&zt->event,
+                      ngx_random() % NGX_HTTP_UPSTREAM_RESOLVE_TICK + 1,
+                      NGX_FUNC_LINE);
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+对到了解析时间的域名，在peers写锁内把expire推后resolver_timeout加上重试间隔，谁先推后谁解析，
+解析成功后由ngx_http_upstream_zone_resolve_handler按TTL设置真正的下次解析时间
+*/
+static void
+ngx_http_upstream_zone_resolve_timer_handler(ngx_event_t *ev)
+{
+    ngx_uint_t                         i, claim;
+    ngx_connection_t                  *dumb;
+    ngx_http_upstream_rr_peers_t      *peers;
+    ngx_http_upstream_rr_resolve_t    *e;
+    ngx_http_upstream_zone_timer_t    *zt;
+    ngx_http_upstream_zone_resolve_t  *rs;
+
+    dumb = ev->data;
+    zt = dumb->data;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    peers = zt->upstream->peer.data;
+
+    for (i = 0; i < peers->nresolve; i++) {
+        rs = &zt->resolve[i];
+        e = &peers->resolve[i];
+
+        if (rs->ctx) {
+            continue;
+        }
+
+        claim = 0;
+
+        ngx_http_upstream_rr_peers_wlock(peers);
+
+        if ((ngx_msec_int_t) (ngx_current_msec - e->expire) >= 0) {
+            e->expire = ngx_current_msec + zt->upstream->resolver_timeout
+                        + NGX_HTTP_UPSTREAM_RESOLVE_RETRY;
+            claim = 1;
+        }
+
+        ngx_http_upstream_rr_peers_unlock(peers);
+
+        if (claim) {
+            ngx_http_upstream_zone_resolve(rs, e, ev->log);
+        }
+    }
+
+    ngx_add_timer(ev, NGX_HTTP_UPSTREAM_RESOLVE_TICK, NGX_FUNC_LINE);
+}
+
+
+static void
+ngx_http_upstream_zone_resolve(ngx_http_upstream_zone_resolve_t *rs,
+    ngx_http_upstream_rr_resolve_t *e, ngx_log_t *log)
+{
+    ngx_resolver_ctx_t  *ctx, temp;
+
+    temp.name = e->host;
+
+    ctx = ngx_resolve_start(rs->upstream->resolver, &temp);
+
+    if (ctx == NULL || ctx == NGX_NO_RESOLVER) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "could not start resolving \"%V\" in upstream \"%V\"",
+                      &e->host, &rs->upstream->host);
+        return;
+    }
+
+    ctx->name = e->host;
+    ctx->handler = ngx_http_upstream_zone_resolve_handler;
+    ctx->data = rs;
+    ctx->timeout = rs->upstream->resolver_timeout;
+
+    /* 命中resolver缓存时handler在ngx_resolve_name返回前就会被调用，并清除rs->ctx */
+
+    rs->ctx = ctx;
+
+    if (ngx_resolve_name(ctx) != NGX_OK) {
+        rs->ctx = NULL;
+
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "could not start resolving \"%V\" in upstream \"%V\"",
+                      &e->host, &rs->upstream->host);
+    }
+}
+
+
+/*
+先把新出现的地址放入空位，再删除已经消失的地址，这样total_weight不会降为0；地址没变的peer保持原位，
+它的连接数、失败计数和keepalive连接都不受影响
+*/
+static void
+ngx_http_upstream_zone_resolve_handler(ngx_resolver_ctx_t *ctx)
+{
+    u_char                            *p;
+    time_t                             valid;
+    ngx_int_t                          rc;
+    ngx_log_t                         *log;
+    ngx_uint_t                         i, id, *found;
+    ngx_pool_t                        *pool;
+    ngx_addr_t                        *addrs;
+    struct sockaddr                   *sa;
+    ngx_http_upstream_rr_peer_t       *peer, tmp;
+    ngx_http_upstream_rr_peers_t      *peers;
+    ngx_http_upstream_rr_resolve_t    *e;
+    ngx_http_upstream_srv_conf_t      *uscf;
+    ngx_http_upstream_zone_resolve_t  *rs;
+
+    rs = ctx->data;
+    uscf = rs->upstream;
+    peers = uscf->peer.data;
+    e = &peers->resolve[rs->index];
+    log = ngx_cycle->log;
+
+    rs->ctx = NULL;
+
+    if (ctx->state) {
+        /* 保留原来的地址，expire在认领时已经推后了重试间隔 */
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "upstream \"%V\": %V could not be resolved (%i: %s)",
+                      &uscf->host, &e->host, ctx->state,
+                      ngx_resolver_strerror(ctx->state));
+        goto done;
+    }
+
+    pool = ngx_create_pool(1024, log);
+    if (pool == NULL) {
+        goto done;
+    }
+
+    addrs = ngx_pcalloc(pool, ctx->naddrs * sizeof(ngx_addr_t));
+    found = ngx_pcalloc(pool, ctx->naddrs * sizeof(ngx_uint_t));
+
+    if (addrs == NULL || found == NULL) {
+        goto failed;
+    }
+
+    /* 解析结果中没有端口，按server指令中的端口补上，并生成"IP:端口"形式的名字 */
+
+    for (i = 0; i < ctx->naddrs; i++) {
+        sa = ngx_pcalloc(pool, NGX_SOCKADDRLEN);
+        p = ngx_pnalloc(pool, NGX_SOCKADDR_STRLEN);
+
+        if (sa == NULL || p == NULL) {
+            goto failed;
+        }
+
+        ngx_memcpy(sa, ctx->addrs[i].sockaddr, ctx->addrs[i].socklen);
+
+        switch (sa->sa_family) {
+
+#if (NGX_HAVE_INET6)
+        case AF_INET6:
+            ((struct sockaddr_in6 *) sa)->sin6_port = htons(e->port);
+            break;
+#endif
+
+        default: /* AF_INET */
+            ((struct sockaddr_in *) sa)->sin_port = htons(e->port);
+        }
+
+        addrs[i].sockaddr = sa;
+        addrs[i].socklen = ctx->addrs[i].socklen;
+        addrs[i].name.data = p;
+        addrs[i].name.len = ngx_sock_ntop(sa, addrs[i].socklen, p,
+                                          NGX_SOCKADDR_STRLEN, 1);
+    }
+
+    ngx_memzero(&tmp, sizeof(ngx_http_upstream_rr_peer_t));
+
+    tmp.server = e->server;
+    tmp.weight = e->weight;
+    tmp.max_fails = e->max_fails;
+    tmp.fail_timeout = e->fail_timeout;
+    tmp.down = e->down;
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+    /* 找出已经在使用的地址 */
+
+    for (peer = peers->peer; peer; peer = peer->next) {
+
+        if (peer->weight == 0
+            || peer->server.len != e->server.len
+            || ngx_strncmp(peer->server.data, e->server.data,
+                           e->server.len) != 0)
+        {
+            continue;
+        }
+
+        for (i = 0; i < ctx->naddrs; i++) {
+            if (ngx_cmp_sockaddr(peer->sockaddr, peer->socklen,
+                                 addrs[i].sockaddr, addrs[i].socklen, 1)
+                == NGX_OK)
+            {
+                found[i] = 1;
+                break;
+            }
+        }
+    }
+
+    /* 添加新地址 */
+
+    for (i = 0; i < ctx->naddrs; i++) {
+
+        if (found[i]) {
+            continue;
+        }
+
+        rc = ngx_http_upstream_zone_add_peer(peers, &addrs[i], &tmp, &id);
+
+        if (rc == NGX_DECLINED) {
+            ngx_log_error(NGX_LOG_WARN, log, 0,
+                          "upstream \"%V\": no spare slot for %V of %V",
+                          &uscf->host, &addrs[i].name, &e->server);
+            break;
+        }
+
+        if (rc != NGX_OK) {
+            break;
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                      "upstream \"%V\": added server %V of %V",
+                      &uscf->host, &addrs[i].name, &e->server);
+    }
+
+    /* 删除消失的地址，与upstream_conf的remove相同，位置在连接数降为0后可以复用 */
+
+    for (peer = peers->peer; peer; peer = peer->next) {
+
+        if (peer->weight == 0
+            || peer->server.len != e->server.len
+            || ngx_strncmp(peer->server.data, e->server.data,
+                           e->server.len) != 0)
+        {
+            continue;
+        }
+
+        for (i = 0; i < ctx->naddrs; i++) {
+            if (ngx_cmp_sockaddr(peer->sockaddr, peer->socklen,
+                                 addrs[i].sockaddr, addrs[i].socklen, 1)
+                == NGX_OK)
+            {
+                break;
+            }
+        }
+
+        if (i < ctx->naddrs
+            || peers->total_weight == (ngx_uint_t) peer->weight)
+        {
+            continue;
+        }
+
+        peers->total_weight -= peer->weight;
+
+        peer->weight = 0;
+        peer->effective_weight = 0;
+        peer->current_weight = 0;
+        peer->down = NGX_HTTP_UPSTREAM_PEER_DOWN;
+
+        ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                      "upstream \"%V\": removed server %V of %V",
+                      &uscf->host, &peer->name, &e->server);
+    }
+
+    valid = ctx->valid - ngx_time();
+
+    e->expire = ngx_current_msec + (ngx_msec_t) ngx_max(valid, 1) * 1000;
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+failed:
+
+    ngx_destroy_pool(pool);
+
+done:
+
+    ngx_resolve_name_done(ctx);
+}
@@ -142,6 +142,8 @@ ngx_int_t ngx_http_parse_chunked(ngx_http_request_t *r, ngx_buf_t *b,
 
 
 ngx_http_request_t *ngx_http_create_request(ngx_connection_t *c);
+ngx_http_request_t *ngx_http_alloc_request(ngx_connection_t *c,
+    ngx_pool_t *pool);
 ngx_int_t ngx_http_process_request_uri(ngx_http_request_t *r);
 ngx_int_t ngx_http_process_request_header(ngx_http_request_t *r);
 void ngx_http_process_request(ngx_http_request_t *r);
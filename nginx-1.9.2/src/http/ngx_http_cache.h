@@ -109,7 +109,9 @@ error_page 配置指令也对该响应码做了设定的情况下，该字段记
     unsigned                         updating:1; //客户端请求到nginx后，发现缓存过期，则会重新从后端获取数据，updating置1，见ngx_http_file_cache_read
     //参考ngx_http_file_cache_delete
     unsigned                         deleting:1;     /* 正在被清理中 */     //是否正在删除
-                                     /* 11 unused bits */
+    //从快照恢复、还没有在目录遍历中或被请求打开时确认文件存在，见ngx_http_file_cache_snapshot_prune
+    unsigned                         unverified:1;
+                                     /* 10 unused bits */
     //文件inode节点号，
     ngx_file_uniq_t                  uniq;//文件的uniq  赋值见ngx_http_file_cache_update
     //expires C 缓存节点的可回收时间 (附带缓存内容)。 
@@ -120,6 +122,25 @@ error_page 配置指令也对该响应码做了设定的情况下，该字段记
     ngx_msec_t                       lock_time;
 } ngx_http_file_cache_node_t;
 
+
+/*
+ * 内存层对象: proxy_cache_path ram_cache=配置后，不超过ram_max_object的整个缓存文件(头部+包体)
+ * 在磁盘命中时被复制到单独的共享内存中，之后的命中直接从内存发送，不再open/read缓存文件。
+ * 以缓存key查找，并用uniq(文件inode)校验内存副本与磁盘文件是同一个版本
+ */
+typedef struct {
+    ngx_rbtree_node_t                node;
+    ngx_queue_t                      queue; //LRU队列，头部为最近使用
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN
+                                         - sizeof(ngx_rbtree_key_t)];
+    unsigned                         count:20; //正在发送该对象的请求数
+    unsigned                         deleted:1; //已从红黑树摘除，最后一个引用释放时回收
+    ngx_file_uniq_t                  uniq;
+    size_t                           length; //data长度，也就是缓存文件大小
+    u_char                          *data; //紧跟在本结构后面
+} ngx_http_file_cache_ram_node_t;
+
+
 //参考: nginx proxy cache分析  http://blog.csdn.net/xiaolang85/article/details/38260041
 //参考:nginx proxy cache的实现原理 http://blog.itpub.net/15480802/viewspace-1421409/
 /*
@@ -265,6 +286,8 @@ body_start: [ngx_http_file_cache_header_t]["\nKEY: "][fastcgi_cache_key中的KEY
     //ngx_http_file_cache_node_t  最近获取到的(新创建或者遍历查询得到的)ngx_http_file_cache_node_t，见ngx_http_file_cache_exists
     //在获取后端数据前，首先会会查找缓存是否有缓存该请求数据，如果没有，则会在ngx_http_file_cache_open中创建node,然后继续去后端获取数据
     ngx_http_file_cache_node_t      *node; //ngx_http_file_cache_exists中创建空间和赋值
+    //命中内存层时指向共享内存中的对象，持有其引用直到请求池销毁，见ngx_http_file_cache_ram_open
+    ngx_http_file_cache_ram_node_t  *ram;
 
 #if (NGX_THREADS)
 //ngx_http_file_cache_aio_read->ngx_thread_read中创建空间和赋值
@@ -313,6 +336,8 @@ body_start: [ngx_http_file_cache_header_t]["\nKEY: "][fastcgi_cache_key中的KEY
     // 注意这是同一个客户端r请求，同一个客户端在获取后端数据的过程中(后端数据还没返回)，又发送一次get请求，注意只有aio才有该情况
     unsigned                         reading:1; 
     unsigned                         secondary:1;
+    //过期缓存已经发送给客户端，由后台子请求更新，updating在本请求结束时才清除，见ngx_http_upstream_cache
+    unsigned                         background:1;
 };
 
 /*
@@ -398,6 +423,29 @@ ngx_http_file_cache_node_t在ngx_http_file_cache_expire进行失效判断。
 
 /*所有的ngx_http_file_cache_node_t除了添加到上面的rbtree红黑树外，还会添加到队列queue中，红黑树用于按照key来查找对应的node节点，参考
     ngx_http_file_cache_lookup。queue用于快速获取最先添加到queue对了和最后添加queue对了的node节点用于删除跟新等，参考ngx_http_file_cache_expire*/
+typedef struct {
+    ngx_rbtree_t                     rbtree;
+    ngx_rbtree_node_t                sentinel;
+    ngx_queue_t                      queue;
+    size_t                           size; //已占用字节数，不超过ram_cache=
+} ngx_http_file_cache_ram_sh_t;
+
+
+#define NGX_HTTP_FILE_CACHE_SKETCH_DEPTH  4
+
+/*
+ * proxy_cache_path admission=tinylfu时keys_zone中的count-min sketch，记录每个key最近的访问频率(包括已经
+ * 被淘汰或者从未缓存过的key)。共NGX_HTTP_FILE_CACHE_SKETCH_DEPTH行，每行mask+1个4位计数器，一个字节存
+ * 两个计数器，第i行的下标取自key(MD5)的第i个32位字。累计sample次访问后所有计数器减半，使频率反映最近的访问
+ */
+typedef struct {
+    ngx_uint_t                       mask;
+    ngx_uint_t                       additions;
+    ngx_uint_t                       sample; //10 * (mask + 1)
+    u_char                          *table; //DEPTH * (mask + 1) / 2字节
+} ngx_http_file_cache_sketch_t;
+
+
 typedef struct { //用于保存缓存节点 和 缓存的当前状态 (是否正在从磁盘加载、当前缓存大小等)；
     //以ngx_http_cache_t->key字符串中的最前面4字节为key来在红黑树中变量，见ngx_http_file_cache_lookup
     ngx_rbtree_t                     rbtree; //红黑树初始化在ngx_http_file_cache_init
@@ -413,6 +461,8 @@ typedef struct { //用于保存缓存节点 和 缓存的当前状态 (是否正
     ngx_atomic_t                     loading;  /* 是否正在被 loader 进程加载 */ //正在load这个cache  loader进程pid，见ngx_http_file_cache_loader
     //缓存文件总大小，在文件老化删除后，size会减去删掉这部分大小，见ngx_http_file_cache_delete
     off_t                            size;    /* 初始化为 0 */ //占用了缓存空间的总大小，赋值见ngx_http_file_cache_update  
+    //admission=tinylfu时分配，见ngx_http_file_cache_sketch_init
+    ngx_http_file_cache_sketch_t    *sketch;
 } ngx_http_file_cache_sh_t; //注意ngx_http_file_cache_sh_t和ngx_open_file_cache_t的区别
 //缓存好文章参考:缓存服务器涉及与实现(一  到  五) http://blog.csdn.net/brainkick/article/details/8535242
 
@@ -470,6 +520,30 @@ proxy_cache_path(fastcgi_cache_path) /a/b的时候带有use_temp_path=off(表示
 
     //fastcgi_cache_path keys_zone=fcgi:10m;中的keys_zone=fcgi:10m指定共享内存名字已经共享内存空间大小
     ngx_shm_zone_t                  *shm_zone;
+
+    //proxy_cache_path带有ram_cache=size时创建的内存层，共享内存名为"ram:"+keys_zone名，见ngx_http_file_cache_ram_init
+    ngx_http_file_cache_ram_sh_t    *ram_sh;
+    ngx_slab_pool_t                 *ram_shpool;
+    size_t                           ram_size; //ram_cache=
+    size_t                           ram_max_object; //ram_max_object=，默认32k
+    ngx_shm_zone_t                  *ram_zone;
+
+    /*
+     * proxy_cache_path带有snapshot=time时，cache manager每隔time把keys_zone中的节点写入
+     * path/keys_zone.snapshot，loader启动时先从中恢复，见ngx_http_file_cache_snapshot_load
+     */
+    ngx_str_t                        snapshot;
+    ngx_str_t                        snapshot_temp; //先写入snapshot.tmp再rename
+    time_t                           snapshot_interval;
+    time_t                           snapshot_last; //cache manager进程中上次写入的时间
+    time_t                           snapshot_since; //loader进程中，mtime早于该时间的叶子目录不再遍历
+    uintptr_t                       *snapshot_dirs; //loader进程中，从快照恢复后重新遍历过的叶子目录的位图
+
+    /*
+     * proxy_cache_path带有admission=tinylfu时，磁盘接近max_size后，新对象只有在sketch估计的访问频率
+     * 高于LRU队尾待淘汰对象时才写入磁盘，避免只访问一次的对象把热点对象挤出缓存，见ngx_http_file_cache_admit
+     */
+    ngx_uint_t                       admission;
 };
 
 
@@ -4001,6 +4001,7 @@ ngx_http_subrequest(ngx_http_request_t *r,
        ·¢ËÍbody¸ødownsstreamÊ±ÓÃµ½ */  
     sr->subrequest_in_memory = (flags & NGX_HTTP_SUBREQUEST_IN_MEMORY) != 0;
     sr->waited = (flags & NGX_HTTP_SUBREQUEST_WAITED) != 0;
+    sr->background = (flags & NGX_HTTP_SUBREQUEST_BACKGROUND) != 0;
 
     sr->unparsed_uri = r->unparsed_uri;
     sr->method_name = ngx_http_core_get_method;
@@ -4037,7 +4038,7 @@ ngx_http_subrequest(ngx_http_request_t *r,
           ÏÂÃæµÄÕâ¸öifÖÐ×îÖÕc->dataÖ¸ÏòµÄÊÇsub11_r£¬Ò²¾ÍÊÇ×î×óÏÂ²ãµÄr
      */
     //×¢Òâ:ÔÚ´´½¨×ÓÇëÇóµÄ¹ý³ÌÖÐ²¢Ã»ÓÐ´´½¨ÐÂµÄngx_connection_t£¬Ò²¾ÍÊÇÊ¼ÖÕÓÃµÄrootÇëÇóµÄngx_connection_t
-    if (c->data == r && r->postponed == NULL) { //ËµÃ÷ÊÇr»¹Ã»ÓÐ×ÓÇëÇó£¬ÔÚ´´½¨rµÄµÚÒ»¸ö×ÓÇëÇó£¬ÀýÈçµÚ¶þ²ãrµÄµÚÒ»¸ö×ÓÇëÇó¾ÍÊÇµÚÈý²ãr
+    if (!sr->background && c->data == r && r->postponed == NULL) { //ËµÃ÷ÊÇr»¹Ã»ÓÐ×ÓÇëÇó£¬ÔÚ´´½¨rµÄµÚÒ»¸ö×ÓÇëÇó£¬ÀýÈçµÚ¶þ²ãrµÄµÚÒ»¸ö×ÓÇëÇó¾ÍÊÇµÚÈý²ãr
         c->data = sr;  /* ×îÖÕ¿Í»§¶ËÇëÇór->connection->dataÖ¸Ïò×îÏÂ²ã×ó±ßµÄ×ÓÇëÇó */
     } 
 
@@ -4056,6 +4057,10 @@ ngx_http_subrequest(ngx_http_request_t *r,
 
     sr->log_handler = r->log_handler;
 
+    if (sr->background) { //后台子请求没有输出，不需要参与postponed排序
+        goto post;
+    }
+
     pr = ngx_palloc(r->pool, sizeof(ngx_http_postponed_request_t));
     if (pr == NULL) {
         return NGX_ERROR;
@@ -4075,6 +4080,8 @@ ngx_http_subrequest(ngx_http_request_t *r,
         r->postponed = pr;
     }
 
+post:
+
     /* ÕâÀï¸³ÖµÎª1£¬ÐèÒª×ö´Ó¶¨Ïò */
     sr->internal = 1;
 
@@ -11,6 +11,41 @@
 #include <ngx_md5.h>
 
 
+/*
+ * keys_zone快照文件格式: [header][node][node]...，crc32覆盖所有node。
+ * fs_size以bsize为单位，因此bsize不同的快照不能使用
+ */
+
+#define NGX_HTTP_CACHE_SNAPSHOT_VERSION  1
+
+/* 每次加锁最多处理的节点数，避免长时间持有keys_zone锁 */
+#define NGX_HTTP_CACHE_SNAPSHOT_BATCH    512
+
+/* 快照写入时刚rename但还没有置exists的文件，靠这个余量在重新遍历目录时补上 */
+#define NGX_HTTP_CACHE_SNAPSHOT_SLACK    60
+
+
+typedef struct {
+    u_char                           magic[8];
+    ngx_uint_t                       version;
+    ngx_uint_t                       node_size;
+    ngx_uint_t                       count;
+    size_t                           bsize;
+    time_t                           time; //快照写入时间
+    uint32_t                         crc32;
+} ngx_http_file_cache_snapshot_header_t;
+
+
+typedef struct {
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
+    ngx_file_uniq_t                  uniq;
+    time_t                           valid_sec;
+    off_t                            fs_size;
+    size_t                           body_start;
+    ngx_uint_t                       uses;
+} ngx_http_file_cache_snapshot_node_t;
+
+
 static ngx_int_t ngx_http_file_cache_lock(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static void ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev);
@@ -62,6 +97,39 @@ static ngx_int_t ngx_http_file_cache_add(ngx_http_file_cache_t *cache,
     ngx_http_cache_t *c);
 static ngx_int_t ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
+static time_t ngx_http_file_cache_snapshot(ngx_http_file_cache_t *cache);
+static ngx_int_t ngx_http_file_cache_snapshot_write(
+    ngx_http_file_cache_t *cache);
+static ngx_http_file_cache_node_t *
+    ngx_http_file_cache_snapshot_next(ngx_http_file_cache_t *cache,
+    u_char *key);
+static ngx_int_t ngx_http_file_cache_snapshot_load(
+    ngx_http_file_cache_t *cache);
+static ngx_int_t ngx_http_file_cache_snapshot_dir(ngx_http_file_cache_t *cache,
+    u_char *key);
+static void ngx_http_file_cache_snapshot_prune(ngx_http_file_cache_t *cache);
+static ngx_int_t ngx_http_file_cache_ram_init(ngx_shm_zone_t *shm_zone,
+    void *data);
+static ngx_http_file_cache_ram_node_t *
+    ngx_http_file_cache_ram_lookup(ngx_http_file_cache_t *cache, u_char *key);
+static ngx_int_t ngx_http_file_cache_ram_open(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_ram_store(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_ram_delete(ngx_http_file_cache_t *cache,
+    u_char *key);
+static void ngx_http_file_cache_ram_unlink(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_ram_node_t *rn);
+static ngx_uint_t ngx_http_file_cache_ram_evict(ngx_http_file_cache_t *cache);
+static void ngx_http_file_cache_ram_cleanup(void *data);
+static ngx_int_t ngx_http_file_cache_sketch_init(ngx_shm_zone_t *shm_zone,
+    ngx_http_file_cache_t *cache);
+static ngx_uint_t ngx_http_file_cache_sketch_estimate(
+    ngx_http_file_cache_sketch_t *sk, u_char *key);
+static void ngx_http_file_cache_sketch_add(ngx_http_file_cache_sketch_t *sk,
+    u_char *key);
+static ngx_uint_t ngx_http_file_cache_admit(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c);
 
 
 ngx_str_t  ngx_http_cache_status[] = {
@@ -121,6 +189,10 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data) //ngx_init_cycle
             cache->path->loader = NULL;
         }
 
+        if (cache->admission && cache->sh->sketch == NULL) {
+            return ngx_http_file_cache_sketch_init(shm_zone, cache);
+        }
+
         return NGX_OK;
     }
 
@@ -148,6 +220,7 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data) //ngx_init_cycle
     cache->sh->cold = 1;
     cache->sh->loading = 0;
     cache->sh->size = 0;
+    cache->sh->sketch = NULL;
 
     cache->bsize = ngx_fs_bsize(cache->path->name.data);
 
@@ -165,6 +238,72 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data) //ngx_init_cycle
 
     cache->shpool->log_nomem = 0;
 
+    if (cache->admission) {
+        return ngx_http_file_cache_sketch_init(shm_zone, cache);
+    }
+
+    return NGX_OK;
+}
+
+
+//proxy_cache_path带有ram_cache=时，内存层共享内存"ram:xxx"的初始化，ngx_init_cycle中执行
+static ngx_int_t
+ngx_http_file_cache_ram_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_file_cache_t  *ocache = data;
+
+    size_t                  len;
+    ngx_http_file_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    if (ocache && ocache->ram_sh) { //reload时共享内存大小没变，继承旧的内存层对象
+        cache->ram_sh = ocache->ram_sh;
+        cache->ram_shpool = ocache->ram_shpool;
+
+        return NGX_OK;
+    }
+
+    cache->ram_shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->ram_sh = cache->ram_shpool->data;
+
+        return NGX_OK;
+    }
+
+    cache->ram_sh = ngx_slab_alloc(cache->ram_shpool,
+                                   sizeof(ngx_http_file_cache_ram_sh_t));
+    if (cache->ram_sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->ram_shpool->data = cache->ram_sh;
+
+    /*
+     * ngx_http_file_cache_ram_node_t和ngx_http_file_cache_node_t前面的node、queue、key布局相同，
+     * 因此可以直接复用ngx_http_file_cache_rbtree_insert_value
+     */
+    ngx_rbtree_init(&cache->ram_sh->rbtree, &cache->ram_sh->sentinel,
+                    ngx_http_file_cache_rbtree_insert_value);
+
+    ngx_queue_init(&cache->ram_sh->queue);
+
+    cache->ram_sh->size = 0;
+
+    len = sizeof(" in cache ram zone \"\"") + shm_zone->shm.name.len;
+
+    cache->ram_shpool->log_ctx = ngx_slab_alloc(cache->ram_shpool, len);
+    if (cache->ram_shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->ram_shpool->log_ctx, " in cache ram zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    /* 内存不足时会淘汰LRU对象后重试，不需要打印no memory */
+    cache->ram_shpool->log_nomem = 0;
+
     return NGX_OK;
 }
 
@@ -371,6 +510,18 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         goto done;
     }
 
+    if (cache->ram_sh && c->exists) {
+        rc = ngx_http_file_cache_ram_open(r, c);
+
+        if (rc == NGX_OK) { //内存层命中，头部和包体都从共享内存中获取，不用打开缓存文件
+            return ngx_http_file_cache_read(r, c);
+        }
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
     ngx_memzero(&of, sizeof(ngx_open_file_info_t));
@@ -623,10 +774,17 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
      头部部分在ngx_http_cache_send->ngx_http_send_header发送，
      缓存文件后面的包体部分在ngx_http_cache_send后半部代码中触发在filter模块中发送
      */
-    n = ngx_http_file_cache_aio_read(r, c);//读取缓存文件中的前面头部相关信息部分数据
+    if (c->ram) { //内存层命中，直接拷贝，后面的校验和磁盘读取完全一样
+        n = (c->length < (off_t) c->body_start) ? (ssize_t) c->length
+                                                 : (ssize_t) c->body_start;
+        ngx_memcpy(c->buf->pos, c->ram->data, n);
 
-    if (n < 0) {
-        return n;
+    } else {
+        n = ngx_http_file_cache_aio_read(r, c);//读取缓存文件中的前面头部相关信息部分数据
+
+        if (n < 0) {
+            return n;
+        }
     }
 
     //写缓冲区封装过程参考:ngx_http_upstream_process_header
@@ -707,6 +865,8 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
             cache->sh->size += c->fs_size;
         }
 
+        c->node->unverified = 0;
+
         ngx_shmtx_unlock(&cache->shpool->mutex);
     }
 
@@ -735,6 +895,14 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
         return rc;
     }
 
+    //磁盘命中且文件足够小，提升到内存层，后续命中不再读磁盘
+    if (c->ram == NULL
+        && cache->ram_sh
+        && c->length <= (off_t) cache->ram_max_object)
+    {
+        ngx_http_file_cache_ram_store(r, c);
+    }
+
     return NGX_OK;
 }
 
@@ -967,6 +1135,10 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
     fcn = c->node;//后面没找到则会创建node节点
    
     if (fcn == NULL) {
+        if (cache->admission && cache->sh->sketch) { //每个请求只计一次访问频率
+            ngx_http_file_cache_sketch_add(cache->sh->sketch, c->key);
+        }
+
         fcn = ngx_http_file_cache_lookup(cache, c->key); //以 c->key 为查找条件从缓存中查找缓存节点： 
     }
 
@@ -993,6 +1165,11 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 
         if (fcn->exists || fcn->uses >= c->min_uses) { //该请求的缓存已经存在，并且对该缓存的请求次数达到了最低要求次数min_uses
             //表示该缓存文件是否存在，Proxy_cache_min_uses 3，则第3次后开始获取后端数据，获取完毕后在ngx_http_file_cache_update中置1，但是只有在地4次请求的时候才会在ngx_http_file_cache_exists赋值为1
+            if (!fcn->exists && !ngx_http_file_cache_admit(cache, c)) {
+                rc = NGX_AGAIN; //频率不够，本次不写入缓存，按min_uses未达到处理
+                goto done;
+            }
+
             c->exists = fcn->exists;
             if (fcn->body_start) {
                 c->body_start = fcn->body_start;
@@ -1051,6 +1228,10 @@ renew:
     fcn->body_start = 0;
     fcn->fs_size = 0;
 
+    if (fcn->uses >= c->min_uses && !ngx_http_file_cache_admit(cache, c)) {
+        rc = NGX_AGAIN;
+    }
+
 done:
 
     fcn->expire = ngx_time() + cache->inactive;
@@ -1382,6 +1563,8 @@ ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     ngx_shmtx_unlock(&cache->shpool->mutex);
 
+    ngx_http_file_cache_ram_cleanup(c); //vary不匹配，释放主key对应的内存层对象引用
+
     c->secondary = 1;
     c->file.name.len = 0;
     c->body_start = c->buf->end - c->buf->start;
@@ -1605,11 +1788,16 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
 
     if (rc == NGX_OK) {
         c->node->exists = 1; //前面rename成功后，该缓存文件肯定就存在了，标识一下
+        c->node->unverified = 0;
     }
 
     c->node->updating = 0;
 
     ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (cache->ram_sh) { //缓存文件被替换，内存层中的旧副本失效
+        ngx_http_file_cache_ram_delete(cache, c->key);
+    }
 }
 
 
@@ -1628,6 +1816,10 @@ ngx_http_file_cache_update_header(ngx_http_request_t *r)
 
     c = r->cache;
 
+    if (c->file_cache->ram_sh) { //头部(valid_sec等)会被改写，内存层中的副本失效
+        ngx_http_file_cache_ram_delete(c->file_cache, c->key);
+    }
+
     ngx_memzero(&file, sizeof(ngx_file_t));
 
     file.name = c->file.name;
@@ -1786,11 +1978,13 @@ ngx_http_cache_send(ngx_http_request_t *r)
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
-    if (b->file == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    if (c->ram == NULL) {
+        b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+        if (b->file == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
     }
-    
+
 
     rc = ngx_http_send_header(r); //先把头部行发送出去
 
@@ -1800,17 +1994,25 @@ ngx_http_cache_send(ngx_http_request_t *r)
 
     //一下触发包体发送
 
-    b->file_pos = c->body_start; //指向网页包体部分内容
-    b->file_last = c->length; //包体末尾处，也就是文件尾部   
+    if (c->ram) { //内存层命中，包体直接指向共享内存，请求结束前一直持有该对象的引用
+        b->pos = c->ram->data + c->body_start;
+        b->last = c->ram->data + c->length;
+        b->memory = (c->length - c->body_start) ? 1: 0;
+
+    } else {
+        b->file_pos = c->body_start; //指向网页包体部分内容
+        b->file_last = c->length; //包体末尾处，也就是文件尾部   
+
+        b->in_file = (c->length - c->body_start) ? 1: 0;
+
+        b->file->fd = c->file.fd;
+        b->file->name = c->file.name;
+        b->file->log = r->connection->log;
+    }
 
-    b->in_file = (c->length - c->body_start) ? 1: 0;
     b->last_buf = (r == r->main) ? 1: 0;
     b->last_in_chain = 1;
 
-    b->file->fd = c->file.fd;
-    b->file->name = c->file.name;
-    b->file->log = r->connection->log;
-
     out.buf = b;
     out.next = NULL;
 
@@ -1818,665 +2020,1794 @@ ngx_http_cache_send(ngx_http_request_t *r)
 }
 
 
-void
-ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
+static ngx_http_file_cache_ram_node_t *
+ngx_http_file_cache_ram_lookup(ngx_http_file_cache_t *cache, u_char *key)
 {
-    ngx_http_file_cache_t       *cache;
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_int_t                        rc;
+    ngx_rbtree_key_t                 node_key;
+    ngx_rbtree_node_t               *node, *sentinel;
+    ngx_http_file_cache_ram_node_t  *rn;
 
-    if (c->updated || c->node == NULL) {
-        return;
-    }
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
 
-    cache = c->file_cache;
+    node = cache->ram_sh->rbtree.root;
+    sentinel = cache->ram_sh->rbtree.sentinel;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache free, fd: %d", c->file.fd);
+    while (node != sentinel) {
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+        if (node_key < node->key) {
+            node = node->left;
+            continue;
+        }
 
-    fcn = c->node;
-    fcn->count--;
+        if (node_key > node->key) {
+            node = node->right;
+            continue;
+        }
 
-    if (c->updating && fcn->lock_time == c->lock_time) {
-        fcn->updating = 0;
-    }
+        /* node_key == node->key */
 
-    if (c->error) {
-        fcn->error = c->error;
+        rn = (ngx_http_file_cache_ram_node_t *) node;
 
-        if (c->valid_sec) {
-            fcn->valid_sec = c->valid_sec;
-            fcn->valid_msec = c->valid_msec;
+        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], rn->key,
+                        NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        if (rc == 0) {
+            return rn;
         }
 
-    } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
-        ngx_queue_remove(&fcn->queue);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        c->node = NULL;
+        node = (rc < 0) ? node->left : node->right;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    /* not found */
 
-    c->updated = 1;
-    c->updating = 0;
+    return NULL;
+}
 
-    if (c->temp_file) {
-        if (tf && tf->file.fd != NGX_INVALID_FILE) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                           "http file cache incomplete: \"%s\"",
-                           tf->file.name.data);
 
-            if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
-                ngx_log_error(NGX_LOG_CRIT, c->file.log, ngx_errno,
-                              ngx_delete_file_n " \"%s\" failed",
-                              tf->file.name.data);
-            }
-        }
-    }
+/*
+ * 查找内存层对象，uniq必须和红黑树节点中记录的缓存文件一致。命中则增加引用计数，
+ * 并创建c->buf，之后由ngx_http_file_cache_read按磁盘命中一样的流程解析头部
+ */
+static ngx_int_t
+ngx_http_file_cache_ram_open(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_pool_cleanup_t              *cln;
+    ngx_http_file_cache_t           *cache;
+    ngx_http_file_cache_ram_node_t  *rn;
 
-    if (c->wait_event.timer_set) {
-        ngx_del_timer(&c->wait_event, NGX_FUNC_LINE);
+    cache = c->file_cache;
+
+    ngx_shmtx_lock(&cache->ram_shpool->mutex);
+
+    rn = ngx_http_file_cache_ram_lookup(cache, c->key);
+
+    if (rn == NULL || rn->uniq != c->uniq) {
+        ngx_shmtx_unlock(&cache->ram_shpool->mutex);
+        return NGX_DECLINED;
     }
-}
 
+    rn->count++;
 
-static void
-ngx_http_file_cache_cleanup(void *data)
-{
-    ngx_http_cache_t  *c = data;
+    ngx_queue_remove(&rn->queue);
+    ngx_queue_insert_head(&cache->ram_sh->queue, &rn->queue);
 
-    if (c->updated) {
-        return;
+    ngx_shmtx_unlock(&cache->ram_shpool->mutex);
+
+    c->ram = rn;
+
+    /* 只有命中时才需要cleanup释放引用，未命中不在请求池中留下空的cleanup */
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        ngx_http_file_cache_ram_cleanup(c);
+        return NGX_ERROR;
     }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache cleanup");
+    cln->handler = ngx_http_file_cache_ram_cleanup;
+    cln->data = c;
 
-    if (c->updating) {
-        ngx_log_error(NGX_LOG_ALERT, c->file.log, 0,
-                      "stalled cache updating, error:%ui", c->error);
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache ram hit: %uz", rn->length);
+
+    c->file.fd = NGX_INVALID_FILE;
+    c->file.log = r->connection->log;
+    c->length = rn->length;
+    c->fs_size = c->node->fs_size;
+
+    c->buf = ngx_create_temp_buf(r->pool, c->body_start);
+    if (c->buf == NULL) {
+        return NGX_ERROR;
     }
 
-    ngx_http_file_cache_free(c, NULL);
+    return NGX_OK;
 }
 
-/*
-ngx_http_file_cache_expire，一个是ngx_http_file_cache_forced_expire，他们有什么区别呢，主要区别是这样子，前一个只有过期的cache
-才会去尝试删除它(引用计数为0)，而后一个不管有没有过期，只要引用计数为0，就会去清理。来详细看这两个函数的实现。
-*/
-/*
-然后是ngx_http_file_cache_forced_expire，顾名思义，就是强制删除cache 节点，它的返回值也是wait time，它的遍历也是从后到前的。
-*/
 
 /*
-函数ngx_http_file_cache_forced_expire 从 inactive queue 队尾开始扫描，直到找到 
-可以被清理的当前未使用节点 ( fcn->count == 0 且不论它是否过期) 或者查找了20 个节点后仍未找到符合条件的节点。 
-*/
-//删除过期的缓存
-static time_t //这个一般是所有缓存文件大小超过最大限制了( xxx_cache_path  path max_size=size中的size),则调用该函数
-ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
+ * 把刚校验过的缓存文件整个读入内存层。先按大小预占ram_size预算，文件读取在锁外进行，
+ * 读完再插入红黑树；期间若其他进程已插入同一版本则丢弃本次副本。
+ * 这里的ngx_read_file是同步读，配置了aio on或aio threads的location不提升，免得阻塞worker
+ */
+static void
+ngx_http_file_cache_ram_store(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    u_char                      *name;
-    size_t                       len;
-    time_t                       wait;
-    ngx_uint_t                   tries;
-    ngx_path_t                  *path;
-    ngx_queue_t                 *q;
-    ngx_http_file_cache_node_t  *fcn;
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache forced expire");
+    size_t                           size;
+    ssize_t                          n;
+    ngx_uint_t                       tries;
+    ngx_http_file_cache_t           *cache;
+    ngx_http_core_loc_conf_t        *clcf;
+    ngx_http_file_cache_ram_node_t  *rn, *old;
 
-    path = cache->path;
-    
-    //len表示缓存文件对应的全路径名称的长度
-     /* 
-     全路径的名称形式为:proxy_cache_path+'/'+根据level生成的子路径+16进制表示的MD5码，path->name.len + 1 ：表示proxy_cache_path+'/'的
-     长度，path->len 表示根据 level生成的子路径的长度，2 * NGX_HTTP_CACHE_KEY_LEN 表示16进制表示的MD5码的长度，之所以是
-     2 * NGX_HTTP_CACHE_KEY_LEN 是因此MD5码是16个字节，一个字节是8位，而一个16进制数字只需要4位表示，因此MD5码所占的位数为     
-     16*8,转换成16进制的形式，所表示的字节的个数为16*8/2=16*2 = NGX_HTTP_CACHE_KEY_LEN * 2
-     */
-    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
-    name = ngx_alloc(len + 1, ngx_cycle->log);
-    if (name == NULL) {
-        return 10;
+    if (clcf->aio != NGX_HTTP_AIO_OFF) {
+        return;
     }
 
-    ngx_memcpy(name, path->name.data, path->name.len);
+    cache = c->file_cache;
 
-    wait = 10;
-    tries = 20; //删除节点尝试次数
+    size = sizeof(ngx_http_file_cache_ram_node_t) + (size_t) c->length;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    if (size > cache->ram_size) {
+        return;
+    }
 
-    for (q = ngx_queue_last(&cache->sh->queue);
-         q != ngx_queue_sentinel(&cache->sh->queue);
-         q = ngx_queue_prev(q))
-    {
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    ngx_shmtx_lock(&cache->ram_shpool->mutex);
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                  "http file cache forced expire: #%d %d %02xd%02xd%02xd%02xd",
-                  fcn->count, fcn->exists,
-                  fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+    old = ngx_http_file_cache_ram_lookup(cache, c->key);
 
-        if (fcn->count == 0) {
-            //如果引用计数为0则删除cache
-            ngx_http_file_cache_delete(cache, q, name);
-            wait = 0;
+    if (old) {
+        if (old->uniq == c->uniq) {
+            ngx_shmtx_unlock(&cache->ram_shpool->mutex);
+            return;
+        }
 
-        } else {
-            //否则尝试20次
-            if (--tries) {
-                continue;
-            }
+        ngx_http_file_cache_ram_unlink(cache, old);
+    }
 
-            wait = 1;
+    while (cache->ram_sh->size + size > cache->ram_size) {
+        if (ngx_http_file_cache_ram_evict(cache) == 0) {
+            ngx_shmtx_unlock(&cache->ram_shpool->mutex);
+            return;
         }
-
-        break;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    /* slab碎片可能导致预算内仍分配失败，继续淘汰几个对象后重试 */
 
-    ngx_free(name);
+    for (tries = 0; /* void */ ; tries++) {
+        rn = ngx_slab_alloc_locked(cache->ram_shpool, size);
 
-    return wait;
-}
+        if (rn || tries == 8 || ngx_http_file_cache_ram_evict(cache) == 0) {
+            break;
+        }
+    }
 
-//参考nginx proxy cache分析 http://blog.csdn.net/xiaolang85/article/details/38260041 图解
-/*
-ngx_http_file_cache_expire，一个是ngx_http_file_cache_forced_expire，他们有什么区别呢，主要区别是这样子，前一个只有过期的cache
-才会去尝试删除它(引用计数为0)，而后一个不管有没有过期，只要引用计数为0，就会去清理。来详细看这两个函数的实现。
-*/
+    if (rn == NULL) {
+        ngx_shmtx_unlock(&cache->ram_shpool->mutex);
+        return;
+    }
 
-/*
-首先是ngx_http_file_cache_expire，这里注意nginx使用了LRU，也就是队列最尾端保存的是最长时间没有被使用的，并且这个函数返回的就是
-一个wait值，这个值的计算不知道为什么nginx会设置为10ms，我觉得这个值设置为可调或许更好。
-*/
+    cache->ram_sh->size += size;
 
-/*
-缓存文件stat状态信息ngx_cached_open_file_s(ngx_open_file_cache_t->rbtree(expire_queue)的成员   )在ngx_expire_old_cached_files进行失效判断, 
-缓存文件内容信息(实实在在的文件信息)ngx_http_file_cache_node_t(ngx_http_file_cache_s->sh中的成员)在ngx_http_file_cache_expire进行失效判断。
-*/
+    ngx_shmtx_unlock(&cache->ram_shpool->mutex);
 
-//删除过期缓存 ngx_http_file_cache_expire 函数清除过期缓存条目 (删除其占用的共享内存 和对应的磁盘文件)。 
-static time_t //ngx_http_file_cache_expire和ngx_http_file_cache_add对应
-ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
-{ //最少返回值是10，也就是最短超时进行老化操作的时间是10s,即使限制缓存中有节点还有5s就过期了，但是我们还是在10s的时候进行清除
-//然如果最末尾的缓存文件正在被删除，则返回1
-    u_char                      *name, *p;
-    size_t                       len;
-    time_t                       now, wait;
-    ngx_path_t                  *path;
-    ngx_queue_t                 *q;
-    ngx_http_file_cache_node_t  *fcn;
-    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+    n = ngx_read_file(&c->file, (u_char *) (rn + 1), (size_t) c->length, 0);
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache expire");
+    ngx_shmtx_lock(&cache->ram_shpool->mutex);
 
-    path = cache->path;
-    
-    //len表示缓存文件对应的全路径名称的长度
-    
-    /* 
-        全路径的名称形式为:proxy_cache_path+'/'+根据level生成的子路径+16进制表示的MD5码，path->name.len + 1 ：表示
-        proxy_cache_path+'/'的长度，path->len 表示根据 level生成的子路径的长度，2 * NGX_HTTP_CACHE_KEY_LEN 表示16进制表示的
-        MD5码的长度，之所以是2 * NGX_HTTP_CACHE_KEY_LEN 是因此MD5码是16个字节，一个字节是8位，而一个16进制数字只需要4位表示，
-        因此MD5码所占的位数为16*8,转换成16进制的形式，所表示的字节的个数为16*8/2=16*2 = NGX_HTTP_CACHE_KEY_LEN * 2
-    */
-    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+    if (n != (ssize_t) c->length) {
+        goto failed;
+    }
 
-    name = ngx_alloc(len + 1, ngx_cycle->log);
-    if (name == NULL) {
-        return 10;
+    old = ngx_http_file_cache_ram_lookup(cache, c->key);
+
+    if (old) {
+        if (old->uniq == c->uniq) {
+            goto failed;
+        }
+
+        ngx_http_file_cache_ram_unlink(cache, old);
     }
 
-    ngx_memcpy(name, path->name.data, path->name.len);
+    ngx_memcpy((u_char *) &rn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(rn->key, &c->key[sizeof(ngx_rbtree_key_t)],
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-    now = ngx_time();
+    rn->count = 0;
+    rn->deleted = 0;
+    rn->uniq = c->uniq;
+    rn->length = (size_t) c->length;
+    rn->data = (u_char *) (rn + 1);
 
-    ngx_shmtx_lock(&cache->shpool->mutex); //必须加锁，多进程环境避免同时对共享内存操作
+    ngx_rbtree_insert(&cache->ram_sh->rbtree, &rn->node);
+    ngx_queue_insert_head(&cache->ram_sh->queue, &rn->queue);
 
-    for ( ;; ) {
+    ngx_shmtx_unlock(&cache->ram_shpool->mutex);
 
-        if (ngx_quit || ngx_terminate) {
-            wait = 1;
-            break;
-        }
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache ram store: %O, used: %uz",
+                   c->length, cache->ram_sh->size);
 
-        if (ngx_queue_empty(&cache->sh->queue)) {
-            //如果cache队列为空，则直接退出返回
-            wait = 10;//最少返回值是10，也就是最短超时进行老化操作的时间是10s,即使限制缓存中有节点还有5s就过期了，但是我们还是在10s的时候进行清除
-            break;
-        }
-        
-        //取得过期队列的最后一个节点
-        q = ngx_queue_last(&cache->sh->queue);
-        
-        //获得过期队列节点对应的ngx_http_file_cache_node_t节点的地址
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    return;
 
-        wait = fcn->expire - now;
-        
-        //表示当前的cache文件没有过期，则直接跳出循环，因为过期队列越是最新的就越靠前存放，最新的缓存存在队列头部
-        if (wait > 0) {
-            //如果没有超时，则退出循环
-            wait = wait > 10 ? 10 : wait;//最少返回值是10，也就是最短超时进行老化操作的时间是10s,即使限制缓存中有节点还有5s就过期了，但是我们还是在10s的时候进行清除
-            break;
-        }
+failed:
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache expire: #%d %d %02xd%02xd%02xd%02xd",
-                       fcn->count, fcn->exists,
-                       fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+    cache->ram_sh->size -= size;
+    ngx_slab_free_locked(cache->ram_shpool, rn);
 
-        if (fcn->count == 0) { 
-            //如果引用计数为0，则删除这个cache节点
-            //删除磁盘中缓存的文件
-            ngx_http_file_cache_delete(cache, q, name);
-            continue;
-        }
+    ngx_shmtx_unlock(&cache->ram_shpool->mutex);
+}
 
-        if (fcn->deleting) { //配合ngx_http_file_cache_delete阅读
-            //如果当前节点正在删除，则退出循环
-            wait = 1; //如果最末尾节点正在被删除，则返回1,1s后继续执行该函数
-            break;
-        }
 
-        
-        //将node中字符表示的MD5码，key转换为16进制表示的MD5码并将转换后的16进制表示形式存储在key中，方法执行完后
-        //返回转换后的字符串的最后一个字符
-        p = ngx_hex_dump(key, (u_char *) &fcn->node.key, 
-                         sizeof(ngx_rbtree_key_t)); //ngx_http_file_cache_expire和ngx_http_file_cache_add对应
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        
-        //将fcn->key转换成16进制表示的形式fcn->key中存储的是url的MD5码的后12个字符
-        (void) ngx_hex_dump(p, fcn->key, len);
-        
-        //通过上面的两部转换，就将URL的MD5吗转换成了16进制表示的形式并且存储在了key中
-        
-        /*
-         * abnormally exited workers may leave locked cache entries,
-         * and although it may be safe to remove them completely,
-         * we prefer to just move them to the top of the inactive queue
-         */
-        //将当前节点放入队列最前端,如果超时时间到，但是当前还有其他客户端在使用该缓存，则在把缓存时间延迟inactive， 
-        ngx_queue_remove(q);
-        fcn->expire = ngx_time() + cache->inactive;
-        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+static void
+ngx_http_file_cache_ram_delete(ngx_http_file_cache_t *cache, u_char *key)
+{
+    ngx_http_file_cache_ram_node_t  *rn;
 
-        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                      "ignore long locked inactive cache entry %*s, count:%d",
-                      2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
-    }
+    ngx_shmtx_lock(&cache->ram_shpool->mutex);
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    rn = ngx_http_file_cache_ram_lookup(cache, key);
 
-    ngx_free(name);
+    if (rn) {
+        ngx_http_file_cache_ram_unlink(cache, rn);
+    }
 
-    return wait;
+    ngx_shmtx_unlock(&cache->ram_shpool->mutex);
 }
 
-/*
-缓存文件清理过程均调用了ngx_http_file_cache_delete 函数，并且调用它的前提条 
-件是当前函数已经获得了cache->shpool->mutex 锁，同时，当前缓存节点的引用计数为0。
-*/
-//它主要有2个功能，一个是删除cache文件，一个是删除cache管理节点。
+
+/* 调用者持有ram_shpool锁。仍有请求在发送的对象只做标记，最后一个引用释放时回收 */
 static void
-ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
-    u_char *name)
+ngx_http_file_cache_ram_unlink(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_ram_node_t *rn)
 {
-    u_char                      *p;
-    size_t                       len;
-    ngx_path_t                  *path;
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_rbtree_delete(&cache->ram_sh->rbtree, &rn->node);
+    ngx_queue_remove(&rn->queue);
 
-    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    cache->ram_sh->size -= sizeof(ngx_http_file_cache_ram_node_t)
+                           + rn->length;
 
-    if (fcn->exists) {
-        cache->sh->size -= fcn->fs_size; //这块共享内存释放了，总共占用的共享内存也就少了这么多
+    if (rn->count) {
+        rn->deleted = 1;
+        return;
+    }
 
-        path = cache->path;
-        p = name + path->name.len + 1 + path->len;
-        p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        p = ngx_hex_dump(p, fcn->key, len);
-        *p = '\0';
+    ngx_slab_free_locked(cache->ram_shpool, rn);
+}
 
-        fcn->count++; //count 加 1 以避免其它进程再次尝试清理此节点 (当前代码中还不会有这种情况发生)。 
-        
-        fcn->deleting = 1; //deleting 标识此缓存节点正在被删除，其它函数或进程因视其为无效节点。 
-        
 
-        /*
-          由于文件删除操作 ( ngx_delete_file ) 可能发生阻塞，所以进行这个操作期间，函数将缓存锁先释放掉，以免其它进程因为等待这个锁而阻塞。 
-          */
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+/* 调用者持有ram_shpool锁。从LRU尾部淘汰一个没有被引用的对象，最多检查20个，返回是否淘汰成功 */
+static ngx_uint_t
+ngx_http_file_cache_ram_evict(ngx_http_file_cache_t *cache)
+{
+    ngx_uint_t                       tries;
+    ngx_queue_t                     *q;
+    ngx_http_file_cache_ram_node_t  *rn;
 
-        len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
-        ngx_create_hashed_filename(path, name, len);
+    tries = 20;
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache expire: \"%s\"", name);
+    for (q = ngx_queue_last(&cache->ram_sh->queue);
+         q != ngx_queue_sentinel(&cache->ram_sh->queue) && tries--;
+         q = ngx_queue_prev(q))
+    {
+        rn = ngx_queue_data(q, ngx_http_file_cache_ram_node_t, queue);
 
-        if (ngx_delete_file(name) == NGX_FILE_ERROR) {
-            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
-                          ngx_delete_file_n " \"%s\" failed", name);
+        if (rn->count == 0) {
+            ngx_http_file_cache_ram_unlink(cache, rn);
+            return 1;
         }
-
-        ngx_shmtx_lock(&cache->shpool->mutex);
-        fcn->count--;
-        fcn->deleting = 0;
     }
 
-    if (fcn->count == 0) {
-        ngx_queue_remove(q);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-    }
+    return 0;
 }
 
-/*
-在Nginx中，如果启用了proxy(fastcgi) cache功能，master process会在启动的时候启动管理缓存的两个子进程(区别于处理请求的子进程)来管理内
-存和磁盘的缓存个体。第一个进程的功能是定期检查缓存，并将过期的缓存删除；第二个进程的作用是在启动的时候将磁盘中已经缓存的个
-体映射到内存中(目前Nginx设定为启动以后60秒)，然后退出。
-
-具体的，在这两个进程的ngx_process_events_and_timers()函数中，会调用ngx_event_expire_timers()。Nginx的ngx_event_timer_rbtree(红黑树)里
-面按照执行的时间的先后存放着一系列的事件。每次取执行时间最早的事件，如果当前时间已经到了应该执行该事件，就会调用事件的handler。两个
-进程的handler分别是ngx_cache_manager_process_handler和ngx_cache_loader_process_handler
-*/
 
-//ngx_cache_manager_process_handler中执行
-static time_t //定时执行ngx_cache_manager_process_handler->ngx_http_file_cache_manager从而进行超时(通过定时器实现)清理操作
-ngx_http_file_cache_manager(void *data) //每次nginx退出的时候，例如kill nginx都会坚持缓存文件，如果过期，则会删除
+//请求池销毁时释放对内存层对象的引用，reopen时也会提前调用
+static void
+ngx_http_file_cache_ram_cleanup(void *data)
 {
-    ngx_http_file_cache_t  *cache = data;
-
-    off_t   size;
-    time_t  next, wait;
-
-    next = ngx_http_file_cache_expire(cache); //先删过期的缓存  
+    ngx_http_cache_t  *c = data;
 
-    cache->last = ngx_current_msec; //最后访问时间
-    cache->files = 0;
+    ngx_http_file_cache_t           *cache;
+    ngx_http_file_cache_ram_node_t  *rn;
 
-    for ( ;; ) {
-        ngx_shmtx_lock(&cache->shpool->mutex);
-        
-        //获取更新的缓存空间的大小  
-        size = cache->sh->size; //获取删除过期缓存后的缓存队列的大小
+    rn = c->ram;
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+    if (rn == NULL) {
+        return;
+    }
 
-        //killall -9 nginx的时候打印是:http file cache size: 16, max_size:0 所以后面会把所有缓存清楚
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache size: %O, max_size:%O", size, cache->max_size);
+    c->ram = NULL;
 
-        //检查缓存磁盘目录是否超过设定大小限制  超过了proxy_cache_path xxx_cache_path  path max_size=size
-        if (size < cache->max_size) { //如果空间在指定范围内，不用再删了。return  
-            return next;
-        }
+    cache = c->file_cache;
 
-       /*
-        如果超限，调用函数ngx_http_file_cache_forced_expire 从 inactive queue 队尾开始扫描，直到找到 
-        可以被清理的当前未使用节点 ( fcn->count == 0 且不论它是否过期) 或者查找了20 个节点后仍未找到符合条件的节点。 
-        */
-        
-        //如果size超过磁盘的使用空间，即size >= cache->max_size 强制把部分缓存删除，以保证缓存使用的空间在指定范围内   
-        wait = ngx_http_file_cache_forced_expire(cache);
+    ngx_shmtx_lock(&cache->ram_shpool->mutex);
 
-        if (wait > 0) { //休息一下以后继续删
-            return wait;
-        }
+    rn->count--;
 
-        if (ngx_quit || ngx_terminate) {
-            return next;
-        }
+    if (rn->count == 0 && rn->deleted) {
+        ngx_slab_free_locked(cache->ram_shpool, rn);
     }
+
+    ngx_shmtx_unlock(&cache->ram_shpool->mutex);
 }
 
 
 /*
-在nginx启动1分钟之后，会启动一个名为cache loader process的进程，该进程运行了一段时间之后，该进程就会结束消失。
+ * admission=tinylfu: sketch的宽度按keys_zone最多能容纳的节点数估算(每个节点在slab中占128字节)，取2的幂，
+ * 4行4位计数器一共占用宽度的2倍字节，即keys_zone的1/64到1/32
+ */
+static ngx_int_t
+ngx_http_file_cache_sketch_init(ngx_shm_zone_t *shm_zone,
+    ngx_http_file_cache_t *cache)
+{
+    size_t                         size;
+    ngx_uint_t                     width;
+    ngx_http_file_cache_sketch_t  *sk;
 
-在该进程运行期间主要做了以下事情：遍历配置文件中proxy_cache_path命令指定的路径中的所有的缓存文件，并且针对遍历到的各个缓存文件
-的MD5编码先遍历红黑树和相应的ngx_http_file_cache_node_t节点，如果不存在就创建新的ngx_http_file_cache_node_t，并将该对象中的rbnode
-和queue分别插入到红黑树和过期队列；如果存在，则更新相应的属性。
-*/
-//ngx_cache_loader_process_handler->ngx_http_file_cache_loader
-static void
-ngx_http_file_cache_loader(void *data)
+    width = 1024;
+
+    while (width < shm_zone->shm.size / 128) {
+        width <<= 1;
+    }
+
+    size = NGX_HTTP_FILE_CACHE_SKETCH_DEPTH * width / 2;
+
+    sk = ngx_slab_alloc(cache->shpool, sizeof(ngx_http_file_cache_sketch_t));
+    if (sk == NULL) {
+        return NGX_ERROR;
+    }
+
+    sk->table = ngx_slab_alloc(cache->shpool, size);
+    if (sk->table == NULL) {
+        ngx_slab_free(cache->shpool, sk);
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(sk->table, size);
+
+    sk->mask = width - 1;
+    sk->additions = 0;
+    sk->sample = 10 * width;
+
+    cache->sh->sketch = sk;
+
+    return NGX_OK;
+}
+
+
+//key在sketch中的估计频率，即4行对应计数器中的最小值，调用者持有shpool锁
+static ngx_uint_t
+ngx_http_file_cache_sketch_estimate(ngx_http_file_cache_sketch_t *sk,
+    u_char *key)
 {
-    ngx_http_file_cache_t  *cache = data;
+    uint32_t    h;
+    ngx_uint_t  i, idx, v, min;
 
-    ngx_tree_ctx_t  tree;
+    min = 0xf;
 
-    if (!cache->sh->cold || cache->sh->loading) {//表示已经被加载完毕
+    for (i = 0; i < NGX_HTTP_FILE_CACHE_SKETCH_DEPTH; i++) {
+        ngx_memcpy(&h, key + i * sizeof(uint32_t), sizeof(uint32_t));
+
+        idx = i * (sk->mask + 1) + (h & sk->mask);
+        v = (sk->table[idx >> 1] >> ((idx & 1) << 2)) & 0xf;
+
+        if (v < min) {
+            min = v;
+        }
+    }
+
+    return min;
+}
+
+
+/*
+ * 记录一次访问: 只增加4行中等于最小值的计数器(conservative update)，计数器到15后不再增加。
+ * 累计sample次后所有计数器减半，旧的访问频率逐渐衰减
+ */
+static void
+ngx_http_file_cache_sketch_add(ngx_http_file_cache_sketch_t *sk, u_char *key)
+{
+    u_char      *p;
+    uint32_t     h;
+    ngx_uint_t   i, n, idx[NGX_HTTP_FILE_CACHE_SKETCH_DEPTH], shift, min;
+
+    min = ngx_http_file_cache_sketch_estimate(sk, key);
+
+    if (min < 0xf) {
+        for (i = 0; i < NGX_HTTP_FILE_CACHE_SKETCH_DEPTH; i++) {
+            ngx_memcpy(&h, key + i * sizeof(uint32_t), sizeof(uint32_t));
+
+            idx[i] = i * (sk->mask + 1) + (h & sk->mask);
+            shift = (idx[i] & 1) << 2;
+            p = &sk->table[idx[i] >> 1];
+
+            if (((*p >> shift) & 0xf) == min) {
+                *p += (u_char) (1 << shift);
+            }
+        }
+    }
+
+    if (++sk->additions < sk->sample) {
         return;
     }
 
-    if (!ngx_atomic_cmp_set(&cache->sh->loading, 0, ngx_pid)) {
+    p = sk->table;
+    n = NGX_HTTP_FILE_CACHE_SKETCH_DEPTH * (sk->mask + 1) / 2;
+
+    for (i = 0; i < n; i++) {
+        p[i] = (p[i] >> 1) & 0x77;
+    }
+
+    sk->additions /= 2;
+}
+
+
+/*
+ * 磁盘快满时决定是否把新对象写入缓存: 从LRU队尾找到cache manager接下来会淘汰的节点(和
+ * ngx_http_file_cache_forced_expire一样跳过正在使用的节点)，只有新对象的估计频率更高时才接纳。
+ * 磁盘还有空间时不会淘汰任何对象，直接接纳。调用者持有shpool锁，c->node不在队列中
+ */
+static ngx_uint_t
+ngx_http_file_cache_admit(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+{
+    u_char                         key[NGX_HTTP_CACHE_KEY_LEN];
+    ngx_uint_t                     tries, freq, victim;
+    ngx_queue_t                   *q;
+    ngx_http_file_cache_node_t    *fcn;
+    ngx_http_file_cache_sketch_t  *sk;
+
+    sk = cache->sh->sketch;
+
+    if (!cache->admission || sk == NULL) {
+        return 1;
+    }
+
+    if (cache->sh->size < cache->max_size - cache->max_size / 16) {
+        return 1;
+    }
+
+    tries = 20;
+
+    for (q = ngx_queue_last(&cache->sh->queue);
+         q != ngx_queue_sentinel(&cache->sh->queue) && tries;
+         q = ngx_queue_prev(q), tries--)
+    {
+        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        if (fcn->count || !fcn->exists || fcn->deleting) {
+            continue;
+        }
+
+        ngx_memcpy(key, &fcn->node.key, sizeof(ngx_rbtree_key_t));
+        ngx_memcpy(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        freq = ngx_http_file_cache_sketch_estimate(sk, c->key);
+        victim = ngx_http_file_cache_sketch_estimate(sk, key);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache admission: %ui victim: %ui",
+                       freq, victim);
+
+        return freq > victim;
+    }
+
+    return 1;
+}
+
+
+void
+ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
+{
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_node_t  *fcn;
+
+    if (c->updated || c->node == NULL) {
+        return;
+    }
+
+    cache = c->file_cache;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache free, fd: %d", c->file.fd);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    fcn = c->node;
+    fcn->count--;
+
+    if (c->updating && fcn->lock_time == c->lock_time) {
+        fcn->updating = 0;
+    }
+
+    if (c->error) {
+        fcn->error = c->error;
+
+        if (c->valid_sec) {
+            fcn->valid_sec = c->valid_sec;
+            fcn->valid_msec = c->valid_msec;
+        }
+
+    } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
+        ngx_queue_remove(&fcn->queue);
+        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
+        ngx_slab_free_locked(cache->shpool, fcn);
+        c->node = NULL;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    c->updated = 1;
+    c->updating = 0;
+
+    if (c->temp_file) {
+        if (tf && tf->file.fd != NGX_INVALID_FILE) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                           "http file cache incomplete: \"%s\"",
+                           tf->file.name.data);
+
+            if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
+                ngx_log_error(NGX_LOG_CRIT, c->file.log, ngx_errno,
+                              ngx_delete_file_n " \"%s\" failed",
+                              tf->file.name.data);
+            }
+        }
+    }
+
+    if (c->wait_event.timer_set) {
+        ngx_del_timer(&c->wait_event, NGX_FUNC_LINE);
+    }
+}
+
+
+static void
+ngx_http_file_cache_cleanup(void *data)
+{
+    ngx_http_cache_t  *c = data;
+
+    if (c->updated) {
         return;
     }
 
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache cleanup");
+
+    if (c->updating && !c->background) {
+        ngx_log_error(NGX_LOG_ALERT, c->file.log, 0,
+                      "stalled cache updating, error:%ui", c->error);
+    }
+
+    ngx_http_file_cache_free(c, NULL);
+}
+
+/*
+ngx_http_file_cache_expire，一个是ngx_http_file_cache_forced_expire，他们有什么区别呢，主要区别是这样子，前一个只有过期的cache
+才会去尝试删除它(引用计数为0)，而后一个不管有没有过期，只要引用计数为0，就会去清理。来详细看这两个函数的实现。
+*/
+/*
+然后是ngx_http_file_cache_forced_expire，顾名思义，就是强制删除cache 节点，它的返回值也是wait time，它的遍历也是从后到前的。
+*/
+
+/*
+函数ngx_http_file_cache_forced_expire 从 inactive queue 队尾开始扫描，直到找到 
+可以被清理的当前未使用节点 ( fcn->count == 0 且不论它是否过期) 或者查找了20 个节点后仍未找到符合条件的节点。 
+*/
+//删除过期的缓存
+static time_t //这个一般是所有缓存文件大小超过最大限制了( xxx_cache_path  path max_size=size中的size),则调用该函数
+ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
+{
+    u_char                      *name;
+    size_t                       len;
+    time_t                       wait;
+    ngx_uint_t                   tries;
+    ngx_path_t                  *path;
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_node_t  *fcn;
+
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache loader");
+                   "http file cache forced expire");
 
-    tree.init_handler = NULL;
-    tree.file_handler = ngx_http_file_cache_manage_file;
-    tree.pre_tree_handler = ngx_http_file_cache_manage_directory;
-    tree.post_tree_handler = ngx_http_file_cache_noop;
-    tree.spec_handler = ngx_http_file_cache_delete_file;
-    //上述的注册方法都会在ngx_walk_tree方法中进行调用
+    path = cache->path;
     
-    tree.data = cache; //回调数据就是cache
-    tree.alloc = 0;
-    tree.log = ngx_cycle->log;
+    //len表示缓存文件对应的全路径名称的长度
+     /* 
+     全路径的名称形式为:proxy_cache_path+'/'+根据level生成的子路径+16进制表示的MD5码，path->name.len + 1 ：表示proxy_cache_path+'/'的
+     长度，path->len 表示根据 level生成的子路径的长度，2 * NGX_HTTP_CACHE_KEY_LEN 表示16进制表示的MD5码的长度，之所以是
+     2 * NGX_HTTP_CACHE_KEY_LEN 是因此MD5码是16个字节，一个字节是8位，而一个16进制数字只需要4位表示，因此MD5码所占的位数为     
+     16*8,转换成16进制的形式，所表示的字节的个数为16*8/2=16*2 = NGX_HTTP_CACHE_KEY_LEN * 2
+     */
+    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
 
-    cache->last = ngx_current_msec; //last为最后load时间
-    cache->files = 0;
+    name = ngx_alloc(len + 1, ngx_cycle->log);
+    if (name == NULL) {
+        return 10;
+    }
 
-    if (ngx_walk_tree(&tree, &cache->path->name) == NGX_ABORT) { //开始遍历
-        cache->sh->loading = 0;
-        return;
+    ngx_memcpy(name, path->name.data, path->name.len);
+
+    wait = 10;
+    tries = 20; //删除节点尝试次数
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    for (q = ngx_queue_last(&cache->sh->queue);
+         q != ngx_queue_sentinel(&cache->sh->queue);
+         q = ngx_queue_prev(q))
+    {
+        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                  "http file cache forced expire: #%d %d %02xd%02xd%02xd%02xd",
+                  fcn->count, fcn->exists,
+                  fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+
+        if (fcn->count == 0) {
+            //如果引用计数为0则删除cache
+            ngx_http_file_cache_delete(cache, q, name);
+            wait = 0;
+
+        } else {
+            //否则尝试20次
+            if (--tries) {
+                continue;
+            }
+
+            wait = 1;
+        }
+
+        break;
     }
 
-    cache->sh->cold = 0;
-    cache->sh->loading = 0;
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 
-    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
-                  "http file cache: %V %.3fM, bsize: %uz",
-                  &cache->path->name,
-                  ((double) cache->sh->size * cache->bsize) / (1024 * 1024),
-                  cache->bsize);
+    ngx_free(name);
+
+    return wait;
 }
 
+//参考nginx proxy cache分析 http://blog.csdn.net/xiaolang85/article/details/38260041 图解
+/*
+ngx_http_file_cache_expire，一个是ngx_http_file_cache_forced_expire，他们有什么区别呢，主要区别是这样子，前一个只有过期的cache
+才会去尝试删除它(引用计数为0)，而后一个不管有没有过期，只要引用计数为0，就会去清理。来详细看这两个函数的实现。
+*/
+
+/*
+首先是ngx_http_file_cache_expire，这里注意nginx使用了LRU，也就是队列最尾端保存的是最长时间没有被使用的，并且这个函数返回的就是
+一个wait值，这个值的计算不知道为什么nginx会设置为10ms，我觉得这个值设置为可调或许更好。
+*/
+
+/*
+缓存文件stat状态信息ngx_cached_open_file_s(ngx_open_file_cache_t->rbtree(expire_queue)的成员   )在ngx_expire_old_cached_files进行失效判断, 
+缓存文件内容信息(实实在在的文件信息)ngx_http_file_cache_node_t(ngx_http_file_cache_s->sh中的成员)在ngx_http_file_cache_expire进行失效判断。
+*/
+
+//删除过期缓存 ngx_http_file_cache_expire 函数清除过期缓存条目 (删除其占用的共享内存 和对应的磁盘文件)。 
+static time_t //ngx_http_file_cache_expire和ngx_http_file_cache_add对应
+ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
+{ //最少返回值是10，也就是最短超时进行老化操作的时间是10s,即使限制缓存中有节点还有5s就过期了，但是我们还是在10s的时候进行清除
+//然如果最末尾的缓存文件正在被删除，则返回1
+    u_char                      *name, *p;
+    size_t                       len;
+    time_t                       now, wait;
+    ngx_path_t                  *path;
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_node_t  *fcn;
+    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache expire");
+
+    path = cache->path;
+    
+    //len表示缓存文件对应的全路径名称的长度
+    
+    /* 
+        全路径的名称形式为:proxy_cache_path+'/'+根据level生成的子路径+16进制表示的MD5码，path->name.len + 1 ：表示
+        proxy_cache_path+'/'的长度，path->len 表示根据 level生成的子路径的长度，2 * NGX_HTTP_CACHE_KEY_LEN 表示16进制表示的
+        MD5码的长度，之所以是2 * NGX_HTTP_CACHE_KEY_LEN 是因此MD5码是16个字节，一个字节是8位，而一个16进制数字只需要4位表示，
+        因此MD5码所占的位数为16*8,转换成16进制的形式，所表示的字节的个数为16*8/2=16*2 = NGX_HTTP_CACHE_KEY_LEN * 2
+    */
+    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+
+    name = ngx_alloc(len + 1, ngx_cycle->log);
+    if (name == NULL) {
+        return 10;
+    }
+
+    ngx_memcpy(name, path->name.data, path->name.len);
+
+    now = ngx_time();
+
+    ngx_shmtx_lock(&cache->shpool->mutex); //必须加锁，多进程环境避免同时对共享内存操作
+
+    for ( ;; ) {
+
+        if (ngx_quit || ngx_terminate) {
+            wait = 1;
+            break;
+        }
+
+        if (ngx_queue_empty(&cache->sh->queue)) {
+            //如果cache队列为空，则直接退出返回
+            wait = 10;//最少返回值是10，也就是最短超时进行老化操作的时间是10s,即使限制缓存中有节点还有5s就过期了，但是我们还是在10s的时候进行清除
+            break;
+        }
+        
+        //取得过期队列的最后一个节点
+        q = ngx_queue_last(&cache->sh->queue);
+        
+        //获得过期队列节点对应的ngx_http_file_cache_node_t节点的地址
+        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        wait = fcn->expire - now;
+        
+        //表示当前的cache文件没有过期，则直接跳出循环，因为过期队列越是最新的就越靠前存放，最新的缓存存在队列头部
+        if (wait > 0) {
+            //如果没有超时，则退出循环
+            wait = wait > 10 ? 10 : wait;//最少返回值是10，也就是最短超时进行老化操作的时间是10s,即使限制缓存中有节点还有5s就过期了，但是我们还是在10s的时候进行清除
+            break;
+        }
+
+        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache expire: #%d %d %02xd%02xd%02xd%02xd",
+                       fcn->count, fcn->exists,
+                       fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+
+        if (fcn->count == 0) { 
+            //如果引用计数为0，则删除这个cache节点
+            //删除磁盘中缓存的文件
+            ngx_http_file_cache_delete(cache, q, name);
+            continue;
+        }
+
+        if (fcn->deleting) { //配合ngx_http_file_cache_delete阅读
+            //如果当前节点正在删除，则退出循环
+            wait = 1; //如果最末尾节点正在被删除，则返回1,1s后继续执行该函数
+            break;
+        }
+
+        
+        //将node中字符表示的MD5码，key转换为16进制表示的MD5码并将转换后的16进制表示形式存储在key中，方法执行完后
+        //返回转换后的字符串的最后一个字符
+        p = ngx_hex_dump(key, (u_char *) &fcn->node.key, 
+                         sizeof(ngx_rbtree_key_t)); //ngx_http_file_cache_expire和ngx_http_file_cache_add对应
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        
+        //将fcn->key转换成16进制表示的形式fcn->key中存储的是url的MD5码的后12个字符
+        (void) ngx_hex_dump(p, fcn->key, len);
+        
+        //通过上面的两部转换，就将URL的MD5吗转换成了16进制表示的形式并且存储在了key中
+        
+        /*
+         * abnormally exited workers may leave locked cache entries,
+         * and although it may be safe to remove them completely,
+         * we prefer to just move them to the top of the inactive queue
+         */
+        //将当前节点放入队列最前端,如果超时时间到，但是当前还有其他客户端在使用该缓存，则在把缓存时间延迟inactive， 
+        ngx_queue_remove(q);
+        fcn->expire = ngx_time() + cache->inactive;
+        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "ignore long locked inactive cache entry %*s, count:%d",
+                      2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_free(name);
+
+    return wait;
+}
+
+/*
+缓存文件清理过程均调用了ngx_http_file_cache_delete 函数，并且调用它的前提条 
+件是当前函数已经获得了cache->shpool->mutex 锁，同时，当前缓存节点的引用计数为0。
+*/
+//它主要有2个功能，一个是删除cache文件，一个是删除cache管理节点。
+static void
+ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
+    u_char *name)
+{
+    u_char                      *p;
+    size_t                       len;
+    ngx_path_t                  *path;
+    ngx_http_file_cache_node_t  *fcn;
+
+    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+    if (fcn->exists) {
+        cache->sh->size -= fcn->fs_size; //这块共享内存释放了，总共占用的共享内存也就少了这么多
+
+        path = cache->path;
+        p = name + path->name.len + 1 + path->len;
+        p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        p = ngx_hex_dump(p, fcn->key, len);
+        *p = '\0';
+
+        fcn->count++; //count 加 1 以避免其它进程再次尝试清理此节点 (当前代码中还不会有这种情况发生)。 
+        
+        fcn->deleting = 1; //deleting 标识此缓存节点正在被删除，其它函数或进程因视其为无效节点。 
+        
+
+        /*
+          由于文件删除操作 ( ngx_delete_file ) 可能发生阻塞，所以进行这个操作期间，函数将缓存锁先释放掉，以免其它进程因为等待这个锁而阻塞。 
+          */
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+        ngx_create_hashed_filename(path, name, len);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache expire: \"%s\"", name);
+
+        if (ngx_delete_file(name) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed", name);
+        }
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+        fcn->count--;
+        fcn->deleting = 0;
+    }
+
+    if (fcn->count == 0) {
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
+        ngx_slab_free_locked(cache->shpool, fcn);
+    }
+}
+
+/*
+在Nginx中，如果启用了proxy(fastcgi) cache功能，master process会在启动的时候启动管理缓存的两个子进程(区别于处理请求的子进程)来管理内
+存和磁盘的缓存个体。第一个进程的功能是定期检查缓存，并将过期的缓存删除；第二个进程的作用是在启动的时候将磁盘中已经缓存的个
+体映射到内存中(目前Nginx设定为启动以后60秒)，然后退出。
+
+具体的，在这两个进程的ngx_process_events_and_timers()函数中，会调用ngx_event_expire_timers()。Nginx的ngx_event_timer_rbtree(红黑树)里
+面按照执行的时间的先后存放着一系列的事件。每次取执行时间最早的事件，如果当前时间已经到了应该执行该事件，就会调用事件的handler。两个
+进程的handler分别是ngx_cache_manager_process_handler和ngx_cache_loader_process_handler
+*/
+
+//ngx_cache_manager_process_handler中执行
+static time_t //定时执行ngx_cache_manager_process_handler->ngx_http_file_cache_manager从而进行超时(通过定时器实现)清理操作
+ngx_http_file_cache_manager(void *data) //每次nginx退出的时候，例如kill nginx都会坚持缓存文件，如果过期，则会删除
+{
+    ngx_http_file_cache_t  *cache = data;
+
+    off_t   size;
+    time_t  next, wait;
+
+    next = ngx_http_file_cache_expire(cache); //先删过期的缓存  
+
+    if (cache->snapshot.len) {
+        wait = ngx_http_file_cache_snapshot(cache);
+
+        if (wait < next) {
+            next = wait;
+        }
+    }
+
+    cache->last = ngx_current_msec; //最后访问时间
+    cache->files = 0;
+
+    for ( ;; ) {
+        ngx_shmtx_lock(&cache->shpool->mutex);
+        
+        //获取更新的缓存空间的大小  
+        size = cache->sh->size; //获取删除过期缓存后的缓存队列的大小
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        //killall -9 nginx的时候打印是:http file cache size: 16, max_size:0 所以后面会把所有缓存清楚
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache size: %O, max_size:%O", size, cache->max_size);
+
+        //检查缓存磁盘目录是否超过设定大小限制  超过了proxy_cache_path xxx_cache_path  path max_size=size
+        if (size < cache->max_size) { //如果空间在指定范围内，不用再删了。return  
+            return next;
+        }
+
+       /*
+        如果超限，调用函数ngx_http_file_cache_forced_expire 从 inactive queue 队尾开始扫描，直到找到 
+        可以被清理的当前未使用节点 ( fcn->count == 0 且不论它是否过期) 或者查找了20 个节点后仍未找到符合条件的节点。 
+        */
+        
+        //如果size超过磁盘的使用空间，即size >= cache->max_size 强制把部分缓存删除，以保证缓存使用的空间在指定范围内   
+        wait = ngx_http_file_cache_forced_expire(cache);
+
+        if (wait > 0) { //休息一下以后继续删
+            return wait;
+        }
+
+        if (ngx_quit || ngx_terminate) {
+            return next;
+        }
+    }
+}
+
+
+/*
+在nginx启动1分钟之后，会启动一个名为cache loader process的进程，该进程运行了一段时间之后，该进程就会结束消失。
+
+在该进程运行期间主要做了以下事情：遍历配置文件中proxy_cache_path命令指定的路径中的所有的缓存文件，并且针对遍历到的各个缓存文件
+的MD5编码先遍历红黑树和相应的ngx_http_file_cache_node_t节点，如果不存在就创建新的ngx_http_file_cache_node_t，并将该对象中的rbnode
+和queue分别插入到红黑树和过期队列；如果存在，则更新相应的属性。
+*/
+//ngx_cache_loader_process_handler->ngx_http_file_cache_loader
+static void
+ngx_http_file_cache_loader(void *data)
+{
+    ngx_http_file_cache_t  *cache = data;
+
+    ngx_tree_ctx_t  tree;
+
+    if (!cache->sh->cold || cache->sh->loading) {//表示已经被加载完毕
+        return;
+    }
+
+    if (!ngx_atomic_cmp_set(&cache->sh->loading, 0, ngx_pid)) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache loader");
+
+    tree.init_handler = NULL;
+    tree.file_handler = ngx_http_file_cache_manage_file;
+    tree.pre_tree_handler = ngx_http_file_cache_manage_directory;
+    tree.post_tree_handler = ngx_http_file_cache_noop;
+    tree.spec_handler = ngx_http_file_cache_delete_file;
+    //上述的注册方法都会在ngx_walk_tree方法中进行调用
+    
+    tree.data = cache; //回调数据就是cache
+    tree.alloc = 0;
+    tree.log = ngx_cycle->log;
+
+    cache->last = ngx_current_msec; //last为最后load时间
+    cache->files = 0;
+
+    /*
+     * 先从快照恢复节点，随后的目录遍历只进入快照之后有变化的叶子目录，
+     * 见ngx_http_file_cache_manage_directory
+     */
+    cache->snapshot_since = 0;
+    cache->snapshot_dirs = NULL;
+
+    if (cache->snapshot.len) {
+        (void) ngx_http_file_cache_snapshot_load(cache);
+    }
+
+    if (ngx_walk_tree(&tree, &cache->path->name) == NGX_ABORT) { //开始遍历
+        cache->sh->loading = 0;
+
+        if (cache->snapshot_dirs) {
+            ngx_free(cache->snapshot_dirs);
+        }
+
+        return;
+    }
+
+    if (cache->snapshot_dirs) {
+        /* 在cold清零之前删除，快照中的失效节点不会再被写入下一个快照 */
+        ngx_http_file_cache_snapshot_prune(cache);
+        ngx_free(cache->snapshot_dirs);
+    }
+
+    cache->sh->cold = 0;
+    cache->sh->loading = 0;
+
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "http file cache: %V %.3fM, bsize: %uz",
+                  &cache->path->name,
+                  ((double) cache->sh->size * cache->bsize) / (1024 * 1024),
+                  cache->bsize);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    return NGX_OK;
+}
+
+//ngx_http_file_cache_manage_file 将缓存文件信息存入缓存中。 
+static ngx_int_t
+ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_msec_t              elapsed;
+    ngx_http_file_cache_t  *cache;
+
+    cache = ctx->data;
+
+    if (cache->snapshot.len
+        && path->len >= cache->snapshot.len
+        && ngx_strncmp(path->data, cache->snapshot.data, cache->snapshot.len)
+           == 0)
+    { //快照文件和写快照用的临时文件不是缓存文件
+        return NGX_OK;
+    }
+
+    if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
+        //将文件添加进cache
+        (void) ngx_http_file_cache_delete_file(ctx, path);
+    }
+
+   /* 
+        根据配置控制缓存的读取速度 ( loader_files 和 loader_threshold )，以便在缓存文件很多的情况下降低初次启动时对系统资源的消耗。 
+    */
+    if (++cache->files >= cache->loader_files) {
+        //如果文件个数太大，则休眠并清理files计数
+        ngx_http_file_cache_loader_sleep(cache);
+
+    } else {
+        ngx_time_update();
+        //否则看loader时间是不是过长，如果过长则又进入休眠
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache loader time elapsed: %M", elapsed);
+
+      /* 
+        根据配置控制缓存的读取速度 ( loader_files 和 loader_threshold )，以便在缓存文件很多的情况下降低初次启动时对系统资源的消耗。 
+        */
+        if (elapsed >= cache->loader_threshold) {
+            ngx_http_file_cache_loader_sleep(cache);
+        }
+    }
+
+    return (ngx_quit || ngx_terminate) ? NGX_ABORT : NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_int_t               n;
+    ngx_http_file_cache_t  *cache;
+
+    if (path->len >= 5
+        && ngx_strncmp(path->data + path->len - 5, "/temp", 5) == 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    cache = ctx->data;
+
+    /*
+     * 缓存文件的创建、替换、删除都会更新所在叶子目录的mtime，快照之前就没有
+     * 变化的叶子目录中的文件都已经从快照中恢复了
+     */
+    if (cache->snapshot_since
+        && path->len == cache->path->name.len + cache->path->len)
+    {
+        if (ctx->mtime < cache->snapshot_since) {
+            return NGX_DECLINED;
+        }
+
+        /* 记下这个叶子目录，遍历结束后删除其中文件已经不存在的快照节点 */
+
+        n = ngx_http_file_cache_snapshot_dir(cache,
+                                             path->data + cache->path->name.len);
+
+        if (n != NGX_ERROR) {
+            cache->snapshot_dirs[n / (8 * sizeof(uintptr_t))]
+                |= (uintptr_t) 1 << (n % (8 * sizeof(uintptr_t)));
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache)
+{
+    ngx_msleep(cache->loader_sleep);
+
+    ngx_time_update();
+
+    cache->last = ngx_current_msec;
+    cache->files = 0;
+}
+
+/*
+ngx_http_file_cache_add_file，它主要是通过文件名计算hash，然后调用ngx_http_file_cache_add将这个文件加入到cache管理中(也就是添加红黑树以及队列),
+*/
+static ngx_int_t
+ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
+{
+    u_char                 *p;
+    ngx_int_t               n;
+    ngx_uint_t              i;
+    ngx_http_cache_t        c;
+    ngx_http_file_cache_t  *cache;
+
+    if (name->len < 2 * NGX_HTTP_CACHE_KEY_LEN) {
+        return NGX_ERROR;
+    }
+
+    if (ctx->size < (off_t) sizeof(ngx_http_file_cache_header_t)) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, 0,
+                      "cache file \"%s\" is too small", name->data);
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(&c, sizeof(ngx_http_cache_t));
+    cache = ctx->data;
+
+    c.length = ctx->size;
+    c.fs_size = (ctx->fs_size + cache->bsize - 1) / cache->bsize;
+
+    p = &name->data[name->len - 2 * NGX_HTTP_CACHE_KEY_LEN];
+
+    for (i = 0; i < NGX_HTTP_CACHE_KEY_LEN; i++) {
+        n = ngx_hextoi(p, 2);
+
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        p += 2;
+
+        c.key[i] = (u_char) n;
+    }
+
+    return ngx_http_file_cache_add(cache, &c);
+}
+
+//ngx_http_file_cache_add 函数将此节点加入 ngx_http_file_cache_sh_t 类型的缓存管理机制中。 
+
+//按照c->key在红黑树中查找，没有就创建node节点，然后把节点添加到红黑树cache->sh->rbtree和cache->sh->queue队列头
+static ngx_int_t //ngx_http_file_cache_expire和ngx_http_file_cache_add对应
+ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+{
+    ngx_http_file_cache_node_t  *fcn;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    fcn = ngx_http_file_cache_lookup(cache, c->key);//首先查找
+
+    if (fcn == NULL) {
+        //如果不存在，则新建结构
+        fcn = ngx_slab_calloc_locked(cache->shpool,
+                                     sizeof(ngx_http_file_cache_node_t));
+        if (fcn == NULL) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+
+        ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
+                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node); //插入红黑树
+
+        fcn->uses = 1;
+        fcn->exists = 1;
+        fcn->fs_size = c->fs_size;
+
+        cache->sh->size += c->fs_size;
+
+    } else {
+        //否则删除queue，后续会重新插入
+        ngx_queue_remove(&fcn->queue);
+        fcn->unverified = 0;
+    }
+
+    fcn->expire = ngx_time() + cache->inactive;
+
+    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue); //重新插入
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                   "http file cache delete: \"%s\"", path->data);
+
+    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", path->data);
+    }
+
+    return NGX_OK;
+}
+
+//ngx_http_file_cache_manager中执行，到期则写快照，返回距离下次写快照的秒数
+static time_t
+ngx_http_file_cache_snapshot(ngx_http_file_cache_t *cache)
+{
+    time_t  now;
+
+    if (cache->sh->cold) { //loader还没有加载完，这时的keys_zone是不完整的
+        return cache->snapshot_interval;
+    }
+
+    now = ngx_time();
+
+    if (now < cache->snapshot_last + cache->snapshot_interval) {
+        return cache->snapshot_last + cache->snapshot_interval - now;
+    }
+
+    cache->snapshot_last = now;
+
+    (void) ngx_http_file_cache_snapshot_write(cache);
+
+    return cache->snapshot_interval;
+}
+
+
+/*
+ * 按key的顺序分批遍历红黑树，每批只在持锁期间拷贝节点信息，写文件在锁外进行。
+ * 只记录已经有缓存文件的节点
+ */
+static ngx_int_t
+ngx_http_file_cache_snapshot_write(ngx_http_file_cache_t *cache)
+{
+    off_t                                   offset;
+    time_t                                  now;
+    ssize_t                                 n;
+    ngx_uint_t                              i, visited, count, done;
+    ngx_file_t                              file;
+    ngx_http_file_cache_node_t             *fcn;
+    ngx_http_file_cache_snapshot_node_t    *sn, *nodes;
+    ngx_http_file_cache_snapshot_header_t   h;
+    u_char                                  key[NGX_HTTP_CACHE_KEY_LEN];
+
+    nodes = ngx_alloc(NGX_HTTP_CACHE_SNAPSHOT_BATCH
+                      * sizeof(ngx_http_file_cache_snapshot_node_t),
+                      ngx_cycle->log);
+    if (nodes == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = cache->snapshot_temp;
+    file.log = ngx_cycle->log;
+
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_WRONLY,
+                            NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", file.name.data);
+        ngx_free(nodes);
+        return NGX_ERROR;
+    }
+
+    now = ngx_time();
+
+    ngx_memzero(&h, sizeof(ngx_http_file_cache_snapshot_header_t));
+    ngx_crc32_init(h.crc32);
+
+    offset = sizeof(ngx_http_file_cache_snapshot_header_t);
+    count = 0;
+    done = 0;
+    fcn = NULL;
+
+    while (!done) {
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        /*
+         * 每次持锁最多访问BATCH个节点，跳过的节点(还没写完或正在删除)也计数，
+         * 否则大量这样的节点会让一次持锁遍历整棵树
+         */
+
+        i = 0;
+
+        for (visited = 0; visited < NGX_HTTP_CACHE_SNAPSHOT_BATCH; visited++) {
+
+            fcn = ngx_http_file_cache_snapshot_next(cache, fcn ? key : NULL);
+
+            if (fcn == NULL) {
+                done = 1;
+                break;
+            }
+
+            ngx_memcpy(key, &fcn->node.key, sizeof(ngx_rbtree_key_t));
+            ngx_memcpy(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                       NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+            if (!fcn->exists || fcn->deleting) {
+                continue;
+            }
+
+            sn = &nodes[i++];
+
+            ngx_memzero(sn, sizeof(ngx_http_file_cache_snapshot_node_t));
+
+            ngx_memcpy(sn->key, key, NGX_HTTP_CACHE_KEY_LEN);
+            sn->uniq = fcn->uniq;
+            sn->valid_sec = fcn->valid_sec;
+            sn->fs_size = fcn->fs_size;
+            sn->body_start = fcn->body_start;
+            sn->uses = fcn->uses;
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        if (i == 0) {
+            continue;
+        }
+
+        n = ngx_write_file(&file, (u_char *) nodes,
+                           i * sizeof(ngx_http_file_cache_snapshot_node_t),
+                           offset);
+
+        if (n == NGX_ERROR) {
+            goto failed;
+        }
+
+        ngx_crc32_update(&h.crc32, (u_char *) nodes,
+                         i * sizeof(ngx_http_file_cache_snapshot_node_t));
+
+        offset += n;
+        count += i;
+
+        if (ngx_quit || ngx_terminate) {
+            goto failed;
+        }
+    }
+
+    ngx_crc32_final(h.crc32);
+
+    ngx_memcpy(h.magic, "NGXKZSNP", 8);
+    h.version = NGX_HTTP_CACHE_SNAPSHOT_VERSION;
+    h.node_size = sizeof(ngx_http_file_cache_snapshot_node_t);
+    h.count = count;
+    h.bsize = cache->bsize;
+    h.time = now;
+
+    n = ngx_write_file(&file, (u_char *) &h,
+                       sizeof(ngx_http_file_cache_snapshot_header_t), 0);
+
+    if (n == NGX_ERROR) {
+        goto failed;
+    }
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
+    }
+
+    ngx_free(nodes);
+
+    if (ngx_rename_file(cache->snapshot_temp.data, cache->snapshot.data)
+        == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                      cache->snapshot_temp.data, cache->snapshot.data);
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache snapshot: \"%s\" %ui nodes",
+                   cache->snapshot.data, count);
+
+    return NGX_OK;
+
+failed:
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
+    }
+
+    if (ngx_delete_file(file.name.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", file.name.data);
+    }
+
+    ngx_free(nodes);
+
+    return NGX_ERROR;
+}
+
+
+/*
+ * 返回红黑树中key大于给定key的最小节点，key为NULL时返回最小节点。
+ * 红黑树先按node.key再按剩余的key字节排序，见ngx_http_file_cache_rbtree_insert_value
+ */
+static ngx_http_file_cache_node_t *
+ngx_http_file_cache_snapshot_next(ngx_http_file_cache_t *cache, u_char *key)
+{
+    ngx_int_t                    rc;
+    ngx_rbtree_key_t             node_key;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_http_file_cache_node_t  *fcn, *next;
+
+    node_key = 0;
+
+    if (key) {
+        ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+    }
+
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
+    next = NULL;
+
+    while (node != sentinel) {
+
+        fcn = (ngx_http_file_cache_node_t *) node;
+
+        if (key == NULL || node_key < node->key) {
+            rc = 1;
+
+        } else if (node_key > node->key) {
+            rc = -1;
+
+        } else {
+            rc = ngx_memcmp(fcn->key, &key[sizeof(ngx_rbtree_key_t)],
+                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+        }
+
+        if (rc > 0) {
+            next = fcn;
+            node = node->left;
+
+        } else {
+            node = node->right;
+        }
+    }
+
+    return next;
+}
+
+
+/*
+ * loader进程中执行: 校验快照后分批插入keys_zone。成功后设置snapshot_since，
+ * 之后的目录遍历只补上快照之后新增或替换的文件
+ */
+static ngx_int_t
+ngx_http_file_cache_snapshot_load(ngx_http_file_cache_t *cache)
+{
+    off_t                                   size, offset;
+    size_t                                  len, levels;
+    time_t                                  now;
+    ssize_t                                 n;
+    uint32_t                                crc32;
+    ngx_int_t                               rc;
+    ngx_uint_t                              i, left, batch, loaded;
+    ngx_file_t                              file;
+    ngx_file_info_t                         fi;
+    ngx_http_file_cache_node_t             *fcn;
+    ngx_http_file_cache_snapshot_node_t    *sn, *nodes;
+    ngx_http_file_cache_snapshot_header_t   h;
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = cache->snapshot;
+    file.log = ngx_cycle->log;
+
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        if (ngx_errno != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                          ngx_open_file_n " \"%s\" failed", file.name.data);
+        }
+
+        return NGX_DECLINED;
+    }
+
+    nodes = NULL;
+    rc = NGX_DECLINED;
+
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", file.name.data);
+        goto done;
+    }
+
+    size = ngx_file_size(&fi);
+
+    n = ngx_read_file(&file, (u_char *) &h,
+                      sizeof(ngx_http_file_cache_snapshot_header_t), 0);
+
+    if (n != (ssize_t) sizeof(ngx_http_file_cache_snapshot_header_t)
+        || ngx_memcmp(h.magic, "NGXKZSNP", 8) != 0
+        || h.version != NGX_HTTP_CACHE_SNAPSHOT_VERSION
+        || h.node_size != sizeof(ngx_http_file_cache_snapshot_node_t)
+        || h.bsize != cache->bsize
+        || size != (off_t) (sizeof(ngx_http_file_cache_snapshot_header_t)
+                            + h.count
+                              * sizeof(ngx_http_file_cache_snapshot_node_t)))
+    {
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                      "cache snapshot \"%s\" is invalid, ignored",
+                      file.name.data);
+        goto done;
+    }
+
+    nodes = ngx_alloc(NGX_HTTP_CACHE_SNAPSHOT_BATCH
+                      * sizeof(ngx_http_file_cache_snapshot_node_t),
+                      ngx_cycle->log);
+    if (nodes == NULL) {
+        goto done;
+    }
+
+    /* 第一遍只校验crc32，校验通过之前不改动keys_zone */
+
+    ngx_crc32_init(crc32);
+
+    offset = sizeof(ngx_http_file_cache_snapshot_header_t);
+
+    for (left = h.count; left; left -= batch) {
+        batch = ngx_min(left, NGX_HTTP_CACHE_SNAPSHOT_BATCH);
+        len = batch * sizeof(ngx_http_file_cache_snapshot_node_t);
+
+        n = ngx_read_file(&file, (u_char *) nodes, len, offset);
+
+        if (n != (ssize_t) len) {
+            goto done;
+        }
+
+        ngx_crc32_update(&crc32, (u_char *) nodes, len);
+        offset += len;
+    }
+
+    ngx_crc32_final(crc32);
+
+    if (crc32 != h.crc32) {
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                      "cache snapshot \"%s\" has wrong checksum, ignored",
+                      file.name.data);
+        goto done;
+    }
+
+    /* 每个叶子目录一位，levels最多6个16进制字符，位图最大2M */
+
+    levels = cache->path->level[0] + cache->path->level[1]
+             + cache->path->level[2];
+
+    cache->snapshot_dirs = ngx_calloc(ngx_max(((size_t) 1 << (4 * levels)) / 8,
+                                              sizeof(uintptr_t)),
+                                      ngx_cycle->log);
+    if (cache->snapshot_dirs == NULL) {
+        goto done;
+    }
+
+    now = ngx_time();
+    loaded = 0;
+
+    offset = sizeof(ngx_http_file_cache_snapshot_header_t);
+
+    for (left = h.count; left; left -= batch) {
+        batch = ngx_min(left, NGX_HTTP_CACHE_SNAPSHOT_BATCH);
+        len = batch * sizeof(ngx_http_file_cache_snapshot_node_t);
+
+        n = ngx_read_file(&file, (u_char *) nodes, len, offset);
+
+        if (n != (ssize_t) len) {
+            goto done;
+        }
+
+        offset += len;
 
-static ngx_int_t
-ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
-    return NGX_OK;
-}
+        ngx_shmtx_lock(&cache->shpool->mutex);
 
-//ngx_http_file_cache_manage_file 将缓存文件信息存入缓存中。 
-static ngx_int_t
-ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
-    ngx_msec_t              elapsed;
-    ngx_http_file_cache_t  *cache;
+        for (i = 0; i < batch; i++) {
+            sn = &nodes[i];
 
-    cache = ctx->data;
+            if (ngx_http_file_cache_lookup(cache, sn->key)) {
+                continue;
+            }
 
-    if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
-        //将文件添加进cache
-        (void) ngx_http_file_cache_delete_file(ctx, path);
-    }
+            fcn = ngx_slab_calloc_locked(cache->shpool,
+                                         sizeof(ngx_http_file_cache_node_t));
+            if (fcn == NULL) {
+                /* keys_zone比写快照时小，剩下的交给完整的目录遍历 */
+                ngx_shmtx_unlock(&cache->shpool->mutex);
+
+                ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                              "cache snapshot \"%s\" does not fit "
+                              "into keys zone%s", file.name.data,
+                              cache->shpool->log_ctx);
+                goto done;
+            }
 
-   /* 
-        根据配置控制缓存的读取速度 ( loader_files 和 loader_threshold )，以便在缓存文件很多的情况下降低初次启动时对系统资源的消耗。 
-    */
-    if (++cache->files >= cache->loader_files) {
-        //如果文件个数太大，则休眠并清理files计数
-        ngx_http_file_cache_loader_sleep(cache);
+            ngx_memcpy((u_char *) &fcn->node.key, sn->key,
+                       sizeof(ngx_rbtree_key_t));
+            ngx_memcpy(fcn->key, &sn->key[sizeof(ngx_rbtree_key_t)],
+                       NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-    } else {
-        ngx_time_update();
-        //否则看loader时间是不是过长，如果过长则又进入休眠
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+            ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache loader time elapsed: %M", elapsed);
+            fcn->uses = sn->uses;
+            fcn->exists = 1;
+            fcn->uniq = sn->uniq;
+            fcn->valid_sec = sn->valid_sec;
+            fcn->body_start = sn->body_start;
+            fcn->fs_size = sn->fs_size;
+            fcn->expire = now + cache->inactive;
+            fcn->unverified = 1;
 
-      /* 
-        根据配置控制缓存的读取速度 ( loader_files 和 loader_threshold )，以便在缓存文件很多的情况下降低初次启动时对系统资源的消耗。 
-        */
-        if (elapsed >= cache->loader_threshold) {
-            ngx_http_file_cache_loader_sleep(cache);
-        }
-    }
+            cache->sh->size += sn->fs_size;
 
-    return (ngx_quit || ngx_terminate) ? NGX_ABORT : NGX_OK;
-}
+            ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
 
+            loaded++;
+        }
 
-static ngx_int_t
-ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
-    if (path->len >= 5
-        && ngx_strncmp(path->data + path->len - 5, "/temp", 5) == 0)
-    {
-        return NGX_DECLINED;
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        if (ngx_quit || ngx_terminate) {
+            goto done;
+        }
     }
 
-    return NGX_OK;
-}
+    cache->snapshot_since = h.time - NGX_HTTP_CACHE_SNAPSHOT_SLACK;
+    rc = NGX_OK;
 
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "http file cache: %ui nodes loaded from snapshot \"%s\"",
+                  loaded, file.name.data);
 
-static void
-ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache)
-{
-    ngx_msleep(cache->loader_sleep);
+done:
 
-    ngx_time_update();
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
+    }
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+    if (nodes) {
+        ngx_free(nodes);
+    }
+
+    return rc;
 }
 
+
 /*
-ngx_http_file_cache_add_file，它主要是通过文件名计算hash，然后调用ngx_http_file_cache_add将这个文件加入到cache管理中(也就是添加红黑树以及队列),
-*/
+ * 叶子目录在snapshot_dirs位图中的序号: p指向缓存目录之后的"/0/8d"部分，
+ * 把其中的16进制字符按路径顺序连起来，例如levels=1:2时为0x08d
+ */
 static ngx_int_t
-ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
+ngx_http_file_cache_snapshot_dir(ngx_http_file_cache_t *cache, u_char *p)
 {
-    u_char                 *p;
-    ngx_int_t               n;
-    ngx_uint_t              i;
-    ngx_http_cache_t        c;
-    ngx_http_file_cache_t  *cache;
-
-    if (name->len < 2 * NGX_HTTP_CACHE_KEY_LEN) {
-        return NGX_ERROR;
-    }
-
-    if (ctx->size < (off_t) sizeof(ngx_http_file_cache_header_t)) {
-        ngx_log_error(NGX_LOG_CRIT, ctx->log, 0,
-                      "cache file \"%s\" is too small", name->data);
-        return NGX_ERROR;
-    }
+    u_char     *last;
+    ngx_int_t   n, c;
 
-    ngx_memzero(&c, sizeof(ngx_http_cache_t));
-    cache = ctx->data;
+    n = 0;
+    last = p + cache->path->len;
 
-    c.length = ctx->size;
-    c.fs_size = (ctx->fs_size + cache->bsize - 1) / cache->bsize;
+    for ( /* void */ ; p < last; p++) {
 
-    p = &name->data[name->len - 2 * NGX_HTTP_CACHE_KEY_LEN];
+        if (*p == '/') {
+            continue;
+        }
 
-    for (i = 0; i < NGX_HTTP_CACHE_KEY_LEN; i++) {
-        n = ngx_hextoi(p, 2);
+        c = ngx_hextoi(p, 1);
 
-        if (n == NGX_ERROR) {
+        if (c == NGX_ERROR) {
             return NGX_ERROR;
         }
 
-        p += 2;
-
-        c.key[i] = (u_char) n;
+        n = n * 16 + c;
     }
 
-    return ngx_http_file_cache_add(cache, &c);
+    return n;
 }
 
-//ngx_http_file_cache_add 函数将此节点加入 ngx_http_file_cache_sh_t 类型的缓存管理机制中。 
 
-//按照c->key在红黑树中查找，没有就创建node节点，然后把节点添加到红黑树cache->sh->rbtree和cache->sh->queue队列头
-static ngx_int_t //ngx_http_file_cache_expire和ngx_http_file_cache_add对应
-ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+/*
+ * loader遍历结束后执行。从快照恢复的节点如果所在的叶子目录被重新遍历过(没能使用
+ * 快照时则是所有目录)，却没有在遍历中找到文件，说明文件在快照写入之后已经被删除，
+ * 把这些节点从keys_zone中删除。没有重新遍历的目录在快照之后没有变化，文件都还在
+ */
+static void
+ngx_http_file_cache_snapshot_prune(ngx_http_file_cache_t *cache)
 {
+    u_char                      *name, *p;
+    size_t                       len;
+    ngx_int_t                    n;
+    uintptr_t                    m;
+    ngx_uint_t                   visited, pruned, done, w;
+    ngx_path_t                  *path;
     ngx_http_file_cache_node_t  *fcn;
+    u_char                       key[NGX_HTTP_CACHE_KEY_LEN];
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    path = cache->path;
+    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
 
-    fcn = ngx_http_file_cache_lookup(cache, c->key);//首先查找
+    /* 用ngx_create_hashed_filename得到节点所在的叶子目录，与磁盘上的目录名一致 */
 
-    if (fcn == NULL) {
-        //如果不存在，则新建结构
-        fcn = ngx_slab_calloc_locked(cache->shpool,
-                                     sizeof(ngx_http_file_cache_node_t));
-        if (fcn == NULL) {
-            ngx_shmtx_unlock(&cache->shpool->mutex);
-            return NGX_ERROR;
-        }
+    name = ngx_alloc(len + 1, ngx_cycle->log);
+    if (name == NULL) {
+        return;
+    }
 
-        ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+    pruned = 0;
+    done = 0;
+    fcn = NULL;
 
-        ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
-                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+    while (!done) {
 
-        ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node); //插入红黑树
+        ngx_shmtx_lock(&cache->shpool->mutex);
 
-        fcn->uses = 1;
-        fcn->exists = 1;
-        fcn->fs_size = c->fs_size;
+        for (visited = 0; visited < NGX_HTTP_CACHE_SNAPSHOT_BATCH; visited++) {
 
-        cache->sh->size += c->fs_size;
+            fcn = ngx_http_file_cache_snapshot_next(cache, fcn ? key : NULL);
 
-    } else {
-        //否则删除queue，后续会重新插入
-        ngx_queue_remove(&fcn->queue);
-    }
+            if (fcn == NULL) {
+                done = 1;
+                break;
+            }
 
-    fcn->expire = ngx_time() + cache->inactive;
+            ngx_memcpy(key, &fcn->node.key, sizeof(ngx_rbtree_key_t));
+            ngx_memcpy(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                       NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue); //重新插入
+            if (!fcn->unverified) {
+                continue;
+            }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+            fcn->unverified = 0;
 
-    return NGX_OK;
-}
+            if (cache->snapshot_since) {
+                p = name + path->name.len + 1 + path->len;
+                p = ngx_hex_dump(p, key, NGX_HTTP_CACHE_KEY_LEN);
+                *p = '\0';
 
+                ngx_create_hashed_filename(path, name, len);
 
-static ngx_int_t
-ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                   "http file cache delete: \"%s\"", path->data);
+                n = ngx_http_file_cache_snapshot_dir(cache,
+                                                     name + path->name.len);
+                if (n == NGX_ERROR) {
+                    continue;
+                }
 
-    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
-                      ngx_delete_file_n " \"%s\" failed", path->data);
+                w = n / (8 * sizeof(uintptr_t));
+                m = (uintptr_t) 1 << (n % (8 * sizeof(uintptr_t)));
+
+                if (!(cache->snapshot_dirs[w] & m)) {
+                    continue;
+                }
+            }
+
+            /* 正在被请求使用的节点由请求在打开文件失败后按未命中处理 */
+
+            if (fcn->count || fcn->deleting) {
+                continue;
+            }
+
+            if (fcn->exists) {
+                cache->sh->size -= fcn->fs_size;
+            }
+
+            ngx_queue_remove(&fcn->queue);
+            ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
+            ngx_slab_free_locked(cache->shpool, fcn);
+
+            pruned++;
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
     }
 
-    return NGX_OK;
+    ngx_free(name);
+
+    if (pruned) {
+        ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                      "http file cache: %ui snapshot nodes without cache "
+                      "files removed from \"%V\"", pruned, &path->name);
+    }
 }
 
+
 //获取//proxy_cache_valid xxx 4m;中的4m，根据status查找对应的时间
 time_t
 ngx_http_file_cache_valid(ngx_array_t *cache_valid, ngx_uint_t status)
@@ -2527,10 +3858,10 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     off_t                   max_size;
     u_char                 *last, *p;
-    time_t                  inactive;
+    time_t                  inactive, snapshot;
     size_t                  len;
-    ssize_t                 size;
-    ngx_str_t               s, name, *value;
+    ssize_t                 size, ram_size, ram_max_object;
+    ngx_str_t               s, name, ram_name, *value;
     ngx_int_t               loader_files;
     ngx_msec_t              loader_sleep, loader_threshold;
     ngx_uint_t              i, n, 
@@ -2558,6 +3889,9 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     name.len = 0;
     size = 0;
     max_size = NGX_MAX_OFF_T_VALUE;
+    ram_size = 0;
+    ram_max_object = NGX_CONF_UNSET;
+    snapshot = 0;
 
     value = cf->args->elts;
 
@@ -2742,11 +4076,85 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        //ram_cache=size 在共享内存中缓存小的热点对象(头部+包体)，命中时不读磁盘
+        if (ngx_strncmp(value[i].data, "ram_cache=", 10) == 0) {
+
+            s.len = value[i].len - 10;
+            s.data = value[i].data + 10;
+
+            ram_size = ngx_parse_size(&s);
+            if (ram_size < 8192) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid ram_cache value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        //ram_max_object=size 超过该大小的缓存文件不进入内存层，默认32k
+        if (ngx_strncmp(value[i].data, "ram_max_object=", 15) == 0) {
+
+            s.len = value[i].len - 15;
+            s.data = value[i].data + 15;
+
+            ram_max_object = ngx_parse_size(&s);
+            if (ram_max_object <= 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid ram_max_object value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        //admission=tinylfu 磁盘接近max_size时按访问频率决定新对象是否写入缓存
+        if (ngx_strncmp(value[i].data, "admission=", 10) == 0) {
+
+            if (ngx_strcmp(&value[i].data[10], "tinylfu") == 0) {
+                cache->admission = 1;
+
+            } else if (ngx_strcmp(&value[i].data[10], "off") == 0) {
+                cache->admission = 0;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid admission value \"%V\", "
+                                   "it must be \"tinylfu\" or \"off\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        //snapshot=time cache manager每隔time把keys_zone写入快照，重启后loader直接从快照恢复
+        if (ngx_strncmp(value[i].data, "snapshot=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            snapshot = ngx_parse_time(&s, 1);
+            if (snapshot == (time_t) NGX_ERROR || snapshot == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid snapshot value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[i]);
         return NGX_CONF_ERROR;
     }
 
+    if (ram_max_object != NGX_CONF_UNSET && ram_size == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"ram_max_object\" requires \"ram_cache\"");
+        return NGX_CONF_ERROR;
+    }
+
     if (name.len == 0 || size == 0) {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "\"%V\" must have \"keys_zone\" parameter",
@@ -2763,6 +4171,29 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     cache->loader_sleep = loader_sleep;
     cache->loader_threshold = loader_threshold;
 
+    if (snapshot) {
+        len = cache->path->name.len + sizeof("/keys_zone.snapshot") - 1;
+
+        p = ngx_pnalloc(cf->pool, 2 * (len + sizeof(".tmp")));
+        if (p == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        cache->snapshot.len = len;
+        cache->snapshot.data = p;
+
+        p = ngx_cpymem(p, cache->path->name.data, cache->path->name.len);
+        p = ngx_cpymem(p, "/keys_zone.snapshot", sizeof("/keys_zone.snapshot"));
+
+        cache->snapshot_temp.len = len + sizeof(".tmp") - 1;
+        cache->snapshot_temp.data = p;
+
+        p = ngx_cpymem(p, cache->snapshot.data, len);
+        ngx_memcpy(p, ".tmp", sizeof(".tmp"));
+
+        cache->snapshot_interval = snapshot;
+    }
+
     if (ngx_add_path(cf, &cache->path) != NGX_OK) {
         return NGX_CONF_ERROR;
     }
@@ -2813,6 +4244,40 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     cache->shm_zone->init = ngx_http_file_cache_init;
     cache->shm_zone->data = cache;
 
+    if (ram_size) {
+        /* keys_zone名字中不会出现':'，因此"ram:"前缀不会和其他共享内存重名 */
+        ram_name.len = sizeof("ram:") - 1 + name.len;
+        ram_name.data = ngx_pnalloc(cf->pool, ram_name.len);
+        if (ram_name.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_memcpy(ngx_cpymem(ram_name.data, "ram:", sizeof("ram:") - 1),
+                   name.data, name.len);
+
+        /* 预算之外为slab页面对齐和管理结构留出余量 */
+        cache->ram_zone = ngx_shared_memory_add(cf, &ram_name,
+                                                ram_size + ram_size / 4
+                                                + 8 * ngx_pagesize,
+                                                cmd->post);
+        if (cache->ram_zone == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        if (cache->ram_zone->data) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "duplicate zone \"%V\"", &ram_name);
+            return NGX_CONF_ERROR;
+        }
+
+        cache->ram_zone->init = ngx_http_file_cache_ram_init;
+        cache->ram_zone->data = cache;
+
+        cache->ram_size = ram_size;
+        cache->ram_max_object = (ram_max_object == NGX_CONF_UNSET)
+                                ? 32768 : ram_max_object;
+    }
+
     cache->inactive = inactive;
     cache->max_size = max_size;
 
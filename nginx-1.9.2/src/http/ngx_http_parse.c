@@ -10,6 +10,33 @@
 #include <ngx_http.h>
 
 
+#if (NGX_HAVE_X86_SIMD)
+
+#include <immintrin.h>
+
+/*
+状态机在URI、头部名和头部值上逐字节推进，这里一次检查16(SSE4.2)或32(AVX2)字节，只找出会引起状态变化的
+字节交给原来的状态机处理。使用哪种实现由ngx_cpuinfo检测到的ngx_cpu_features在运行时决定
+*/
+
+static u_char *ngx_http_parse_scan_sse42(u_char *p, u_char *last,
+    u_char *set, int n) __attribute__((target("sse4.2")));
+static u_char *ngx_http_parse_scan_avx2(u_char *p, u_char *last,
+    u_char *set, int n) __attribute__((target("avx2")));
+static size_t ngx_http_parse_lowcase_sse42(u_char *p, u_char *last,
+    u_char *dst) __attribute__((target("sse4.2")));
+static size_t ngx_http_parse_lowcase_avx2(u_char *p, u_char *last,
+    u_char *dst) __attribute__((target("avx2")));
+
+/* URI中usual[]以外的字节 */
+static u_char  ngx_http_parse_uri_set[16] =
+    { '\0', LF, CR, ' ', '#', '%', '+', '.', '/', '?' };
+
+static u_char  ngx_http_parse_value_set[16] = { '\0', LF, CR };
+
+#endif
+
+
 static uint32_t  usual[] = {
     0xffffdbfe, /* 1111 1111 1111 1111  1101 1011 1111 1110 */
 
@@ -98,6 +125,44 @@ static uint32_t  usual[] = {
 #endif
 
 
+#if (NGX_HAVE_X86_SIMD)
+
+/* 返回p之后第一个在set中的字节，剩余不足16字节的部分不处理，交给状态机 */
+
+static ngx_inline u_char *
+ngx_http_parse_scan(u_char *p, u_char *last, u_char *set, int n)
+{
+    if (ngx_cpu_features & NGX_CPU_AVX2) {
+        return ngx_http_parse_scan_avx2(p, last, set, n);
+    }
+
+    if (ngx_cpu_features & NGX_CPU_SSE42) {
+        return ngx_http_parse_scan_sse42(p, last, set, n);
+    }
+
+    return p;
+}
+
+
+/* 头部名开头连续的[A-Za-z0-9-]转成小写存入dst，返回其长度 */
+
+static ngx_inline size_t
+ngx_http_parse_lowcase(u_char *p, u_char *last, u_char *dst)
+{
+    if (ngx_cpu_features & NGX_CPU_AVX2) {
+        return ngx_http_parse_lowcase_avx2(p, last, dst);
+    }
+
+    if (ngx_cpu_features & NGX_CPU_SSE42) {
+        return ngx_http_parse_lowcase_sse42(p, last, dst);
+    }
+
+    return 0;
+}
+
+#endif
+
+
 /* gcc, icc, msvc and others compile these switches as an jump table */
 /*
 GET /sample.jsp HTTP/1.1
@@ -564,6 +629,13 @@ ngx_http_parse_request_line(ngx_http_request_t *r, ngx_buf_t *b)
         case sw_check_uri:
 
             if (usual[ch >> 5] & (1 << (ch & 0x1f))) {
+#if (NGX_HAVE_X86_SIMD)
+                m = ngx_http_parse_scan(p, b->last, ngx_http_parse_uri_set, 10);
+
+                if (m > p) {
+                    p = m - 1;
+                }
+#endif
                 break;
             }
 
@@ -650,6 +722,13 @@ ngx_http_parse_request_line(ngx_http_request_t *r, ngx_buf_t *b)
         case sw_uri:
 
             if (usual[ch >> 5] & (1 << (ch & 0x1f))) {
+#if (NGX_HAVE_X86_SIMD)
+                m = ngx_http_parse_scan(p, b->last, ngx_http_parse_uri_set, 10);
+
+                if (m > p) {
+                    p = m - 1;
+                }
+#endif
                 break;
             }
 
@@ -876,6 +955,10 @@ ngx_http_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b,
 {
     u_char      c, ch, *p;
     ngx_uint_t  hash, i;
+#if (NGX_HAVE_X86_SIMD)
+    u_char     *m, lc[32];
+    size_t      k, n;
+#endif
     enum {
         sw_start = 0,
         sw_name,
@@ -962,6 +1045,20 @@ ngx_http_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b,
             c = lowcase[ch];
 
             if (c) {
+#if (NGX_HAVE_X86_SIMD)
+                n = ngx_http_parse_lowcase(p, b->last, lc);
+
+                if (n) {
+                    for (k = 0; k < n; k++) {
+                        hash = ngx_hash(hash, lc[k]);
+                        r->lowcase_header[i++] = lc[k];
+                        i &= (NGX_HTTP_LC_HEADER_LEN - 1);
+                    }
+
+                    p += n - 1;
+                    break;
+                }
+#endif
                 hash = ngx_hash(hash, c);
                 r->lowcase_header[i++] = c;
                 i &= (NGX_HTTP_LC_HEADER_LEN - 1);
@@ -1045,6 +1142,29 @@ ngx_http_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b,
 
         /* header value */
         case sw_value:
+#if (NGX_HAVE_X86_SIMD)
+            /*
+             * 值中的空格也一起跳过，跳过的部分以空格结尾时和逐字节解析一样
+             * 让header_end指向末尾连续空格的开始并进入sw_space_after_value
+             */
+            m = ngx_http_parse_scan(p, b->last, ngx_http_parse_value_set, 3);
+
+            if (m > p) {
+                if (m[-1] == ' ') {
+                    for (r->header_end = m - 1;
+                         r->header_end > p && r->header_end[-1] == ' ';
+                         r->header_end--)
+                    {
+                        /* void */
+                    }
+
+                    state = sw_space_after_value;
+                }
+
+                p = m - 1;
+                break;
+            }
+#endif
             switch (ch) {
             case ' ':
                 r->header_end = p;
@@ -2421,3 +2541,133 @@ invalid:
 
     return NGX_ERROR;
 }
+
+
+#if (NGX_HAVE_X86_SIMD)
+
+static u_char *
+ngx_http_parse_scan_sse42(u_char *p, u_char *last, u_char *set, int n)
+{
+    int      i;
+    __m128i  s, d;
+
+    s = _mm_loadu_si128((__m128i *) set);
+
+    while (last - p >= 16) {
+        d = _mm_loadu_si128((__m128i *) p);
+
+        i = _mm_cmpestri(s, n, d, 16, _SIDD_UBYTE_OPS|_SIDD_CMP_EQUAL_ANY
+                                      |_SIDD_LEAST_SIGNIFICANT);
+        if (i < 16) {
+            return p + i;
+        }
+
+        p += 16;
+    }
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_parse_scan_avx2(u_char *p, u_char *last, u_char *set, int n)
+{
+    int       k;
+    uint32_t  mask;
+    __m256i   d, m, s[16];
+
+    for (k = 0; k < n; k++) {
+        s[k] = _mm256_set1_epi8((char) set[k]);
+    }
+
+    while (last - p >= 32) {
+        d = _mm256_loadu_si256((__m256i *) p);
+
+        m = _mm256_cmpeq_epi8(d, s[0]);
+
+        for (k = 1; k < n; k++) {
+            m = _mm256_or_si256(m, _mm256_cmpeq_epi8(d, s[k]));
+        }
+
+        mask = (uint32_t) _mm256_movemask_epi8(m);
+
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 32;
+    }
+
+    /* 剩下的16到31字节 */
+
+    return ngx_http_parse_scan_sse42(p, last, set, n);
+}
+
+
+static size_t
+ngx_http_parse_lowcase_sse42(u_char *p, u_char *last, u_char *dst)
+{
+    int      n;
+    __m128i  d, r, upper;
+
+    static u_char  ranges[16] = "azAZ09--";
+
+    if (last - p < 16) {
+        return 0;
+    }
+
+    r = _mm_loadu_si128((__m128i *) ranges);
+    d = _mm_loadu_si128((__m128i *) p);
+
+    /* 第一个不在[a-zA-Z0-9-]中的字节 */
+
+    n = _mm_cmpestri(r, 8, d, 16, _SIDD_UBYTE_OPS|_SIDD_CMP_RANGES
+                                  |_SIDD_NEGATIVE_POLARITY
+                                  |_SIDD_LEAST_SIGNIFICANT);
+
+    upper = _mm_and_si128(_mm_cmpgt_epi8(d, _mm_set1_epi8('A' - 1)),
+                          _mm_cmplt_epi8(d, _mm_set1_epi8('Z' + 1)));
+
+    d = _mm_or_si128(d, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+
+    _mm_storeu_si128((__m128i *) dst, d);
+
+    return n;
+}
+
+
+static size_t
+ngx_http_parse_lowcase_avx2(u_char *p, u_char *last, u_char *dst)
+{
+    uint32_t  mask;
+    __m256i   d, l, alpha, digit, valid;
+
+    if (last - p < 32) {
+        return ngx_http_parse_lowcase_sse42(p, last, dst);
+    }
+
+    d = _mm256_loadu_si256((__m256i *) p);
+
+    /* 大于0x7f的字节按有符号比较是负数，不会落在下面的范围内 */
+
+    l = _mm256_or_si256(d, _mm256_set1_epi8(0x20));
+
+    alpha = _mm256_and_si256(_mm256_cmpgt_epi8(l, _mm256_set1_epi8('a' - 1)),
+                             _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), l));
+
+    digit = _mm256_and_si256(_mm256_cmpgt_epi8(d, _mm256_set1_epi8('0' - 1)),
+                             _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), d));
+
+    valid = _mm256_or_si256(_mm256_or_si256(alpha, digit),
+                            _mm256_cmpeq_epi8(d, _mm256_set1_epi8('-')));
+
+    d = _mm256_or_si256(d, _mm256_and_si256(alpha, _mm256_set1_epi8(0x20)));
+
+    _mm256_storeu_si256((__m256i *) dst, d);
+
+    mask = ~(uint32_t) _mm256_movemask_epi8(valid);
+
+    return mask ? (size_t) __builtin_ctz(mask) : 32;
+}
+
+#endif
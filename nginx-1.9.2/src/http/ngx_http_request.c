@@ -545,7 +545,17 @@ ngx_http_wait_request_handler(ngx_event_t *rev)
 ngx_http_request_t *
 ngx_http_create_request(ngx_connection_t *c)
 {
-    ngx_pool_t                 *pool;
+    return ngx_http_alloc_request(c, NULL);
+}
+
+
+/*
+pool为NULL时按request_pool_size新建请求池，否则在调用者提供的空池上创建请求，例如HTTP/2连接上回收的请求池，
+见ngx_http_v2_create_stream。失败时pool会被销毁
+*/
+ngx_http_request_t *
+ngx_http_alloc_request(ngx_connection_t *c, ngx_pool_t *pool)
+{
     ngx_time_t                 *tp;
     ngx_http_request_t         *r;
     ngx_http_log_ctx_t         *ctx;
@@ -562,9 +572,11 @@ ngx_http_create_request(ngx_connection_t *c)
 
     cscf = ngx_http_get_module_srv_conf(hc->conf_ctx, ngx_http_core_module);
 
-    pool = ngx_create_pool(cscf->request_pool_size, c->log);
     if (pool == NULL) {
-        return NULL;
+        pool = ngx_create_pool(cscf->request_pool_size, c->log);
+        if (pool == NULL) {
+            return NULL;
+        }
     }
 
     r = ngx_pcalloc(pool, sizeof(ngx_http_request_t));
@@ -2707,6 +2719,30 @@ ngx_http_finalize_request(ngx_http_request_t *r, ngx_int_t rc)
             return;
         }
 
+        if (r->background) { //后台子请求不在postponed链表中，直接释放对主请求的引用
+            r->main->subrequests++;
+
+            if (!r->logged) {
+                clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+                if (clcf->log_subrequest) {
+                    ngx_http_log_request(r);
+                }
+
+                r->logged = 1;
+
+            } else {
+                ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                              "subrequest: \"%V?%V\" logged again",
+                              &r->uri, &r->args);
+            }
+
+            r->done = 1;
+
+            ngx_http_finalize_connection(r);
+            return;
+        }
+
         /*
             ”…”⁄µ±«∞«Î«Û «◊”«Î«Û£¨ƒ«√¥’˝≥£«Èøˆœ¬–Ë“™Ã¯µΩÀ¸µƒ∏∏«Î«Û…œ£¨º§ªÓ∏∏«Î«ÛºÃ–¯œÚœ¬÷¥––£¨À˘“‘’‚“ª≤Ω ◊œ»∏˘æ›ngx_http_request_tΩ·
         ππÃÂµƒparent≥…‘±’“µΩ∏∏«Î«Û£¨‘Ÿππ‘Ï“ª∏ˆngx_http_posted_request_tΩ·ππÃÂ∞—∏∏«Î«Û∑≈÷√∆‰÷–£¨◊Ó∫Û∞—∏√Ω·ππÃÂÃÌº”µΩ‘≠ º«Î«Ûµƒ
@@ -2949,6 +2985,10 @@ discard_bodyŒ™l£¨‘Ú±Ì æ’˝‘⁄∂™∆˙∞¸ÃÂ£¨’‚ ±
         return;
     }
 
+    /* 主请求先结束时，最后结束的后台子请求负责主请求的keepalive或者关闭 */
+    r = r->main;
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
     if (r->reading_body) {
         r->keepalive = 0; // π”√—”≥Ÿπÿ±’¡¨Ω”π¶ƒ‹£¨æÕ≤ª–Ë“™‘Ÿ≈–∂œkeepaliveπ¶ƒ‹πÿ¡¨Ω”¡À
         r->lingering_close = 1;
@@ -4138,6 +4178,14 @@ ngx_http_free_request(ngx_http_request_t *r, ngx_int_t rc) // Õ∑≈requestµ
     pool = r->pool;
     r->pool = NULL;
 
+#if (NGX_HTTP_V2)
+    /* HTTP/2流的请求池由ngx_http_v2_close_stream重置后留给同一连接上的下一个流 */
+    if (r->stream) {
+        r->stream->pool = pool;
+        return;
+    }
+#endif
+
     ngx_destroy_pool(pool); /*  Õ∑≈request->pool */
 }
 
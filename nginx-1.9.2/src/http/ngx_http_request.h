@@ -92,6 +92,8 @@ OPTIONS 请求查询服务器的性能，或者查询与资源相关的选项和
 //表示如果该子请求提前完成(按后续遍历的顺序)，是否设置将它的状态设为done，当设置该参数时，提前完成就会设置done，不设时，会让该子
 //请求等待它之前的子请求处理完毕才会将状态设置为done。
 #define NGX_HTTP_SUBREQUEST_WAITED         4
+//后台子请求: 不挂到父请求的postponed链表，也不输出任何数据，主请求不用等它就可以发送完应答，见ngx_http_upstream_cache_background_update
+#define NGX_HTTP_SUBREQUEST_BACKGROUND     16
 #define NGX_HTTP_LOG_UNSAFE                8
 
 
@@ -884,6 +886,7 @@ typedef struct { //包含在ngx_http_request_s结构headers_out中,ngx_http_send
     ngx_array_t                       cache_control;
     /*在这里指定过content_length_n后，不用再次到ngx_table_elt_t *content_length中设置响应长度*/
     off_t                             content_length_n; //这个标示应答体的长度  不包括头部行长度，只包含消息体长度
+    off_t                             content_offset; //包体在完整文件中的起始偏移，见ngx_http_slice_header_filter
     time_t                            date_time;
 
     //实际上该时间是通过ngx_open_and_stat_file->stat获取的文件最近修改的时间，客户端每次请求都会从新通过stat获取，如果客户端第一次请求该文件和第二次请求该文件过程中修改了该文件，则
@@ -1499,6 +1502,7 @@ ngx_http_finalize_request方法一次，这是正确的。对于mytest模块也
     */
     unsigned                          subrequest_in_memory:1; //ngx_http_subrequest中赋值 NGX_HTTP_SUBREQUEST_IN_MEMORY
     unsigned                          waited:1; //ngx_http_subrequest中赋值 NGX_HTTP_SUBREQUEST_WAITED
+    unsigned                          background:1; //ngx_http_subrequest中赋值 NGX_HTTP_SUBREQUEST_BACKGROUND
 
 #if (NGX_HTTP_CACHE)
     unsigned                          cached:1;//如果客户端请求过来有读到缓存文件，则置1，见ngx_http_file_cache_read  ngx_http_upstream_cache_send
@@ -1567,6 +1571,7 @@ ngx_http_finalize_request方法一次，这是正确的。对于mytest模块也
     unsigned                          filter_need_temporary:1;
     unsigned                          allow_ranges:1;  //支持断点续传 参考3.8.3节
     unsigned                          single_range:1;
+    unsigned                          subrequest_ranges:1; //子请求也由range过滤模块处理，见ngx_http_slice_header_filter
     //
     unsigned                          disable_not_modified:1; //r->disable_not_modified = !u->cacheable;因此默认为0
 
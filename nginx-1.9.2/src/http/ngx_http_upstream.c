@@ -17,6 +17,8 @@ static ngx_int_t ngx_http_upstream_cache_get(ngx_http_request_t *r,
     ngx_http_upstream_t *u, ngx_http_file_cache_t **cache);
 static ngx_int_t ngx_http_upstream_cache_send(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_cache_background_update(
+    ngx_http_request_t *r, ngx_http_upstream_t *u);
 static ngx_int_t ngx_http_upstream_cache_status(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_upstream_cache_last_modified(ngx_http_request_t *r,
@@ -74,6 +76,13 @@ static void
     ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
     ngx_uint_t do_write);
 static ngx_int_t ngx_http_upstream_non_buffered_filter_init(void *data);
+#if (NGX_HAVE_SPLICE)
+static ngx_int_t ngx_http_upstream_splice_init(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_splice_cleanup(void *data);
+static ngx_int_t ngx_http_upstream_splice(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+#endif
 static ngx_int_t ngx_http_upstream_non_buffered_filter(void *data,
     ssize_t bytes);
 static void ngx_http_upstream_process_downstream(ngx_http_request_t *r);
@@ -190,6 +199,11 @@ ngx_http_upstream_header_t  ngx_http_upstream_headers_in[] = { //ºó¶ËÓ¦´
                  ngx_http_upstream_process_content_length, 0,
                  ngx_http_upstream_ignore_header_line, 0, 0 },
 
+    { ngx_string("Content-Range"), //slice模块需要从headers_out.content_range中解析分片范围
+                 ngx_http_upstream_ignore_header_line, 0,
+                 ngx_http_upstream_copy_header_line,
+                 offsetof(ngx_http_headers_out_t, content_range), 0 },
+
     { ngx_string("Date"),
                  ngx_http_upstream_process_header_line,
                  offsetof(ngx_http_upstream_headers_in_t, date),
@@ -957,6 +971,8 @@ found:
         return;
     }
 
+    u->upstream = uscf;
+
 #if (NGX_HTTP_SSL)
     u->ssl_name = uscf->host;
 #endif
@@ -1074,9 +1090,31 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
     switch (rc) {
 
+    case NGX_HTTP_CACHE_STALE:
+
+        /*
+         * proxy_cache_background_update on并且proxy_cache_use_stale包含updating时，第一个发现过期的
+         * 请求立即发送过期的缓存，同时发起后台子请求更新缓存，node->updating在主请求结束前一直保持，
+         * 其他worker中的请求会得到NGX_HTTP_CACHE_UPDATING，不会重复更新。没有updating时不允许
+         * 发送过期缓存，background_update不起作用
+         */
+        if ((u->conf->cache_use_stale & NGX_HTTP_UPSTREAM_FT_UPDATING)
+            && u->conf->cache_background_update
+            && !r->background)
+        {
+            c->background = 1;
+            u->cache_status = rc;
+            rc = NGX_OK;
+        }
+
+        break;
+
     case NGX_HTTP_CACHE_UPDATING:
         
-        if (u->conf->cache_use_stale & NGX_HTTP_UPSTREAM_FT_UPDATING) {
+        //后台更新子请求自己不能用过期缓存应答，要去后端获取
+        if ((u->conf->cache_use_stale & NGX_HTTP_UPSTREAM_FT_UPDATING)
+            && !r->background)
+        {
             //Èç¹ûÉèÖÃÁËfastcgi_cache_use_stale updating£¬±íÊ¾ËµËäÈ»¸Ã»º´æÎÄ¼şÊ§Ğ§ÁË£¬ÒÑ¾­ÓĞÆäËû¿Í»§¶ËÇëÇóÔÚ»ñÈ¡ºó¶ËÊı¾İ£¬µ«ÊÇÏÖÔÚ»¹Ã»ÓĞ»ñÈ¡ÍêÕû£¬
             //ÕâÊ±ºò¾Í¿ÉÒÔ°ÑÒÔÇ°¹ıÆÚµÄ»º´æ·¢ËÍ¸øµ±Ç°ÇëÇóµÄ¿Í»§¶Ë
             u->cache_status = rc;
@@ -1099,9 +1137,20 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
         rc = ngx_http_upstream_cache_send(r, u);
 
         if (rc != NGX_HTTP_UPSTREAM_INVALID_HEADER) {
+
+            if (c->background
+                && rc != NGX_ERROR
+                && ngx_http_upstream_cache_background_update(r, u) != NGX_OK)
+            {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                              "cache background update failed");
+            }
+
             return rc;
         }
 
+        c->background = 0; //缓存文件头部不合法，当前请求自己去后端获取
+
         break;
 
     case NGX_HTTP_CACHE_STALE: //±íÊ¾»º´æ¹ıÆÚ£¬¼ûÉÏÃæµÄngx_http_file_cache_open->ngx_http_file_cache_read
@@ -1201,6 +1250,30 @@ ngx_http_upstream_cache_get(ngx_http_request_t *r, ngx_http_upstream_t *u,
 }
 
 
+/*
+ * 以当前uri发起后台子请求，它在ngx_http_upstream_cache中得到NGX_HTTP_CACHE_UPDATING后
+ * 按过期处理去后端获取，并由ngx_http_file_cache_update替换缓存文件。header_only使得
+ * 子请求只写缓存，不向客户端输出
+ */
+static ngx_int_t
+ngx_http_upstream_cache_background_update(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    ngx_http_request_t  *sr;
+
+    if (ngx_http_subrequest(r, &r->uri, &r->args, &sr, NULL,
+                            NGX_HTTP_SUBREQUEST_BACKGROUND)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    sr->header_only = 1;
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_upstream_cache_send(ngx_http_request_t *r, ngx_http_upstream_t *u)
 {
@@ -1663,6 +1736,9 @@ ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
 {
     ngx_int_t          rc;
     ngx_connection_t  *c;
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    ngx_str_t         *name;
+#endif
 
     r->connection->log->action = "connecting to upstream";
 
@@ -1698,6 +1774,32 @@ ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
     u->state->peer = u->peer.name;
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+
+    if (u->upstream && u->upstream->shm_zone && u->peer.name) {
+
+        /*
+         * upstream_conf可以在运行时删除服务器，空出的位置被新服务器复用时会释放共享内存中原来的名字，
+         * 而$upstream_addr要到写access日志时才用，所以把名字拷贝到请求池中
+         */
+
+        name = ngx_palloc(r->pool, sizeof(ngx_str_t) + u->peer.name->len);
+        if (name == NULL) {
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+        name->len = u->peer.name->len;
+        name->data = (u_char *) (name + 1);
+        ngx_memcpy(name->data, u->peer.name->data, name->len);
+
+        u->peer.name = name;
+        u->state->peer = name;
+    }
+
+#endif
+
     if (rc == NGX_BUSY) {
     //Èô rc = NGX_BUSY£¬±íÊ¾µ±Ç°ÉÏÓÎ·şÎñÆ÷´¦ÓÚ²»»îÔ¾×´Ì¬£¬Ôòµ÷ÓÃ ngx_http_upstream_next ·½·¨¸ù¾İ´«ÈëµÄ²ÎÊı³¢ÊÔÖØĞÂ·¢ÆğÁ¬½ÓÇëÇó£¬²¢ return ´Óµ±Ç°º¯Êı·µ»Ø£»
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "no live upstreams");
@@ -3230,7 +3332,6 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
         r->write_event_handler =
                              ngx_http_upstream_process_non_buffered_downstream;//µ÷ÓÃ¹ıÂËÄ£¿éÒ»¸ö¸ö¹ıÂËbody£¬×îÖÕ·¢ËÍ³öÈ¥¡£
 
-        r->limit_rate = 0;
         //ngx_http_XXX_input_filter_init(Èçngx_http_fastcgi_input_filter_init ngx_http_proxy_input_filter_init ngx_http_proxy_input_filter_init)  
         //Ö»ÓĞmemcached»áÖ´ĞĞngx_http_memcached_filter_init£¬ÆäËû·½Ê½Ê²Ã´Ò²Ã»×ö 
         if (u->input_filter_init(u->input_filter_ctx) == NGX_ERROR) {
@@ -3238,6 +3339,15 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
             return;
         }
 
+#if (NGX_HAVE_SPLICE)
+        /* splice_init要根据limit_rate决定是否使用splice，所以limit_rate在这之后再清零 */
+        if (u->splice && ngx_http_upstream_splice_init(r, u) != NGX_OK) {
+            u->splice = 0;
+        }
+#endif
+
+        r->limit_rate = 0;
+
         if (clcf->tcp_nodelay && c->tcp_nodelay == NGX_TCP_NODELAY_UNSET) {
             ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "tcp_nodelay");
 
@@ -3908,6 +4018,24 @@ ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
 
     for ( ;; ) {
 
+#if (NGX_HAVE_SPLICE)
+        /* u->buffer中预读的包体发完以后，剩下的包体都经过管道直接转发 */
+
+        if (u->splice
+            && u->out_bufs == NULL && u->busy_bufs == NULL && r->out == NULL)
+        {
+            rc = ngx_http_upstream_splice(r, u);
+
+            if (rc == NGX_AGAIN) {
+                break;
+            }
+
+            ngx_http_upstream_finalize_request(r, u,
+                                               rc == NGX_OK ? 0 : rc);
+            return;
+        }
+#endif
+
         if (do_write) { //ÒªÁ¢¼´·¢ËÍ¡£
             //out_bufsÖĞµÄÊı¾İÊÇ´Óngx_http_fastcgi_non_buffered_filter»ñÈ¡
             if (u->out_bufs || u->busy_bufs) {
@@ -3955,6 +4083,16 @@ ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
             }
         }
 
+#if (NGX_HAVE_SPLICE)
+        if (u->splice) {
+            if (u->busy_bufs == NULL && r->out == NULL) {
+                continue;
+            }
+
+            break;
+        }
+#endif
+
         size = b->end - b->last;//µÃµ½µ±Ç°bufµÄÊ£Óà¿Õ¼ä
 
         if (size && upstream->read->ready) { 
@@ -4024,6 +4162,200 @@ ngx_http_upstream_non_buffered_filter_init(void *data)
     return NGX_OK;
 }
 
+
+#if (NGX_HAVE_SPLICE)
+
+/*
+上游包体可以原样转发(u->splice)时，如果两端都不是SSL，也没有过滤模块修改包体，就创建一个管道，之后用splice()
+把包体从上游socket移到管道再移到客户端socket，不再经过用户态的u->buffer。gzip、sub_filter、ssi、charset、range
+等修改包体的过滤模块都会清除或修改Content-Length，chunked编码会置r->chunked，所以这里只要求发给客户端的状态码
+和Content-Length与上游的一致。splice绕过了ngx_http_write_filter，limit_rate、limit_rate_after和sendfile_max_chunk
+都不会生效，配置了这些限制时仍走原来的路径
+*/
+static ngx_int_t
+ngx_http_upstream_splice_init(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_pool_cleanup_t        *cln;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (r != r->main
+        || r->chunked
+        || r->limit_rate
+        || clcf->sendfile_max_chunk
+        || u->headers_in.content_length_n <= 0
+        || r->headers_out.content_length_n != u->headers_in.content_length_n
+        || r->headers_out.status != u->headers_in.status_n)
+    {
+        return NGX_DECLINED;
+    }
+
+#if (NGX_HTTP_SSL)
+    if (r->connection->ssl || u->peer.connection->ssl) {
+        return NGX_DECLINED;
+    }
+#endif
+
+#if (NGX_HTTP_V2)
+    if (r->stream) {
+        return NGX_DECLINED;
+    }
+#endif
+
+    /* io_uring_io on时套接字上可能有未完成的RECV，数据也可能还在连接的缓冲区中，不能直接splice() */
+
+    if (u->peer.connection->recv != ngx_os_io.recv
+        || r->connection->send_chain != ngx_os_io.send_chain)
+    {
+        return NGX_DECLINED;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (pipe2(u->splice_pipe, O_NONBLOCK|O_CLOEXEC) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                      "pipe2() failed, splice disabled");
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_upstream_splice_cleanup;
+    cln->data = u;
+
+    u->splice_size = 0;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream splice: %d %d",
+                   u->splice_pipe[0], u->splice_pipe[1]);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_splice_cleanup(void *data)
+{
+    ngx_http_upstream_t  *u = data;
+
+    if (close(u->splice_pipe[0]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "close() splice pipe failed");
+    }
+
+    if (close(u->splice_pipe[1]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "close() splice pipe failed");
+    }
+}
+
+
+/*
+先把管道中的数据发给客户端，管道空了再从上游读入，直到u->length为0。返回NGX_AGAIN表示需要等待读写事件，
+NGX_OK表示包体已全部发送，其他值为ngx_http_upstream_finalize_request的参数
+*/
+static ngx_int_t
+ngx_http_upstream_splice(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    size_t             size;
+    ssize_t            n;
+    ngx_err_t          err;
+    ngx_connection_t  *downstream, *upstream;
+
+    downstream = r->connection;
+    upstream = u->peer.connection;
+
+    for ( ;; ) {
+
+        if (u->splice_size) {
+
+            if (!downstream->write->ready) {
+                return NGX_AGAIN;
+            }
+
+            n = splice(u->splice_pipe[0], NULL, downstream->fd, NULL,
+                       u->splice_size, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, downstream->log, 0,
+                           "splice to client: %z of %uz", n, u->splice_size);
+
+            if (n == -1) {
+                err = ngx_errno;
+
+                if (err == NGX_EAGAIN) {
+                    downstream->write->ready = 0;
+                    return NGX_AGAIN;
+                }
+
+                if (err == NGX_EINTR) {
+                    continue;
+                }
+
+                downstream->write->error = 1;
+                ngx_connection_error(downstream, err, "splice() failed");
+
+                return NGX_ERROR;
+            }
+
+            u->splice_size -= n;
+            downstream->sent += n;
+
+            continue;
+        }
+
+        if (u->length == 0) {
+            u->keepalive = !u->headers_in.connection_close;
+            return NGX_OK;
+        }
+
+        if (!upstream->read->ready) {
+            return NGX_AGAIN;
+        }
+
+        size = (size_t) ngx_min(u->length, NGX_HTTP_UPSTREAM_SPLICE_SIZE);
+
+        n = splice(upstream->fd, NULL, u->splice_pipe[1], NULL, size,
+                   SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, upstream->log, 0,
+                       "splice from upstream: %z of %uz", n, size);
+
+        if (n == 0) {
+            upstream->read->eof = 1;
+            ngx_log_error(NGX_LOG_ERR, upstream->log, 0,
+                          "upstream prematurely closed connection");
+            return NGX_HTTP_BAD_GATEWAY;
+        }
+
+        if (n == -1) {
+            err = ngx_errno;
+
+            if (err == NGX_EAGAIN) {
+                upstream->read->ready = 0;
+                return NGX_AGAIN;
+            }
+
+            if (err == NGX_EINTR) {
+                continue;
+            }
+
+            upstream->read->error = 1;
+            ngx_log_error(NGX_LOG_ERR, upstream->log, err,
+                          "splice() from upstream failed");
+
+            return NGX_HTTP_BAD_GATEWAY;
+        }
+
+        u->splice_size = n;
+        u->length -= n;
+        u->state->response_length += n;
+    }
+}
+
+#endif
+
 /*
 ½«u->buffer.last - u->buffer.posÖ®¼äµÄÊı¾İ·Åµ½u->out_bufs·¢ËÍ»º³åÈ¥Á´±íÀïÃæ¡£ÕâÑù¿ÉĞ´µÄÊ±ºò¾Í»á·¢ËÍ¸ø¿Í»§¶Ë¡£
 ngx_http_upstream_process_non_buffered_requestº¯Êı»á¶ÁÈ¡out_bufsÀïÃæµÄÊı¾İ£¬È»ºóµ÷ÓÃÊä³ö¹ıÂËÁ´½Ó½øĞĞ·¢ËÍµÄ¡£
@@ -6138,6 +6470,13 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+        if (ngx_strcmp(value[i].data, "resolve") == 0) {
+            us->resolve = 1;
+            continue;
+        }
+#endif
+
         goto invalid;
     }
 
@@ -6155,6 +6494,33 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    if (us->resolve) {
+
+        /* 只有域名才需要重新解析，backup服务器不在upstream_conf和重新解析的管理范围内 */
+
+        if (ngx_strncasecmp(u.url.data, (u_char *) "unix:", 5) == 0
+            || u.host.len == 0
+            || u.host.data[0] == '['
+            || ngx_inet_addr(u.host.data, u.host.len) != INADDR_NONE)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"resolve\" requires a domain name "
+                               "in upstream server \"%V\"", &u.url);
+            return NGX_CONF_ERROR;
+        }
+
+        if (us->backup) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"resolve\" cannot be used with \"backup\"");
+            return NGX_CONF_ERROR;
+        }
+
+        us->host = u.host;
+        us->port = u.port;
+    }
+#endif
+
     us->name = u.url;
     us->addrs = u.addrs;
     us->naddrs = u.naddrs;
@@ -32,6 +32,9 @@
 #define NGX_HTTP_UPSTREAM_FT_NOLIVE          0x40000000
 #define NGX_HTTP_UPSTREAM_FT_OFF             0x80000000
 
+/* 一次splice()从上游读入管道的最大字节数，与默认的管道容量相同 */
+#define NGX_HTTP_UPSTREAM_SPLICE_SIZE          65536
+
 #define NGX_HTTP_UPSTREAM_FT_STATUS          (NGX_HTTP_UPSTREAM_FT_HTTP_500  \
                                              |NGX_HTTP_UPSTREAM_FT_HTTP_502  \
                                              |NGX_HTTP_UPSTREAM_FT_HTTP_503  \
@@ -112,6 +115,13 @@ typedef struct { //ngx_http_upstream_srv_conf_s->servers[]中的成员   创建
 
     unsigned                         down:1; //该服务器处于离线状态，不可用
     unsigned                         backup:1; //备份服务器 所有的非备份服务器都宕机或繁忙，则使用本服务器
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    /* server指令带resolve参数时有效，运行中按DNS的TTL重新解析host，见ngx_http_upstream_zone_resolve_handler */
+    unsigned                         resolve:1;
+    ngx_str_t                        host; //不带端口的域名
+    in_port_t                        port;
+#endif
 } ngx_http_upstream_server_t;
 
 
@@ -161,6 +171,11 @@ struct ngx_http_upstream_srv_conf_s { //upstream {}模块配置信息,该配置
 
 #if (NGX_HTTP_UPSTREAM_ZONE)
     ngx_shm_zone_t                  *shm_zone;
+    /* zone指令的spare参数，共享内存中预留给upstream_conf运行时添加服务器的空位数 */
+    ngx_uint_t                       spare;
+    /* 重新解析resolve服务器使用的http级resolver和resolver_timeout，赋值见ngx_http_upstream_zone_postconfiguration */
+    ngx_resolver_t                  *resolver;
+    ngx_msec_t                       resolver_timeout;
 #endif
 };
 
@@ -246,6 +261,8 @@ store_access表示所创建的目录、文件的权限
 响应；如果buffering为0，仅会开辟一块固定大小的内存块作为缓存来转发响应
 */ //默认为1  request_buffering是否缓存客户端到后端的包体  buffering是否缓存后端到客户端浏览器的包体
     ngx_flag_t                       buffering; //见xxx_buffering如fastcgi_buffering  是否换成后端服务器应答回来的包体
+    //proxy_splice on | off; buffering为0时用splice()经过管道把上游包体直接转给客户端，见ngx_http_upstream_splice_init
+    ngx_flag_t                       splice;
     //默认1  request_buffering是否缓存客户端到后端的包体  buffering是否缓存后端到客户端浏览器的包体
     ngx_flag_t                       request_buffering;//是否换成客户端请求的包体 XXX_request_buffering (例如proxy_request_buffering fastcgi_request_buffering
     //proxy_pass_request_headers fastcgi_pass_request_headers设置是否转发HTTP头部。
@@ -326,6 +343,7 @@ in the cache or the cache lock for this element to be released, up to the time s
     ngx_msec_t                       cache_lock_age;
 
     ngx_flag_t                       cache_revalidate;
+    ngx_flag_t                       cache_background_update; //proxy_cache_background_update 默认off
 
     /*
 语法：proxy_cache_valid reply_code [reply_code ...] time;  proxy_cache_valid  200 302 10m; 
@@ -538,6 +556,8 @@ struct ngx_http_upstream_s { //该结构中的部分成员是从upstream{}中的
     上面列出的3个超时时间(connect_timeout  send_imeout read_timeout)是必须要设置的，因为它们默认为0，如果不设置将永远无法与上游服务器建立起TCP连接（因为connect timeout值为0）。
     */ //使用upstream机制时的各种配置  例如fastcgi赋值在ngx_http_fastcgi_handler赋值来自于ngx_http_fastcgi_loc_conf_t->upstream
     ngx_http_upstream_conf_t        *conf; 
+    /* 本次请求实际使用的upstream{}配置，proxy_pass带变量时也在ngx_http_upstream_init_request中设置 */
+    ngx_http_upstream_srv_conf_t    *upstream;
     
 #if (NGX_HTTP_CACHE) //proxy_pache_cache或者fastcgi_path_cache解析的时候赋值，见ngx_http_file_cache_set_slot
     ngx_array_t                     *caches; //u->caches = &ngx_http_proxy_main_conf_t->caches;
@@ -571,6 +591,11 @@ struct ngx_http_upstream_s { //该结构中的部分成员是从upstream{}中的
     //表示来自上游服务器的响应包体的长度    proxy包体赋值在ngx_http_proxy_input_filter_init
     off_t                            length; //要发送给客户端的数据大小，还需要读取这么多进来。 
 
+#if (NGX_HAVE_SPLICE)
+    int                              splice_pipe[2];
+    size_t                           splice_size; //管道中还没有发给客户端的字节数
+#endif
+
     /*
 out_bufs在两种场景下有不同的意义：
 ①当不需要转发包体，且使用默认的input_filter方法（也就是ngx_http_upstream_non_buffered_filter方法）处理包体时，out bufs将会指向响应包体，
@@ -801,6 +826,11 @@ ngx_http_upstream_process_headers方法将会最终调用rewrite_redirect方法
     //此外，在后端服务器交互包体后，如果头部行指定没有包体，则会u->keepalive = !u->headers_in.connection_close;例如ngx_http_proxy_process_header
     unsigned                         keepalive:1;//只有在开启keepalive con-num才有效，释放后端tcp连接判断在ngx_http_upstream_free_keepalive_peer
     unsigned                         upgrade:1; //后端返回//HTTP/1.1 101的时候置1  
+    /*
+    input_filter_init中置1表示包体可以原样转发(例如proxy中有Content-Length的应答)，ngx_http_upstream_splice_init
+    再检查过滤模块没有修改包体后才真正使用splice
+    */
+    unsigned                         splice:1;
 
 /*
 request_sent表示是否已经向上游服务器发送了请求，当request_sent为1时，表示upstream机制已经向上游服务器发送了全部或者部分的请求。
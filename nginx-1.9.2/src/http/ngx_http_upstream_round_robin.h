@@ -16,6 +16,11 @@
 
 typedef struct ngx_http_upstream_rr_peer_s   ngx_http_upstream_rr_peer_t;
 
+
+/* peer->down的各个位，任何一位被设置都不会再选这台服务器 */
+#define NGX_HTTP_UPSTREAM_PEER_DOWN       1 //server指令的down参数，或者upstream_conf的down、drain
+#define NGX_HTTP_UPSTREAM_PEER_UNHEALTHY  2 //主动健康检查失败，见ngx_http_upstream_hc_finish
+
 /*
 例如upstream {
     server ip1;
@@ -69,7 +74,21 @@ struct ngx_http_upstream_rr_peer_s {
 
     //是否处于离线不可用状态 赋值见ngx_http_upstream_init_round_robin   
     //只有在server xxxx down;加上down配置，该服务器才不会被轮询到。一般都是人为指定后端某个服务器挂了，则修改配置文件加上down，然后重新reload nginx进程
-    ngx_uint_t                      down;          /* unsigned  down:1; *///指定某后端是否挂了
+    ngx_uint_t                      down;          /* unsigned  down:1; *///指定某后端是否挂了，取值见NGX_HTTP_UPSTREAM_PEER_DOWN
+
+    /* 以下两个字段只由ngx_http_upstream_ewma_module使用，配置了zone时和其他字段一样位于共享内存，所有worker可见 */
+    ngx_uint_t                      ewma;     //响应时间的峰值指数加权平均，单位微秒
+    ngx_msec_t                      ewma_stamp; //上次更新ewma的时间
+
+    /* 以下字段由ngx_http_upstream_health_check_module使用 */
+    ngx_msec_t                      hc_next;   //下次主动探测的时间，worker在peer锁内把它推后后才探测
+    ngx_uint_t                      hc_fails;  //连续探测失败次数
+    ngx_uint_t                      hc_passes; //连续探测成功次数
+
+    /* 以下字段由ngx_http_upstream_keepalive_module用原子操作更新，配置了zone时是所有worker的合计 */
+    ngx_atomic_t                    ka_idle;     //缓存中到该服务器的空闲连接数
+    ngx_atomic_t                    ka_requests; //经keepalive模块发往该服务器的请求数
+    ngx_atomic_t                    ka_reused;   //其中使用缓存连接的请求数，与ka_requests之比就是连接复用率
 
 #if (NGX_HTTP_SSL)
     void                           *ssl_session;
@@ -88,6 +107,29 @@ struct ngx_http_upstream_rr_peer_s {
 
 typedef struct ngx_http_upstream_rr_peers_s  ngx_http_upstream_rr_peers_t;
 
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+
+/*
+带resolve参数的server指令，在ngx_http_upstream_zone_copy_peers中按顺序放在共享内存的peers->resolve数组中。
+解析出的每个地址对应一个peer，这些peer的server字段都等于本结构的server，借此找到属于同一个域名的peer
+*/
+typedef struct {
+    ngx_str_t                       host;   //不带端口的域名
+    in_port_t                       port;
+    ngx_str_t                       server; //server指令中的原始字符串
+
+    ngx_int_t                       weight;
+    ngx_uint_t                      max_fails;
+    time_t                          fail_timeout;
+    ngx_uint_t                      down;
+
+    /* 下次解析的时间，worker在peers写锁内把它推后后才解析，所以同一时间只有一个worker解析同一个域名 */
+    ngx_msec_t                      expire;
+} ngx_http_upstream_rr_resolve_t;
+
+#endif
+
 //此函数会创建后端服务器列表，并且将非后备服务器与后备服务器分开进行各自单独的链表。每一个后端服务器用一个结构体
 //ngx_http_upstream_rr_peer_t与之对应（ngx_http_upstream_round_robin.h）： 
 
@@ -98,6 +140,9 @@ struct ngx_http_upstream_rr_peers_s { //每个upstream节点的信息
 #if (NGX_HTTP_UPSTREAM_ZONE)
     ngx_slab_pool_t                *shpool;
     ngx_atomic_t                    rwlock;
+
+    ngx_http_upstream_rr_resolve_t *resolve; //需要重新解析的域名，只在非backup的peers中
+    ngx_uint_t                      nresolve;
 #endif
 
     ngx_uint_t                      total_weight; //所有服务器的权重和
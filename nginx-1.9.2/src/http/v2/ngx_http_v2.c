@@ -201,6 +201,9 @@ static ngx_int_t ngx_http_v2_init_request_body(ngx_http_request_t *r);
 
 static ngx_int_t ngx_http_v2_terminate_stream(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_stream_t *stream, ngx_uint_t status);
+static void ngx_http_v2_free_stream(ngx_http_v2_connection_t *h2c,
+    ngx_http_v2_stream_t *stream);
+static void ngx_http_v2_destroy_free_streams(ngx_http_v2_connection_t *h2c);
 static void ngx_http_v2_close_stream_handler(ngx_event_t *ev);
 static void ngx_http_v2_handle_connection_handler(ngx_event_t *rev);
 static void ngx_http_v2_idle_handler(ngx_event_t *rev);
@@ -283,6 +286,8 @@ ngx_http_v2_init(ngx_event_t *rev)
     /* 获取http2模块的配置信息 */
     h2scf = ngx_http_get_module_srv_conf(hc->conf_ctx, ngx_http_v2_module);
 
+    ngx_http_v2_table_enc_init(h2c, h2scf->hpack_table_size);
+
     h2c->pool = ngx_create_pool(h2scf->pool_size, h2c->connection->log);
     if (h2c->pool == NULL) {
         ngx_http_close_connection(c);
@@ -684,6 +689,8 @@ ngx_http_v2_handle_connection(ngx_http_v2_connection_t *h2c)
         return;
     }
 
+    ngx_http_v2_destroy_free_streams(h2c);
+
     ngx_destroy_pool(h2c->pool);
 
     h2c->pool = NULL;
@@ -2181,6 +2188,11 @@ ngx_http_v2_state_settings_params(ngx_http_v2_connection_t *h2c, u_char *pos,
             h2c->frame_size = value;
             break;
 
+        /* 客户端解码动态表的上限，编码应答头部时使用的动态表不能超过该值 */
+        case NGX_HTTP_V2_HEADER_TABLE_SIZE_SETTING:
+            ngx_http_v2_table_enc_size(h2c, value);
+            break;
+
         default:
             break;
         }
@@ -2893,11 +2905,14 @@ static ngx_http_v2_stream_t *
 ngx_http_v2_create_stream(ngx_http_v2_connection_t *h2c)
 {
     ngx_log_t                 *log;
+    ngx_pool_t                *pool;
     ngx_event_t               *rev, *wev;
     ngx_connection_t          *fc;
     ngx_http_log_ctx_t        *ctx;
+    ngx_chain_t               *free_data_headers;
     ngx_http_request_t        *r;
     ngx_http_v2_stream_t      *stream;
+    ngx_http_v2_out_frame_t   *free_frames;
     ngx_http_core_srv_conf_t  *cscf;
 
     fc = h2c->free_fake_connections;
@@ -2967,9 +2982,37 @@ ngx_http_v2_create_stream(ngx_http_v2_connection_t *h2c)
     fc->sndlowat = 1;
     fc->tcp_nodelay = NGX_TCP_NODELAY_DISABLED;
 
-    r = ngx_http_create_request(fc);
+    /* 优先使用本连接上已关闭流留下的流结构和请求池 */
+
+    stream = h2c->free_streams;
+
+    if (stream) {
+        h2c->free_streams = stream->next;
+
+        free_frames = stream->free_frames;
+        free_data_headers = stream->free_data_headers;
+
+        pool = stream->pool;
+
+        if (pool) {
+            pool->log = log;
+        }
+
+    } else {
+        stream = ngx_palloc(h2c->pool, sizeof(ngx_http_v2_stream_t));
+        if (stream == NULL) {
+            return NULL;
+        }
+
+        free_frames = NULL;
+        free_data_headers = NULL;
+
+        pool = NULL;
+    }
+
+    r = ngx_http_alloc_request(fc, pool);
     if (r == NULL) {
-        return NULL;
+        goto failed;
     }
 
     ngx_str_set(&r->http_protocol, "HTTP/2.0");
@@ -2985,7 +3028,7 @@ ngx_http_v2_create_stream(ngx_http_v2_connection_t *h2c)
                                        cscf->client_header_buffer_size);
     if (r->header_in == NULL) {
         ngx_http_free_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
-        return NULL;
+        goto failed;
     }
 
     if (ngx_list_init(&r->headers_in.headers, r->pool, 20,
@@ -2993,16 +3036,15 @@ ngx_http_v2_create_stream(ngx_http_v2_connection_t *h2c)
         != NGX_OK)
     {
         ngx_http_free_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
-        return NULL;
+        goto failed;
     }
 
     r->headers_in.connection_type = NGX_HTTP_CONNECTION_CLOSE;
 
-    stream = ngx_pcalloc(r->pool, sizeof(ngx_http_v2_stream_t));
-    if (stream == NULL) {
-        ngx_http_free_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
-        return NULL;
-    }
+    ngx_memzero(stream, sizeof(ngx_http_v2_stream_t));
+
+    stream->free_frames = free_frames;
+    stream->free_data_headers = free_data_headers;
 
     r->stream = stream;
 
@@ -3015,6 +3057,26 @@ ngx_http_v2_create_stream(ngx_http_v2_connection_t *h2c)
     h2c->processing++;
 
     return stream;
+
+failed:
+
+    /*
+     * 请求池已经在ngx_http_alloc_request或ngx_http_free_request中销毁(r->stream还没有设置)，
+     * 流结构和伪连接放回空闲链表，下一个流重新创建请求池
+     */
+
+    ngx_memzero(stream, sizeof(ngx_http_v2_stream_t));
+
+    stream->free_frames = free_frames;
+    stream->free_data_headers = free_data_headers;
+
+    stream->next = h2c->free_streams;
+    h2c->free_streams = stream;
+
+    fc->data = h2c->free_fake_connections;
+    h2c->free_fake_connections = fc;
+
+    return NULL;
 }
 
 /* 根据sid查找对应的node，如果找到直接返回，找不到并在alloc=1(允许开辟新的空间创建新的node节点)则创建一个node节点 */
@@ -3873,11 +3935,23 @@ ngx_http_v2_close_stream(ngx_http_v2_stream_t *stream, ngx_int_t rc)
 
     node->stream = NULL;
 
+    /* 流结构会被回收，不能再让读状态机把后续的帧交给它 */
+    if (h2c->state.stream == stream) {
+        h2c->state.stream = NULL;
+    }
+
     ngx_queue_insert_tail(&h2c->closed, &node->reuse);
     h2c->closed_nodes++;
 
+    if (stream->handled) {
+        stream->handled = 0;
+        ngx_queue_remove(&stream->queue);
+    }
+
     ngx_http_free_request(stream->request, rc);
 
+    ngx_http_v2_free_stream(h2c, stream);
+
     ev = fc->read;
 
     if (ev->active || ev->disabled) {
@@ -3924,6 +3998,66 @@ ngx_http_v2_close_stream(ngx_http_v2_stream_t *stream, ngx_int_t rc)
 }
 
 
+/*
+ngx_http_free_request已经把请求池交回stream->pool，这里运行池上的cleanup并重置，连同流结构挂到h2c->free_streams，
+下一个流在ngx_http_v2_create_stream中直接使用，不再每个流都创建和销毁一次请求池。内存块太多的池直接销毁，
+免得一个大请求留下的内存一直占用到连接空闲
+*/
+static void
+ngx_http_v2_free_stream(ngx_http_v2_connection_t *h2c,
+    ngx_http_v2_stream_t *stream)
+{
+    ngx_uint_t           n;
+    ngx_pool_t          *pool, *p;
+    ngx_pool_cleanup_t  *cln;
+
+    pool = stream->pool;
+
+    n = 0;
+
+    for (p = pool; p; p = p->d.next) {
+        n++;
+    }
+
+    if (n > NGX_HTTP_V2_MAX_POOL_BLOCKS) {
+        ngx_destroy_pool(pool);
+        stream->pool = NULL;
+
+    } else {
+        for (cln = pool->cleanup; cln; cln = cln->next) {
+            if (cln->handler) {
+                cln->handler(cln->data);
+            }
+        }
+
+        pool->cleanup = NULL;
+
+        ngx_reset_pool(pool);
+    }
+
+    stream->request = NULL;
+
+    stream->next = h2c->free_streams;
+    h2c->free_streams = stream;
+}
+
+
+/* 流结构在h2c->pool中，销毁h2c->pool之前先销毁它们保留的请求池 */
+static void
+ngx_http_v2_destroy_free_streams(ngx_http_v2_connection_t *h2c)
+{
+    ngx_http_v2_stream_t  *stream;
+
+    for (stream = h2c->free_streams; stream; stream = stream->next) {
+        if (stream->pool) {
+            ngx_destroy_pool(stream->pool);
+        }
+    }
+
+    h2c->free_streams = NULL;
+}
+
+
 static void
 ngx_http_v2_close_stream_handler(ngx_event_t *ev)
 {
@@ -4319,6 +4453,7 @@ ngx_http_v2_pool_cleanup(void *data)
     }
 
     if (h2c->pool) {
+        ngx_http_v2_destroy_free_streams(h2c);
         ngx_destroy_pool(h2c->pool);
     }
 }
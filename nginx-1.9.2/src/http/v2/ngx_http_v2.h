@@ -461,6 +461,12 @@ Stream Identifier若为0x0，则表示针对整个连接，否则针对具体流
 #define NGX_HTTP_V2_INT_OCTETS           4
 #define NGX_HTTP_V2_MAX_FIELD            ((1 << NGX_HTTP_V2_INT_OCTETS * 7) - 1)
 
+/* http2_hpack_table_size的上限，动态表索引最大为61 + 65536 / 32，用NGX_HTTP_V2_INT_OCTETS个字节足够编码 */
+#define NGX_HTTP_V2_MAX_HPACK_TABLE_SIZE 65536
+
+/* 流关闭后请求池的内存块不超过这么多个才留给下一个流，否则直接销毁，见ngx_http_v2_free_stream */
+#define NGX_HTTP_V2_MAX_POOL_BLOCKS      4
+
 /* 以下三个都是赋值给V2的ngx_http_v2_stream_t.skip_data */
 #define NGX_HTTP_V2_DATA_DISCARD         1
 #define NGX_HTTP_V2_DATA_ERROR           2
@@ -594,6 +600,38 @@ typedef struct {
     u_char                          *pos;
 } ngx_http_v2_hpack_t;
 
+
+typedef struct {
+    ngx_http_v2_header_t             header; /* name(小写)和value都指向ngx_http_v2_hpack_enc_t.storage */
+    ngx_uint_t                       hash;   /* name的ngx_hash_key */
+} ngx_http_v2_hpack_enc_entry_t;
+
+/*
+ngx_http_v2_connection_t.hpack_enc，编码应答头部用的动态表，和客户端解码用的动态表一一对应。只在
+ngx_http_v2_header_filter中修改，生成的HEADERS帧按创建顺序发送(见ngx_http_v2_queue_blocked_frame)，
+所以客户端看到的插入顺序和这里相同
+*/
+typedef struct {
+    /* 环形数组，第k个加入的表项在entries[k % allocated]，有效的k为[deleted, added) */
+    ngx_http_v2_hpack_enc_entry_t   *entries;
+    ngx_uint_t                       added;
+    ngx_uint_t                       deleted;
+    ngx_uint_t                       allocated;
+
+    size_t                           capacity; /* http2_hpack_table_size配置项 */
+    /* 当前动态表大小，不超过capacity和客户端SETTINGS_HEADER_TABLE_SIZE中较小的一个 */
+    size_t                           size;
+    size_t                           free;
+    /* 上次发送Dynamic Table Size Update以后size的最小值，RFC 7541 4.2要求先通知这个值 */
+    size_t                           min_size;
+
+    u_char                          *storage; /* capacity字节的环形缓冲区 */
+    u_char                          *pos;
+
+    /* size变化后置1，下一个头部块开头发送Dynamic Table Size Update */
+    unsigned                         size_update:1;
+} ngx_http_v2_hpack_enc_t;
+
 /* ngx_http_v2_init中分配空间 */
 struct ngx_http_v2_connection_s {
     ngx_connection_t                *connection;//对应的客户端连接，赋值见ngx_http_v2_init
@@ -626,12 +664,16 @@ struct ngx_http_v2_connection_s {
     ngx_http_v2_state_t              state;
     /* hpack动态表，创建空间和赋值见ngx_http_v2_add_header */
     ngx_http_v2_hpack_t              hpack;
+    /* 应答头部编码用的动态表，见ngx_http_v2_table_enc_init */
+    ngx_http_v2_hpack_enc_t          hpack_enc;
 
     ngx_pool_t                      *pool;
     /* frame通过该free链表来实现重复利用，可以参考ngx_http_v2_get_frame ngx_http_v2_frame_handler*/
     ngx_http_v2_out_frame_t         *free_frames;
     /* 创建空间和赋值见ngx_http_v2_create_stream，根据客户端连接伪造的一个连接 */
     ngx_connection_t                *free_fake_connections;
+    /* 已关闭流的ngx_http_v2_stream_t，连同重置过的请求池给同一连接上的新流使用，见ngx_http_v2_free_stream */
+    ngx_http_v2_stream_t            *free_streams;
     
     /* ngx_http_v2_node_t类型的数组指针，ngx_http_v2_init中创建空间和赋值，真正的ngx_http_v2_node_t赋值见ngx_http_v2_get_node_by_id */
     ngx_http_v2_node_t             **streams_index;
@@ -661,6 +703,12 @@ struct ngx_http_v2_connection_s {
     /* 最末尾的一个流ID号 */
     ngx_uint_t                       last_sid;
 
+    /*
+    加权公平队列的虚拟时间，等于最近发送完成的DATA帧的vfinish，见ngx_http_v2_data_frame_handler。
+    新的DATA帧的vfinish从这里和stream->vfinish中较大的一个开始计算，见ngx_http_v2_send_chain
+    */
+    double                           vtime;
+
     unsigned                         closed_nodes:8;
     unsigned                         blocked:1;
 };
@@ -746,10 +794,15 @@ struct ngx_http_v2_stream_s {
     ssize_t                          send_window; //默认等于h2c->init_window，也就是65535
     size_t                           recv_window; //默认值NGX_HTTP_V2_MAX_WINDOW 2^32 - 1
 
+    /* free_frames和free_data_headers从h2c->pool分配，流结构回收后继续给下一个流使用 */
     ngx_http_v2_out_frame_t         *free_frames;
     ngx_chain_t                     *free_data_headers;
     ngx_chain_t                     *free_bufs;
 
+    /* 流关闭后ngx_http_free_request把请求池交回这里，next用于挂到h2c->free_streams */
+    ngx_pool_t                      *pool;
+    ngx_http_v2_stream_t            *next;
+
     ngx_queue_t                      queue;
     /* 创建空间和赋值见ngx_http_v2_cookie,header帧中如果有设置cookie，则赋值到该数组中 */
     ngx_array_t                     *cookies;
@@ -758,6 +811,9 @@ struct ngx_http_v2_stream_s {
     */
     size_t                           header_limit;
 
+    /* 该流最后一个入队的DATA帧的vfinish */
+    double                           vfinish;
+
     unsigned                         handled:1;
     unsigned                         blocked:1;
     unsigned                         exhausted:1;
@@ -787,6 +843,12 @@ struct ngx_http_v2_out_frame_s {
     ngx_http_v2_stream_t            *stream;
     size_t                           length;
 
+    /*
+    DATA帧的虚拟完成时间，等于开始时间加上length / node->rel_weight，同一rank的DATA帧按该值从小到大发送，
+    这样同一连接上各个流按权重分享带宽，后到的小请求不用等前面大文件已经排队的帧全部发完
+    */
+    double                           vfinish;
+
     /* 说明该帧在ngx_http_v2_send_output_queue调用的时候还没有发送出去，当数据发送出去后ngx_http_v2_out_frame_t会被
     stream->free_frames回收，这时候还是为1，下次get重复利用的时候就是0了
     */
@@ -809,12 +871,11 @@ ngx_http_v2_queue_frame(ngx_http_v2_connection_t *h2c,
         }
 
         /* 树形结构中不同的rank层，上面的优先级比下面层的优先级高，先发送
-           同一层的数据，rel_weight大的先发送
+           同一层的数据，vfinish小的先发送
         */
         if ((*out)->stream->node->rank < frame->stream->node->rank
             || ((*out)->stream->node->rank == frame->stream->node->rank
-                && (*out)->stream->node->rel_weight
-                   >= frame->stream->node->rel_weight))
+                && (*out)->vfinish <= frame->vfinish))
         {
             break;
         }
@@ -861,9 +922,20 @@ ngx_int_t ngx_http_v2_add_header(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_header_t *header);
 ngx_int_t ngx_http_v2_table_size(ngx_http_v2_connection_t *h2c, size_t size);
 
+void ngx_http_v2_table_enc_init(ngx_http_v2_connection_t *h2c,
+    size_t capacity);
+ngx_int_t ngx_http_v2_table_enc_alloc(ngx_http_v2_connection_t *h2c);
+void ngx_http_v2_table_enc_size(ngx_http_v2_connection_t *h2c, size_t size);
+ngx_uint_t ngx_http_v2_table_enc_find(ngx_http_v2_connection_t *h2c,
+    ngx_str_t *name, ngx_str_t *value, ngx_uint_t hash,
+    ngx_uint_t *name_index);
+void ngx_http_v2_table_enc_add(ngx_http_v2_connection_t *h2c,
+    ngx_str_t *name, ngx_str_t *value, ngx_uint_t hash);
+
 
 ngx_int_t ngx_http_v2_huff_decode(u_char *state, u_char *src, size_t len,
     u_char **dst, ngx_uint_t last, ngx_log_t *log);
+size_t ngx_http_v2_huff_encode(u_char *src, size_t len, u_char *dst);
 
 /* 低bits - 1位全为1  例如bits为4，则结果为bit:1111   例如bits为5，则结果为bit:1111*/
 #define ngx_http_v2_prefix(bits)  ((1 << (bits)) - 1)
@@ -20,6 +20,12 @@
 /* 128也就是位操作1000 0000,也就是该index在索引表中，如果i为1表示索引表的0，i=2对应索引表的1，i=3对应索引表的2，i=4对应索引表的3 */
 #define ngx_http_v2_indexed(i)      (128 + (i))
 #define ngx_http_v2_inc_indexed(i)  (64 + (i))
+/* Dynamic Table Size Update，后面跟5位前缀的整数，见RFC 7541 6.3 */
+#define ngx_http_v2_size_update     32
+
+/* 字符串字面量第一个字节的H位，见RFC 7541 5.2 */
+#define NGX_HTTP_V2_ENCODE_RAW            0
+#define NGX_HTTP_V2_ENCODE_HUFF           0x80
 
 /* 和ngx_http_v2_static_table数组下表对应，相差1 */
 #define NGX_HTTP_V2_STATUS_INDEX          8
@@ -39,7 +45,18 @@
 #define NGX_HTTP_V2_SERVER_INDEX          54
 #define NGX_HTTP_V2_VARY_INDEX            59
 
+/*
+每个流在发送队列中最多同时有这么多个DATA帧，发送出去以后再继续组帧，避免一个大文件把整个发送窗口的数据
+一次排进h2c->last_out，见ngx_http_v2_send_chain
+*/
+#define NGX_HTTP_V2_MAX_QUEUED_FRAMES     4
 
+
+static u_char *ngx_http_v2_write_header(ngx_http_v2_connection_t *h2c,
+    u_char *pos, ngx_uint_t index, ngx_str_t *name, ngx_str_t *value,
+    ngx_uint_t indexing, u_char *tmp);
+static u_char *ngx_http_v2_write_string(u_char *pos, u_char *data, size_t len,
+    u_char *tmp);
 static u_char *ngx_http_v2_write_int(u_char *pos, ngx_uint_t prefix,
     ngx_uint_t value);
 static void ngx_http_v2_write_headers_head(u_char *pos, size_t length,
@@ -137,10 +154,10 @@ static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
 static ngx_int_t
 ngx_http_v2_header_filter(ngx_http_request_t *r)
 {
-    u_char                     status, *p, *head;
-    size_t                     len, rest;
+    u_char                     status, *p, *head, *lower, *huff;
+    size_t                     len, rest, tmp_len;
     ngx_buf_t                 *b;
-    ngx_str_t                  host, location;
+    ngx_str_t                  host, location, name, value;
     ngx_uint_t                 i, port, continuation;
     ngx_chain_t               *cl;
     ngx_list_part_t           *part;
@@ -149,6 +166,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     ngx_http_cleanup_t        *cln;
     ngx_http_v2_stream_t      *stream;
     ngx_http_v2_out_frame_t   *frame;
+    ngx_http_v2_connection_t  *h2c;
     ngx_http_core_loc_conf_t  *clcf;
     ngx_http_core_srv_conf_t  *cscf;
     struct sockaddr_in        *sin;
@@ -156,6 +174,8 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     struct sockaddr_in6       *sin6;
 #endif
     u_char                     addr[NGX_SOCKADDR_STRLEN];
+    u_char                     buf[sizeof("Wed, 31 Dec 1986 18:00:00 GMT")
+                                   + NGX_OFF_T_LEN];
 
 
     if (!r->stream) { /* 如果没有创建对应的stream，则直接跳到下一个filter */
@@ -236,41 +256,75 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     */
 
     /* 头部9字节 + status响应长度(1字节为什么可以表示status响应码，因为一个字节就可以表示静态表的那个成员,见ngx_http_v2_static_table) */
+    stream = r->stream;
+    h2c = stream->connection;
+
     len = NGX_HTTP_V2_FRAME_HEADER_SIZE
           + (status ? 1 : 1 + ngx_http_v2_literal_size("418"));
 
+    /* 动态表大小有变化时，头部块开头最多有两个Dynamic Table Size Update */
+    if (h2c->hpack_enc.size_update) {
+        len += 2 * NGX_HTTP_V2_INT_OCTETS;
+    }
+
+    /* tmp_len为需要编码的最长字符串，Huffman编码和转换小写的头部名都先写到临时空间 */
+    tmp_len = sizeof("Wed, 31 Dec 1986 18:00:00 GMT") - 1;
+
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
     //对server:进行编码
     if (r->headers_out.server == NULL) {
-        len += 1 + clcf->server_tokens ? ngx_http_v2_literal_size(NGINX_VER)
-                                       : ngx_http_v2_literal_size("nginx");
+        len += NGX_HTTP_V2_INT_OCTETS + ngx_http_v2_literal_size(NGINX_VER);
     }
 
     if (r->headers_out.date == NULL) {
-        len += 1 + ngx_http_v2_literal_size("Wed, 31 Dec 1986 18:00:00 GMT");
+        len += NGX_HTTP_V2_INT_OCTETS
+               + ngx_http_v2_literal_size("Wed, 31 Dec 1986 18:00:00 GMT");
     }
 
     if (r->headers_out.content_type.len) {
-        len += NGX_HTTP_V2_INT_OCTETS + r->headers_out.content_type.len;
 
         if (r->headers_out.content_type_len == r->headers_out.content_type.len
             && r->headers_out.charset.len)
         {
-            len += sizeof("; charset=") - 1 + r->headers_out.charset.len;
+            value.len = r->headers_out.content_type.len
+                        + sizeof("; charset=") - 1 + r->headers_out.charset.len;
+
+            value.data = ngx_pnalloc(r->pool, value.len);
+            if (value.data == NULL) {
+                return NGX_ERROR;
+            }
+
+            p = ngx_cpymem(value.data, r->headers_out.content_type.data,
+                           r->headers_out.content_type.len);
+
+            p = ngx_cpymem(p, "; charset=", sizeof("; charset=") - 1);
+
+            ngx_memcpy(p, r->headers_out.charset.data,
+                       r->headers_out.charset.len);
+
+            /* update r->headers_out.content_type for possible logging */
+
+            r->headers_out.content_type = value;
         }
+
+        len += NGX_HTTP_V2_INT_OCTETS * 2 + r->headers_out.content_type.len;
+
+        tmp_len = ngx_max(tmp_len, r->headers_out.content_type.len);
     }
 
     if (r->headers_out.content_length == NULL
         && r->headers_out.content_length_n >= 0)
     {
-        len += 1 + ngx_http_v2_integer_octets(NGX_OFF_T_LEN) + NGX_OFF_T_LEN;
+        len += NGX_HTTP_V2_INT_OCTETS
+               + ngx_http_v2_integer_octets(NGX_OFF_T_LEN) + NGX_OFF_T_LEN;
     }
 
     if (r->headers_out.last_modified == NULL
         && r->headers_out.last_modified_time != -1)
     {
-        len += 1 + ngx_http_v2_literal_size("Wed, 31 Dec 1986 18:00:00 GMT");
+        len += NGX_HTTP_V2_INT_OCTETS
+               + ngx_http_v2_literal_size("Wed, 31 Dec 1986 18:00:00 GMT");
     }
 
     fc = r->connection;
@@ -365,13 +419,17 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 
         r->headers_out.location->hash = 0;
 
-        len += 1 + NGX_HTTP_V2_INT_OCTETS + r->headers_out.location->value.len;
+        len += NGX_HTTP_V2_INT_OCTETS * 2
+               + r->headers_out.location->value.len;
+
+        tmp_len = ngx_max(tmp_len, r->headers_out.location->value.len);
     }
 
 #if (NGX_HTTP_GZIP)
     if (r->gzip_vary) {
         if (clcf->gzip_vary) {
-            len += 1 + ngx_http_v2_literal_size("Accept-Encoding");
+            len += NGX_HTTP_V2_INT_OCTETS
+                   + ngx_http_v2_literal_size("Accept-Encoding");
 
         } else {
             r->gzip_vary = 0;
@@ -413,128 +471,162 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
             return NGX_ERROR;
         }
 
-        len += NGX_HTTP_V2_INT_OCTETS + header[i].key.len
-               + NGX_HTTP_V2_INT_OCTETS + header[i].value.len;
-    }
+        len += NGX_HTTP_V2_INT_OCTETS * 3 + header[i].key.len
+               + header[i].value.len;
 
-    stream = r->stream;
+        tmp_len = ngx_max(tmp_len, header[i].key.len);
+        tmp_len = ngx_max(tmp_len, header[i].value.len);
+    }
 
     /* 如果整个头部帧内容超过了最大frame_size大小，则可能需要拆分到多个帧 */
     len += NGX_HTTP_V2_FRAME_HEADER_SIZE
            * (len / stream->connection->frame_size);
 
+    /*
+     * 开始编码以后会修改h2c->hpack_enc，这之后不能再出错返回，否则客户端的动态表会和这里不一致，
+     * 所以需要的内存都在这里先分配好
+     */
+
     b = ngx_create_temp_buf(r->pool, len);
     if (b == NULL) {
         return NGX_ERROR;
     }
 
+    lower = ngx_pnalloc(r->pool, tmp_len * 2);
+    if (lower == NULL) {
+        return NGX_ERROR;
+    }
+
+    huff = lower + tmp_len;
+
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    /*
+     * 针对前面的header帧封包，组一个frame结构，挂到h2c->last_out队列，通过ngx_http_v2_filter_send触发发送出去。
+     * 发送完后frame会挂到stream->free_frames，随流结构一起回收给下一个流，所以要从h2c->pool分配
+     */
+    frame = ngx_palloc(stream->connection->pool,
+                       sizeof(ngx_http_v2_out_frame_t));
+    if (frame == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln = ngx_http_cleanup_add(r, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_v2_table_enc_alloc(h2c) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
     b->last_buf = r->header_only;
 
     b->last += NGX_HTTP_V2_FRAME_HEADER_SIZE;
 
+    if (h2c->hpack_enc.size_update) {
+        if (h2c->hpack_enc.min_size < h2c->hpack_enc.size) {
+            *b->last = ngx_http_v2_size_update;
+            b->last = ngx_http_v2_write_int(b->last, ngx_http_v2_prefix(5),
+                                            h2c->hpack_enc.min_size);
+        }
+
+        *b->last = ngx_http_v2_size_update;
+        b->last = ngx_http_v2_write_int(b->last, ngx_http_v2_prefix(5),
+                                        h2c->hpack_enc.size);
+
+        h2c->hpack_enc.min_size = h2c->hpack_enc.size;
+        h2c->hpack_enc.size_update = 0;
+    }
+
     if (status) {
         *b->last++ = status;
+
     } else {
-        *b->last++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_STATUS_INDEX);
-        *b->last++ = 3;
-        b->last = ngx_sprintf(b->last, "%03ui", r->headers_out.status);
+        value.data = buf;
+        value.len = ngx_sprintf(buf, "%03ui", r->headers_out.status) - buf;
+
+        b->last = ngx_http_v2_write_header(h2c, b->last,
+                                           NGX_HTTP_V2_STATUS_INDEX, NULL,
+                                           &value, 0, huff);
     }
 
     if (r->headers_out.server == NULL) {
-        *b->last++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_SERVER_INDEX);
+        ngx_str_set(&name, "server");
 
         if (clcf->server_tokens) {
-            *b->last++ = sizeof(NGINX_VER) - 1;
-            b->last = ngx_cpymem(b->last, NGINX_VER, sizeof(NGINX_VER) - 1);
+            ngx_str_set(&value, NGINX_VER);
 
         } else {
-            *b->last++ = sizeof("nginx") - 1;
-            b->last = ngx_cpymem(b->last, "nginx", sizeof("nginx") - 1);
+            ngx_str_set(&value, "nginx");
         }
+
+        b->last = ngx_http_v2_write_header(h2c, b->last,
+                                           NGX_HTTP_V2_SERVER_INDEX, &name,
+                                           &value, 1, huff);
     }
 
     if (r->headers_out.date == NULL) {
-        *b->last++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_DATE_INDEX);
-        *b->last++ = (u_char) ngx_cached_http_time.len;
+        value.len = ngx_cached_http_time.len;
+        value.data = ngx_cached_http_time.data;
 
-        b->last = ngx_cpymem(b->last, ngx_cached_http_time.data,
-                             ngx_cached_http_time.len);
+        b->last = ngx_http_v2_write_header(h2c, b->last,
+                                           NGX_HTTP_V2_DATE_INDEX, NULL,
+                                           &value, 0, huff);
     }
 
     if (r->headers_out.content_type.len) {
-        *b->last++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_CONTENT_TYPE_INDEX);
-
-        if (r->headers_out.content_type_len == r->headers_out.content_type.len
-            && r->headers_out.charset.len)
-        {
-            *b->last = 0;
-            b->last = ngx_http_v2_write_int(b->last, ngx_http_v2_prefix(7),
-                                            r->headers_out.content_type.len
-                                            + sizeof("; charset=") - 1
-                                            + r->headers_out.charset.len);
-
-            p = b->last;
-
-            b->last = ngx_cpymem(p, r->headers_out.content_type.data,
-                                 r->headers_out.content_type.len);
+        ngx_str_set(&name, "content-type");
 
-            b->last = ngx_cpymem(b->last, "; charset=",
-                                 sizeof("; charset=") - 1);
-
-            b->last = ngx_cpymem(b->last, r->headers_out.charset.data,
-                                 r->headers_out.charset.len);
-
-            /* update r->headers_out.content_type for possible logging */
-
-            r->headers_out.content_type.len = b->last - p;
-            r->headers_out.content_type.data = p;
-
-        } else {
-            *b->last = 0;
-            b->last = ngx_http_v2_write_int(b->last, ngx_http_v2_prefix(7),
-                                            r->headers_out.content_type.len);
-            b->last = ngx_cpymem(b->last, r->headers_out.content_type.data,
-                                 r->headers_out.content_type.len);
-        }
+        b->last = ngx_http_v2_write_header(h2c, b->last,
+                                           NGX_HTTP_V2_CONTENT_TYPE_INDEX,
+                                           &name,
+                                           &r->headers_out.content_type, 1,
+                                           huff);
     }
 
     if (r->headers_out.content_length == NULL
         && r->headers_out.content_length_n >= 0)
     {
-        *b->last++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_CONTENT_LENGTH_INDEX);
+        value.data = buf;
+        value.len = ngx_sprintf(buf, "%O", r->headers_out.content_length_n)
+                    - buf;
 
-        p = b->last;
-        b->last = ngx_sprintf(b->last + 1, "%O",
-                              r->headers_out.content_length_n);
-        *p = (u_char) (b->last - p - 1);
+        b->last = ngx_http_v2_write_header(h2c, b->last,
+                                           NGX_HTTP_V2_CONTENT_LENGTH_INDEX,
+                                           NULL, &value, 0, huff);
     }
 
     if (r->headers_out.last_modified == NULL
         && r->headers_out.last_modified_time != -1)
     {
-        *b->last++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_LAST_MODIFIED_INDEX);
+        value.data = buf;
+        value.len = ngx_http_time(buf, r->headers_out.last_modified_time)
+                    - buf;
 
-        p = b->last;
-        b->last = ngx_http_time(b->last + 1, r->headers_out.last_modified_time);
-        *p = (u_char) (b->last - p - 1);
+        b->last = ngx_http_v2_write_header(h2c, b->last,
+                                           NGX_HTTP_V2_LAST_MODIFIED_INDEX,
+                                           NULL, &value, 0, huff);
     }
 
     if (r->headers_out.location && r->headers_out.location->value.len) {
-        *b->last++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_LOCATION_INDEX);
-
-        *b->last = 0;
-        b->last = ngx_http_v2_write_int(b->last, ngx_http_v2_prefix(7),
-                                        r->headers_out.location->value.len);
-        b->last = ngx_cpymem(b->last, r->headers_out.location->value.data,
-                                      r->headers_out.location->value.len);
+        b->last = ngx_http_v2_write_header(h2c, b->last,
+                                           NGX_HTTP_V2_LOCATION_INDEX, NULL,
+                                           &r->headers_out.location->value, 0,
+                                           huff);
     }
 
 #if (NGX_HTTP_GZIP)
     if (r->gzip_vary) {
-        *b->last++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_VARY_INDEX);
-        *b->last++ = sizeof("Accept-Encoding") - 1;
-        b->last = ngx_cpymem(b->last, "Accept-Encoding",
-                             sizeof("Accept-Encoding") - 1);
+        ngx_str_set(&name, "vary");
+        ngx_str_set(&value, "Accept-Encoding");
+
+        b->last = ngx_http_v2_write_header(h2c, b->last,
+                                           NGX_HTTP_V2_VARY_INDEX, &name,
+                                           &value, 1, huff);
     }
 #endif
 
@@ -563,7 +655,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
             continue;
         }
 
-        len = 1 + NGX_HTTP_V2_INT_OCTETS * 2
+        len = NGX_HTTP_V2_INT_OCTETS * 3
               + header[i].key.len
               + header[i].value.len;
 
@@ -585,19 +677,18 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
             b->last += NGX_HTTP_V2_FRAME_HEADER_SIZE;
         }
 
-        p = b->last;
+        name.len = header[i].key.len;
+        name.data = lower;
 
-        *p++ = 0;
+        ngx_strlow(lower, header[i].key.data, header[i].key.len);
 
-        *p = 0;
-        p = ngx_http_v2_write_int(p, ngx_http_v2_prefix(7), header[i].key.len);
-        ngx_strlow(p, header[i].key.data, header[i].key.len);
-        p += header[i].key.len;
+        /* Set-Cookie每个应答都不同，加入动态表只会挤掉其他表项 */
 
-        *p = 0;
-        p = ngx_http_v2_write_int(p, ngx_http_v2_prefix(7),
-                                  header[i].value.len);
-        p = ngx_cpymem(p, header[i].value.data, header[i].value.len);
+        p = ngx_http_v2_write_header(h2c, b->last, 0, &name, &header[i].value,
+                                     name.len != sizeof("set-cookie") - 1
+                                     || ngx_strncmp(lower, "set-cookie",
+                                                    sizeof("set-cookie") - 1),
+                                     huff);
 
         rest -= p - b->last;
         b->last = p;
@@ -613,20 +704,9 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                                        r->header_only);
     }
 
-    cl = ngx_alloc_chain_link(r->pool);
-    if (cl == NULL) {
-        return NGX_ERROR;
-    }
-
     cl->buf = b;
     cl->next = NULL;
 
-    /* 针对前面的header帧封包，组一个frame结构，挂到h2c->last_out队列，通过ngx_http_v2_filter_send触发发送出去 */
-    frame = ngx_palloc(r->pool, sizeof(ngx_http_v2_out_frame_t));
-    if (frame == NULL) {
-        return NGX_ERROR;
-    }
-
     frame->first = cl;
     frame->last = cl;
     //该frame上对应的数据发送完毕后，会调用ngx_http_v2_headers_frame_handler
@@ -642,12 +722,6 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 
     ngx_http_v2_queue_blocked_frame(stream->connection, frame);
 
-    cln = ngx_http_cleanup_add(r, 0);
-    if (cln == NULL) {
-        return NGX_ERROR;
-    }
-
-    
     cln->handler = ngx_http_v2_filter_cleanup;
     cln->data = stream;
 
@@ -661,6 +735,73 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     return ngx_http_v2_filter_send(fc, stream);
 }
 
+
+/*
+按RFC 7541 6.2编码一个头部行。indexing为1并且表项不超过动态表的一半时使用Literal Header Field with Incremental
+Indexing并加入动态表，动态表中已有相同的name:value时只发送其索引；否则使用Literal Header Field without Indexing。
+index为name在静态表中的索引，为0时name必须是小写的，动态表中有同名的表项时使用其索引，否则按字面量发送name
+*/
+static u_char *
+ngx_http_v2_write_header(ngx_http_v2_connection_t *h2c, u_char *pos,
+    ngx_uint_t index, ngx_str_t *name, ngx_str_t *value, ngx_uint_t indexing,
+    u_char *tmp)
+{
+    ngx_uint_t  hash, found, name_index;
+
+    if (indexing
+        && 32 + name->len + value->len <= h2c->hpack_enc.size / 2)
+    {
+        hash = ngx_hash_key(name->data, name->len);
+        name_index = 0;
+
+        found = ngx_http_v2_table_enc_find(h2c, name, value, hash,
+                                           &name_index);
+        if (found) {
+            *pos = ngx_http_v2_indexed(0);
+            return ngx_http_v2_write_int(pos, ngx_http_v2_prefix(7), found);
+        }
+
+        if (index == 0) {
+            index = name_index;
+        }
+
+        *pos = ngx_http_v2_inc_indexed(0);
+        pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(6), index);
+
+        ngx_http_v2_table_enc_add(h2c, name, value, hash);
+
+    } else {
+        *pos = 0;
+        pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(4), index);
+    }
+
+    if (index == 0) {
+        pos = ngx_http_v2_write_string(pos, name->data, name->len, tmp);
+    }
+
+    return ngx_http_v2_write_string(pos, value->data, value->len, tmp);
+}
+
+
+/* 字符串经Huffman编码后更短就按Huffman编码发送(H位为1)，否则原样发送，tmp至少要有len字节 */
+static u_char *
+ngx_http_v2_write_string(u_char *pos, u_char *data, size_t len, u_char *tmp)
+{
+    size_t  hlen;
+
+    hlen = ngx_http_v2_huff_encode(data, len, tmp);
+
+    if (hlen) {
+        *pos = NGX_HTTP_V2_ENCODE_HUFF;
+        pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(7), hlen);
+        return ngx_cpymem(pos, tmp, hlen);
+    }
+
+    *pos = NGX_HTTP_V2_ENCODE_RAW;
+    pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(7), len);
+    return ngx_cpymem(pos, data, len);
+}
+
 static u_char *
 ngx_http_v2_write_int(u_char *pos, ngx_uint_t prefix, ngx_uint_t value)
 {
@@ -742,6 +883,7 @@ ngx_http_v2_send_chain(ngx_connection_t *fc, ngx_chain_t *in, off_t limit)
 {
     off_t                      size, offset;
     size_t                     rest, frame_size;
+    ngx_uint_t                 bounded;
     ngx_chain_t               *cl, *out, **ln;
     ngx_http_request_t        *r;
     ngx_http_v2_stream_t      *stream;
@@ -825,6 +967,8 @@ ngx_http_v2_send_chain(ngx_connection_t *fc, ngx_chain_t *in, off_t limit)
     cl = NULL;
 #endif
 
+    bounded = 0;
+
     for ( ;; ) {  
         if ((off_t) frame_size > limit) {
             frame_size = (size_t) limit;
@@ -889,6 +1033,11 @@ ngx_http_v2_send_chain(ngx_connection_t *fc, ngx_chain_t *in, off_t limit)
             return NGX_CHAIN_ERROR;
         }
 
+        /* 虚拟完成时间，rel_weight越大同样长度的帧占用的虚拟时间越少 */
+        frame->vfinish = ngx_max(h2c->vtime, stream->vfinish)
+                         + frame_size / stream->node->rel_weight;
+        stream->vfinish = frame->vfinish;
+
         ngx_http_v2_queue_frame(h2c, frame);
 
         /* 发送了这么多数据，则窗口减少 */
@@ -906,6 +1055,11 @@ ngx_http_v2_send_chain(ngx_connection_t *fc, ngx_chain_t *in, off_t limit)
         if (limit == 0) {
             break;
         }
+
+        if (stream->queued >= NGX_HTTP_V2_MAX_QUEUED_FRAMES) {
+            bounded = 1;
+            break;
+        }
     }
 
     if (offset) {
@@ -924,6 +1078,18 @@ ngx_http_v2_send_chain(ngx_connection_t *fc, ngx_chain_t *in, off_t limit)
 
     if (in && ngx_http_v2_flow_control(h2c, stream) == NGX_DECLINED) {
         fc->write->delayed = 1;
+        return in;
+    }
+
+    /*
+     * 排队的帧已经全部发送出去，把该流排到h2c->posted末尾，由ngx_http_v2_write_handler
+     * 轮流调度，同一连接上其他流的帧也有机会先发送；否则等这些帧发送完成后在
+     * ngx_http_v2_data_frame_handler中再次调度该流
+     */
+
+    if (bounded && stream->queued == 0) {
+        ngx_http_v2_handle_stream(h2c, stream);
+        ngx_post_event(h2c->connection->write, &ngx_posted_events);
     }
 
     return in;
@@ -979,7 +1145,7 @@ ngx_http_v2_filter_get_data_frame(ngx_http_v2_stream_t *stream,
         stream->free_frames = frame->next;
 
     } else {
-        frame = ngx_palloc(stream->request->pool,
+        frame = ngx_palloc(stream->connection->pool,
                            sizeof(ngx_http_v2_out_frame_t));
         if (frame == NULL) {
             return NULL;
@@ -992,7 +1158,7 @@ ngx_http_v2_filter_get_data_frame(ngx_http_v2_stream_t *stream,
                    "http2:%ui create DATA frame %p: len:%uz flags:%ui",
                    stream->node->id, frame, len, (ngx_uint_t) flags);
 
-    cl = ngx_chain_get_free_buf(stream->request->pool,
+    cl = ngx_chain_get_free_buf(stream->connection->pool,
                                 &stream->free_data_headers);
     if (cl == NULL) {
         return NULL;
@@ -1001,7 +1167,8 @@ ngx_http_v2_filter_get_data_frame(ngx_http_v2_stream_t *stream,
     buf = cl->buf;
 
     if (!buf->start) {
-        buf->start = ngx_palloc(stream->request->pool, NGX_HTTP_V2_FRAME_HEADER_SIZE);
+        buf->start = ngx_palloc(stream->connection->pool,
+                                NGX_HTTP_V2_FRAME_HEADER_SIZE);
         if (buf->start == NULL) {
             return NULL;
         }
@@ -1236,6 +1403,10 @@ done:
 
     stream->request->header_size += NGX_HTTP_V2_FRAME_HEADER_SIZE;
 
+    if (h2c->vtime < frame->vfinish) {
+        h2c->vtime = frame->vfinish;
+    }
+
     ngx_http_v2_handle_frame(stream, frame);
 
     ngx_http_v2_handle_stream(h2c, stream);
@@ -32,6 +32,8 @@ static char *ngx_http_v2_recv_buffer_size(ngx_conf_t *cf, void *post,
 static char *ngx_http_v2_pool_size(ngx_conf_t *cf, void *post, void *data);
 static char *ngx_http_v2_streams_index_mask(ngx_conf_t *cf, void *post,
     void *data);
+static char *ngx_http_v2_hpack_table_size(ngx_conf_t *cf, void *post,
+    void *data);
 static char *ngx_http_v2_chunk_size(ngx_conf_t *cf, void *post, void *data);
 static char *ngx_http_v2_spdy_deprecated(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
@@ -43,6 +45,8 @@ static ngx_conf_post_t  ngx_http_v2_pool_size_post =
     { ngx_http_v2_pool_size };
 static ngx_conf_post_t  ngx_http_v2_streams_index_mask_post =
     { ngx_http_v2_streams_index_mask };
+static ngx_conf_post_t  ngx_http_v2_hpack_table_size_post =
+    { ngx_http_v2_hpack_table_size };
 static ngx_conf_post_t  ngx_http_v2_chunk_size_post =
     { ngx_http_v2_chunk_size };
 
@@ -87,6 +91,14 @@ static ngx_command_t  ngx_http_v2_commands[] = {
       offsetof(ngx_http_v2_srv_conf_t, max_header_size),
       NULL },
 
+    //应答头部编码时使用的HPACK动态表大小，实际使用的大小不超过客户端SETTINGS_HEADER_TABLE_SIZE
+    { ngx_string("http2_hpack_table_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_v2_srv_conf_t, hpack_table_size),
+      &ngx_http_v2_hpack_table_size_post },
+
     { ngx_string("http2_streams_index_size"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_num_slot,
@@ -321,6 +333,7 @@ ngx_http_v2_create_srv_conf(ngx_conf_t *cf)
 
     h2scf->max_field_size = NGX_CONF_UNSET_SIZE;
     h2scf->max_header_size = NGX_CONF_UNSET_SIZE;
+    h2scf->hpack_table_size = NGX_CONF_UNSET_SIZE;
 
     h2scf->streams_index_mask = NGX_CONF_UNSET_UINT;
 
@@ -346,6 +359,8 @@ ngx_http_v2_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
                               4096);
     ngx_conf_merge_size_value(conf->max_header_size, prev->max_header_size,
                               16384);
+    ngx_conf_merge_size_value(conf->hpack_table_size, prev->hpack_table_size,
+                              4096);
 
     ngx_conf_merge_uint_value(conf->streams_index_mask,
                               prev->streams_index_mask, 32 - 1);
@@ -425,6 +440,23 @@ ngx_http_v2_pool_size(ngx_conf_t *cf, void *post, void *data)
 }
 
 
+static char *
+ngx_http_v2_hpack_table_size(ngx_conf_t *cf, void *post, void *data)
+{
+    size_t *sp = data;
+
+    if (*sp > NGX_HTTP_V2_MAX_HPACK_TABLE_SIZE) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "the hpack table size must be no more than %uz",
+                           (size_t) NGX_HTTP_V2_MAX_HPACK_TABLE_SIZE);
+
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
 static char *
 ngx_http_v2_streams_index_mask(ngx_conf_t *cf, void *post, void *data)
 {
@@ -31,6 +31,8 @@ typedef struct {
     限制经过HPACK压缩后完整请求头的最大尺寸。
     */
     size_t                          max_header_size; //http2_max_header_size配置项指定 默认16384
+    /* 编码应答头部时使用的HPACK动态表大小，0表示不使用动态表，只做Huffman编码，见ngx_http_v2_header_filter */
+    size_t                          hpack_table_size; //http2_hpack_table_size配置项指定 默认4096
     ngx_uint_t                      streams_index_mask; //http2_streams_index_size配置项指定 默认32-1
     ngx_msec_t                      recv_timeout; //http2_recv_timeout配置项指定  默认30000
     /* 设置空闲连接关闭的超时时间。 */
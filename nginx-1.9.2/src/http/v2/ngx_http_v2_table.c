@@ -15,6 +15,12 @@
 
 static ngx_int_t ngx_http_v2_table_account(ngx_http_v2_connection_t *h2c,
     size_t size);
+static void ngx_http_v2_table_enc_evict(ngx_http_v2_connection_t *h2c,
+    size_t size);
+static ngx_uint_t ngx_http_v2_table_enc_cmp(ngx_http_v2_connection_t *h2c,
+    ngx_str_t *entry, ngx_str_t *str);
+static u_char *ngx_http_v2_table_enc_copy(ngx_http_v2_connection_t *h2c,
+    ngx_str_t *str);
 
 /**/
 //header帧内容部分，可以通过1字节来获取到对应的name:value，例如客户端发送过来的一字节编码转换后为2，则对应method:POST头部行
@@ -381,3 +387,240 @@ ngx_http_v2_table_size(ngx_http_v2_connection_t *h2c, size_t size)
 
     return NGX_OK;
 }
+
+
+/*
+ngx_http_v2_init中调用，客户端的SETTINGS帧到来之前动态表大小按RFC 7540的默认值4096计算。配置的capacity
+比4096小时需要在第一个头部块中告诉客户端
+*/
+void
+ngx_http_v2_table_enc_init(ngx_http_v2_connection_t *h2c, size_t capacity)
+{
+    ngx_http_v2_hpack_enc_t  *enc;
+
+    enc = &h2c->hpack_enc;
+
+    enc->capacity = capacity;
+    enc->size = ngx_min(capacity, NGX_HTTP_V2_TABLE_SIZE);
+    enc->free = enc->size;
+    enc->min_size = enc->size;
+    enc->size_update = (enc->size != NGX_HTTP_V2_TABLE_SIZE);
+}
+
+
+/* 第一次发送头部时才分配动态表的空间，每个表项至少占32字节，所以最多capacity / 32个表项 */
+ngx_int_t
+ngx_http_v2_table_enc_alloc(ngx_http_v2_connection_t *h2c)
+{
+    ngx_http_v2_hpack_enc_t  *enc;
+
+    enc = &h2c->hpack_enc;
+
+    if (enc->storage || enc->capacity == 0) {
+        return NGX_OK;
+    }
+
+    enc->allocated = enc->capacity / 32 + 1;
+
+    enc->entries = ngx_palloc(h2c->connection->pool,
+                              sizeof(ngx_http_v2_hpack_enc_entry_t)
+                              * enc->allocated);
+    if (enc->entries == NULL) {
+        return NGX_ERROR;
+    }
+
+    enc->storage = ngx_palloc(h2c->connection->pool, enc->capacity);
+    if (enc->storage == NULL) {
+        return NGX_ERROR;
+    }
+
+    enc->pos = enc->storage;
+
+    return NGX_OK;
+}
+
+
+/* 客户端SETTINGS帧中的SETTINGS_HEADER_TABLE_SIZE，见ngx_http_v2_state_settings_params */
+void
+ngx_http_v2_table_enc_size(ngx_http_v2_connection_t *h2c, size_t size)
+{
+    size_t                    used;
+    ngx_http_v2_hpack_enc_t  *enc;
+
+    enc = &h2c->hpack_enc;
+
+    size = ngx_min(size, enc->capacity);
+
+    if (size == enc->size) {
+        return;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 new hpack encoder table size: %uz was:%uz",
+                   size, enc->size);
+
+    used = enc->size - enc->free;
+
+    if (used > size) {
+        ngx_http_v2_table_enc_evict(h2c, used - size);
+        used = enc->size - enc->free;
+    }
+
+    enc->size = size;
+    enc->free = size - used;
+
+    if (size < enc->min_size) {
+        enc->min_size = size;
+    }
+
+    enc->size_update = 1;
+}
+
+
+/*
+在动态表中查找name(已转为小写):value，找到则返回其在HPACK索引空间中的下标，否则返回0。只有name相同时
+*name_index为最新的那个表项的下标，没有则不修改
+*/
+ngx_uint_t
+ngx_http_v2_table_enc_find(ngx_http_v2_connection_t *h2c, ngx_str_t *name,
+    ngx_str_t *value, ngx_uint_t hash, ngx_uint_t *name_index)
+{
+    ngx_uint_t                      k, found;
+    ngx_http_v2_hpack_enc_t        *enc;
+    ngx_http_v2_hpack_enc_entry_t  *entry;
+
+    enc = &h2c->hpack_enc;
+
+    found = 0;
+
+    /* 从最新的表项往前找，越新的表项索引越小 */
+
+    for (k = enc->added; k != enc->deleted; k--) {
+        entry = &enc->entries[(k - 1) % enc->allocated];
+
+        if (entry->hash != hash
+            || !ngx_http_v2_table_enc_cmp(h2c, &entry->header.name, name))
+        {
+            continue;
+        }
+
+        if (!found) {
+            found = 1;
+            *name_index = NGX_HTTP_V2_STATIC_TABLE_ENTRIES + 1
+                          + enc->added - k;
+        }
+
+        if (ngx_http_v2_table_enc_cmp(h2c, &entry->header.value, value)) {
+            return NGX_HTTP_V2_STATIC_TABLE_ENTRIES + 1 + enc->added - k;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+按RFC 7541 4.4把name:value加入动态表，空间不够时先淘汰最老的表项。调用者保证32 + name.len + value.len
+不超过enc->size
+*/
+void
+ngx_http_v2_table_enc_add(ngx_http_v2_connection_t *h2c, ngx_str_t *name,
+    ngx_str_t *value, ngx_uint_t hash)
+{
+    size_t                          size;
+    ngx_http_v2_hpack_enc_t        *enc;
+    ngx_http_v2_hpack_enc_entry_t  *entry;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 add header to hpack encoder table: \"%V: %V\"",
+                   name, value);
+
+    enc = &h2c->hpack_enc;
+
+    size = 32 + name->len + value->len;
+
+    if (size > enc->free) {
+        ngx_http_v2_table_enc_evict(h2c, size - enc->free);
+    }
+
+    enc->free -= size;
+
+    entry = &enc->entries[enc->added++ % enc->allocated];
+
+    entry->hash = hash;
+
+    entry->header.name.len = name->len;
+    entry->header.name.data = ngx_http_v2_table_enc_copy(h2c, name);
+
+    entry->header.value.len = value->len;
+    entry->header.value.data = ngx_http_v2_table_enc_copy(h2c, value);
+}
+
+
+/* 淘汰最老的表项，直到至少腾出size字节 */
+static void
+ngx_http_v2_table_enc_evict(ngx_http_v2_connection_t *h2c, size_t size)
+{
+    size_t                          freed;
+    ngx_http_v2_hpack_enc_t        *enc;
+    ngx_http_v2_hpack_enc_entry_t  *entry;
+
+    enc = &h2c->hpack_enc;
+
+    freed = 0;
+
+    while (freed < size && enc->deleted != enc->added) {
+        entry = &enc->entries[enc->deleted++ % enc->allocated];
+        freed += 32 + entry->header.name.len + entry->header.value.len;
+    }
+
+    enc->free += freed;
+}
+
+
+/* entry指向storage，可能在环形缓冲区末尾折回到开头 */
+static ngx_uint_t
+ngx_http_v2_table_enc_cmp(ngx_http_v2_connection_t *h2c, ngx_str_t *entry,
+    ngx_str_t *str)
+{
+    size_t  rest;
+
+    if (entry->len != str->len) {
+        return 0;
+    }
+
+    rest = h2c->hpack_enc.storage + h2c->hpack_enc.capacity - entry->data;
+
+    if (entry->len > rest) {
+        return ngx_memcmp(entry->data, str->data, rest) == 0
+               && ngx_memcmp(h2c->hpack_enc.storage, str->data + rest,
+                             entry->len - rest) == 0;
+    }
+
+    return ngx_memcmp(entry->data, str->data, entry->len) == 0;
+}
+
+
+static u_char *
+ngx_http_v2_table_enc_copy(ngx_http_v2_connection_t *h2c, ngx_str_t *str)
+{
+    u_char                   *data;
+    size_t                    avail;
+    ngx_http_v2_hpack_enc_t  *enc;
+
+    enc = &h2c->hpack_enc;
+
+    data = enc->pos;
+    avail = enc->storage + enc->capacity - enc->pos;
+
+    if (avail > str->len) {
+        enc->pos = ngx_cpymem(enc->pos, str->data, str->len);
+
+    } else {
+        ngx_memcpy(enc->pos, str->data, avail);
+        enc->pos = ngx_cpymem(enc->storage, str->data + avail,
+                              str->len - avail);
+    }
+
+    return data;
+}
@@ -12,6 +12,7 @@
 
 
 static char *ngx_mail_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_mail_init_conf(ngx_cycle_t *cycle, void *conf);
 static ngx_int_t ngx_mail_add_ports(ngx_conf_t *cf, ngx_array_t *ports,
     ngx_mail_listen_t *listen);
 static char *ngx_mail_optimize_servers(ngx_conf_t *cf, ngx_array_t *ports);
@@ -23,6 +24,10 @@ static ngx_int_t ngx_mail_add_addrs6(ngx_conf_t *cf, ngx_mail_port_t *mport,
 #endif
 static ngx_int_t ngx_mail_cmp_conf_addrs(const void *one, const void *two);
 
+#if (NGX_MAIL_SSL && NGX_HAVE_IO_URING)
+ngx_uint_t ngx_io_uring_socket_io(ngx_cycle_t *cycle);
+#endif
+
 
 ngx_uint_t  ngx_mail_max_module;
 
@@ -43,7 +48,7 @@ static ngx_command_t  ngx_mail_commands[] = {
 static ngx_core_module_t  ngx_mail_module_ctx = {
     ngx_string("mail"),
     NULL,
-    NULL
+    ngx_mail_init_conf
 };
 
 
@@ -224,6 +229,46 @@ ngx_mail_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 }
 
 
+/*
+ * 所有配置解析完之后调用，这时events{}一定已经解析过了。STARTTLS之前的明文阶段通过c->recv读取，
+ * io_uring_io on时套接字上可能有未完成的RECV，客户端的ClientHello会被读进io_uring的缓冲区，
+ * 而SSL握手直接在fd上读，两者不能同时使用
+ */
+static char *
+ngx_mail_init_conf(ngx_cycle_t *cycle, void *conf)
+{
+#if (NGX_MAIL_SSL && NGX_HAVE_IO_URING)
+    ngx_mail_conf_ctx_t  *ctx = conf;
+
+    ngx_uint_t                   s;
+    ngx_mail_ssl_conf_t         *sslcf;
+    ngx_mail_core_srv_conf_t   **cscfp;
+    ngx_mail_core_main_conf_t   *cmcf;
+
+    if (ctx == NULL || !ngx_io_uring_socket_io(cycle)) {
+        return NGX_CONF_OK;
+    }
+
+    cmcf = ctx->main_conf[ngx_mail_core_module.ctx_index];
+    cscfp = cmcf->servers.elts;
+
+    for (s = 0; s < cmcf->servers.nelts; s++) {
+
+        sslcf = cscfp[s]->ctx->srv_conf[ngx_mail_ssl_module.ctx_index];
+
+        if (sslcf->starttls != NGX_MAIL_STARTTLS_OFF) {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                          "\"starttls\" cannot be used with \"io_uring_io on\" "
+                          "in %s:%ui", sslcf->file, sslcf->line);
+            return NGX_CONF_ERROR;
+        }
+    }
+#endif
+
+    return NGX_CONF_OK;
+}
+
+
 static ngx_int_t
 ngx_mail_add_ports(ngx_conf_t *cf, ngx_array_t *ports,
     ngx_mail_listen_t *listen)
@@ -124,6 +124,14 @@ epoll的描述符。
 extern int            ngx_eventfd;
 extern aio_context_t  ngx_aio_ctx;
 
+#if (NGX_HAVE_IO_URING)
+//use io_uring;时读文件请求通过io_uring提交，见ngx_io_uring_module.c
+extern ngx_uint_t     ngx_io_uring_file_aio;
+
+ngx_int_t ngx_io_uring_aio_read(ngx_file_t *file, u_char *buf, size_t size,
+    off_t offset);
+#endif
+
 
 static void ngx_file_aio_event_handler(ngx_event_t *ev);
 
@@ -296,6 +304,27 @@ ngx_file_aio_read(ngx_file_t *file, u_char *buf, size_t size, off_t offset,
 */
     ev->handler = ngx_file_aio_event_handler; //在ngx_epoll_eventfd_handler中会获取该ev，然后会执行该handler
 
+#if (NGX_HAVE_IO_URING)
+
+    if (ngx_io_uring_file_aio) {
+
+        if (ngx_io_uring_aio_read(file, buf, size, offset) == NGX_OK) {
+            ev->active = 1;
+            ev->ready = 0;
+            ev->complete = 0;
+
+            return NGX_AGAIN;
+        }
+
+        /* io_uring的SQ满了，退回到Linux AIO */
+
+        if (ngx_eventfd == -1) {
+            return ngx_read_file(file, buf, size, offset);
+        }
+    }
+
+#endif
+
     piocb[0] = &aio->aiocb;
     //调用io_submit向ngx_aio_ctx异步1/0上下文中添加1个事件，返回1表示成功
     if (io_submit(ngx_aio_ctx, 1, piocb) == 1) {
@@ -18,6 +18,7 @@ static void ngx_start_cache_manager_processes(ngx_cycle_t *cycle,
 static void ngx_pass_open_channel(ngx_cycle_t *cycle, ngx_channel_t *ch);
 static void ngx_signal_worker_processes(ngx_cycle_t *cycle, int signo);
 static ngx_uint_t ngx_reap_children(ngx_cycle_t *cycle);
+static void ngx_reclaim_slab_magazines(ngx_cycle_t *cycle, ngx_pid_t pid);
 static void ngx_master_process_exit(ngx_cycle_t *cycle);
 static void ngx_worker_process_cycle(ngx_cycle_t *cycle, void *data);
 static void ngx_worker_process_init(ngx_cycle_t *cycle, ngx_int_t worker);
@@ -955,6 +956,8 @@ ngx_reap_children(ngx_cycle_t *cycle) //ngx_reap_children和ngx_signal_worker_pr
         if (ngx_processes[i].exited) {
 
             if (!ngx_processes[i].detached) {
+                ngx_reclaim_slab_magazines(cycle, ngx_processes[i].pid);
+
                 ngx_close_channel(ngx_processes[i].channel, cycle->log);
 
                 ngx_processes[i].channel[0] = -1;
@@ -1049,6 +1052,44 @@ ngx_reap_children(ngx_cycle_t *cycle) //ngx_reap_children和ngx_signal_worker_pr
 }
 
 
+/*
+异常退出的worker来不及把magazine中缓存的chunk还给共享内存(见ngx_slab_magazine_flush_all)，在重新拉起worker
+之前由master收回。持有锁的进程已经在ngx_process_get_status->ngx_unlock_mutexes中强制解锁
+*/
+static void
+ngx_reclaim_slab_magazines(ngx_cycle_t *cycle, ngx_pid_t pid)
+{
+    ngx_uint_t        i, n;
+    ngx_shm_zone_t   *shm_zone;
+    ngx_list_part_t  *part;
+
+    part = &cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        n = ngx_slab_magazine_reclaim((ngx_slab_pool_t *) shm_zone[i].shm.addr,
+                                      pid);
+
+        if (n) {
+            ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+                          "reclaimed %ui chunks cached by exited process %P "
+                          "in shared memory zone \"%V\"",
+                          n, pid, &shm_zone[i].shm.name);
+        }
+    }
+}
+
+
 static void
 ngx_master_process_exit(ngx_cycle_t *cycle)
 {
@@ -1133,8 +1174,7 @@ ngx_worker_process_cycle(ngx_cycle_t *cycle, void *data) //data表示这是第
 
             ngx_event_cancel_timers();
 
-            if (ngx_event_timer_rbtree.root == ngx_event_timer_rbtree.sentinel)
-            {
+            if (ngx_event_timers_empty()) {
                 ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0, "exiting");
 
                 ngx_worker_process_exit(cycle); 
@@ -1237,6 +1277,14 @@ ngx_worker_process_init(ngx_cycle_t *cycle, ngx_int_t worker)
         ngx_log_debugall(cycle->log, 0, "setrlimit(RLIMIT_CORE, &rlmt) OK,rlimit_core:%O",ccf->rlimit_core);
     }
 
+    if (worker >= 0 && ccf->pool_cache) {
+        ngx_pool_cache_init(ccf->pool_cache, ccf->pool_cache_low);
+    }
+
+    if (worker >= 0 && ccf->slab_magazine > 0) {
+        ngx_slab_magazine_init(ccf->slab_magazine);
+    }
+
     if (geteuid() == 0) {
         if (setgid(ccf->group) == -1) {
             ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
@@ -1409,6 +1457,9 @@ ngx_worker_process_exit(ngx_cycle_t *cycle)
         }
     }
 
+    /* 把magazine中缓存的chunk还给共享内存，否则这些chunk会一直处于已分配状态 */
+    ngx_slab_magazine_flush_all();
+
     if (ngx_exiting) {
         c = cycle->connections;
         for (i = 0; i < cycle->connection_n; i++) {